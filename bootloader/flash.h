@@ -2,12 +2,54 @@
 #define __FLASH_H__
 
 #define FLASH_VERSION_MAJOR 1
-#define FLASH_VERSION_MINOR 0
+#define FLASH_VERSION_MINOR 5
 
 // addresses
 #define FLASH_SOURCE	0xC0FFEE1000LL
 #define FLASH_TARGET	0xC0FFEE0010LL
 #define FLASH_CHANNEL	113
+// every bootloader listens on FLASH_SOURCE, which doubles as the multicast address for no-ack
+// broadcasts; each bootloader also listens on its own node address, which differs
+// from FLASH_SOURCE only in the least significant byte (nRF24 pipes 2-5 share the upper bytes)
+// the node id is taken from the EEPROM or, when that is erased, hashed from the serial number
+// in the signature row, and HELLO reports it
+#define FLASH_MULTICAST	FLASH_SOURCE
+#define FLASH_NODE_ADDRESS(node_id)	((FLASH_SOURCE & ~0xFFLL) | (uint8_t)(node_id))
+#define FLASH_NODE_ID_NONE	0xFF	// erased EEPROM, derive the node id from the serial number
+#define FLASH_NODE_ID_VALID(node_id)	((node_id) != FLASH_NODE_ID_NONE && (node_id) != (uint8_t)FLASH_SOURCE)
+// signature row bytes holding the lot, wafer and die position of the part
+#define FLASH_SERIAL_START	0x0E
+#define FLASH_SERIAL_END	0x17
+
+// the top of the EEPROM is reserved for the bootloader, offsets are counted back from the end
+// e.g. the node id lives at EEPROM address (EEPROM size - FLASH_EEPROM_NODE_ID_OFFSET)
+#define FLASH_EEPROM_RESERVED		8
+#define FLASH_EEPROM_NODE_ID_OFFSET	1
+#define FLASH_EEPROM_APP_MARKER_OFFSET	2
+#define FLASH_EEPROM_BOOT_WINDOW_OFFSET	3
+#define FLASH_EEPROM_BOOT_REQUEST_OFFSET	4
+#define FLASH_EEPROM_NONCE_EPOCH_OFFSET	6	// uint16_t, bumped by the application once per boot for its OTA nonces
+
+// the bootloader clears the application marker before it erases the first page of an upload and
+// will not start the application again until the host writes FLASH_APP_COMPLETE once every page
+// is confirmed; an erased marker (parts programmed over ISP) counts as complete
+#define FLASH_APP_INCOMPLETE		0x00
+#define FLASH_APP_COMPLETE		0xA5
+
+// fast boot, after a reset the bootloader listens for a host for the boot window and then starts
+// the application; any packet from a host ends the window, after which the watchdog (8s) applies
+// the window is kept in the EEPROM in FLASH_BOOT_WINDOW_UNIT_MS units, erased picks the default
+// and FLASH_BOOT_WINDOW_NONE always waits for the watchdog
+#define FLASH_BOOT_WINDOW_UNIT_MS	10
+#define FLASH_BOOT_WINDOW_NONE		0x00
+#define FLASH_BOOT_WINDOW_ERASED	0xFF
+#ifndef FLASH_BOOT_WINDOW_DEFAULT
+#define FLASH_BOOT_WINDOW_DEFAULT	10
+#endif
+// an application that wants the bootloader to stay for a host writes FLASH_BOOT_REQUEST to the
+// boot request byte before resetting, the bootloader clears it again
+#define FLASH_BOOT_REQUEST		0xB0
+#define FLASH_BOOT_REQUEST_NONE		0xFF
 
 //      2      3      5      7     11     13     17     19     23     29 
 //     31     37     41     43     47     53     59     61     67     71 
@@ -35,13 +77,37 @@
 // write eeprom
 #define FLASH_EEPROM_PROG		53
 #define FLASH_EEPROM_PROG_PAYLOAD	59
+// multicast session
+#define FLASH_MCAST_BEGIN		61
+#define FLASH_MCAST_STATUS		67
+#define FLASH_MCAST_STATUS_PAYLOAD	71
+#define FLASH_MCAST_STATUS_FLUSH	73
+// write flash, forward error corrected no-ack shards
+#define FLASH_PAGE_FEC_PAYLOAD		79
+// read eeprom, many bytes at a time
+#define FLASH_EEPROM_BLOCK_READ		83
+#define FLASH_EEPROM_BLOCK_READ_PAYLOAD	89
+#define FLASH_EEPROM_BLOCK_READ_FLUSH	97
+// write eeprom, many bytes at a time
+#define FLASH_EEPROM_BLOCK_PROG		101
+// page crc
+#define FLASH_PAGE_CRC			103
+#define FLASH_PAGE_CRC_PAYLOAD		107
+#define FLASH_PAGE_CRC_FLUSH		109
+// read flash, streamed
+#define FLASH_PAGE_STREAM		113
+#define FLASH_PAGE_STREAM_PAYLOAD	127
+#define FLASH_PAGE_STREAM_FLUSH		131
+// link options
+#define FLASH_SET_RATE			137
 // error
 #define FLASH_CMD_FAILED		251
 
 // packet sizes
 // hello, goodbye
-#define FLASH_HELLO_SIZE		(sizeof(uint8_t) + (2 * sizeof(uint8_t)) + (3 * sizeof(uint8_t)) + sizeof(uint8_t) + sizeof(uint16_t) + (4 * sizeof(uint8_t)) + sizeof(uint16_t))
-					// packet type, major ver., minor ver., 3 byte device signature, SPM_PAGESIZE, available flash size, fuses: l, h, e, lock, EEPROM size
+#define FLASH_HELLO_SIZE		(sizeof(uint8_t) + (2 * sizeof(uint8_t)) + (3 * sizeof(uint8_t)) + sizeof(uint8_t) + sizeof(uint16_t) + (4 * sizeof(uint8_t)) + sizeof(uint16_t) + sizeof(uint8_t) + sizeof(uint8_t) + sizeof(uint8_t))
+					// packet type, major ver., minor ver., 3 byte device signature, SPM_PAGESIZE, available flash size, fuses: l, h, e, lock, EEPROM size, node id,
+					// capabilities, page window
 #define FLASH_HELLO_FLUSH_SIZE		(sizeof(uint8_t))			// packet type
 #define FLASH_DONE_SIZE			(sizeof(uint8_t))			// packet type
 // read flash
@@ -58,9 +124,64 @@
 // write eeprom
 #define FLASH_EEPROM_PROG_SIZE		(sizeof(uint8_t) + sizeof(uint16_t) + sizeof(uint8_t))
 					// packet type, address, byte
+// multicast session
+#define FLASH_MCAST_BEGIN_SIZE		(sizeof(uint8_t) + (3 * sizeof(uint8_t)))	// packet type, 3 byte device signature
+#define FLASH_MCAST_STATUS_SIZE		(sizeof(uint8_t) + sizeof(uint8_t))	// packet type, bitmap byte offset
+#define FLASH_MCAST_STATUS_PAYLOAD_MIN_SIZE (sizeof(uint8_t) + sizeof(uint8_t))	// packet type, bitmap byte offset, [bitmap]
+#define FLASH_MCAST_STATUS_FLUSH_SIZE	(sizeof(uint8_t))			// packet type
+// write flash, forward error corrected
+#define FLASH_PAGE_FEC_PAYLOAD_MIN_SIZE	(sizeof(uint8_t) + sizeof(uint8_t) + sizeof(uint8_t))	// packet type, page no, shard no, [shard]
+// read eeprom, many bytes at a time
+#define FLASH_EEPROM_BLOCK_READ_SIZE	(sizeof(uint8_t) + sizeof(uint16_t) + sizeof(uint16_t))	// packet type, address, length
+#define FLASH_EEPROM_BLOCK_READ_PAYLOAD_MIN_SIZE (sizeof(uint8_t) + sizeof(uint16_t))	// packet type, address, [data]
+#define FLASH_EEPROM_BLOCK_READ_FLUSH_SIZE (sizeof(uint8_t))			// packet type
+// write eeprom, many bytes at a time
+#define FLASH_EEPROM_BLOCK_PROG_MIN_SIZE (sizeof(uint8_t) + sizeof(uint16_t))	// packet type, address, [data]
+// page crc, as avr-libc _crc16_update starting from 0xFFFF
+#define FLASH_PAGE_CRC_SIZE		(sizeof(uint8_t) + sizeof(uint16_t))	// packet type, address
+#define FLASH_PAGE_CRC_PAYLOAD_SIZE	(sizeof(uint8_t) + sizeof(uint16_t) + sizeof(uint16_t))	// packet type, address, crc
+#define FLASH_PAGE_CRC_FLUSH_SIZE	(sizeof(uint8_t))			// packet type
+// read flash, streamed
+#define FLASH_PAGE_STREAM_SIZE		(sizeof(uint8_t) + sizeof(uint16_t) + sizeof(uint16_t))	// packet type, address, length
+#define FLASH_PAGE_STREAM_PAYLOAD_MIN_SIZE (sizeof(uint8_t) + sizeof(uint16_t))	// packet type, address, [data]
+#define FLASH_PAGE_STREAM_FLUSH_SIZE	(sizeof(uint8_t))			// packet type
+// link options
+#define FLASH_SET_RATE_SIZE		(sizeof(uint8_t) + sizeof(uint8_t))	// packet type, data rate
 // error
 #define FLASH_CMD_FAILED_SIZE		(sizeof(uint8_t) + sizeof(uint8_t))	// packet type, reason
 
+// forward error correction of a page, see fec.h
+// every shard carries its page number so a lost shard never leaves the rest without an address
+// shards 0 to FLASH_FEC_DATA_SHARDS - 1 are the page itself (zero padded), the rest are parity rows
+#define FLASH_FEC_SHARD_SIZE		(32 - FLASH_PAGE_FEC_PAYLOAD_MIN_SIZE)
+#define FLASH_FEC_DATA_SHARDS(pagesize)	(((pagesize) + FLASH_FEC_SHARD_SIZE - 1) / FLASH_FEC_SHARD_SIZE)
+#define FLASH_FEC_MAX_PARITY		3
+
+// eeprom blocks and flash streams
+// a block read or stream stages the first FLASH_BLOCK_READ_DEPTH payloads in the ack fifo at once and
+// each flush stages one more, so every flush is answered without waiting on the bootloader
+#define FLASH_BLOCK_SIZE		(32 - FLASH_EEPROM_BLOCK_PROG_MIN_SIZE)
+#define FLASH_BLOCK_READ_DEPTH		3
+
+// capabilities, HELLO carries a bit field of them both ways and the bootloader answers with those
+// both ends have, it reports its page window too, the number of pages it takes ahead of writing them
+#define FLASH_CAP_RATE_250KBPS		(1 << 0)
+#define FLASH_CAP_RATE_1MBPS		(1 << 1)
+#define FLASH_CAP_RATE_2MBPS		(1 << 2)
+#define FLASH_CAP_PAGE_CRC		(1 << 3)
+#define FLASH_CAP_PAGE_STREAM		(1 << 4)
+#define FLASH_CAP_FEC			(1 << 5)
+
+// data rates of FLASH_SET_RATE, the order of the host nrf24_data_rate_e
+// the bootloader acks at the old rate and switches; the host confirms the new rate with another
+// FLASH_SET_RATE for it, until then the bootloader goes back to 1 Mbps once nothing arrived for
+// the probation, so a host that lost the link falls back by waiting
+#define FLASH_RATE_1MBPS		0
+#define FLASH_RATE_2MBPS		1
+#define FLASH_RATE_250KBPS		2
+#define FLASH_RATE_CAP(rate)		((rate) == FLASH_RATE_250KBPS ? FLASH_CAP_RATE_250KBPS : FLASH_CAP_RATE_1MBPS << (rate))
+#define FLASH_RATE_PROBATION_MS		1000
+
 // failed command reasons
 #define FLASH_CMD_FAILED__VERSION_MISMATCH	2
 #define FLASH_CMD_FAILED__SIGNATURE_MISMATCH	3
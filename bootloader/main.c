@@ -4,10 +4,13 @@
 #include <avr/wdt.h>
 #include <util/delay.h>
 #include <avr/pgmspace.h>
+#include <util/crc16.h>
 
 #include "spi.h"
 #include "nrf24.h"
 #include "flash.h"
+#include "fec.h"
+#include "page.h"
 #include "nRF24L01.h"
 
 // this is a way of knowing if the bootloader was started by:
@@ -16,6 +19,19 @@
 #define BOOTLOADER_KEY	0x8576
 uint16_t reset_key __attribute__ ((section (".noinit")));
 
+// EEPROM writes are queued and written a byte at a time from the main loop, like the SPM
+// operations, so that packets keep being taken during the 3.4 ms of each write
+// eeprom_poll() runs ahead of every SPM operation, which keeps the two in the order they were asked for
+#define EEPROM_QUEUE_SIZE	32	// a power of two
+
+typedef struct eeprom_write {
+	uint16_t address;
+	uint8_t value;
+} eeprom_write_t;
+
+static eeprom_write_t eeprom_queue[EEPROM_QUEUE_SIZE];
+static uint8_t eeprom_head, eeprom_tail;
+
 // check to see if the bootloader was started by a watchdog reset from within the bootloader
 // put this function in init3 so that it runs before main and after zero init but it will go early
 // enough to circumvent an existing watchdog on a short timer
@@ -29,8 +45,10 @@ void skip_bootloader(void) {
 		wdt_disable();
 
 		// if the watchdog originated from the bootloader, then the timeout occurred,
-		// skip to the application
-		if (reset_key == BOOTLOADER_KEY) {
+		// skip to the application, unless an upload to it never completed
+		EEAR = E2END + 1 - FLASH_EEPROM_APP_MARKER_OFFSET;
+		EECR |= 1 << EERE;
+		if (reset_key == BOOTLOADER_KEY && EEDR != FLASH_APP_INCOMPLETE) {
 			// enable a long watchdog (4s) to enable reprogramming of isolated devices
 			// in the case of a botched flash or broken application
 			wdt_enable(WDTO_4S);
@@ -38,27 +56,142 @@ void skip_bootloader(void) {
 			// clear the reset key so that we don't end up here again
 			reset_key = 0;
 
+#ifdef BOOT_TIMING_PIN
+			// mark the application start, e.g. to measure the boot time in a simavr trace
+			BOOT_TIMING_DDR |= 1 << BOOT_TIMING_PIN;
+			BOOT_TIMING_PORT |= 1 << BOOT_TIMING_PIN;
+#endif
+
 			// jump to the application code
 			(( void (*)(void))0x0000)();
 		}
 	}
 }
 
+static uint8_t eeprom_read(uint16_t address) {
+	// load address
+	EEAR = address;
+	// start eeprom read
+	EECR |= 1 << EERE;
+	// read data
+	return EEDR;
+}
+
+// start the next queued write, only cells that differ are written, saving both time and wear
+// returns 1 while a write is in progress
+uint8_t eeprom_poll(void) {
+	eeprom_write_t *e;
+
+	// an EEPROM write waits for any page operation to finish
+	if ((EECR & (1 << EEPE)) || boot_spm_busy())
+		return 1;
+	while (eeprom_tail != eeprom_head) {
+		e = &eeprom_queue[eeprom_tail++ & (EEPROM_QUEUE_SIZE - 1)];
+		if (eeprom_read(e->address) == e->value)
+			continue;
+		// load address and data
+		EEAR = e->address;
+		EEDR = e->value;
+		// set EEMPE
+		EECR |= (1 << EEMPE);
+		// begin write
+		EECR |= (1 << EEPE);
+		return 1;
+	}
+
+	return 0;
+}
+
+// write every queued byte, before the EEPROM is read or the application started
+static void eeprom_drain(void) {
+	while (eeprom_poll());
+}
+
+void eeprom_update(uint16_t address, uint8_t value) {
+	eeprom_write_t *e;
+
+	// with the queue full wait for the oldest write
+	while ((uint8_t)(eeprom_head - eeprom_tail) == EEPROM_QUEUE_SIZE)
+		eeprom_poll();
+	e = &eeprom_queue[eeprom_head++ & (EEPROM_QUEUE_SIZE - 1)];
+	e->address = address;
+	e->value = value;
+}
+
+// load the next part of a block read into the ack fifo, the payload type says whether it is
+// an EEPROM block or a flash stream
+static void block_stage(uint8_t pipe, uint8_t type, uint16_t *address, uint16_t *remaining) {
+	uint8_t buf[NRF24_MAX_PAYLOAD_SIZE], length, *buf_ptr;
+
+	length = (*remaining > FLASH_BLOCK_SIZE ? FLASH_BLOCK_SIZE : *remaining);
+	*remaining -= length;
+	buf[0] = type;
+	buf[1] = (uint8_t)(*address & 0x00FF);
+	buf[2] = (uint8_t)((*address & 0xFF00) >> 8);
+	buf_ptr = &buf[FLASH_EEPROM_BLOCK_READ_PAYLOAD_MIN_SIZE];
+	length += FLASH_EEPROM_BLOCK_READ_PAYLOAD_MIN_SIZE;
+	if (type != FLASH_PAGE_STREAM_PAYLOAD)
+		eeprom_drain();
+	while (buf_ptr < &buf[length]) {
+		if (type == FLASH_PAGE_STREAM_PAYLOAD)
+			*buf_ptr++ = pgm_read_byte(*address);
+		else
+			*buf_ptr++ = eeprom_read(*address);
+		(*address)++;
+	}
+	nrf24_tx_ack_payload(pipe, buf, length);
+}
+
+// node id for an erased EEPROM, a hash of the serial number kept clear of the reserved values
+static uint8_t node_id_from_serial(void) {
+	uint8_t i, crc = 0;
+
+	for (i = FLASH_SERIAL_START; i <= FLASH_SERIAL_END; ++i)
+		crc = _crc_ibutton_update(crc, boot_signature_byte_get(i));
+
+	return (crc % 254) + 1;
+}
+
 int main(void) {
 	uint8_t bootloader_continue = 1;
+	uint8_t node_id, pipe;
+	uint8_t window, rate_probation = 0, rate = FLASH_RATE_1MBPS, caps = 0;
+	uint16_t window_ticks;
+
+	// multicast session state
+	uint8_t mcast_ignore = 0;
 
 	// for data transfer
-	uint8_t page[SPM_PAGESIZE];
 	uint8_t packet[NRF24_MAX_PAYLOAD_SIZE];
-	uint8_t seq_no = 0, *page_ptr = NULL;
+	uint8_t seq_no = 0, *page = NULL, *page_ptr = NULL;
 	uint16_t address = 0;
+	uint16_t block_address = 0, block_remaining = 0;
+	uint8_t block_type = FLASH_EEPROM_BLOCK_READ_PAYLOAD;
+	uint16_t crc;
 
 	// skip_bootloader has already run in init.3 so the watchdog MCUSR bit will have been cleared and the watchdog is disabled
 	// set the reset key so that if our internal watchdog reboots, we will know we have been here already
 	reset_key = BOOTLOADER_KEY;
 
-	// initialize the radio
-	nrf24_init();
+	// initialize the radio, listening on our own address as well
+	node_id = eeprom_read(E2END + 1 - FLASH_EEPROM_NODE_ID_OFFSET);
+	if (!FLASH_NODE_ID_VALID(node_id))
+		node_id = node_id_from_serial();
+	nrf24_init(node_id);
+
+	// fast boot unless the application asked us to stay, or there is no complete application
+	window = eeprom_read(E2END + 1 - FLASH_EEPROM_BOOT_WINDOW_OFFSET);
+	if (window == FLASH_BOOT_WINDOW_ERASED)
+		window = FLASH_BOOT_WINDOW_DEFAULT;
+	if (eeprom_read(E2END + 1 - FLASH_EEPROM_BOOT_REQUEST_OFFSET) == FLASH_BOOT_REQUEST
+		|| eeprom_read(E2END + 1 - FLASH_EEPROM_APP_MARKER_OFFSET) == FLASH_APP_INCOMPLETE
+		|| pgm_read_word(0x0000) == 0xFFFF)
+		window = FLASH_BOOT_WINDOW_NONE;
+	eeprom_update(E2END + 1 - FLASH_EEPROM_BOOT_REQUEST_OFFSET, FLASH_BOOT_REQUEST_NONE);
+	// timer1 counts out the window at F_CPU / 1024
+	window_ticks = (uint32_t)window * FLASH_BOOT_WINDOW_UNIT_MS * (F_CPU / 1024) / 1000;
+	TCNT1 = 0;
+	TCCR1B = (1 << CS12) | (1 << CS10);
 
 	// setup the watchdog timer to reset the device after 8S
 	wdt_enable(WDTO_8S);
@@ -66,6 +199,19 @@ int main(void) {
 	// main loop that we will either be in during the watchdog reset
 	// or that we will exit from as a result of programming done
 	while (bootloader_continue) {
+		// keep the page writes going
+		spm_poll();
+
+		// no host turned up in time, start the application
+		if (window != FLASH_BOOT_WINDOW_NONE && TCNT1 >= window_ticks)
+			bootloader_continue = 0;
+		// the host never made it to the new data rate, or lost it before confirming it
+		if (rate_probation && TCNT1 >= (uint16_t)((uint32_t)FLASH_RATE_PROBATION_MS * (F_CPU / 1024) / 1000)) {
+			rate = FLASH_RATE_1MBPS;
+			nrf24_set_rate(rate);
+			rate_probation = 0;
+		}
+
 		// if the IRQ pin is low
 		if ((PIND & (1 << PD2)) == 0) {
 			// incoming data
@@ -75,10 +221,14 @@ int main(void) {
 
 			// pet the dog to keep it from resetting out of the bootloader
 			wdt_reset();
+			// a host is here, stay until it is done or goes quiet
+			window = FLASH_BOOT_WINDOW_NONE;
+			// the probation counts from the last packet
+			TCNT1 = 0;
 
 			while (!done) {
 				len = NRF24_MAX_PAYLOAD_SIZE;
-				done = nrf24_rx_read(packet, &len);
+				done = nrf24_rx_read(packet, &len, &pipe);
 
 				// do something with packet, e.g.
 				switch (packet[0]) {
@@ -93,9 +243,12 @@ int main(void) {
 						}
 						// for incoming HELLO, we ignore the other bytes
 						if (packet[0] == FLASH_CMD_FAILED) {
-							nrf24_tx_ack_payload(packet, FLASH_CMD_FAILED_SIZE);
+							nrf24_tx_ack_payload(pipe, packet, FLASH_CMD_FAILED_SIZE);
 							break;
 						}
+						// only what both ends have is used, a host that has none, or an older one sending a
+						// shorter HELLO, gets none
+						caps = (len >= FLASH_HELLO_SIZE ? packet[16] : 0) & (FLASH_CAP_RATE_250KBPS | FLASH_CAP_RATE_1MBPS | FLASH_CAP_RATE_2MBPS | FLASH_CAP_PAGE_CRC | FLASH_CAP_PAGE_STREAM | FLASH_CAP_FEC);
 						// send response
 						packet[0] = FLASH_HELLO;
 						packet[1] = FLASH_VERSION_MAJOR;
@@ -112,12 +265,38 @@ int main(void) {
 						packet[12] = boot_lock_fuse_bits_get(GET_LOCK_BITS);
 						packet[13] = (uint8_t)((E2END + 1) & 0x00FF);
 						packet[14] = (uint8_t)(((E2END + 1) & 0xFF00) >> 8);
-						nrf24_tx_ack_payload(packet, FLASH_HELLO_SIZE);
+						packet[15] = node_id;
+						packet[16] = caps;
+						packet[17] = PAGE_BUFFERS;
+						nrf24_tx_ack_payload(pipe, packet, FLASH_HELLO_SIZE);
+						// a host is talking to us directly, multicast data is welcome again
+						mcast_ignore = 0;
+						page_session();
 						break;
 					case FLASH_HELLO_FLUSH:
 						// ack payload already loaded
 						break;
+					case FLASH_SET_RATE:
+						// the host confirms the rate it is on once a page burst got through
+						if (packet[1] == rate) {
+							rate_probation = 0;
+							break;
+						}
+						// a rate the host did not offer in its HELLO is not taken, nor is a rate that is
+						// none, FLASH_RATE_CAP() of it would be another cap
+						if (packet[1] > FLASH_RATE_250KBPS || !(caps & FLASH_RATE_CAP(packet[1])))
+							break;
+						// let the ack go out at the old rate first
+						_delay_us(500);
+						rate = packet[1];
+						nrf24_set_rate(rate);
+						// timer1 is free once a host is here
+						TCNT1 = 0;
+						rate_probation = 1;
+						break;
 					case FLASH_DONE:
+						// finish writing before the application gets started
+						spm_drain();
 						// signal to the outer loop that we are done here
 						bootloader_continue = 0;
 						// disable this handler to prevent any future interupts
@@ -125,40 +304,57 @@ int main(void) {
 					case FLASH_EEPROM_READ:
 						// address checking happens on the host
 						packet[0] = FLASH_EEPROM_READ_PAYLOAD;
-#if 0
-						// wait for any SPM operation to finish or for any eeprom write operation to complete
-						// the eeprom write operation isn't possible as the only way to write is below and we wait afterwards
-						while (boot_spm_busy() || EECR & (1 << EEPE));
-#endif
-						// load address
-						EEAR = ((uint16_t)packet[2] << 8) | packet[1];
-						// start eeprom read
-						EECR |= 1 << EERE;
-						// read data
-						packet[1] = EEDR;
-						nrf24_tx_ack_payload(packet, FLASH_EEPROM_READ_PAYLOAD_SIZE);
+						// the queued writes go first, they have to be read back
+						eeprom_drain();
+						packet[1] = eeprom_read(((uint16_t)packet[2] << 8) | packet[1]);
+						nrf24_tx_ack_payload(pipe, packet, FLASH_EEPROM_READ_PAYLOAD_SIZE);
 						break;
 					case FLASH_EEPROM_READ_FLUSH:
 						// ack payload already loaded
 						break;
 					case FLASH_EEPROM_PROG:
 						// address checking happens on the host
+						// queued writes go ahead of the pages, the application marker must not overtake them
+						spm_drain();
 #if 0
 						// wait for any SPM operation to finish or for any eeprom write operation to complete
 						// the eeprom write operation isn't possible as the only way to write is below and we wait afterwards
 						while (boot_spm_busy() || EECR & (1 << EEPE));
 #endif
-						// load address and data
-						EEAR = ((uint16_t)packet[2] << 8) | packet[1];
-						EEDR = packet[3];
-						// set EEMPE
-						EECR |= (1 << EEMPE);
-						// begin write
-						EECR |= (1 << EEPE);
-						while (EECR & (1 << EEPE));	// wait for available
+						eeprom_update(((uint16_t)packet[2] << 8) | packet[1], packet[3]);
+						break;
+					case FLASH_EEPROM_BLOCK_PROG:
+						// address checking happens on the host
+						// as for a single byte, a block may hold the application marker
+						spm_drain();
+						address = ((uint16_t)packet[2] << 8) | packet[1];
+						pkt_ptr = &packet[FLASH_EEPROM_BLOCK_PROG_MIN_SIZE];
+						while (pkt_ptr < &packet[len])
+							eeprom_update(address++, *pkt_ptr++);
+						break;
+					case FLASH_EEPROM_BLOCK_READ:
+					case FLASH_PAGE_STREAM:
+						// address and length checking happens on the host
+						block_type = (packet[0] == FLASH_PAGE_STREAM ? FLASH_PAGE_STREAM_PAYLOAD : FLASH_EEPROM_BLOCK_READ_PAYLOAD);
+						block_address = ((uint16_t)packet[2] << 8) | packet[1];
+						block_remaining = ((uint16_t)packet[4] << 8) | packet[3];
+						spm_drain();
+						// anything left over from an earlier read would be out of order
+						nrf24_tx_flush();
+						for (length = 0; length < FLASH_BLOCK_READ_DEPTH && block_remaining; ++length)
+							block_stage(pipe, block_type, &block_address, &block_remaining);
+						break;
+					case FLASH_EEPROM_BLOCK_READ_FLUSH:
+					case FLASH_PAGE_STREAM_FLUSH:
+						// one payload went out with this ack, top the fifo back up
+						if (block_remaining)
+							block_stage(pipe, block_type, &block_address, &block_remaining);
 						break;
 					case FLASH_PAGE_READ:
 						address = ((uint16_t)packet[2] << 8) | packet[1];
+						// with the writes done a page buffer is free to hold the copy
+						spm_drain();
+						page = page_scratch();
 						// fill the page
 						length = SPM_PAGESIZE;
 						page_ptr = page;
@@ -175,7 +371,7 @@ int main(void) {
 						do {
 							*pkt_ptr++ = *page_ptr++;
 						} while (--length);
-						nrf24_tx_ack_payload(packet, NRF24_MAX_PAYLOAD_SIZE);
+						nrf24_tx_ack_payload(pipe, packet, NRF24_MAX_PAYLOAD_SIZE);
 						break;
 					case FLASH_PAGE_READ_FLUSH:
 						// prepare next ack_payload, if any
@@ -192,46 +388,64 @@ int main(void) {
 							do {
 								*pkt_ptr++ = *page_ptr++;
 							} while (--length);
-							nrf24_tx_ack_payload(packet, payload_length);
+							nrf24_tx_ack_payload(pipe, packet, payload_length);
 						} // else, we are done loading the acks and this is the final flush, nothing more to send
 						break;
 					case FLASH_PAGE_PROG:
-						address = ((uint16_t)packet[2] << 8) | packet[1];
-						// begin page erase
-						boot_page_erase(address);
-						// setup for next packets
-						seq_no = 0;
-						page_ptr = page;
+						// multicast sessions for other device signatures are not for us
+						if (pipe == 1 && mcast_ignore)
+							break;
+						page_prog(((uint16_t)packet[2] << 8) | packet[1]);
 						break;
 					case FLASH_PAGE_PROG_PAYLOAD:
-						// ignore any out of sequence data
-						if (packet[1] != seq_no)
+						if (pipe == 1 && mcast_ignore)
+							break;
+						page_prog_payload(packet[1], &packet[FLASH_PAGE_PROG_PAYLOAD_MIN_SIZE], len - FLASH_PAGE_PROG_PAYLOAD_MIN_SIZE);
+						break;
+					case FLASH_PAGE_FEC_PAYLOAD:
+						if (pipe == 1 && mcast_ignore)
 							break;
-						// but it is too late, already erased
-						length = len - FLASH_PAGE_PROG_PAYLOAD_MIN_SIZE;
-						pkt_ptr = &packet[FLASH_PAGE_PROG_PAYLOAD_MIN_SIZE];
+						page_fec_payload(packet[1], packet[2], &packet[FLASH_PAGE_FEC_PAYLOAD_MIN_SIZE]);
+						break;
+					case FLASH_PAGE_CRC:
+						address = ((uint16_t)packet[2] << 8) | packet[1];
+						// the host verifies a page while the next one is written
+						spm_settle(address);
+						packet[0] = FLASH_PAGE_CRC_PAYLOAD;
+						crc = 0xFFFF;
+						length = SPM_PAGESIZE;
 						do {
-							*page_ptr++ = *pkt_ptr++;
+							crc = _crc16_update(crc, pgm_read_byte(address++));
 						} while (--length);
-						++seq_no;
-						if (page_ptr - page == SPM_PAGESIZE) {
-							uint8_t i;
-							page_ptr = page;
-							// wait until the page erase is complete
-							boot_spm_busy_wait();
-							// fill the boot page
-							for (i = 0; i < SPM_PAGESIZE; i += 2) {
-								uint16_t w = *page_ptr++;
-								w += (*page_ptr++) << 8;
-								boot_page_fill(address + i, w);
-							}
-							boot_page_write(address);
-							// wait until the page fill is complete - do this now vs. above as the page might be overwritten in the ISR
-							boot_spm_busy_wait();
-							// reenable rww so that application jump works
-							boot_rww_enable();
-							seq_no = 0;
+						packet[3] = (uint8_t)(crc & 0x00FF);
+						packet[4] = (uint8_t)((crc & 0xFF00) >> 8);
+						nrf24_tx_ack_payload(pipe, packet, FLASH_PAGE_CRC_PAYLOAD_SIZE);
+						break;
+					case FLASH_PAGE_CRC_FLUSH:
+						// ack payload already loaded
+						break;
+					case FLASH_MCAST_BEGIN:
+						// no-ack broadcast to every bootloader, only those with a matching signature take part
+						if (packet[1] != SIGNATURE_0 || packet[2] != SIGNATURE_1 || packet[3] != SIGNATURE_2) {
+							mcast_ignore = 1;
+							break;
 						}
+						mcast_ignore = 0;
+						page_session();
+						for (length = 0; length < FLASH_PAGE_BITMAP_SIZE; ++length)
+							page_bitmap[length] = 0;
+						break;
+					case FLASH_MCAST_STATUS:
+						// return the written page map starting at the requested byte offset
+						length = packet[1];
+						packet[0] = FLASH_MCAST_STATUS_PAYLOAD;
+						pkt_ptr = &packet[FLASH_MCAST_STATUS_PAYLOAD_MIN_SIZE];
+						while (length < FLASH_PAGE_BITMAP_SIZE && pkt_ptr < &packet[NRF24_MAX_PAYLOAD_SIZE])
+							*pkt_ptr++ = page_bitmap[length++];
+						nrf24_tx_ack_payload(pipe, packet, pkt_ptr - packet);
+						break;
+					case FLASH_MCAST_STATUS_FLUSH:
+						// ack payload already loaded
 						break;
 					default:
 						// unknown packet type - ignore
@@ -245,6 +459,9 @@ int main(void) {
 		}
 	}
 
+	// queued writes, e.g. the boot request, are done before the reset
+	eeprom_drain();
+
 	// cleanup the SPI and radio pins, etc.
 	nrf24_done();
 
@@ -252,7 +469,7 @@ int main(void) {
 	cli();
 
 	// use the watchdog timer to force a timeout to reset
-	// use a long enough time that the next startup completes without the watchdog firing
-	wdt_enable(WDTO_120MS);
+	// skip_bootloader runs from init3 and disables the watchdog well within the shortest timeout
+	wdt_enable(WDTO_15MS);
 	for (;;);
 }
@@ -36,7 +36,7 @@ static void nrf24_write_addr_reg(uint8_t addr, const uint8_t address[5]) {
 	nrf24_csn(1);
 }
 
-static uint8_t nrf24_tx_flush(void) {
+uint8_t nrf24_tx_flush(void) {
         uint8_t ret;
 
         nrf24_csn(0);
@@ -60,7 +60,7 @@ static uint8_t nrf24_rx_flush(void) {
 	return ret;
 }
 
-void nrf24_init(void) {
+void nrf24_init(uint8_t node_id) {
 	const uint8_t tx_addr[5] = { (uint8_t)(FLASH_TARGET), (uint8_t)(FLASH_TARGET >> 8), (uint8_t)(FLASH_TARGET >> 16), (uint8_t)(FLASH_TARGET >> 24), (uint8_t)(FLASH_TARGET >> 32) };
 	const uint8_t rx_addr[5] = { (uint8_t)(FLASH_SOURCE), (uint8_t)(FLASH_SOURCE >> 8), (uint8_t)(FLASH_SOURCE >> 16), (uint8_t)(FLASH_SOURCE >> 24), (uint8_t)(FLASH_SOURCE >> 32) };
 
@@ -81,17 +81,17 @@ void nrf24_init(void) {
 	// wait 4000us and 15 retries
 	nrf24_write_reg(SETUP_RETR, 0xff);
 	// max power level and 1 MBPS data rate
-	nrf24_write_reg(RF_SETUP, (1 << RF_PWR_LOW) | (1 << RF_PWR_HIGH));
-	// dynamic payload length for pipes 0 and 1
-	nrf24_write_reg(DYNPD, (1 << DPL_P1) | (1 << DPL_P0));
+	nrf24_set_rate(FLASH_RATE_1MBPS);
+	// dynamic payload length for pipes 0, 1 and 2
+	nrf24_write_reg(DYNPD, (1 << DPL_P2) | (1 << DPL_P1) | (1 << DPL_P0));
 	// enable dynamic payloads and ack payload
 	nrf24_write_reg(FEATURE, (1 << EN_DPL) | (1 << EN_ACK_PAY));
 	// set the channel
 	nrf24_write_reg(RF_CH, FLASH_CHANNEL);
 	// set the address width to 5 bytes
 	nrf24_write_reg(SETUP_AW, (1 << 1) | (1 << 0));
-	// enable auto ack on pipes 0 and 1
-	nrf24_write_reg(EN_AA, (1 << ENAA_P1) | (1 << ENAA_P0));
+	// enable auto ack on pipes 0, 1 and 2
+	nrf24_write_reg(EN_AA, (1 << ENAA_P2) | (1 << ENAA_P1) | (1 << ENAA_P0));
 
 	// set addresses
 	// write (tx)
@@ -101,7 +101,13 @@ void nrf24_init(void) {
 	// read (rx)
 	nrf24_write_addr_reg(RX_ADDR_P1, rx_addr);
 	nrf24_write_reg(RX_PW_P1, NRF24_MAX_PAYLOAD_SIZE);
-	nrf24_write_reg(EN_RXADDR, (1 << ERX_P1));
+	// per node address (rx), shares the upper bytes of the pipe 1 address
+	if (FLASH_NODE_ID_VALID(node_id)) {
+		nrf24_write_reg(RX_ADDR_P2, node_id);
+		nrf24_write_reg(RX_PW_P2, NRF24_MAX_PAYLOAD_SIZE);
+		nrf24_write_reg(EN_RXADDR, (1 << ERX_P2) | (1 << ERX_P1));
+	} else
+		nrf24_write_reg(EN_RXADDR, (1 << ERX_P1));
 
 	// enable IRQ and 16 bit CRC
 	// also power down and put in rx
@@ -120,6 +126,20 @@ void nrf24_init(void) {
 	_delay_us(130);
 }
 
+void nrf24_set_rate(uint8_t rate) {
+	uint8_t rf_setup = (1 << RF_PWR_LOW) | (1 << RF_PWR_HIGH);
+
+	if (rate == FLASH_RATE_2MBPS)
+		rf_setup |= 1 << RF_DR_HIGH;
+	else if (rate == FLASH_RATE_250KBPS)
+		rf_setup |= 1 << RF_DR_LOW;
+	// leave rx while the rate changes
+	nrf24_ce(0);
+	nrf24_write_reg(RF_SETUP, rf_setup);
+	nrf24_ce(1);
+	_delay_us(130);
+}
+
 void nrf24_done(void) {
 	nrf24_ce(0);
 
@@ -140,9 +160,12 @@ static uint8_t nrf24_rx_data_avail(void) {
         return ret;
 }
 
-uint8_t nrf24_rx_read(uint8_t *buf, uint8_t *pkt_len) {
+uint8_t nrf24_rx_read(uint8_t *buf, uint8_t *pkt_len, uint8_t *pipe) {
         uint8_t len;
 
+        // pipe number of the payload at the head of the rx fifo
+        *pipe = (nrf24_read_status() >> RX_P_NO) & 0x07;
+
         nrf24_write_reg(STATUS, 1 << RX_DR);
 
         len = nrf24_rx_data_avail();
@@ -159,10 +182,10 @@ uint8_t nrf24_rx_read(uint8_t *buf, uint8_t *pkt_len) {
 	return(nrf24_read_reg(FIFO_STATUS) & (1 << RX_EMPTY));
 }
 
-void nrf24_tx_ack_payload(uint8_t *buf, uint8_t len) {
+void nrf24_tx_ack_payload(uint8_t pipe, uint8_t *buf, uint8_t len) {
 	nrf24_csn(0);
 
-	spi_transfer(W_ACK_PAYLOAD | 1);	// pipe 1
+	spi_transfer(W_ACK_PAYLOAD | pipe);
 	while (len --)
 		spi_transfer(*buf++);
 
@@ -3,11 +3,17 @@
 
 #define NRF24_MAX_PAYLOAD_SIZE 32
 
-void nrf24_init(void);
+void nrf24_init(uint8_t node_id);
 void nrf24_done(void);
 
-uint8_t nrf24_rx_read(uint8_t *buf, uint8_t *pkt_len);
-void nrf24_tx_ack_payload(uint8_t *buf, uint8_t len);
+// reads the payload at the head of the rx fifo and the pipe it arrived on, returns 1 when the fifo is empty
+uint8_t nrf24_rx_read(uint8_t *buf, uint8_t *pkt_len, uint8_t *pipe);
+// ack payloads are sent back on the pipe the next packet arrives on
+void nrf24_tx_ack_payload(uint8_t pipe, uint8_t *buf, uint8_t len);
+// drops any ack payloads still waiting in the tx fifo
+uint8_t nrf24_tx_flush(void);
+// one of the FLASH_RATE_* data rates, at max power level
+void nrf24_set_rate(uint8_t rate);
 uint8_t nrf24_read_status(void);
 void nrf24_write_reg(uint8_t addr, uint8_t value);
 
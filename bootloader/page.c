@@ -0,0 +1,234 @@
+#include <inttypes.h>
+#ifdef __AVR__
+#include <avr/boot.h>
+#else
+#include "page_sim.h"
+#endif
+
+#include "flash.h"
+#include "fec.h"
+#include "page.h"
+
+#if FLASH_PAGES > 255
+#error "page numbers of forward error corrected shards are a single byte"
+#endif
+
+// forward error corrected pages, the page buffer is padded out to whole shards
+#define FEC_DATA_SHARDS		FLASH_FEC_DATA_SHARDS(SPM_PAGESIZE)
+#define FEC_PAGE_NONE		0xFF
+
+// the bootloader runs from the NRWW section so it keeps going while the application section is busy
+// spm_poll() moves the SPM engine along from the main loop, the oldest buffer is programmed first
+// and only the buffer being filled is ever PAGE_FILLING
+#define PAGE_BUFFER_SIZE	(FEC_DATA_SHARDS * FLASH_FEC_SHARD_SIZE)
+#define PAGE_SEQ_LOST		0xFF	// a payload went missing, the page waits for its next FLASH_PAGE_PROG
+#define PAGE_FREE		0
+#define PAGE_FILLING		1	// address known, erase scheduled
+#define PAGE_FULL		2	// data complete, write scheduled
+#define SPM_IDLE		0
+#define SPM_ERASE		1
+#define SPM_WRITE		2
+
+typedef struct page_buffer {
+	uint16_t address;
+	uint8_t state;
+	uint8_t erased;
+	uint8_t data[PAGE_BUFFER_SIZE];
+} page_buffer_t;
+
+static page_buffer_t page_buffers[PAGE_BUFFERS];
+static uint8_t page_fill, page_spm;	// buffer being filled, buffer being programmed
+static uint8_t spm_op = SPM_IDLE;
+static uint16_t spm_address;
+uint8_t page_bitmap[FLASH_PAGE_BITMAP_SIZE];
+
+// the page being received
+static page_buffer_t *page = &page_buffers[0];
+static uint8_t *page_ptr, page_seq_no;
+
+// forward error correction state of the page being received
+static uint8_t fec_parity[FLASH_FEC_MAX_PARITY * FLASH_FEC_SHARD_SIZE];
+static uint8_t fec_rows[FLASH_FEC_MAX_PARITY];
+static uint8_t fec_page = FEC_PAGE_NONE, fec_received, fec_parity_count, fec_done;
+
+// finish the current SPM operation, if it is done, and start the next one
+// returns 1 while an operation is in progress
+uint8_t spm_poll(void) {
+	page_buffer_t *p = &page_buffers[page_spm];
+	uint8_t i;
+
+	// SPM is held off by an EEPROM write, queued ones go first
+	if (boot_spm_busy() || eeprom_poll())
+		return 1;
+	if (spm_op != SPM_IDLE) {
+		if (spm_op == SPM_ERASE) {
+			// the buffer may have been handed another address while the old one was erasing
+			if (p->address == spm_address)
+				p->erased = 1;
+		} else
+			p->state = PAGE_FREE;
+		spm_op = SPM_IDLE;
+		// reenable rww so that reading flash and the application jump work
+		boot_rww_enable();
+	}
+	// everything older is done, the other buffer holds the next page if there is one, be it
+	// filled already or still filling, as the buffers are filled in turn
+	if (p->state == PAGE_FREE) {
+		page_spm ^= 1;
+		p = &page_buffers[page_spm];
+		if (p->state == PAGE_FREE)
+			return 0;
+	}
+	spm_address = p->address;
+	if (!p->erased) {
+		boot_page_erase(spm_address);
+		spm_op = SPM_ERASE;
+	} else if (p->state == PAGE_FULL) {
+		for (i = 0; i < SPM_PAGESIZE; i += 2)
+			boot_page_fill(spm_address + i, p->data[i] | ((uint16_t)p->data[i + 1] << 8));
+		boot_page_write(spm_address);
+		spm_op = SPM_WRITE;
+	} else
+		return 0;
+
+	return 1;
+}
+
+// program every buffered page, before flash is read or the application started
+void spm_drain(void) {
+	while (spm_poll() || page_buffers[0].state == PAGE_FULL || page_buffers[1].state == PAGE_FULL);
+}
+
+// wait for the page at address to be written, later pages stay queued
+// the SPM operation in progress is finished so the application section can be read
+void spm_settle(uint16_t address) {
+	uint8_t i;
+
+	for (i = 0; i < PAGE_BUFFERS; ++i)
+		while (page_buffers[i].state == PAGE_FULL && page_buffers[i].address == address)
+			spm_poll();
+	boot_spm_busy_wait();
+	boot_rww_enable();
+}
+
+// a page sized buffer for reading flash into, only once spm_drain() has written every page
+uint8_t *page_scratch(void) {
+	return page_buffers[page_fill].data;
+}
+
+// the buffer for the page at address, its erase starts as soon as SPM is free
+// an unfinished page is given up for the new one, with both buffers full wait for the older
+static page_buffer_t *page_claim(uint16_t address) {
+	page_buffer_t *p = &page_buffers[page_fill];
+
+	if (p->state == PAGE_FULL) {
+		page_fill ^= 1;
+		p = &page_buffers[page_fill];
+		while (p->state != PAGE_FREE)
+			spm_poll();
+	}
+	if (p->state != PAGE_FILLING || p->address != address)
+		p->erased = 0;
+	p->address = address;
+	p->state = PAGE_FILLING;
+
+	return p;
+}
+
+// hand the page being received to SPM, the next one can arrive while it is written
+// the page is noted for the multicast repair pass right away, a full page is always written
+// before the application is marked complete or started, so that the repair pass does not
+// send the last page again just because its write is still under way
+static void page_full(void) {
+	page->state = PAGE_FULL;
+	page_bitmap[(page->address / SPM_PAGESIZE) >> 3] |= 1 << ((page->address / SPM_PAGESIZE) & 0x07);
+}
+
+// a new session, from a FLASH_HELLO or FLASH_MCAST_BEGIN, gives up the page being received, so
+// that its first page is taken even if it has the number of the last page of the session before
+void page_session(void) {
+	fec_page = FEC_PAGE_NONE;
+	fec_received = 0;
+	fec_parity_count = 0;
+	fec_done = 0;
+	page_seq_no = 0;
+	if (page->state == PAGE_FILLING)
+		page->state = PAGE_FREE;
+}
+
+// FLASH_PAGE_PROG, the payloads of the page at address follow
+void page_prog(uint16_t address) {
+	// the bootloader's own pages are never written, nor is a bit set past page_bitmap, the
+	// payloads that follow are dropped
+	if (address >= AVAILABLE_FLASH) {
+		page_seq_no = PAGE_SEQ_LOST;
+		return;
+	}
+	// the application is not whole again until the host says so
+	eeprom_update(E2END + 1 - FLASH_EEPROM_APP_MARKER_OFFSET, FLASH_APP_INCOMPLETE);
+	// page erase starts once SPM is free
+	page = page_claim(address);
+	page_seq_no = 0;
+	page_ptr = page->data;
+}
+
+// FLASH_PAGE_PROG_PAYLOAD, the last one hands the page to SPM
+void page_prog_payload(uint8_t seq_no, uint8_t *data, uint8_t length) {
+	// a payload sent again after its ack went missing is dropped
+	if (page->state != PAGE_FILLING || page_seq_no == PAGE_SEQ_LOST || seq_no + 1 == page_seq_no)
+		return;
+	// a lost multicast payload leaves the page unwritten, the rest of the page is ignored too as
+	// they would be taken for those of the next page once its FLASH_PAGE_PROG went missing as well
+	if (seq_no != page_seq_no || length > SPM_PAGESIZE - (page_ptr - page->data)) {
+		page_seq_no = PAGE_SEQ_LOST;
+		return;
+	}
+	while (length--)
+		*page_ptr++ = *data++;
+	++page_seq_no;
+	if (page_ptr - page->data == SPM_PAGESIZE) {
+		page_full();
+		page_seq_no = 0;
+	}
+}
+
+// FLASH_PAGE_FEC_PAYLOAD, any FEC_DATA_SHARDS of the shards of a page rebuild it
+void page_fec_payload(uint8_t page_no, uint8_t shard, uint8_t *data) {
+	uint8_t *shard_ptr, length, received;
+
+	// shards come unacknowledged from anyone, the bootloader's own pages are never written
+	if (page_no >= FLASH_PAGES)
+		return;
+	// the first shard of another page starts over
+	if (page_no != fec_page) {
+		fec_page = page_no;
+		fec_received = 0;
+		fec_parity_count = 0;
+		fec_done = 0;
+		eeprom_update(E2END + 1 - FLASH_EEPROM_APP_MARKER_OFFSET, FLASH_APP_INCOMPLETE);
+		page = page_claim((uint16_t)fec_page * SPM_PAGESIZE);
+	}
+	// drop duplicates and the surplus shards of a page already written
+	if (fec_done || page->state != PAGE_FILLING || shard >= FEC_MAX_DATA_SHARDS || (fec_received & (1 << shard)))
+		return;
+	if (shard < FEC_DATA_SHARDS) {
+		shard_ptr = &page->data[shard * FLASH_FEC_SHARD_SIZE];
+	} else {
+		if (fec_parity_count == FLASH_FEC_MAX_PARITY)
+			return;
+		fec_rows[fec_parity_count] = shard - FEC_DATA_SHARDS;
+		shard_ptr = &fec_parity[fec_parity_count++ * FLASH_FEC_SHARD_SIZE];
+	}
+	fec_received |= 1 << shard;
+	length = FLASH_FEC_SHARD_SIZE;
+	do {
+		*shard_ptr++ = *data++;
+	} while (--length);
+	for (length = 0, received = fec_received; received; received >>= 1)
+		length += received & 0x01;
+	if (length < FEC_DATA_SHARDS)
+		return;
+	fec_decode(page->data, FEC_DATA_SHARDS, FLASH_FEC_SHARD_SIZE, fec_received, fec_parity, fec_rows, fec_parity_count);
+	page_full();
+	fec_done = 1;
+}
@@ -0,0 +1,30 @@
+#ifndef _PAGE_H_
+#define _PAGE_H_
+
+// double buffered page programming, a page is received into one buffer while SPM erases and
+// writes the other in the background
+// the host benchmarks build page.c as well, against the simulated SPM engine of page_sim.h
+
+// one bit per application page, set as each page is complete and queued for writing
+// a multicast session clears the map so the host can ask which pages it still has to repair
+#define FLASH_PAGES		(AVAILABLE_FLASH / SPM_PAGESIZE)
+#define FLASH_PAGE_BITMAP_SIZE	((FLASH_PAGES + 7) / 8)
+
+#define PAGE_BUFFERS		2
+
+extern uint8_t page_bitmap[FLASH_PAGE_BITMAP_SIZE];
+
+// the EEPROM queue of the bootloader, its writes go ahead of every SPM operation
+uint8_t eeprom_poll(void);
+void eeprom_update(uint16_t address, uint8_t value);
+
+uint8_t spm_poll(void);
+void spm_drain(void);
+void spm_settle(uint16_t address);
+uint8_t *page_scratch(void);
+void page_session(void);
+void page_prog(uint16_t address);
+void page_prog_payload(uint8_t seq_no, uint8_t *data, uint8_t length);
+void page_fec_payload(uint8_t page_no, uint8_t shard, uint8_t *data);
+
+#endif /* _PAGE_H_ */
@@ -7,123 +7,242 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <sys/mman.h>
 
 #include "error.h"
 #include "file.h"
 #include "hex.h"
 
+// hex digit values, HEX_DIGIT marks the characters that are digits at all
+#define HEX_DIGIT	0x10
+static const uint8_t hex_digit[256] = {
+	['0'] = HEX_DIGIT | 0x0, ['1'] = HEX_DIGIT | 0x1, ['2'] = HEX_DIGIT | 0x2, ['3'] = HEX_DIGIT | 0x3,
+	['4'] = HEX_DIGIT | 0x4, ['5'] = HEX_DIGIT | 0x5, ['6'] = HEX_DIGIT | 0x6, ['7'] = HEX_DIGIT | 0x7,
+	['8'] = HEX_DIGIT | 0x8, ['9'] = HEX_DIGIT | 0x9,
+	['A'] = HEX_DIGIT | 0xA, ['B'] = HEX_DIGIT | 0xB, ['C'] = HEX_DIGIT | 0xC,
+	['D'] = HEX_DIGIT | 0xD, ['E'] = HEX_DIGIT | 0xE, ['F'] = HEX_DIGIT | 0xF,
+	['a'] = HEX_DIGIT | 0xA, ['b'] = HEX_DIGIT | 0xB, ['c'] = HEX_DIGIT | 0xC,
+	['d'] = HEX_DIGIT | 0xD, ['e'] = HEX_DIGIT | 0xE, ['f'] = HEX_DIGIT | 0xF,
+};
+
+// the two digits at p as a byte, returns 0 when they are not hex digits
+static inline int hex_byte(const char *p, uint8_t *byte) {
+	uint8_t hi = hex_digit[(uint8_t)p[0]], lo = hex_digit[(uint8_t)p[1]];
+
+	*byte = ((hi & 0x0F) << 4) | (lo & 0x0F);
+
+	return hi & lo & HEX_DIGIT;
+}
+
+// images are gathered in HEX_PAGE_SIZE pages while parsing, kept sorted by address
+// hex files are nearly always in address order so a new page is almost always appended
+typedef struct hex_page {
+	uint32_t address;
+	uint8_t mem[HEX_PAGE_SIZE];
+	uint8_t tag[HEX_PAGE_SIZE];
+} hex_page_t;
+
+typedef struct hex_pages {
+	uint32_t count, size, last;
+	hex_page_t **page;
+} hex_pages_t;
+
+static hex_page_t *hex_pages_get(hex_pages_t *p, uint32_t address) {
+	uint32_t lo = 0, hi = p->count, mid;
+	hex_page_t *page;
+
+	address &= ~(uint32_t)(HEX_PAGE_SIZE - 1);
+	// consecutive records land on the page before
+	if (p->count && p->page[p->last]->address == address)
+		return p->page[p->last];
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (p->page[mid]->address < address)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == p->count || p->page[lo]->address != address) {
+		if (p->count == p->size) {
+			p->size = (p->size ? p->size * 2 : 64);
+			p->page = (hex_page_t **)realloc(p->page, p->size * sizeof(hex_page_t *));
+		}
+		memmove(&p->page[lo + 1], &p->page[lo], (p->count - lo) * sizeof(hex_page_t *));
+		page = (hex_page_t *)malloc(sizeof(hex_page_t));
+		page->address = address;
+		memset(page->mem, 0xFF, HEX_PAGE_SIZE);
+		memset(page->tag, HEX_TAG_UNALLOC, HEX_PAGE_SIZE);
+		p->page[lo] = page;
+		p->count++;
+	}
+	p->last = lo;
+
+	return p->page[lo];
+}
+
+// single pass over the mapped file, the data goes straight into pages
+// extended segment (02) and extended linear (04) address records give 32 bit addresses, the start
+// address records (03, 05) are checked and ignored
 hex_t *hex_load_from_file(char *filename) {
-	file_t *f;
 	hex_t *h;
-	char line[1024];
-	int line_no = 0, fields, i, j;
-	uint8_t checksum, eof = 0;
-	hex_record_t *r;
+	hex_pages_t pages;
+	hex_page_t *page;
+	struct stat st;
+	const char *map, *p, *end, *line;
+	uint8_t byte_count, record_type, checksum, byte, data[255];
+	uint16_t offset;
+	uint32_t base = 0, address, records = 0, i, n;
+	int fd, line_no = 0, eof = 0;
 
-	f = file_open(filename, "r");
+	if ((fd = open(filename, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+		perror(NULL);
+		fatal_error("unable to open file '%s'\n", filename);
+	}
+	map = (st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL);
+	if (map == MAP_FAILED) {
+		perror(NULL);
+		fatal_error("unable to map file '%s'\n", filename);
+	}
 
-	printf("reading hex from file '%s'\n", f->filename);
+	printf("reading hex from file '%s'\n", filename);
 
 	h = malloc(sizeof(hex_t));
 	memset(h, 0, sizeof(hex_t));
-	h->min_address = UINT16_MAX;
+	memset(&pages, 0, sizeof(hex_pages_t));
+	h->min_address = UINT32_MAX;
 
-	while (fgets(line, 1024, f->fp) != NULL) {
+	end = map + st.st_size;
+	for (p = map; p < end; ) {
+		// one line, without its end of line characters
+		line = p;
+		while (p < end && *p != '\n')
+			++p;
+		n = p - line;
+		if (p < end)
+			++p;
 		++line_no;
-		if (line[0] == '#')
+		while (n && (line[n - 1] == '\r' || line[n - 1] == ' ' || line[n - 1] == '\t'))
+			--n;
+		if (n == 0 || line[0] == '#')
 			continue;
 		if (eof) {
-			warning("in file '%s' on line %d: additional lines found in file after EOF record on line %d\n", f->filename, line_no, eof);
-			exit(EXIT_FAILURE);
-		}
-		r = malloc(sizeof(hex_record_t));
-		r->line = strdup(line);
-		// parse the line
-		if (strlen(r->line) < (1 + 2 + 4 + 2 + 2)) {	// : + byte_count + address + record_type + checksum
-			warning("in file '%s' on line %d: line too short for minimum content\n", f->filename, line_no);
+			warning("in file '%s' on line %d: additional lines found in file after EOF record on line %d\n", filename, line_no, eof);
 			exit(EXIT_FAILURE);
 		}
-		fields = sscanf(line, ":%02hhX%04hx%02hhX", &r->byte_count, &r->address, &r->record_type);
-		if (fields != 3) {
-			warning("in file '%s' on line %d: unable to read first three fields on line: byte_count, address, and record_type\n", f->filename, line_no);
+		if (n < (1 + 2 + 4 + 2 + 2)) {	// : + byte_count + address + record_type + checksum
+			warning("in file '%s' on line %d: line too short for minimum content\n", filename, line_no);
 			exit(EXIT_FAILURE);
 		}
-		if (r->record_type == 0x0) {
-			// normal
-			if (r->address < h->min_address) {
-				h->min_address = r->address;
-			}
-			if (r->address + (r->byte_count - 1) > h->max_address) {
-				h->max_address = r->address + (r->byte_count - 1);
-			}
-		} else if (r->record_type == 0x1) {
-			if (r->byte_count != 0) {
-				warning("in file '%s' on line %d: for record type %04hX (EOF), byte count must = 0 (found %d)\n", f->filename, line_no, r->record_type, r->byte_count);
-				exit(EXIT_FAILURE);
-			} else if (r->address != 0) {
-				warning("in file '%s' on line %d: for record type %04hX (EOF), address must = 0x0000 (found %0xhX)\n", f->filename, line_no, r->record_type, r->address);
-				exit(EXIT_FAILURE);
-			}
-			eof = line_no;
-		} else {
-			warning("in file '%s' on line %d: unhandled record type %04hX (%d)\n", f->filename, line_no, r->record_type, r->record_type);
+		if (line[0] != ':' || !hex_byte(&line[1], &byte_count) || !hex_byte(&line[3], &byte) || !hex_byte(&line[5], &checksum) || !hex_byte(&line[7], &record_type)) {
+			warning("in file '%s' on line %d: unable to read first three fields on line: byte_count, address, and record_type\n", filename, line_no);
 			exit(EXIT_FAILURE);
 		}
-//		printf("parsed %d fields: 0x%x 0x%x 0x%x\n", fields, r->byte_count, r->address, r->record_type);
-		if (strlen(r->line) < (1 + 2 + 4 + 2 + 2 + (2 * r->byte_count))) {
-			warning("in file '%s' on line %d: line too short for minimum content and specified byte count (%d)\n", f->filename, line_no, r->byte_count);
+		offset = ((uint16_t)byte << 8) | checksum;
+		if (n < (1 + 2 + 4 + 2 + 2 + (2 * byte_count))) {
+			warning("in file '%s' on line %d: line too short for minimum content and specified byte count (%d)\n", filename, line_no, byte_count);
 			exit(EXIT_FAILURE);
 		}
-		if (r->byte_count > 0) {
-			r->data = (uint8_t *)malloc(r->byte_count * sizeof(uint8_t));
-			for (i = 0; i < r->byte_count; ++i) {
-				sscanf(&line[9 + (i * 2)], "%02hhX", &r->data[i]);
+		checksum = byte_count + (offset >> 8) + (offset & 0x00FF) + record_type;
+		for (i = 0; i <= byte_count; ++i) {
+			if (!hex_byte(&line[9 + (i * 2)], &byte)) {
+				warning("in file '%s' on line %d: invalid hex digits at column %d\n", filename, line_no, 10 + (i * 2));
+				exit(EXIT_FAILURE);
 			}
-		} else {
-			i = 0;
+			checksum += byte;
+			if (i < byte_count)
+				data[i] = byte;
 		}
-		// checksum
-		sscanf(&line[9 + (i * 2)], "%02hhX", &r->checksum);
-		checksum = r->byte_count + ((r->address & 0xFF00) >> 8) + (r->address & 0x00FF) + r->record_type;
-		for (i = 0; i < r->byte_count; ++i) {
-			checksum += r->data[i];
-		}
-//		checksum = ~checksum + 1;
-//		if (checksum != r->checksum) ...
-//		alternately
-		if (((checksum + r->checksum) & 0xFF) != 0) {
-			warning("in file '%s' on line %d: checksum failed!\n", f->filename, line_no);
+		if (checksum != 0) {
+			warning("in file '%s' on line %d: checksum failed!\n", filename, line_no);
 			exit(EXIT_FAILURE);
 		}
+		++records;
 
-		h->records++;
-		h->record = realloc(h->record, sizeof(hex_record_t *) * h->records);
-		h->record[h->records - 1] = r;
-		h->total_bytes += r->byte_count;
+		switch (record_type) {
+			case 0x00:
+				// data
+				address = base + offset;
+				if (byte_count && address < h->min_address)
+					h->min_address = address;
+				if (byte_count && address + (byte_count - 1) > h->max_address)
+					h->max_address = address + (byte_count - 1);
+				page = NULL;
+				for (i = 0; i < byte_count; ++i, ++address) {
+					if (!page || (address & (HEX_PAGE_SIZE - 1)) == 0)
+						page = hex_pages_get(&pages, address);
+					if (page->tag[address & (HEX_PAGE_SIZE - 1)] == HEX_TAG_UNALLOC)
+						h->total_bytes++;
+					page->mem[address & (HEX_PAGE_SIZE - 1)] = data[i];
+					page->tag[address & (HEX_PAGE_SIZE - 1)] = HEX_TAG_ALLOC;
+				}
+				break;
+			case 0x01:
+				// end of file
+				if (byte_count != 0) {
+					warning("in file '%s' on line %d: for record type %04hX (EOF), byte count must = 0 (found %d)\n", filename, line_no, record_type, byte_count);
+					exit(EXIT_FAILURE);
+				} else if (offset != 0) {
+					warning("in file '%s' on line %d: for record type %04hX (EOF), address must = 0x0000 (found %0xhX)\n", filename, line_no, record_type, offset);
+					exit(EXIT_FAILURE);
+				}
+				eof = line_no;
+				break;
+			case 0x02:
+			case 0x04:
+				// extended segment address (bits 4 - 19) or extended linear address (bits 16 - 31)
+				if (byte_count != 2) {
+					warning("in file '%s' on line %d: for record type %04hX (extended address), byte count must = 2 (found %d)\n", filename, line_no, record_type, byte_count);
+					exit(EXIT_FAILURE);
+				}
+				base = ((uint32_t)data[0] << 8) | data[1];
+				base <<= (record_type == 0x02 ? 4 : 16);
+				break;
+			case 0x03:
+			case 0x05:
+				// start segment address (CS:IP) or start linear address (EIP), nothing for us to run
+				if (byte_count != 4) {
+					warning("in file '%s' on line %d: for record type %04hX (start address), byte count must = 4 (found %d)\n", filename, line_no, record_type, byte_count);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			default:
+				warning("in file '%s' on line %d: unhandled record type %04hX (%d)\n", filename, line_no, record_type, record_type);
+				exit(EXIT_FAILURE);
+		}
 	}
+	if (h->total_bytes == 0) {
+		warning("in file '%s': no data records\n", filename);
+		exit(EXIT_FAILURE);
+	}
+
+	// flatten the pages, mem and tag start at min_address
 	h->address_range = (h->max_address - h->min_address) + 1;
-	h->mem = (uint8_t *)malloc((h->max_address + 1) * sizeof(uint8_t));
-	h->tag = (uint8_t *)malloc((h->max_address + 1) * sizeof(uint8_t));
-	memset(h->mem, 0xFF, (h->max_address + 1) * sizeof(uint8_t));
-	memset(h->tag, HEX_TAG_UNALLOC, (h->max_address + 1) * sizeof(uint8_t));
-	for (i = 0; i < h->records; ++i) {
-		uint16_t addr;
-		r = h->record[i];
-		addr = r->address;
-		for (j = 0; j < r->byte_count; ++j) {
-			h->mem[addr] = r->data[j];
-			h->tag[addr++] = HEX_TAG_ALLOC;
+	h->mem = (uint8_t *)malloc(h->address_range * sizeof(uint8_t));
+	h->tag = (uint8_t *)malloc(h->address_range * sizeof(uint8_t));
+	memset(h->mem, 0xFF, h->address_range * sizeof(uint8_t));
+	memset(h->tag, HEX_TAG_UNALLOC, h->address_range * sizeof(uint8_t));
+	for (i = 0; i < pages.count; ++i) {
+		page = pages.page[i];
+		for (n = 0; n < HEX_PAGE_SIZE; ++n) {
+			if (page->tag[n] == HEX_TAG_ALLOC) {
+				h->mem[page->address + n - h->min_address] = page->mem[n];
+				h->tag[page->address + n - h->min_address] = HEX_TAG_ALLOC;
+			}
 		}
+		free(page);
 	}
+	free(pages.page);
 
-	printf("hex: %s\n", f->filename);
-	printf("\t%-20s: %d\n", "records", h->records);
+	printf("hex: %s\n", filename);
+	printf("\t%-20s: %d\n", "records", records);
 	printf("\t%-20s: %d\n", "total bytes", h->total_bytes);
-	printf("\t%-20s: %04hX (%d)\n", "min address", h->min_address, h->min_address);
-	printf("\t%-20s: %04hX (%d)\n", "max address", h->max_address, h->max_address);
-	printf("\t%-20s: %04hX (%d)\n", "address range", h->address_range, h->address_range);
+	printf("\t%-20s: %04X (%u)\n", "min address", h->min_address, h->min_address);
+	printf("\t%-20s: %04X (%u)\n", "max address", h->max_address, h->max_address);
+	printf("\t%-20s: %04X (%u)\n", "address range", h->address_range, h->address_range);
 
-	file_close(f);
+	if (map)
+		munmap((void *)map, st.st_size);
+	close(fd);
 
 	return h;
 }
@@ -143,11 +262,19 @@ void hex_free(hex_t *h) {
 	free(h);
 }
 
-void hex_from_map_add_record(hex_t *h, uint16_t start, uint16_t end) {
+void hex_from_map_add_record(hex_t *h, uint32_t start, uint32_t end) {
 	hex_record_t *r;
-	uint16_t i;
+	uint32_t i;
 	uint8_t line_len;
 
+	// a record never crosses into the next 64K, the address of its line is only 16 bits
+	if (((start + h->min_address) >> 16) != ((end + h->min_address) >> 16)) {
+		i = (((end + h->min_address) & 0xFFFF0000) - h->min_address);
+		hex_from_map_add_record(h, start, i - 1);
+		hex_from_map_add_record(h, i, end);
+		return;
+	}
+
 	r = (hex_record_t *)malloc(sizeof(hex_record_t));
 	h->record = (hex_record_t **)realloc(h->record, (h->records + 1) * sizeof(hex_record_t *));
 	h->record[h->records++] = r;
@@ -166,15 +293,28 @@ void hex_from_map_add_record(hex_t *h, uint16_t start, uint16_t end) {
 
 	line_len = (1 + 2 + 4 + 2 + 2 + (2 * r->byte_count) + 1);
 	r->line = (char *)malloc(sizeof(char) * line_len);
-	sprintf(r->line, ":%02hhX%04hx%02hhX", r->byte_count, r->address, r->record_type);
+	sprintf(r->line, ":%02hhX%04hx%02hhX", r->byte_count, (uint16_t)(r->address & 0xFFFF), r->record_type);
 	for (i = 0; i < r->byte_count; ++i)
 		sprintf(&r->line[(i * 2) + 9], "%02hhX", r->data[i]);
 	sprintf(&r->line[(i * 2) + 9], "%02hhX", r->checksum);
 }
 
-hex_t *hex_from_map(uint8_t *mem, uint8_t *tag, uint16_t bytes, uint16_t min_address) {
+// 64 bit FNV-1a of the address range and contents of the image
+uint64_t hex_hash(hex_t *h) {
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	uint32_t i;
+
+	for (i = 0; i < 4; ++i)
+		hash = (hash ^ ((h->min_address >> (i * 8)) & 0xFF)) * 0x100000001B3ULL;
+	for (i = 0; i < h->address_range; ++i)
+		hash = (hash ^ h->mem[i]) * 0x100000001B3ULL;
+
+	return hash;
+}
+
+hex_t *hex_from_map(uint8_t *mem, uint8_t *tag, uint32_t bytes, uint32_t min_address) {
 	hex_t *h;
-	uint16_t i, start = 0;
+	uint32_t i, start = 0;
 	uint8_t last_tag = HEX_TAG_UNALLOC, consecutive_allocs = 0;
 	
 	h = malloc(sizeof(hex_t));
@@ -222,12 +362,20 @@ hex_t *hex_from_map(uint8_t *mem, uint8_t *tag, uint16_t bytes, uint16_t min_add
 }
 
 void hex_save_to_file(hex_t *h, char *filename) {
-	int i;
+	uint32_t i;
+	uint16_t upper = 0;
+	uint8_t checksum;
 	file_t *f;
 
 	f = file_open(filename, "w");
 
 	for (i = 0; i < h->records; ++i) {
+		// an extended linear address record ahead of records above 64K
+		if ((h->record[i]->address >> 16) != upper) {
+			upper = h->record[i]->address >> 16;
+			checksum = ~(0x02 + 0x04 + (upper >> 8) + (upper & 0x00FF)) + 1;
+			fprintf(f->fp, ":02000004%04X%02hhX\n", upper, checksum);
+		}
 		fprintf(f->fp, "%s\n",  h->record[i]->line);
 	}
 	fprintf(f->fp, ":00000001FF\n");
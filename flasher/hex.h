@@ -3,7 +3,7 @@
 
 typedef struct hex_record {
 	uint8_t byte_count;
-	uint16_t address;
+	uint32_t address;
 	uint8_t record_type;
 	uint8_t *data;
 	uint8_t checksum;
@@ -16,20 +16,26 @@ typedef struct hex_record {
 //#define HEX_DEFAULT_BYTE_COUNT	32
 #define HEX_DEFAULT_BYTE_COUNT	16
 
+// granularity of the image while a file is parsed
+#define HEX_PAGE_SIZE	256
+
+// loading a file fills mem and tag only, hex_from_map also makes records for saving
+// mem and tag start at min_address
 typedef struct hex {
-	uint16_t records;
+	uint32_t records;
 	hex_record_t **record;
-	uint16_t min_address;
-	uint16_t max_address;
-	uint16_t address_range;
-	uint16_t total_bytes;
+	uint32_t min_address;
+	uint32_t max_address;
+	uint32_t address_range;
+	uint32_t total_bytes;
 	uint8_t *mem;
 	uint8_t	*tag;
 } hex_t;
 
 hex_t *hex_load_from_file(char *filename);
 void hex_free(hex_t *p);
-hex_t *hex_from_map(uint8_t *mem, uint8_t *tag, uint16_t bytes, uint16_t min_address);
+hex_t *hex_from_map(uint8_t *mem, uint8_t *tag, uint32_t bytes, uint32_t min_address);
 void hex_save_to_file(hex_t *h, char *filename);
+uint64_t hex_hash(hex_t *h);
 
 #endif /* _HEX_H_ */
@@ -99,7 +99,7 @@ int task_flash_hex(int argc, char *argv[]) {
 		hex_save_to_file(h, argv[4]);
 #else
 		hex_t *hout;
-		hout = hex_from_map(h->mem, h->tag, h->total_bytes, h->min_address);
+		hout = hex_from_map(h->mem, h->tag, h->address_range, h->min_address);
 		hex_save_to_file(hout, argv[4]);
 		hex_free(hout);
 #endif
@@ -5,6 +5,8 @@
 #include <avr/wdt.h>
 #include <avr/eeprom.h>
 #include <avr/pgmspace.h>
+#include <avr/sleep.h>
+#include <util/delay_basic.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,15 +18,149 @@
 #include "nRF24L01+.h"
 #include "rgb.h"
 #include "program.h"
+#include "effect.h"
 #include "packet.h"
 #include "timer1.h"
+#include "flash.h"
+#include "xtea.h"
+#include "packetq.h"
+#include "eequeue.h"
 
 nrf24_t *radio;
 
 const uint64_t pipes[2] = { PIPE_0_ADDR, PIPE_1_ADDR };
-uint8_t packet[NRF24__MAX_PAYLOAD_SIZE];
 extern volatile program_state_e program_state;
 extern volatile uint16_t icp_hz;
+extern volatile uint16_t program_late_max, program_late_steps;
+extern volatile uint32_t program_ms;
+extern volatile uint16_t rgb_replaced;
+
+// the INT0 ISR only moves packets from the radio to the queue, the main loop handles them
+static packetq_t packets;
+// with the queue full packets are left in the radio, which stops acking once its own fifo fills
+static volatile uint8_t radio_pending = 0;
+#define PWM_LOAD_WINDOW_MS	100
+// longest INT0 ISR in timer 1 ticks
+static volatile uint16_t isr_ticks_max = 0;
+// share of the CPU the PWM interrupts take in permille, measured once at boot
+static uint16_t pwm_load = 0;
+
+// the main loop keeps the ISR off the SPI bus while it talks to the radio
+#define RADIO_LOCK()	(EIMSK &= ~(1 << INT0))
+#define RADIO_UNLOCK()	(EIMSK |= (1 << INT0))
+
+static void packet_dispatch(void);
+
+// over the air update, a nonce is made unique by the boot epoch kept in the EEPROM and a count
+static const uint32_t ota_key[XTEA_KEY_WORDS] = { OTA_KEY };
+static uint8_t ota_nonce[XTEA_BLOCK_SIZE], ota_nonce_valid = 0;
+static uint16_t ota_epoch = 0, ota_count = 0;
+
+static void ota_nonce_new(void) {
+	// once per boot
+	if (!ota_epoch) {
+		uint16_t location = E2END + 1 - FLASH_EEPROM_NONCE_EPOCH_OFFSET;
+		eequeue_flush();
+		ota_epoch = eeprom_read_word((uint16_t *)location) + 1;
+		if (!ota_epoch)
+			ota_epoch = 1;
+		eequeue_write_word(location, ota_epoch);
+	}
+	ota_nonce[0] = (uint8_t)(ota_epoch & 0x00FF);
+	ota_nonce[1] = (uint8_t)((ota_epoch & 0xFF00) >> 8);
+	ota_nonce[2] = (uint8_t)(ota_count & 0x00FF);
+	ota_nonce[3] = (uint8_t)((ota_count & 0xFF00) >> 8);
+	ota_nonce[4] = TCNT0 ^ TCNT2;
+	ota_nonce[5] = (uint8_t)(TCNT1 & 0x00FF);
+	ota_nonce[6] = (uint8_t)((TCNT1 & 0xFF00) >> 8);
+	ota_nonce[7] = 0;
+	++ota_count;
+	ota_nonce_valid = 1;
+}
+
+// steps have to stay below the EEPROM reserved for the bootloader
+static uint8_t program_steps_fit(uint16_t step, uint16_t steps) {
+	if (!steps)
+		return 0;
+	if (PROGRAM_STEP_LOCATION((uint32_t)step + steps) > E2END + 1 - FLASH_EEPROM_RESERVED) {
+		printf_P(PSTR("steps %" PRIu16 "+%" PRIu16 " out of range\n"), step, steps);
+		return 0;
+	}
+
+	return 1;
+}
+
+static void ack_payload(uint8_t *buf, uint8_t len) {
+	RADIO_LOCK();
+	nrf24_write_ack_payload(radio, 1, buf, len);
+	RADIO_UNLOCK();
+}
+
+// streamed read back of the program steps
+static uint16_t stream_step, stream_remaining;
+static uint8_t stream_sequence;
+
+// load the next payload of the stream into the ack fifo
+static void program_stream_stage(void) {
+	uint8_t buf[NRF24__MAX_PAYLOAD_SIZE], steps;
+
+	steps = (stream_remaining > PACKET_PROGRAM_STREAM_STEPS ? PACKET_PROGRAM_STREAM_STEPS : stream_remaining);
+	buf[0] = PACKET_PROGRAM_STREAM_PAYLOAD;
+	buf[1] = stream_sequence++;
+	eequeue_flush();
+	eeprom_read_block(&buf[PACKET_PROGRAM_STREAM_PAYLOAD_MIN_SIZE], (void *)PROGRAM_STEP_LOCATION(stream_step), steps * PACKET_PROGRAM_STEP_PACKED_SIZE);
+	stream_step += steps;
+	stream_remaining -= steps;
+	ack_payload(buf, PACKET_PROGRAM_STREAM_PAYLOAD_MIN_SIZE + (steps * PACKET_PROGRAM_STEP_PACKED_SIZE));
+}
+
+// real time colors, a frame more than COLOR_STREAM_TIMEOUT_MS after the last one starts a new
+// stream, within a stream the gaps in the sequence are frames the radio lost
+#define COLOR_STREAM_TIMEOUT_MS	1000
+static uint32_t color_stream_last_ms;
+static uint16_t color_stream_lost;
+static uint8_t color_stream_next;
+
+static uint32_t ms_now(void) {
+	uint32_t ms;
+	uint8_t sreg = SREG;
+
+	cli();
+	ms = program_ms;
+	SREG = sreg;
+
+	return ms;
+}
+
+// rounds of a fixed busy loop that fit in ms milliseconds
+static uint32_t busy_loops(uint16_t ms) {
+	uint32_t loops = 0, start;
+
+	start = ms_now();
+	while (ms_now() == start);
+	start += 1;
+	while (ms_now() - start < ms) {
+		_delay_loop_2(250);
+		++loops;
+	}
+
+	return loops;
+}
+
+// the PWM interrupts take what the busy loop gets done less with them than without
+// a dim color keeps every channel in between off and full on, where the backends work hardest
+static uint16_t pwm_load_measure(void) {
+	uint32_t with, without;
+
+	rgb_set(1, 1, 1);
+	rgb_pwm_interrupts(0);
+	without = busy_loops(PWM_LOAD_WINDOW_MS);
+	rgb_pwm_interrupts(1);
+	with = busy_loops(PWM_LOAD_WINDOW_MS);
+	rgb_set(0, 0, 0);
+
+	return (with >= without ? 0 : ((without - with) * 1000) / without);
+}
 
 int main(void) {
 	// disable the watchdog timer, this is necessary if the timer was used to reset the device
@@ -51,6 +187,8 @@ int main(void) {
 //	EICRA = 0;				// the low level of INT0 triggers interrupt
 	EIMSK |= (1 << INT0);			// enable INT0 interrupt (PD2)
 
+	packetq_init(&packets);
+
 	// led program execution
 	timer0_init();
 	program_init();
@@ -62,51 +200,130 @@ int main(void) {
 	// turn on interrupts
 	sei();
 
+	pwm_load = pwm_load_measure();
+	printf_P(PSTR("PWM %" PRIu32 " Hz, %u.%u%% CPU\n"), (uint32_t)RGB_PWM_HZ, pwm_load / 10, pwm_load % 10);
+
 	nrf24_print_details(radio);
 
+	set_sleep_mode(SLEEP_MODE_IDLE);
+
+	// playback runs from the timer 1 millisecond tick, the main loop handles packets, reads
+	// steps ahead and renders the program or effect, then sleeps until the next interrupt
 	while (1) {
-		program_run();
+		packet_dispatch();
+		program_poll();
+		effect_poll();
+
+		cli();
+		if (!packetq_front(&packets) && !radio_pending) {
+			sleep_enable();
+			sei();
+			sleep_cpu();
+			sleep_disable();
+		}
+		sei();
 	}
 }
 
+// move packets from the radio fifo to the queue, called by the ISR and by the main loop
+// once the queue has room again for packets that were left in the radio
+static void radio_drain(void) {
+	uint8_t done, *slot;
+	uint8_t status = nrf24_read_status(radio);
+
+	// a pipe number of all ones means the fifo is empty, e.g. on an IRQ for a sent ack payload
+	done = (((status >> NRF24__RX_P_NO) & 0x07) == 0x07);
+	radio_pending = 0;
+	while (!done) {
+		slot = packetq_slot(&packets);
+		if (!slot) {
+			radio_pending = 1;
+			break;
+		}
+		done = nrf24_read(radio, slot, NRF24__MAX_PAYLOAD_SIZE);
+		packetq_push(&packets);
+	}
+
+	// reset IRQ status bit
+	status |= _BV(NRF24__RX_DR) | _BV(NRF24__TX_DS) | _BV(NRF24__MAX_RT);
+	nrf24_write_register(radio, NRF24__STATUS, &status, 1);
+}
+
 // interrupt for nrf24 IRQ pin (PD2)
 ISR(INT0_vect) {
+	uint16_t start = TCNT1, ticks;
+
 	// incoming data
-	uint8_t done = 0;
-	uint8_t status = nrf24_read_status(radio);
+	radio_drain();
 
-	while (!done) {
-		done = nrf24_read(radio, packet, NRF24__MAX_PAYLOAD_SIZE);
+	ticks = timer1_ticks_since(start);
+	if (ticks > isr_ticks_max)
+		isr_ticks_max = ticks;
+}
+
+// handle the queued packets, from the main loop
+static void packet_dispatch(void) {
+	uint8_t *packet;
 
+	while ((packet = packetq_front(&packets))) {
 #ifdef AVR0_DEBUG
 		printf_P(PSTR("packet type = %d\n"), packet[0]);
 #endif
 
 		switch (packet[0]) {
 			case PACKET_RESET:
+				// queued writes land before the reset
+				eequeue_flush();
 				// call the watchdog timer to reset in 15ms
 				wdt_enable(WDTO_15MS);
 				// wait 20ms, effectively forcing a reset
 				_delay_ms(20);
 				break;
 			case PACKET_STOP_PROGRAM:
-				program_state = PROGRAM_STOP;
+				effect_stop();
+				program_set_state(PROGRAM_STOP);
 				break;
 			case PACKET_RUN_PROGRAM:
-				program_state = PROGRAM_RUN;
+				effect_stop();
+				program_set_state(PROGRAM_RUN);
 				break;
 			case PACKET_SET_COLOR:
+				effect_stop();
 				rgb_set(packet[1], packet[2], packet[3]);
 				break;
+			case PACKET_STREAM_COLOR:
+				{
+					uint32_t now = ms_now();
+
+					if (now - color_stream_last_ms <= COLOR_STREAM_TIMEOUT_MS)
+						color_stream_lost += (uint8_t)(packet[1] - color_stream_next);
+					color_stream_last_ms = now;
+					color_stream_next = packet[1] + 1;
+					// the stream takes over from a program or effect
+					effect_stop();
+					if (program_state == PROGRAM_RUN)
+						program_set_state(PROGRAM_STOP);
+					rgb_set(packet[2], packet[3], packet[4]);
+				}
+				break;
+			case PACKET_RUN_EFFECT:
+				// the effect takes over from the program
+				program_set_state(PROGRAM_STOP);
+				effect_start(packet);
+				break;
+			case PACKET_SET_BRIGHTNESS:
+				rgb_set_brightness(packet[1]);
+				break;
 			case PACKET_BEGIN_PROGRAMMING:
-				program_state = PROGRAM_PROGRAMMING;
+				effect_stop();
+				program_set_state(PROGRAM_PROGRAMMING);
 				printf_P(PSTR("entering programming state\n"));
 				break;
 			case PACKET_PROGRAM_LENGTH:
 				if (program_state == PROGRAM_PROGRAMMING) {
 					uint16_t location = PROGRAM_START, steps = ((uint16_t)packet[2] << 8) | packet[1];
 					printf_P(PSTR("program steps = %" PRIu16 "\n"), steps);
-					eeprom_update_word((uint16_t *)location, steps);
+					eequeue_write_word(location, steps);
 				}
 				break;
 			case PACKET_PROGRAM_STEP:
@@ -119,14 +336,28 @@ ISR(INT0_vect) {
 //					printf_P(PSTR("program delay = %" PRIu16 "\n"), step);
 					printf_P(PSTR("."));
 					location = PROGRAM_STEP_LOCATION(step);
-					eeprom_update_block(&packet[3], (void *)location, 3 * sizeof(uint8_t));
+					eequeue_write_block(&packet[3], location, 3 * sizeof(uint8_t));
 					location += 3 * sizeof(uint8_t);
-					eeprom_update_word((uint16_t *)location, delay_in_ms);
+					eequeue_write_word(location, delay_in_ms);
+				}
+				break;
+			case PACKET_PROGRAM_STEPS_BLOCK:
+				if (program_state == PROGRAM_PROGRAMMING) {
+					uint16_t step = ((uint16_t)packet[2] << 8) | packet[1];
+					uint8_t steps = packet[3];
+
+					if (steps > PACKET_PROGRAM_STEPS_BLOCK_MAX_STEPS || !program_steps_fit(step, steps))
+						break;
+					printf_P(PSTR("."));
+					// packed steps are laid out as in EEPROM
+					eequeue_write_block(&packet[PACKET_PROGRAM_STEPS_BLOCK_MIN_SIZE], PROGRAM_STEP_LOCATION(step), steps * PACKET_PROGRAM_STEP_PACKED_SIZE);
 				}
 				break;
 			case PACKET_END_PROGRAMMING:
 				if (program_state == PROGRAM_PROGRAMMING) {
-					program_state = PROGRAM_STOP;
+					// the program is only run once it is all written
+					eequeue_flush();
+					program_set_state(PROGRAM_STOP);
 					printf_P(PSTR("\ndone\n"));
 				}
 				break;
@@ -136,6 +367,7 @@ ISR(INT0_vect) {
 					uint16_t steps;
 
 					packet[0] = PACKET_PROGRAM_LENGTH;
+					eequeue_flush();
 					steps = eeprom_read_word((uint16_t *)location);
 					packet[1] = (uint8_t)(steps & 0x00FF);
 					packet[2] = (uint8_t)((steps & 0xFF00) >> 8);			
@@ -144,8 +376,7 @@ ISR(INT0_vect) {
 					printf_P(PSTR("sending stored program length as next ack packet: %" PRIu16 "\n"), steps);
 #endif
 
-					nrf24_set_payload_size(radio, PACKET_PROGRAM_LENGTH_SIZE);
-					nrf24_write_ack_payload(radio, 1, packet, PACKET_PROGRAM_LENGTH_SIZE);
+					ack_payload(packet, PACKET_PROGRAM_LENGTH_SIZE);
 				}
 				break;
 			case PACKET_READ_PROGRAM_LEN_FLUSH:
@@ -166,6 +397,7 @@ ISR(INT0_vect) {
 					packet[1] = (uint8_t)(step & 0x00FF);
 					packet[2] = (uint8_t)((step & 0xFF00) >> 8);			
 					location = PROGRAM_STEP_LOCATION(step);
+					eequeue_flush();
 					eeprom_read_block(&packet[3], (void *)location, 3 * sizeof(uint8_t));
 					location += 3 * sizeof(uint8_t);
 					delay_in_ms = eeprom_read_word((uint16_t *)location);
@@ -176,13 +408,111 @@ ISR(INT0_vect) {
 					printf_P(PSTR("sending stored program step %" PRIu16 ": %d %d %d - %" PRIu16 " ms\n"), step, packet[3], packet[4], packet[5], delay_in_ms);
 #endif
 
-					nrf24_set_payload_size(radio, PACKET_PROGRAM_STEP_SIZE);
-					nrf24_write_ack_payload(radio, 1, packet, PACKET_PROGRAM_STEP_SIZE);
+					ack_payload(packet, PACKET_PROGRAM_STEP_SIZE);
 				}
 				break;
 			case PACKET_READ_PROGRAM_STEP_FLUSH:
 				// nothing really to do here, we let the auto ack do the heavy lifting
 				break;
+			case PACKET_READ_PROGRAM_STEPS_BLOCK:
+				{
+					uint16_t step = ((uint16_t)packet[2] << 8) | packet[1];
+					uint8_t steps = packet[3];
+
+					if (steps > PACKET_PROGRAM_STEPS_BLOCK_MAX_STEPS || !program_steps_fit(step, steps))
+						break;
+#ifdef AVR0_DEBUG
+					printf_P(PSTR("sending %u steps from step %" PRIu16 "\n"), steps, step);
+#endif
+					packet[0] = PACKET_PROGRAM_STEPS_BLOCK;
+					eequeue_flush();
+					eeprom_read_block(&packet[PACKET_PROGRAM_STEPS_BLOCK_MIN_SIZE], (void *)PROGRAM_STEP_LOCATION(step), steps * PACKET_PROGRAM_STEP_PACKED_SIZE);
+
+					ack_payload(packet, PACKET_PROGRAM_STEPS_BLOCK_MIN_SIZE + (steps * PACKET_PROGRAM_STEP_PACKED_SIZE));
+				}
+				break;
+			case PACKET_READ_PROGRAM_STEPS_BLOCK_FLUSH:
+				// nothing really to do here, we let the auto ack do the heavy lifting
+				break;
+			case PACKET_READ_PROGRAM_STREAM:
+				{
+					uint16_t step = ((uint16_t)packet[2] << 8) | packet[1];
+					uint16_t steps = ((uint16_t)packet[4] << 8) | packet[3];
+					uint8_t i;
+
+					// anything left over from an earlier read would be out of order
+					RADIO_LOCK();
+					nrf24_flush_tx(radio);
+					RADIO_UNLOCK();
+					stream_remaining = 0;
+					if (!program_steps_fit(step, steps))
+						break;
+#ifdef AVR0_DEBUG
+					printf_P(PSTR("streaming %" PRIu16 " steps from step %" PRIu16 "\n"), steps, step);
+#endif
+					stream_step = step;
+					stream_remaining = steps;
+					stream_sequence = 0;
+					for (i = 0; i < PACKET_PROGRAM_STREAM_DEPTH && stream_remaining; ++i)
+						program_stream_stage();
+				}
+				break;
+			case PACKET_READ_PROGRAM_STREAM_FLUSH:
+				// one payload went out with this ack, top the fifo back up
+				if (stream_remaining)
+					program_stream_stage();
+				break;
+			case PACKET_READ_STATS:
+				{
+					uint16_t isr_us, pwm_us, overflows, late_ms, late_steps, replaced, lost;
+					uint8_t high_water, sreg = SREG;
+
+					cli();
+					isr_us = isr_ticks_max * TIMER1_TICK_US;
+					pwm_us = (timer0_period_max > RGB_PWM_PERIOD_TICKS ? (timer0_period_max - RGB_PWM_PERIOD_TICKS) * TIMER1_TICK_US : 0);
+					overflows = packets.overflows;
+					high_water = packets.high_water;
+					late_ms = program_late_max;
+					late_steps = program_late_steps;
+					replaced = rgb_replaced;
+					lost = color_stream_lost;
+					isr_ticks_max = 0;
+					timer0_period_max = 0;
+					program_late_max = 0;
+					program_late_steps = 0;
+					rgb_replaced = 0;
+					color_stream_lost = 0;
+					packets.overflows = 0;
+					packets.high_water = 0;
+					SREG = sreg;
+
+					packet[0] = PACKET_STATS;
+					packet[1] = (uint8_t)(isr_us & 0x00FF);
+					packet[2] = (uint8_t)((isr_us & 0xFF00) >> 8);
+					packet[3] = (uint8_t)(pwm_us & 0x00FF);
+					packet[4] = (uint8_t)((pwm_us & 0xFF00) >> 8);
+					packet[5] = (uint8_t)(overflows & 0x00FF);
+					packet[6] = (uint8_t)((overflows & 0xFF00) >> 8);
+					packet[7] = high_water;
+					packet[8] = (uint8_t)(late_ms & 0x00FF);
+					packet[9] = (uint8_t)((late_ms & 0xFF00) >> 8);
+					packet[10] = (uint8_t)(late_steps & 0x00FF);
+					packet[11] = (uint8_t)((late_steps & 0xFF00) >> 8);
+					packet[12] = (uint8_t)(pwm_load & 0x00FF);
+					packet[13] = (uint8_t)((pwm_load & 0xFF00) >> 8);
+					packet[14] = (uint8_t)(RGB_PWM_HZ & 0x00FF);
+					packet[15] = (uint8_t)((RGB_PWM_HZ & 0xFF00) >> 8);
+					packet[16] = (uint8_t)(lost & 0x00FF);
+					packet[17] = (uint8_t)((lost & 0xFF00) >> 8);
+					packet[18] = (uint8_t)(replaced & 0x00FF);
+					packet[19] = (uint8_t)((replaced & 0xFF00) >> 8);
+
+					ack_payload(packet, PACKET_STATS_SIZE);
+				}
+				break;
+			case PACKET_READ_STATS_FLUSH:
+				// nothing really to do here, we let the auto ack do the heavy lifting
+				break;
 			case PACKET_READ_LIGHT_FREQ:
 				{
 					uint16_t hz = icp_hz;
@@ -194,21 +524,56 @@ ISR(INT0_vect) {
 					packet[1] = (uint8_t)(hz & 0x00FF);
 					packet[2] = (uint8_t)((hz & 0xFF00) >> 8);			
 
-					nrf24_set_payload_size(radio, PACKET_LIGHT_FREQ_SIZE);
-					nrf24_write_ack_payload(radio, 1, packet, PACKET_LIGHT_FREQ_SIZE);
+					ack_payload(packet, PACKET_LIGHT_FREQ_SIZE);
 				}
 				break;
 			case PACKET_READ_LIGHT_FREQ_FLUSH:
 				// nothing really to do here, we let the auto ack do the heavy lifting
 				break;
+			case PACKET_READ_BOOT_NONCE:
+				ota_nonce_new();
+				packet[0] = PACKET_BOOT_NONCE;
+				memcpy(&packet[1], ota_nonce, XTEA_BLOCK_SIZE);
+
+				ack_payload(packet, PACKET_BOOT_NONCE_SIZE);
+				break;
+			case PACKET_READ_BOOT_NONCE_FLUSH:
+				// nothing really to do here, we let the auto ack do the heavy lifting
+				break;
+			case PACKET_ENTER_BOOTLOADER:
+				{
+					uint8_t tag[XTEA_BLOCK_SIZE], ok = ota_nonce_valid;
+
+					if (ok) {
+						xtea_tag(ota_key, ota_nonce, tag);
+						ok = (memcmp(tag, &packet[1], XTEA_BLOCK_SIZE) == 0);
+					}
+					// a nonce is good for a single try
+					ota_nonce_valid = 0;
+					if (!ok) {
+						printf_P(PSTR("bootloader entry refused\n"));
+						break;
+					}
+					// keep the fast booting bootloader around for the host
+					eequeue_write_byte(E2END + 1 - FLASH_EEPROM_BOOT_REQUEST_OFFSET, FLASH_BOOT_REQUEST);
+					eequeue_flush();
+					// call the watchdog timer to reset in 15ms
+					wdt_enable(WDTO_15MS);
+					// wait 20ms, effectively forcing a reset
+					_delay_ms(20);
+				}
+				break;
 			default:
 				// unknown packet type - ignore
 				printf_P(PSTR("unknown packet type received (%d), ignoring\n"), packet[0]);
 				break;
 		};
+		packetq_pop(&packets);
 	}
 
-	// reset IRQ status bit
-	status |= _BV(NRF24__RX_DR) | _BV(NRF24__TX_DS) | _BV(NRF24__MAX_RT);
-	nrf24_write_register(radio, NRF24__STATUS, &status, 1);
+	if (radio_pending) {
+		RADIO_LOCK();
+		radio_drain();
+		RADIO_UNLOCK();
+	}
 }
@@ -0,0 +1,74 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "eequeue.h"
+
+// the main loop only writes head, the interrupt only writes tail
+static eequeue_write_t eequeue[EEQUEUE_SIZE];
+static volatile uint8_t eequeue_head, eequeue_tail;
+
+// start the next write that changes a byte, or turn the interrupt off with nothing left
+static void eequeue_next(void) {
+	eequeue_write_t *e;
+
+	while (eequeue_tail != eequeue_head) {
+		e = &eequeue[eequeue_tail & (EEQUEUE_SIZE - 1)];
+		EEAR = e->address;
+		EECR |= (1 << EERE);
+		if (EEDR != e->value) {
+			EEDR = e->value;
+			EECR |= (1 << EEMPE);
+			EECR |= (1 << EEPE);
+			++eequeue_tail;
+			return;
+		}
+		++eequeue_tail;
+	}
+	EECR &= ~(1 << EERIE);
+}
+
+ISR(EE_READY_vect) {
+	eequeue_next();
+}
+
+// one step of waiting on the queue, with interrupts off, e.g. before sei(), it is drained by polling
+static void eequeue_wait(void) {
+	if (!(SREG & (1 << SREG_I)) && !(EECR & (1 << EEPE)))
+		eequeue_next();
+}
+
+void eequeue_write_byte(uint16_t address, uint8_t value) {
+	eequeue_write_t *e;
+
+	while ((uint8_t)(eequeue_head - eequeue_tail) == EEQUEUE_SIZE)
+		eequeue_wait();
+	e = &eequeue[eequeue_head & (EEQUEUE_SIZE - 1)];
+	e->address = address;
+	e->value = value;
+	// the entry is complete before head moves past it
+	__asm__ __volatile__("" ::: "memory");
+	++eequeue_head;
+	// EE_READY fires right away while no write is in progress
+	EECR |= (1 << EERIE);
+}
+
+void eequeue_write_word(uint16_t address, uint16_t value) {
+	eequeue_write_byte(address, (uint8_t)(value & 0x00FF));
+	eequeue_write_byte(address + 1, (uint8_t)((value & 0xFF00) >> 8));
+}
+
+void eequeue_write_block(const void *src, uint16_t address, uint8_t length) {
+	const uint8_t *p = src;
+
+	while (length--)
+		eequeue_write_byte(address++, *p++);
+}
+
+void eequeue_flush(void) {
+	while (eequeue_pending())
+		eequeue_wait();
+}
+
+uint8_t eequeue_pending(void) {
+	return eequeue_head != eequeue_tail || (EECR & (1 << EEPE));
+}
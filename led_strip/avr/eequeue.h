@@ -0,0 +1,23 @@
+#ifndef _EEQUEUE_H_
+#define _EEQUEUE_H_
+
+#include <inttypes.h>
+
+#define EEQUEUE_SIZE	64	// a power of two
+
+// EEPROM writes are queued in RAM and written a byte at a time from the EE_READY interrupt,
+// bytes that already hold the value are skipped
+// the EEPROM must not be read while writes are queued, eequeue_flush() first
+typedef struct eequeue_write {
+	uint16_t address;
+	uint8_t value;
+} eequeue_write_t;
+
+void eequeue_write_byte(uint16_t address, uint8_t value);
+void eequeue_write_word(uint16_t address, uint16_t value);
+void eequeue_write_block(const void *src, uint16_t address, uint8_t length);
+// wait for every queued write to finish, the barrier before reading or resetting
+void eequeue_flush(void);
+uint8_t eequeue_pending(void);
+
+#endif /* _EEQUEUE_H_ */
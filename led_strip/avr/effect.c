@@ -0,0 +1,150 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+
+#include <string.h>
+
+#include "global.h"
+#include "effect.h"
+#include "rgb.h"
+#include "packet.h"
+#include "flash.h"
+#include "eequeue.h"
+
+extern volatile uint32_t program_ms;
+
+// round(128 + 127 * sin(2 * pi * i / 256))
+static const uint8_t effect_sin[256] PROGMEM = {
+	128, 131, 134, 137, 140, 144, 147, 150, 153, 156, 159, 162, 165, 168, 171, 174,
+	177, 179, 182, 185, 188, 191, 193, 196, 199, 201, 204, 206, 209, 211, 213, 216,
+	218, 220, 222, 224, 226, 228, 230, 232, 234, 235, 237, 239, 240, 241, 243, 244,
+	245, 246, 248, 249, 250, 250, 251, 252, 253, 253, 254, 254, 254, 255, 255, 255,
+	255, 255, 255, 255, 254, 254, 254, 253, 253, 252, 251, 250, 250, 249, 248, 246,
+	245, 244, 243, 241, 240, 239, 237, 235, 234, 232, 230, 228, 226, 224, 222, 220,
+	218, 216, 213, 211, 209, 206, 204, 201, 199, 196, 193, 191, 188, 185, 182, 179,
+	177, 174, 171, 168, 165, 162, 159, 156, 153, 150, 147, 144, 140, 137, 134, 131,
+	128, 125, 122, 119, 116, 112, 109, 106, 103, 100,  97,  94,  91,  88,  85,  82,
+	 79,  77,  74,  71,  68,  65,  63,  60,  57,  55,  52,  50,  47,  45,  43,  40,
+	 38,  36,  34,  32,  30,  28,  26,  24,  22,  21,  19,  17,  16,  15,  13,  12,
+	 11,  10,   8,   7,   6,   6,   5,   4,   3,   3,   2,   2,   2,   1,   1,   1,
+	  1,   1,   1,   1,   2,   2,   2,   3,   3,   4,   5,   6,   6,   7,   8,  10,
+	 11,  12,  13,  15,  16,  17,  19,  21,  22,  24,  26,  28,  30,  32,  34,  36,
+	 38,  40,  43,  45,  47,  50,  52,  55,  57,  60,  63,  65,  68,  71,  74,  77,
+	 79,  82,  85,  88,  91,  94,  97, 100, 103, 106, 109, 112, 116, 119, 122, 125,
+};
+
+static uint8_t effect;
+static uint8_t effect_color[3], effect_shape;
+// phase per ms in 16.8 fixed point, the accumulator holds the phase the same way
+static uint32_t effect_step, effect_phase;
+static uint16_t effect_offset;			// phase of this node
+static uint32_t effect_last;			// millisecond last rendered
+
+uint8_t effect_sin8(uint8_t phase) {
+	return pgm_read_byte(&effect_sin[phase]);
+}
+
+static uint32_t effect_now(void) {
+	uint32_t ms;
+	uint8_t sreg = SREG;
+
+	cli();
+	ms = program_ms;
+	SREG = sreg;
+
+	return ms;
+}
+
+void effect_start(uint8_t *packet) {
+	uint16_t period = ((uint16_t)packet[3] << 8) | packet[2];
+	uint8_t node_id;
+
+	effect = packet[1];
+	memcpy(effect_color, &packet[4], 3);
+	effect_shape = packet[7];
+	// a period of 0 holds the effect at its start
+	effect_step = (period ? ((uint32_t)1 << (16 + EFFECT_PHASE_FRACTION_BITS)) / period : 0);
+	effect_phase = 0;
+	// nodes without an id of their own all run in phase, the queued writes of a program upload
+	// go first as the EEPROM cannot be read in between
+	eequeue_flush();
+	node_id = eeprom_read_byte((uint8_t *)(E2END + 1 - FLASH_EEPROM_NODE_ID_OFFSET));
+	if (!FLASH_NODE_ID_VALID(node_id))
+		node_id = 0;
+	effect_offset = (uint16_t)node_id * packet[8] * 256;
+	effect_last = effect_now();
+	if (effect != PACKET_EFFECT_NONE)
+		effect_last -= RGB_FRAME_MS;
+}
+
+void effect_stop(void) {
+	effect = PACKET_EFFECT_NONE;
+}
+
+uint8_t effect_running(void) {
+	return effect != PACKET_EFFECT_NONE;
+}
+
+// the color scaled by level in 8.8 fixed point
+static void effect_set_level(uint8_t *color, uint8_t level) {
+	rgb_set_fine((uint16_t)color[0] * level, (uint16_t)color[1] * level, (uint16_t)color[2] * level);
+}
+
+void effect_poll(void) {
+	uint32_t now;
+	uint16_t phase;
+	uint8_t color[3], from[3], to[3], p, level, i;
+
+	if (effect == PACKET_EFFECT_NONE)
+		return;
+	now = effect_now();
+	if (now - effect_last < RGB_FRAME_MS)
+		return;
+	effect_phase = (effect_phase + (effect_step * (now - effect_last))) & ((1UL << (16 + EFFECT_PHASE_FRACTION_BITS)) - 1);
+	effect_last = now;
+	phase = (uint16_t)(effect_phase >> EFFECT_PHASE_FRACTION_BITS) + effect_offset;
+	p = phase >> 8;
+
+	switch (effect) {
+		case PACKET_EFFECT_RAINBOW:
+			rgb_hsv(phase, effect_shape, 255, color);
+			rgb_set(color[0], color[1], color[2]);
+			break;
+		case PACKET_EFFECT_BREATHE:
+			// from the lowest level at the start of the period to full in the middle
+			level = effect_sin8(p - 64);
+			effect_set_level(effect_color, effect_shape + (((uint16_t)(255 - effect_shape) * level) >> 8));
+			break;
+		case PACKET_EFFECT_STROBE:
+			effect_set_level(effect_color, p < effect_shape ? 255 : 0);
+			break;
+		case PACKET_EFFECT_CHASE:
+			// the pulse rises and falls on a sine over its width at the start of the period
+			level = 0;
+			if (p < effect_shape)
+				level = effect_sin8((uint8_t)(((uint16_t)p << 8) / effect_shape) - 64);
+			effect_set_level(effect_color, level);
+			break;
+		case PACKET_EFFECT_CYCLE:
+			{
+				// thirds of the period, each holds a rotation of the color and then fades to the next
+				uint32_t third = (uint32_t)phase * 3;
+				uint8_t n = third >> 16, fraction = (third >> 8) & 0xFF, hold = 255 - effect_shape;
+				uint16_t fine[3];
+
+				for (i = 0; i < 3; ++i) {
+					from[i] = effect_color[(i + n) % 3];
+					to[i] = effect_color[(i + n + 1) % 3];
+				}
+				level = (fraction <= hold || !effect_shape ? 0 : ((uint16_t)(fraction - hold) * 255) / effect_shape);
+				for (i = 0; i < 3; ++i)
+					fine[i] = (uint16_t)(((int32_t)from[i] << 8) + ((int32_t)((int16_t)to[i] - from[i]) * level));
+				rgb_set_fine(fine[0], fine[1], fine[2]);
+			}
+			break;
+		default:
+			effect = PACKET_EFFECT_NONE;
+			break;
+	}
+}
@@ -0,0 +1,18 @@
+#ifndef _EFFECT_H_
+#define _EFFECT_H_
+
+#include <inttypes.h>
+
+// a full cycle of an effect is 2^16 of phase, the accumulator keeps 8 bits more for the fraction
+#define EFFECT_PHASE_FRACTION_BITS	8
+
+// effects are rendered by the main loop once every PWM frame from the millisecond count,
+// effect_start takes a PACKET_RUN_EFFECT
+void effect_start(uint8_t *packet);
+void effect_stop(void);
+uint8_t effect_running(void);
+void effect_poll(void);
+// 128 + 127 * sin(2 * pi * phase / 256)
+uint8_t effect_sin8(uint8_t phase);
+
+#endif /* _EFFECT_H_ */
@@ -0,0 +1 @@
+../../bootloader/flash.h
\ No newline at end of file
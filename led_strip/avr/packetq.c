@@ -0,0 +1,41 @@
+#include "packetq.h"
+
+void packetq_init(packetq_t *q) {
+	q->head = 0;
+	q->tail = 0;
+	q->high_water = 0;
+	q->overflows = 0;
+}
+
+uint8_t *packetq_slot(packetq_t *q) {
+	if ((uint8_t)(q->head - q->tail) == PACKETQ_SLOTS) {
+		q->overflows++;
+		return NULL;
+	}
+
+	return q->data[q->head & (PACKETQ_SLOTS - 1)];
+}
+
+void packetq_push(packetq_t *q) {
+	uint8_t length;
+
+	// the slot is filled before head moves past it
+	__asm__ __volatile__("" ::: "memory");
+	q->head++;
+	length = q->head - q->tail;
+	if (length > q->high_water)
+		q->high_water = length;
+}
+
+uint8_t *packetq_front(packetq_t *q) {
+	if (q->head == q->tail)
+		return NULL;
+
+	return q->data[q->tail & (PACKETQ_SLOTS - 1)];
+}
+
+void packetq_pop(packetq_t *q) {
+	// the slot is done with before tail hands it back
+	__asm__ __volatile__("" ::: "memory");
+	q->tail++;
+}
@@ -0,0 +1,27 @@
+#ifndef _PACKETQ_H_
+#define _PACKETQ_H_
+
+#include <inttypes.h>
+
+#define PACKETQ_SLOTS	8	// a power of two
+#define PACKETQ_SLOT_SIZE	32
+
+// single producer, single consumer queue of radio packets, the producer (the radio ISR) only
+// writes head and the consumer (the main loop) only writes tail, so neither has to lock
+typedef struct packetq {
+	volatile uint8_t head;
+	volatile uint8_t tail;
+	volatile uint8_t high_water;	// most packets queued at once
+	volatile uint16_t overflows;	// times the producer found the queue full
+	uint8_t data[PACKETQ_SLOTS][PACKETQ_SLOT_SIZE];
+} packetq_t;
+
+void packetq_init(packetq_t *q);
+// producer, the slot to fill next or NULL while the queue is full, packetq_push queues it
+uint8_t *packetq_slot(packetq_t *q);
+void packetq_push(packetq_t *q);
+// consumer, the oldest packet or NULL while the queue is empty, packetq_pop releases it
+uint8_t *packetq_front(packetq_t *q);
+void packetq_pop(packetq_t *q);
+
+#endif /* _PACKETQ_H_ */
@@ -8,23 +8,75 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <math.h>
+#include <string.h>
+#include <inttypes.h>
 
 #include "global.h"
 #include "program.h"
 #include "usart.h"
 #include "rgb.h"
 #include "compatability.h"
+#include "eequeue.h"
+#include "packet.h"
+#include "effect.h"
 
 volatile program_state_e program_state;
 
+// playback, the timer 1 compare B interrupt counts milliseconds and starts each step on the
+// millisecond it is due, from a RAM cache of the steps ahead that the main loop keeps filled
+// steps are due at the sum of the delays before them, so late steps do not push back the rest
+// the main loop renders the step started last, fades and hue sweeps once every PWM frame
+typedef struct program_cache_step {
+	uint8_t op;			// PACKET_PROGRAM_OP_HOLD, _FADE or _HUE
+	uint8_t from[3];		// color the step starts from
+	uint8_t arg[4];			// hold, fade: red, green, blue, hue: first, last, saturation, value
+	uint16_t delay_in_ms;
+} program_cache_step_t;
+
+static program_cache_step_t program_cache[PROGRAM_CACHE_STEPS];
+// the main loop only writes head, the interrupt only writes tail
+static volatile uint8_t program_cache_head, program_cache_tail;
+static volatile uint8_t program_playing;
+// a plain program is steps long, a v2 program bytes, next is the step or byte to cache next
+static uint16_t program_steps, program_next;
+static uint8_t program_v2;
+static uint32_t program_due;			// millisecond the next step is due
+volatile uint32_t program_ms;
+// instrumentation, the latest a step started in ms and the number of steps that started late
+volatile uint16_t program_late_max, program_late_steps;
+
+// the step started last and the millisecond it was due, seq counts the steps started
+static program_cache_step_t program_current;
+static uint32_t program_current_start;
+static volatile uint8_t program_current_seq;
+
+// v2 decoding, the color and time steps leave out, the loops being run and the color the
+// last cached step ends on, which the next one starts from
+static uint8_t program_color[3];
+static uint16_t program_time;
+static struct {
+	uint16_t op;
+	uint8_t remaining;
+} program_loop[PACKET_PROGRAM_V2_MAX_LOOPS];
+static uint8_t program_loops;
+static uint8_t program_end[3];
+
+// rendering
+static program_cache_step_t program_render_step;
+static uint32_t program_render_start, program_render_last;
+static uint8_t program_render_seq;
+static int32_t program_render_inc[3];
+
+// ops a v2 program may run through without a step, loops only, before it is taken as broken
+#define PROGRAM_DECODE_OPS	16
+
 void program_init(void) {
 	uint16_t preamble;
 
 	preamble = eeprom_read_word((const uint16_t *)PROGRAM_PREAMBLE_LOCATION);
 	if (preamble != PROGRAM_PREAMBLE) {
 		program_setup_default();
-		eeprom_update_word((uint16_t *)PROGRAM_PREAMBLE_LOCATION, PROGRAM_PREAMBLE);
+		eequeue_write_word(PROGRAM_PREAMBLE_LOCATION, PROGRAM_PREAMBLE);
 	}
 
 	program_state = PROGRAM_RUN;
@@ -32,77 +84,267 @@ void program_init(void) {
 
 void program_setup_default(void) {
 	uint16_t location = PROGRAM_START;
-	float frequency = .3;
 	uint8_t i, rgb[3];
 	uint16_t steps = 43, delay_in_ms = 100;
 
 	program_state = PROGRAM_PROGRAMMING;
 
 	printf_P(PSTR("init eeprom ... "));
-	eeprom_update_word((uint16_t *)location, steps);
+	eequeue_write_word(location, steps);
 	location += sizeof(uint16_t);
 	for (i = 0; i < steps; ++i) {
-   		rgb[0] = (uint8_t)(sin(frequency*(float)i + 0.) * 127.) + 128;
-   		rgb[1] = (uint8_t)(sin(frequency*(float)i + 2.) * 127.) + 128;
-   		rgb[2] = (uint8_t)(sin(frequency*(float)i + 4.) * 127.) + 128;
-		eeprom_update_block(&rgb, (void *)location, 3 * sizeof(uint8_t));
+		// .3 radians a step and the channels 2 radians apart, in 256ths of a circle
+		rgb[0] = effect_sin8((uint8_t)(i * 12) + 0);
+		rgb[1] = effect_sin8((uint8_t)(i * 12) + 81);
+		rgb[2] = effect_sin8((uint8_t)(i * 12) + 163);
+		eequeue_write_block(&rgb, location, 3 * sizeof(uint8_t));
 		location += 3 * sizeof(uint8_t);
 
-		eeprom_update_word((uint16_t *)location, delay_in_ms);
+		eequeue_write_word(location, delay_in_ms);
 		location += sizeof(uint16_t);
 	}
+	// the default program is run next
+	eequeue_flush();
 	printf_P(PSTR("done!\n"));
 	
 	program_state = PROGRAM_RUN;
 }
 
-#define PROGRAM_RUN_DEBUG
-#undef PROGRAM_RUN_DEBUG
-void program_run(void) {
-	uint16_t location = PROGRAM_START;
-	uint16_t i, steps, delay_in_ms;
-	uint8_t rgb[3];
+// a state change restarts playback from the first step
+void program_set_state(program_state_e state) {
+	program_playing = 0;
+	program_state = state;
+}
+
+// from the timer 1 compare B interrupt, once a millisecond
+void program_tick(void) {
+	program_cache_step_t *step;
+	uint32_t late;
+
+	++program_ms;
+	if (!program_playing)
+		return;
+	while ((int32_t)(program_ms - program_due) >= 0) {
+		// an empty cache holds the step back until the main loop has read it
+		if (program_cache_tail == program_cache_head)
+			return;
+		step = &program_cache[program_cache_tail & (PROGRAM_CACHE_STEPS - 1)];
+		late = program_ms - program_due;
+		if (late) {
+			++program_late_steps;
+			if (late > program_late_max)
+				program_late_max = (late > 0xFFFF ? 0xFFFF : late);
+		}
+		program_current = *step;
+		program_current_start = program_due;
+		++program_current_seq;
+		program_due += step->delay_in_ms;
+		++program_cache_tail;
+	}
+}
 
-	// don't start running a programming if the program is being written by an external source
-	// or if we are in program stop mode
-	if (program_state != PROGRAM_RUN) goto PROGRAM_RUN_EXIT;
+static void program_rewind(void) {
+	program_next = 0;
+	program_color[0] = program_color[1] = program_color[2] = 0;
+	program_time = 0;
+	program_loops = 0;
+}
 
-	// after each eeprom read, we check to see if the system has left program run state
-	// if so, the eeprom read might be invalid so we need to exit
+static uint8_t program_byte(void) {
+	return eeprom_read_byte((uint8_t *)(PROGRAM_STEP_LOCATION(0) + program_next++));
+}
 
-	steps = eeprom_read_word((uint16_t *)location);
-	if (program_state != PROGRAM_RUN) goto PROGRAM_RUN_EXIT;
-	location += sizeof(uint16_t);
-#ifdef PROGRAM_RUN_DEBUG
-	printf_P(PSTR("program has %d steps\n"), steps);
-#endif
-	for (i = 0; i < steps; ++i) {
-		eeprom_read_block(&rgb, (void *)location, 3 * sizeof(uint8_t));
-		if (program_state != PROGRAM_RUN) goto PROGRAM_RUN_EXIT;
-		location += 3 * sizeof(uint8_t);
-#ifdef PROGRAM_RUN_DEBUG
-		printf_P(PSTR("step %d:\t%d\t%d\t%d\n"), i, rgb[0], rgb[1], rgb[2]);
-#endif	
-		rgb_set(rgb[0], rgb[1], rgb[2]);
+// the color a step ends on
+static void program_step_end(program_cache_step_t *step, uint8_t *color) {
+	if (step->op == PACKET_PROGRAM_OP_HUE)
+		rgb_hsv((uint16_t)step->arg[1] << 8, step->arg[2], step->arg[3], color);
+	else
+		memcpy(color, step->arg, 3);
+}
 
-		delay_in_ms = eeprom_read_word((uint16_t *)location);
-		if (program_state != PROGRAM_RUN) goto PROGRAM_RUN_EXIT;
-		location += sizeof(uint16_t);
-#ifdef PROGRAM_RUN_DEBUG
-		printf_P(PSTR("step %d delay:\t%d\n"), i, delay_in_ms);
-#endif
-		// _delay_ms must be used on a constant (not a variable)
-		while(delay_in_ms--) _delay_ms(1);
+// runs the v2 program up to its next step, 0 if the program is broken
+static uint8_t program_decode(program_cache_step_t *step) {
+	uint16_t at, target;
+	uint8_t op, i, count, guard;
 
-		if (program_state != PROGRAM_RUN) {
-PROGRAM_RUN_EXIT:
+	for (guard = 0; guard < PROGRAM_DECODE_OPS; ++guard) {
+		// the program repeats
+		if (program_next >= program_steps)
+			program_rewind();
+		at = program_next;
+		op = program_byte();
+		switch (op & PACKET_PROGRAM_OP_MASK) {
+			case PACKET_PROGRAM_OP_HOLD:
+			case PACKET_PROGRAM_OP_FADE:
+				for (i = 0; i < 3; ++i)
+					if (op & (PACKET_PROGRAM_OP_RED << i))
+						program_color[i] = program_byte();
+				memcpy(step->arg, program_color, 3);
+				break;
+			case PACKET_PROGRAM_OP_HUE:
+				for (i = 0; i < 4; ++i)
+					step->arg[i] = program_byte();
+				break;
+			case PACKET_PROGRAM_OP_LOOP:
+				count = program_byte();
+				target = program_byte();
+				target |= (uint16_t)program_byte() << 8;
+				if (program_loops && program_loop[program_loops - 1].op == at) {
+					// the body has run all its times
+					if (!--program_loop[program_loops - 1].remaining) {
+						--program_loops;
+						continue;
+					}
+				} else {
+					if (count < 2)
+						continue;
+					if (program_loops == PACKET_PROGRAM_V2_MAX_LOOPS)
+						return 0;
+					program_loop[program_loops].op = at;
+					program_loop[program_loops].remaining = count - 1;
+					++program_loops;
+				}
+				program_next = target;
+				continue;
+			default:
+				return 0;
+		}
+		switch (op & PACKET_PROGRAM_OP_TIME_MASK) {
+			case PACKET_PROGRAM_OP_TIME_16:
+				program_time = program_byte();
+				program_time |= (uint16_t)program_byte() << 8;
+				break;
+			case PACKET_PROGRAM_OP_TIME_8:
+				program_time = program_byte();
+				break;
+			case PACKET_PROGRAM_OP_TIME_SAME:
+				break;
+			default:
+				return 0;
+		}
+		step->op = op & PACKET_PROGRAM_OP_MASK;
+		step->delay_in_ms = program_time;
+
+		return 1;
+	}
+
+	return 0;
+}
+
+// fixed point increments of the rendered step per ms, in 8.16 for fades and 16.8 for hue sweeps
+static void program_render_begin(void) {
+	program_cache_step_t *step = &program_render_step;
+	uint16_t span;
+	uint8_t i;
+
+	if (!step->delay_in_ms)
+		return;
+	if (step->op == PACKET_PROGRAM_OP_FADE) {
+		for (i = 0; i < 3; ++i)
+			program_render_inc[i] = ((int32_t)((int16_t)step->arg[i] - step->from[i]) * 65536L) / step->delay_in_ms;
+	} else if (step->op == PACKET_PROGRAM_OP_HUE) {
+		span = (uint8_t)(step->arg[1] - step->arg[0]);
+		program_render_inc[0] = ((uint32_t)(span ? span : 256) << 16) / step->delay_in_ms;
+	}
+}
+
+static void program_render(void) {
+	program_cache_step_t *step = &program_render_step;
+	uint32_t now, elapsed;
+	uint16_t fine[3];
+	uint8_t sreg, seq, i, color[3];
+
+	sreg = SREG;
+	cli();
+	now = program_ms;
+	seq = program_current_seq;
+	if (seq != program_render_seq) {
+		program_render_step = program_current;
+		program_render_start = program_current_start;
+	}
+	SREG = sreg;
+
+	if (seq != program_render_seq) {
+		program_render_seq = seq;
+		program_render_begin();
+	} else if (step->op == PACKET_PROGRAM_OP_HOLD || now - program_render_last < RGB_FRAME_MS)
+		return;
+	program_render_last = now;
+
+	elapsed = now - program_render_start;
+	if (step->op == PACKET_PROGRAM_OP_HOLD || elapsed >= step->delay_in_ms) {
+		program_step_end(step, color);
+		rgb_set(color[0], color[1], color[2]);
+	} else if (step->op == PACKET_PROGRAM_OP_FADE) {
+		for (i = 0; i < 3; ++i)
+			fine[i] = ((uint16_t)step->from[i] << 8) + (int16_t)((program_render_inc[i] * (int32_t)elapsed) >> 8);
+		rgb_set_fine(fine[0], fine[1], fine[2]);
+	} else {
+		rgb_hsv(((uint16_t)step->arg[0] << 8) + (uint16_t)(((uint32_t)program_render_inc[0] * elapsed) >> 8), step->arg[2], step->arg[3], color);
+		rgb_set(color[0], color[1], color[2]);
+	}
+}
+
+#define PROGRAM_RUN_DEBUG
+#undef PROGRAM_RUN_DEBUG
+// from the main loop, starts playback in the run state, keeps the step cache filled and
+// renders the step playing, the EEPROM is only read with no writes queued, so this never waits on them
+void program_poll(void) {
+	program_cache_step_t *step;
+	uint16_t location;
+	uint8_t sreg;
+
+	if (program_state != PROGRAM_RUN)
+		return;
+
+	if (!program_playing) {
+		if (eequeue_pending())
+			return;
+		program_steps = eeprom_read_word((uint16_t *)PROGRAM_START);
+		program_v2 = (program_steps & PACKET_PROGRAM_V2 ? 1 : 0);
+		program_steps &= ~PACKET_PROGRAM_V2;
 #ifdef PROGRAM_RUN_DEBUG
-			printf_P(PSTR("system is not in run state, exiting run program\n"));
+		printf_P(PSTR("program has %d %s\n"), program_steps, program_v2 ? "bytes" : "steps");
 #endif
+		if (!program_steps)
 			return;
+		program_rewind();
+		program_end[0] = program_end[1] = program_end[2] = 0;
+		program_cache_head = 0;
+		program_cache_tail = 0;
+		// the first step is due on the next tick
+		sreg = SREG;
+		cli();
+		program_render_seq = program_current_seq;
+		program_render_step.op = PACKET_PROGRAM_OP_HOLD;
+		program_due = program_ms + 1;
+		SREG = sreg;
+		program_playing = 1;
+	}
+
+	while (!eequeue_pending() && (uint8_t)(program_cache_head - program_cache_tail) < PROGRAM_CACHE_STEPS) {
+		step = &program_cache[program_cache_head & (PROGRAM_CACHE_STEPS - 1)];
+		if (program_v2) {
+			if (!program_decode(step)) {
+				printf_P(PSTR("program broken at byte %" PRIu16 "\n"), program_next);
+				program_set_state(PROGRAM_STOP);
+				return;
+			}
+		} else {
+			location = PROGRAM_STEP_LOCATION(program_next);
+			step->op = PACKET_PROGRAM_OP_HOLD;
+			eeprom_read_block(&step->arg, (void *)location, 3 * sizeof(uint8_t));
+			step->delay_in_ms = eeprom_read_word((uint16_t *)(location + 3 * sizeof(uint8_t)));
+			// the program repeats
+			if (++program_next == program_steps)
+				program_next = 0;
 		}
+		memcpy(step->from, program_end, 3);
+		program_step_end(step, program_end);
+		// the step is complete before head moves past it
+		__asm__ __volatile__("" ::: "memory");
+		++program_cache_head;
 	}
-#ifdef PROGRAM_RUN_DEBUG
-	printf_P(PSTR("program complete\n"));
-#endif
+
+	program_render();
 }
@@ -5,12 +5,16 @@
 #define PROGRAM_PREAMBLE_LOCATION 0
 #define PROGRAM_START 2
 
-#define PROGRAM_STEP_LOCATION(step) (PROGRAM_START + sizeof(uint16_t) + (step * ((sizeof(uint8_t) * 3) + sizeof(uint16_t))))
+#define PROGRAM_STEP_LOCATION(step) (PROGRAM_START + sizeof(uint16_t) + ((step) * ((sizeof(uint8_t) * 3) + sizeof(uint16_t))))
 
 typedef enum { PROGRAM_STOP = 0, PROGRAM_RUN, PROGRAM_PROGRAMMING } program_state_e;
 
+#define PROGRAM_CACHE_STEPS 8	// steps read ahead of playback, a power of two
+
 void program_init(void);
 void program_setup_default(void);
-void program_run(void);
+void program_set_state(program_state_e state);
+void program_tick(void);
+void program_poll(void);
 
 #endif /* _PROGRAM_H_ */
@@ -7,53 +7,319 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <math.h>
+#include <string.h>
 
 #include "global.h"
 #include "rgb.h"
+#include "timer0.h"
+#include "timer1.h"
+#include "effect.h"
 #include "usart.h"
 #include "compatability.h"
 
+// duty cycles of the 8 bit backends
 volatile uint8_t rgb[3];
+#if RGB_PWM == RGB_PWM_SOFTWARE
+// the next duty cycles, the PWM interrupt takes them at the start of a period
+volatile uint8_t rgb_next[3];
+volatile uint8_t rgb_pending;
+#endif
+// colors that a newer one replaced before a PWM frame showed them
+volatile uint16_t rgb_replaced;
+// last color in 8.8 fixed point and the brightness it is scaled by, 255 is full
+static uint16_t rgb_color[3];
+static uint8_t rgb_brightness = RGB_DEFAULT_BRIGHTNESS;
+
+// round(RGB_DUTY_MAX * (i / 255) ^ 2.2), at least 1 so that every color above 0 still lights
+static const uint16_t rgb_gamma[256] PROGMEM = {
+	   0,    1,    1,    1,    1,    1,    1,    1,    1,    1,    1,    1,    1,    1,    2,    2,
+	   2,    3,    3,    3,    4,    4,    5,    5,    6,    6,    7,    7,    8,    9,    9,   10,
+	  11,   11,   12,   13,   14,   15,   15,   16,   17,   18,   19,   20,   21,   22,   24,   25,
+	  26,   27,   28,   30,   31,   32,   34,   35,   36,   38,   39,   41,   42,   44,   45,   47,
+	  49,   50,   52,   54,   56,   58,   59,   61,   63,   65,   67,   69,   71,   73,   75,   77,
+	  80,   82,   84,   86,   89,   91,   93,   96,   98,  101,  103,  106,  108,  111,  114,  116,
+	 119,  122,  124,  127,  130,  133,  136,  139,  142,  145,  148,  151,  154,  157,  160,  164,
+	 167,  170,  174,  177,  180,  184,  187,  191,  194,  198,  201,  205,  209,  213,  216,  220,
+	 224,  228,  232,  236,  240,  244,  248,  252,  256,  260,  264,  268,  273,  277,  281,  286,
+	 290,  295,  299,  304,  308,  313,  317,  322,  327,  332,  336,  341,  346,  351,  356,  361,
+	 366,  371,  376,  381,  386,  391,  397,  402,  407,  413,  418,  423,  429,  434,  440,  446,
+	 451,  457,  463,  468,  474,  480,  486,  492,  498,  503,  509,  516,  522,  528,  534,  540,
+	 546,  553,  559,  565,  572,  578,  585,  591,  598,  604,  611,  618,  624,  631,  638,  645,
+	 652,  658,  665,  672,  679,  687,  694,  701,  708,  715,  722,  730,  737,  745,  752,  759,
+	 767,  774,  782,  790,  797,  805,  813,  821,  828,  836,  844,  852,  860,  868,  876,  884,
+	 893,  901,  909,  917,  926,  934,  942,  951,  959,  968,  977,  985,  994, 1002, 1011, 1020,
+};
 
 extern volatile uint16_t icp_hz;
 
+#if RGB_PWM == RGB_PWM_HARDWARE
+ISR(TIMER2_OVF_vect) {
+	LED_GREEN_HIGH;
+	TIMER0_PERIOD_END();
+}
+
+ISR(TIMER2_COMPA_vect) {
+	LED_GREEN_LOW;
+}
+#elif RGB_PWM == RGB_PWM_BAM
+// port bits for each bit of the channels, bit 0 first, one set for each frame of the dither,
+// double buffered, rgb_set fills the back planes and the interrupt swaps them in between frames
+static uint8_t rgb_bam[2][RGB_BAM_FRAMES * 8];
+static uint8_t *rgb_bam_front;
+static volatile uint8_t rgb_bam_pending;
+static uint8_t rgb_bam_bit, rgb_bam_frame;
+
+// timer 2 runs in fast PWM mode with OCR2A as TOP, OCR2A is double buffered there, so the
+// length of the next bit is set while the current one is on and interrupt latency does not count
+ISR(TIMER2_OVF_vect) {
+	uint8_t next = (rgb_bam_bit + 1) & 0x07;
+
+	LED_PORT = (LED_PORT & ~LED_MASK) | rgb_bam_front[rgb_bam_frame + rgb_bam_bit];
+	OCR2A = (RGB_BAM_UNIT_TICKS << next) - 1;
+	rgb_bam_bit = next;
+	if (!next) {
+		TIMER0_PERIOD_END();
+		rgb_bam_frame = (rgb_bam_frame + 8) & ((RGB_BAM_FRAMES * 8) - 1);
+		if (rgb_bam_pending) {
+			rgb_bam_front = (rgb_bam_front == rgb_bam[0] ? rgb_bam[1] : rgb_bam[0]);
+			rgb_bam_pending = 0;
+		}
+	}
+}
+#endif
+
 void rgb_init(void) {
 	LED_RED_INIT;
 	LED_GREEN_INIT;
 	LED_BLUE_INIT;
+
+#if RGB_PWM == RGB_PWM_HARDWARE
+	// timer 0 fast PWM at F_CPU / 8, the compare outputs are connected by rgb_set
+	TCCR0A = (1 << WGM01) | (1 << WGM00);
+	TCCR0B = (1 << CS01);
+	// timer 2 the same for green, its interrupts are enabled by rgb_set
+	TCCR2A = (1 << WGM21) | (1 << WGM20);
+	TCCR2B = (1 << CS21);
+#elif RGB_PWM == RGB_PWM_BAM
+	// timer 2 fast PWM with OCR2A as TOP at F_CPU / 32, no compare outputs
+	rgb_bam_bit = 0;
+	rgb_bam_frame = 0;
+	rgb_bam_front = rgb_bam[0];
+	rgb_bam_pending = 0;
+	OCR2A = RGB_BAM_UNIT_TICKS - 1;
+	TCCR2A = (1 << WGM21) | (1 << WGM20);
+	TCCR2B = (1 << WGM22) | (1 << CS21) | (1 << CS20);
+	TIMSK2 = (1 << TOIE2);
+#endif
+}
+
+// turn the PWM interrupts off and on again, e.g. to measure what they cost
+void rgb_pwm_interrupts(uint8_t enable) {
+	// the time they were off is no PWM period
+	timer0_period_start = TCNT1;
+#if RGB_PWM == RGB_PWM_SOFTWARE
+	if (enable)
+		TIMSK0 |= (1 << TOIE0);
+	else
+		TIMSK0 &= ~(1 << TOIE0);
+#else
+	static uint8_t timsk2;
+
+	if (enable)
+		TIMSK2 = timsk2;
+	else {
+		timsk2 = TIMSK2;
+		TIMSK2 = 0;
+	}
+#endif
+}
+
+// gamma corrected duty cycle of RGB_DUTY_BITS for an 8.8 fixed point value, in between two
+// entries of the table by their fraction, scaled by brightness (+ 1, so that 255 is exact)
+static uint16_t rgb_duty(uint16_t value, uint8_t brightness) {
+	uint8_t i = value >> 8, fraction = value & 0xFF;
+	uint16_t duty = pgm_read_word(&rgb_gamma[i]);
+
+	if (fraction && i < 255)
+		duty += (uint16_t)(((uint32_t)(pgm_read_word(&rgb_gamma[i + 1]) - duty) * fraction) >> 8);
+
+	return (uint16_t)(((uint32_t)duty * (brightness + 1)) >> 8);
 }
 
 void rgb_set(uint8_t red, uint8_t green, uint8_t blue) {
-	// rgb_governor is a governor measure
-	uint8_t rgb_governor;
+	rgb_set_fine((uint16_t)red << 8, (uint16_t)green << 8, (uint16_t)blue << 8);
+}
+
+// colors in 8.8 fixed point, fades use the fraction to step through the duty cycles in between
+// the 8 bit colors, an unchanged duty cycle leaves the backends alone
+void rgb_set_fine(uint16_t red, uint16_t green, uint16_t blue) {
+	static uint16_t rgb_duty_last[3] = { 0xFFFF, 0xFFFF, 0xFFFF };
+	uint16_t duty[3];
+	uint8_t i, level[3], brightness = rgb_brightness;
 #if 0
-	if (icp_hz < 20)
-		rgb_governor = 255;
-	else {
-		float tmp = (255. - (((float)icp_hz - 20.) * 3.2));
-		rgb_governor = (uint8_t)(tmp < 0 ? 0 : tmp);
+	// rgb_governor is a governor measure, dims with the light frequency above 20 Hz
+	{
+		uint16_t hz = icp_hz, dim = (hz < 20 ? 0 : ((hz - 20) * 16) / 5);
+		uint8_t rgb_governor = (dim > 255 ? 0 : 255 - dim);
+
+		if (rgb_governor < brightness)
+			brightness = rgb_governor;
 	}
-#else
-	rgb_governor = 255;
 #endif
 
-	rgb[0] = (red < rgb_governor ? red : rgb_governor);
-	rgb[1] = (green < rgb_governor ? green : rgb_governor);
-	rgb[2] = (blue < rgb_governor ? blue : rgb_governor);
+	rgb_color[0] = red;
+	rgb_color[1] = green;
+	rgb_color[2] = blue;
+	for (i = 0; i < 3; ++i)
+		duty[i] = rgb_duty(rgb_color[i], brightness);
+	if (duty[0] == rgb_duty_last[0] && duty[1] == rgb_duty_last[1] && duty[2] == rgb_duty_last[2])
+		return;
+	for (i = 0; i < 3; ++i) {
+		rgb_duty_last[i] = duty[i];
+		// rounded up, so that the lowest duty cycles do not turn the 8 bit backends off
+		level[i] = (uint8_t)((duty[i] + (1 << (RGB_DUTY_BITS - 8)) - 1) >> (RGB_DUTY_BITS - 8));
+	}
+
+#if RGB_PWM == RGB_PWM_SOFTWARE
+	{
+		// the PWM interrupt takes them at the start of its next period, so no period mixes two colors
+		uint8_t sreg = SREG;
+
+		cli();
+		if (rgb_pending)
+			++rgb_replaced;
+		memcpy((uint8_t *)rgb_next, level, sizeof(level));
+		rgb_pending = 1;
+		SREG = sreg;
+	}
+#elif RGB_PWM == RGB_PWM_HARDWARE
+	{
+		// the green interrupts read these, the compare registers are double buffered in fast PWM
+		// mode and take the new values at the end of the period on their own
+		uint8_t sreg = SREG;
+
+		cli();
+		memcpy((uint8_t *)rgb, level, sizeof(level));
+		// a compare value of 0 still lets a one clock spike through, disconnect the output instead
+		OCR0B = rgb[0];
+		OCR0A = rgb[2];
+		TCCR0A &= ~((1 << COM0A1) | (1 << COM0B1));
+		if (rgb[0])
+			TCCR0A |= (1 << COM0B1);
+		else
+			LED_RED_LOW;
+		if (rgb[2])
+			TCCR0A |= (1 << COM0A1);
+		else
+			LED_BLUE_LOW;
+		// green needs the interrupts only in between off and full on
+		OCR2A = rgb[1];
+		if (rgb[1] && rgb[1] != 255) {
+			// nor is the time green was left alone
+			if (!TIMSK2)
+				timer0_period_start = TCNT1;
+			TIMSK2 = (1 << TOIE2) | (1 << OCIE2A);
+		} else {
+			TIMSK2 = 0;
+			if (rgb[1])
+				LED_GREEN_HIGH;
+			else
+				LED_GREEN_LOW;
+		}
+		SREG = sreg;
+	}
+#elif RGB_PWM == RGB_PWM_BAM
+	{
+		uint8_t bam[RGB_BAM_FRAMES * 8], frame, bit, sreg;
+
+		// frame f shows the upper 8 bits plus one where the low bits are above f, so that the
+		// low bits average out over the frames without the frames getting any longer
+		for (frame = 0; frame < RGB_BAM_FRAMES; ++frame) {
+			for (i = 0; i < 3; ++i) {
+				level[i] = (uint8_t)(duty[i] >> (RGB_DUTY_BITS - 8));
+				if ((duty[i] & (RGB_BAM_FRAMES - 1)) > frame)
+					++level[i];
+			}
+			for (bit = 0; bit < 8; ++bit)
+				bam[(frame * 8) + bit] = ((level[0] & (1 << bit)) ? (1 << LED_RED_PORTP) : 0)
+					| ((level[1] & (1 << bit)) ? (1 << LED_GREEN_PORTP) : 0)
+					| ((level[2] & (1 << bit)) ? (1 << LED_BLUE_PORTP) : 0);
+		}
+
+		// into the planes the BAM interrupt is not reading, it swaps them in at the end of the frame,
+		// planes it has not swapped in yet are replaced
+		sreg = SREG;
+		cli();
+		if (rgb_bam_pending)
+			++rgb_replaced;
+		memcpy(rgb_bam_front == rgb_bam[0] ? rgb_bam[1] : rgb_bam[0], bam, sizeof(bam));
+		rgb_bam_pending = 1;
+		SREG = sreg;
+	}
+#endif
 }
 
+// scales every color from here on, the current one included
+void rgb_set_brightness(uint8_t brightness) {
+	rgb_brightness = brightness;
+	rgb_set_fine(rgb_color[0], rgb_color[1], rgb_color[2]);
+}
+
+// hue is a whole circle in 16 bits, red at 0, green at a third and blue at two thirds
+void rgb_hsv(uint16_t hue, uint8_t saturation, uint8_t value, uint8_t *color) {
+	uint16_t h = (uint16_t)(((uint32_t)hue * 6) >> 8);
+	uint8_t sector = h >> 8, fraction = h & 0xFF;
+	uint8_t p, q, t;
+
+	p = ((uint16_t)value * (255 - saturation)) >> 8;
+	q = ((uint16_t)value * (255 - (((uint16_t)saturation * fraction) >> 8))) >> 8;
+	t = ((uint16_t)value * (255 - (((uint16_t)saturation * (255 - fraction)) >> 8))) >> 8;
+
+	switch (sector) {
+		case 0:
+			color[0] = value;
+			color[1] = t;
+			color[2] = p;
+			break;
+		case 1:
+			color[0] = q;
+			color[1] = value;
+			color[2] = p;
+			break;
+		case 2:
+			color[0] = p;
+			color[1] = value;
+			color[2] = t;
+			break;
+		case 3:
+			color[0] = p;
+			color[1] = q;
+			color[2] = value;
+			break;
+		case 4:
+			color[0] = t;
+			color[1] = p;
+			color[2] = value;
+			break;
+		default:
+			color[0] = value;
+			color[1] = p;
+			color[2] = q;
+			break;
+	}
+}
+
+
 void rgb_rainbow(void) {
-	float frequency = .3;
 	uint8_t i, red, green, blue;
 #ifdef RGB_DEBUG
 
 	printf_P(PSTR("i\tred\tgreen\tblue\n"));
 #endif
 	for (i = 0; i < 43; ++i) {
-   		red   = (uint8_t)(sin(frequency*(float)i + 0.) * 127.) + 128;
-   		green = (uint8_t)(sin(frequency*(float)i + 2.) * 127.) + 128;
-   		blue  = (uint8_t)(sin(frequency*(float)i + 4.) * 127.) + 128;
+		red   = effect_sin8((uint8_t)(i * 12) + 0);
+		green = effect_sin8((uint8_t)(i * 12) + 81);
+		blue  = effect_sin8((uint8_t)(i * 12) + 163);
 		rgb_set(red, green, blue);
 #ifdef RGB_DEBUG
 		printf_P(PSTR("%d :\t%d\t%d\t%d\n", i, red, green, blue);
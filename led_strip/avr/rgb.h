@@ -1,7 +1,43 @@
 #ifndef _RGB_H_
 #define _RGB_H_
 
-#define RGB_DEFAULT_GOVERNOR 250
+#define RGB_DEFAULT_BRIGHTNESS 255
+
+// rgb_set maps its 8 bit inputs through a gamma table to duty cycles of RGB_DUTY_BITS,
+// backends with 8 bits of their own use the upper bits
+#define RGB_DUTY_BITS	10
+#define RGB_DUTY_MAX	(255 << (RGB_DUTY_BITS - 8))
+
+// PWM backends, chosen with RGB_PWM in the Makefile
+// software: the timer 0 overflow interrupt compares all three channels every 256 clocks
+// hardware: red (OC0B) and blue (OC0A) from timer 0 compare outputs, green has no compare
+//	output on PD7 and is switched by the timer 2 overflow and compare A interrupts
+// bam: bit angle modulation of all three channels from timer 2, 8 interrupts a frame, the
+//	two low duty bits are dithered over RGB_BAM_FRAMES frames
+#define RGB_PWM_SOFTWARE	0
+#define RGB_PWM_HARDWARE	1
+#define RGB_PWM_BAM		2
+
+#ifndef RGB_PWM
+#define RGB_PWM RGB_PWM_BAM
+#endif
+
+// RGB_PWM_PERIOD_TICKS is a period in timer 1 ticks of F_CPU / 256, rounded up
+#if RGB_PWM == RGB_PWM_SOFTWARE
+#define RGB_PWM_HZ	(F_CPU / 256UL / 256UL)
+#define RGB_PWM_PERIOD_TICKS	256
+#elif RGB_PWM == RGB_PWM_HARDWARE
+#define RGB_PWM_HZ	(F_CPU / 8UL / 256UL)
+#define RGB_PWM_PERIOD_TICKS	8
+#else
+// timer 2 at F_CPU / 32, the least significant bit lasts RGB_BAM_UNIT_TICKS
+#define RGB_BAM_UNIT_TICKS	2
+#define RGB_BAM_FRAMES		(1 << (RGB_DUTY_BITS - 8))
+#define RGB_PWM_HZ	(F_CPU / 32UL / (RGB_BAM_UNIT_TICKS * 255UL))
+#define RGB_PWM_PERIOD_TICKS	((32UL * RGB_BAM_UNIT_TICKS * 255UL + 255) / 256)
+#endif
+// milliseconds a PWM frame takes at least, the least that changing a color any faster is wasted
+#define RGB_FRAME_MS	((1000UL + RGB_PWM_HZ - 1) / RGB_PWM_HZ)
 
 #define LED_RED_DIR     DDRD
 #define LED_RED_PORT    PORTD
@@ -27,9 +63,16 @@
 #define LED_GREEN_LOW    LED_GREEN_PORT &= ~(1 << LED_GREEN_PORTP)
 #define LED_GREEN_HIGH   LED_GREEN_PORT |= (1 << LED_GREEN_PORTP)
 
+// bam drives the three pins together, they have to share a port
+#define LED_PORT	PORTD
+#define LED_MASK	((1 << LED_RED_PORTP) | (1 << LED_GREEN_PORTP) | (1 << LED_BLUE_PORTP))
+
 void rgb_init(void);
 void rgb_set(uint8_t red, uint8_t green, uint8_t blue);
-void rgb_set_governor(uint8_t govna);
+void rgb_set_fine(uint16_t red, uint16_t green, uint16_t blue);
+void rgb_hsv(uint16_t hue, uint8_t saturation, uint8_t value, uint8_t *color);
+void rgb_pwm_interrupts(uint8_t enable);
+void rgb_set_brightness(uint8_t brightness);
 void rgb_rainbow(void);
 void rgb_test(void);
 
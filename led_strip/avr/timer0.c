@@ -7,10 +7,19 @@
 #include "global.h"
 #include "rgb.h"
 #include "timer0.h"
+#include "timer1.h"
 
 volatile uint8_t timer0_counter;
+// longest PWM period seen in timer 1 ticks, overflows lost to other interrupts stretch the period
+volatile uint16_t timer0_period_max;
+uint16_t timer0_period_start;
 extern volatile uint8_t rgb[3];
+#if RGB_PWM == RGB_PWM_SOFTWARE
+extern volatile uint8_t rgb_next[3];
+extern volatile uint8_t rgb_pending;
+#endif
 
+#if RGB_PWM == RGB_PWM_SOFTWARE
 ISR(TIMER0_OVF_vect) {
 	if (timer0_counter == rgb[0])
 		LED_RED_LOW;
@@ -20,6 +29,15 @@ ISR(TIMER0_OVF_vect) {
 		LED_BLUE_LOW;
 
 	if (timer0_counter == 255) {
+		TIMER0_PERIOD_END();
+
+		// a new color starts with a period
+		if (rgb_pending) {
+			rgb[0] = rgb_next[0];
+			rgb[1] = rgb_next[1];
+			rgb[2] = rgb_next[2];
+			rgb_pending = 0;
+		}
 		if (rgb[0] != 0)
 			LED_RED_HIGH;
 		if (rgb[1] != 0)
@@ -30,17 +48,21 @@ ISR(TIMER0_OVF_vect) {
 	} else
 		timer0_counter++;
 }
+#endif
 
 void timer0_init() {
 	timer0_counter = 0;
 
+	// sets up the timers of the other PWM backends
 	rgb_init();
 
+#if RGB_PWM == RGB_PWM_SOFTWARE
 	// set timer 0 prescale factor to 64
 	TCCR0B |= (1 << CS00);
 	//TCCR0B |= (1 << CS01);
 
 	timer0_start();
+#endif
 }
 
 void timer0_stop() {
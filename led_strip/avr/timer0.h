@@ -3,6 +3,21 @@
 
 #define TIMER0_OVERFLOWS_PER_SECOND 77
 
+// longest PWM period seen in timer 1 ticks, against RGB_PWM_PERIOD_TICKS
+extern volatile uint16_t timer0_period_max;
+extern uint16_t timer0_period_start;
+
+// the PWM interrupt of every backend ends its period with this, it needs timer1.h
+// a macro, as a call from the interrupt would have it save every register each time it runs
+#define TIMER0_PERIOD_END() do { \
+	uint16_t now = TCNT1, period = now - timer0_period_start; \
+	if (now < timer0_period_start) \
+		period += TIMER1_CTC_TOP + 1; \
+	timer0_period_start = now; \
+	if (period > timer0_period_max) \
+		timer0_period_max = period; \
+} while (0)
+
 void timer0_init();
 void timer0_stop();
 void timer0_start();
@@ -7,8 +7,11 @@
 #include "global.h"
 #include "rgb.h"
 #include "timer1.h"
+#include "program.h"
 
 volatile uint16_t icp_hz, icp_events;
+// compare B fires every millisecond, at ticks of 31.25 per millisecond rounded up
+static uint32_t timer1_ms_quarters;
 
 ISR(TIMER1_CAPT_vect){ 
 	++icp_events;
@@ -19,6 +22,16 @@ ISR(TIMER1_COMPA_vect) {
 	icp_events = 0;
 }
 
+ISR(TIMER1_COMPB_vect) {
+	// in quarter ticks, a second is 1000 * 125
+	timer1_ms_quarters += 125;
+	if (timer1_ms_quarters >= (TIMER1_CTC_TOP + 1) * 4UL)
+		timer1_ms_quarters = 0;
+	OCR1B = (timer1_ms_quarters + 3) >> 2;
+
+	program_tick();
+}
+
 void timer1_init() {
 	// normal timer counter mode
 	TCCR1A = 0;
@@ -29,6 +42,9 @@ void timer1_init() {
 
 	// set CTC for 1 Hz
 	OCR1A = TIMER1_CTC_TOP;
+	// millisecond tick
+	timer1_ms_quarters = 0;
+	OCR1B = 0;
 	// set timer 1 prescale factor to 256
 	TCCR1B |= (1 << WGM12);
 
@@ -36,13 +52,23 @@ void timer1_init() {
 }
 
 void timer1_stop() {
-	TIMSK1 &= ~(1 << ICIE1);
+	TIMSK1 &= ~((1 << ICIE1) | (1 << OCIE1B));
 }
 
 void timer1_start() {
 	icp_hz = 0;
 	icp_events = 0;
 
-	// enable timer 1 input capture interrupt and CTC interrupt
-	TIMSK1 |= (1 << ICIE1) | (1 << OCIE1A);
+	// enable timer 1 input capture interrupt, CTC interrupt and millisecond tick
+	TIMSK1 |= (1 << ICIE1) | (1 << OCIE1A) | (1 << OCIE1B);
+}
+
+// ticks from a TCNT1 reading to now, for spans below a second
+uint16_t timer1_ticks_since(uint16_t start) {
+	uint16_t now = TCNT1;
+
+	if (now < start)
+		now += TIMER1_CTC_TOP + 1;
+
+	return now - start;
 }
@@ -1,10 +1,14 @@
 #ifndef _TIMER1_H_
 #define _TIMER1_H_
 
-#define TIMER1_CTC_TOP 31250
+// counts 0 to TIMER1_CTC_TOP, 31250 ticks a second
+#define TIMER1_CTC_TOP 31249
+// timer 1 runs at F_CPU / 256 and wraps at TIMER1_CTC_TOP, the ISR timing instrumentation counts its ticks
+#define TIMER1_TICK_US (256000000UL / F_CPU)
 
 void timer1_init();
 void timer1_stop();
 void timer1_start();
+uint16_t timer1_ticks_since(uint16_t start);
 
 #endif /* _TIMER1_H_ */
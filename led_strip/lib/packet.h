@@ -30,6 +30,32 @@
 #define PACKET_READ_LIGHT_FREQ		41		// 1 byte ||| returns 1 byte + uint16_t (freq in hz)
 #define PACKET_READ_LIGHT_FREQ_FLUSH	43		// 1 byte
 #define	PACKET_LIGHT_FREQ		47		// 1 byte + uint16_t (freq in hz)
+// over the air update, the bootloader is only entered with the XTEA tag of a fresh nonce
+// every nonce read or entry attempt retires the nonce
+#define PACKET_READ_BOOT_NONCE		53		// 1 byte ||| returns 1 byte + 8*uint8_t (nonce)
+#define PACKET_READ_BOOT_NONCE_FLUSH	59		// 1 byte
+#define PACKET_BOOT_NONCE		61		// 1 byte + 8*uint8_t (nonce)
+#define PACKET_ENTER_BOOTLOADER		67		// 1 byte + 8*uint8_t (tag)
+// packed programming, a step is packed as in EEPROM: 3*uint8_t (red,green,blue) + uint16_t (delay in ms)
+// a block is only taken in the programming state and is written with one EEPROM block update
+#define PACKET_PROGRAM_STEPS_BLOCK	71		// 1 byte + uint16_t (first step) + uint8_t (steps) + steps*packed step
+#define PACKET_READ_PROGRAM_STEPS_BLOCK	73		// 1 byte + uint16_t (first step) + uint8_t (steps) ||| returns PACKET_PROGRAM_STEPS_BLOCK
+#define PACKET_READ_PROGRAM_STEPS_BLOCK_FLUSH	79	// 1 byte
+// streamed read back, the read stages the first PACKET_PROGRAM_STREAM_DEPTH payloads in the ack fifo and
+// each flush stages one more, payloads are numbered from 0 so a lost one shows up as a gap
+#define PACKET_READ_PROGRAM_STREAM	83		// 1 byte + uint16_t (first step) + uint16_t (steps)
+#define PACKET_PROGRAM_STREAM_PAYLOAD	89		// 1 byte + uint8_t (sequence) + up to PACKET_PROGRAM_STREAM_STEPS*packed step
+#define PACKET_READ_PROGRAM_STREAM_FLUSH	97	// 1 byte
+// timing instrumentation, the maxima are reset by every read
+#define PACKET_READ_STATS		101		// 1 byte ||| returns PACKET_STATS
+#define PACKET_READ_STATS_FLUSH		103		// 1 byte
+#define PACKET_STATS			107		// 1 byte + uint16_t (longest radio ISR in us) + uint16_t (worst PWM period overrun in us) + uint16_t (radio queue overflows) + uint8_t (radio queue high water) + uint16_t (latest program step in ms) + uint16_t (late program steps) + uint16_t (PWM CPU load in permille) + uint16_t (PWM frequency in Hz) + uint16_t (stream frames lost) + uint16_t (colors replaced before shown)
+#define PACKET_SET_BRIGHTNESS		109		// 1 byte + uint8_t (brightness, 255 is full)
+// procedural effects run on the node until a color, program or other effect replaces them
+#define PACKET_RUN_EFFECT		113		// 1 byte + uint8_t (effect) + uint16_t (period in ms) + 3*uint8_t (red,green,blue) + uint8_t (shape) + uint8_t (phase per node id)
+// real time colors, sent without ack at a fixed frame rate, the sequence counts frames so that the
+// node can count the lost ones, a frame stops any program or effect
+#define PACKET_STREAM_COLOR		127		// 1 byte + uint8_t (sequence) + 3*uint8_t (red,green,blue)
 
 // PACKET TYPE SIZES
 #define PACKET_RESET_SIZE			(sizeof(uint8_t))
@@ -47,6 +73,67 @@
 #define PACKET_READ_LIGHT_FREQ_SIZE		(sizeof(uint8_t))
 #define PACKET_READ_LIGHT_FREQ_FLUSH_SIZE	(sizeof(uint8_t))
 #define PACKET_LIGHT_FREQ_SIZE			(sizeof(uint8_t) + sizeof(uint16_t))
+#define PACKET_READ_BOOT_NONCE_SIZE		(sizeof(uint8_t))
+#define PACKET_READ_BOOT_NONCE_FLUSH_SIZE	(sizeof(uint8_t))
+#define PACKET_BOOT_NONCE_SIZE			(sizeof(uint8_t) + (8 * sizeof(uint8_t)))
+#define PACKET_ENTER_BOOTLOADER_SIZE		(sizeof(uint8_t) + (8 * sizeof(uint8_t)))
+#define PACKET_PROGRAM_STEP_PACKED_SIZE		((3 * sizeof(uint8_t)) + sizeof(uint16_t))
+#define PACKET_PROGRAM_STEPS_BLOCK_MIN_SIZE	(sizeof(uint8_t) + sizeof(uint16_t) + sizeof(uint8_t))
+#define PACKET_PROGRAM_STEPS_BLOCK_MAX_STEPS	((32 - PACKET_PROGRAM_STEPS_BLOCK_MIN_SIZE) / PACKET_PROGRAM_STEP_PACKED_SIZE)
+#define PACKET_READ_PROGRAM_STEPS_BLOCK_SIZE	(sizeof(uint8_t) + sizeof(uint16_t) + sizeof(uint8_t))
+#define PACKET_READ_PROGRAM_STEPS_BLOCK_FLUSH_SIZE	(sizeof(uint8_t))
+#define PACKET_READ_PROGRAM_STREAM_SIZE		(sizeof(uint8_t) + sizeof(uint16_t) + sizeof(uint16_t))
+#define PACKET_PROGRAM_STREAM_PAYLOAD_MIN_SIZE	(sizeof(uint8_t) + sizeof(uint8_t))
+#define PACKET_READ_PROGRAM_STREAM_FLUSH_SIZE	(sizeof(uint8_t))
+#define PACKET_PROGRAM_STREAM_STEPS		((32 - PACKET_PROGRAM_STREAM_PAYLOAD_MIN_SIZE) / PACKET_PROGRAM_STEP_PACKED_SIZE)
+#define PACKET_PROGRAM_STREAM_DEPTH		3
+#define PACKET_READ_STATS_SIZE			(sizeof(uint8_t))
+#define PACKET_READ_STATS_FLUSH_SIZE		(sizeof(uint8_t))
+#define PACKET_STATS_SIZE			(sizeof(uint8_t) + sizeof(uint16_t) + sizeof(uint16_t) + sizeof(uint16_t) + sizeof(uint8_t) + sizeof(uint16_t) + sizeof(uint16_t) + sizeof(uint16_t) + sizeof(uint16_t) + sizeof(uint16_t) + sizeof(uint16_t))
+#define PACKET_SET_BRIGHTNESS_SIZE		(sizeof(uint8_t) + sizeof(uint8_t))
+#define PACKET_RUN_EFFECT_SIZE			(sizeof(uint8_t) + sizeof(uint8_t) + sizeof(uint16_t) + (3 * sizeof(uint8_t)) + sizeof(uint8_t) + sizeof(uint8_t))
+#define PACKET_STREAM_COLOR_SIZE		(sizeof(uint8_t) + sizeof(uint8_t) + (3 * sizeof(uint8_t)))
+
+// v2 programs, a PACKET_PROGRAM_LENGTH with PACKET_PROGRAM_V2 set gives the size in bytes of a program
+// of typed steps, which is sent, stored and read back in packed steps as a plain program is
+// a step is an op byte and its arguments:
+//	hold, fade: uint8_t for each channel flagged in the op (red,green,blue) + time, the channels not
+//		flagged keep the color of the last hold or fade, all are 0 at the start of the program
+//	hue: uint8_t (first hue) + uint8_t (last hue, the whole circle when equal) + uint8_t (saturation)
+//		+ uint8_t (value) + time, the hue sweeps upwards
+//	loop: uint8_t (times the body runs) + uint16_t (offset of the first step of the body)
+// the time flags of the op give the time in ms as uint16_t, as uint8_t or as that of the last step,
+// which is 0 at the start of the program
+#define PACKET_PROGRAM_V2		0x8000
+#define PACKET_PROGRAM_V2_MAX_LOOPS	4		// loops inside each other
+#define PACKET_PROGRAM_OP_MASK		0x07
+#define PACKET_PROGRAM_OP_HOLD		1		// holds the color for the time
+#define PACKET_PROGRAM_OP_FADE		2		// fades from the last color for the time
+#define PACKET_PROGRAM_OP_HUE		3		// sweeps the hue for the time
+#define PACKET_PROGRAM_OP_LOOP		4
+#define PACKET_PROGRAM_OP_RED		0x08
+#define PACKET_PROGRAM_OP_GREEN		0x10
+#define PACKET_PROGRAM_OP_BLUE		0x20
+#define PACKET_PROGRAM_OP_TIME_MASK	0xC0
+#define PACKET_PROGRAM_OP_TIME_16	0x00
+#define PACKET_PROGRAM_OP_TIME_8	0x40
+#define PACKET_PROGRAM_OP_TIME_SAME	0x80
+
+// effects, a period is one cycle of the effect and shape sets it up further:
+//	rainbow: sweeps the hue once a period, shape is the saturation, the color is not used
+//	breathe: fades the color in and out on a sine, shape is the lowest level
+//	strobe: flashes the color, shape is the share of the period it is on in 256ths
+//	chase: a pulse of the color, shape is its width in 256ths of the period, with a phase per
+//		node id the pulse runs from node to node
+//	cycle: fades through the color and its channels rotated, (red,green,blue) to (green,blue,red)
+//		to (blue,red,green), shape is the share of each third spent fading in 256ths
+// the phase per node id is in 256ths of a period
+#define PACKET_EFFECT_NONE		0
+#define PACKET_EFFECT_RAINBOW		1
+#define PACKET_EFFECT_BREATHE		2
+#define PACKET_EFFECT_STROBE		3
+#define PACKET_EFFECT_CHASE		4
+#define PACKET_EFFECT_CYCLE		5
 
 #define PIPE_0_ADDR	0xF0F0F0F0E1LL
 #define PIPE_1_ADDR	0xF0F0F0F0D2LL
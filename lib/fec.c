@@ -0,0 +1,111 @@
+#include <inttypes.h>
+
+#include "fec.h"
+
+// multiply in GF(256) with the reducing polynomial x^8 + x^4 + x^3 + x^2 + 1 (0x11D)
+// shift and add rather than log / exp tables, the bootloader cannot spare 512 bytes of flash
+uint8_t fec_mul(uint8_t a, uint8_t b) {
+	uint8_t r = 0;
+
+	while (b) {
+		if (b & 0x01)
+			r ^= a;
+		a = (a << 1) ^ ((a & 0x80) ? 0x1D : 0x00);
+		b >>= 1;
+	}
+
+	return r;
+}
+
+// a^254 == a^-1 as the multiplicative group has 255 elements
+uint8_t fec_inv(uint8_t a) {
+	uint8_t r = 1, e = 254;
+
+	while (e) {
+		if (e & 0x01)
+			r = fec_mul(r, a);
+		a = fec_mul(a, a);
+		e >>= 1;
+	}
+
+	return r;
+}
+
+uint8_t fec_coefficient(uint8_t row, uint8_t shard) {
+	return fec_inv((FEC_PARITY_X + row) ^ shard);
+}
+
+void fec_encode(const uint8_t *data, uint8_t k, uint8_t shard_size, uint8_t row, uint8_t *parity) {
+	uint8_t i, b, c;
+
+	for (b = 0; b < shard_size; ++b)
+		parity[b] = 0;
+	for (i = 0; i < k; ++i) {
+		c = fec_coefficient(row, i);
+		for (b = 0; b < shard_size; ++b)
+			parity[b] ^= fec_mul(c, data[b]);
+		data += shard_size;
+	}
+}
+
+uint8_t fec_decode(uint8_t *data, uint8_t k, uint8_t shard_size, uint8_t present, uint8_t *parity, const uint8_t *rows, uint8_t parity_count) {
+	uint8_t missing[FEC_MAX_PARITY_SHARDS];
+	uint8_t matrix[FEC_MAX_PARITY_SHARDS][FEC_MAX_PARITY_SHARDS];
+	uint8_t i, j, t, b, c, erasures = 0;
+	uint8_t *p, *q;
+
+	for (i = 0; i < k; ++i) {
+		if (present & (1 << i))
+			continue;
+		if (erasures == parity_count || erasures == FEC_MAX_PARITY_SHARDS)
+			return 0;
+		missing[erasures++] = i;
+	}
+	if (!erasures)
+		return 1;
+
+	// strip the received data out of the parity, leaving only the missing shards' contributions
+	for (j = 0; j < erasures; ++j) {
+		p = &parity[j * shard_size];
+		for (i = 0; i < k; ++i) {
+			if (!(present & (1 << i)))
+				continue;
+			c = fec_coefficient(rows[j], i);
+			q = &data[i * shard_size];
+			for (b = 0; b < shard_size; ++b)
+				p[b] ^= fec_mul(c, q[b]);
+		}
+		for (t = 0; t < erasures; ++t)
+			matrix[j][t] = fec_coefficient(rows[j], missing[t]);
+	}
+
+	// gauss-jordan on the erasures x erasures system, the leading minors of a cauchy matrix
+	// are cauchy matrices themselves so the pivots are never zero
+	for (t = 0; t < erasures; ++t) {
+		p = &parity[t * shard_size];
+		c = fec_inv(matrix[t][t]);
+		for (i = 0; i < erasures; ++i)
+			matrix[t][i] = fec_mul(c, matrix[t][i]);
+		for (b = 0; b < shard_size; ++b)
+			p[b] = fec_mul(c, p[b]);
+		for (j = 0; j < erasures; ++j) {
+			if (j == t || !matrix[j][t])
+				continue;
+			c = matrix[j][t];
+			q = &parity[j * shard_size];
+			for (i = 0; i < erasures; ++i)
+				matrix[j][i] ^= fec_mul(c, matrix[t][i]);
+			for (b = 0; b < shard_size; ++b)
+				q[b] ^= fec_mul(c, p[b]);
+		}
+	}
+
+	for (t = 0; t < erasures; ++t) {
+		p = &parity[t * shard_size];
+		q = &data[missing[t] * shard_size];
+		for (b = 0; b < shard_size; ++b)
+			q[b] = p[b];
+	}
+
+	return 1;
+}
@@ -0,0 +1,26 @@
+#ifndef _FEC_H_
+#define _FEC_H_
+
+// systematic erasure code over GF(256) for no-ack bulk transfers
+// a block is k data shards followed by up to m parity shards, all of the same size, and any k of
+// the k + m shards are enough to rebuild the data without asking for a retransmission
+// parity row r is the Cauchy row 1 / (x_r + y_i) with y_i = i, x_r = FEC_PARITY_X + r, so any
+// square submatrix is invertible
+// the shard bookkeeping is a single byte of bits, hence the small limits
+
+#define FEC_MAX_DATA_SHARDS	8
+#define FEC_MAX_PARITY_SHARDS	4
+#define FEC_PARITY_X		0x80
+
+uint8_t fec_mul(uint8_t a, uint8_t b);
+uint8_t fec_inv(uint8_t a);
+uint8_t fec_coefficient(uint8_t row, uint8_t shard);
+// data holds k shards back to back, parity receives shard_size bytes for the given parity row
+void fec_encode(const uint8_t *data, uint8_t k, uint8_t shard_size, uint8_t row, uint8_t *parity);
+// rebuild the data shards missing from the present bit mask (bit i set = data shard i received)
+// parity holds parity_count received parity shards back to back, rows[j] is the row of shard j
+// the parity shards are used as scratch space
+// returns 1 on success, 0 when too few shards were received
+uint8_t fec_decode(uint8_t *data, uint8_t k, uint8_t shard_size, uint8_t present, uint8_t *parity, const uint8_t *rows, uint8_t parity_count);
+
+#endif
@@ -237,8 +237,8 @@ uint8_t nrf24_write_register(nrf24_t *radio, uint8_t reg, uint8_t *buf, uint8_t
 	return status;
 }
 
-uint8_t nrf24_write_payload(nrf24_t *radio, uint8_t *buf, uint8_t len) {
-	uint8_t reg_buf = NRF24__W_TX_PAYLOAD;
+static uint8_t nrf24_write_payload_command(nrf24_t *radio, uint8_t command, uint8_t *buf, uint8_t len) {
+	uint8_t reg_buf = command;
 	uint8_t status, i;
 	uint8_t len_data = radio->payload_size;
 	uint8_t len_pad = 0;
@@ -268,6 +268,10 @@ uint8_t nrf24_write_payload(nrf24_t *radio, uint8_t *buf, uint8_t len) {
 	return status;
 }
 
+uint8_t nrf24_write_payload(nrf24_t *radio, uint8_t *buf, uint8_t len) {
+	return nrf24_write_payload_command(radio, NRF24__W_TX_PAYLOAD, buf, len);
+}
+
 uint8_t nrf24_read_payload(nrf24_t *radio, uint8_t *buf, uint8_t len) {
 	uint8_t reg_buf = NRF24__R_RX_PAYLOAD;
 	uint8_t status;
@@ -444,6 +448,26 @@ void nrf24_enable_dynamic_payloads(nrf24_t *radio) {
 	radio->dynamic_payloads_enabled = 1;
 }
 
+void nrf24_enable_dynamic_ack(nrf24_t *radio) {
+	uint8_t reg_buf;
+
+	nrf24_read_register(radio, NRF24__FEATURE, &reg_buf, 1);
+	reg_buf |= _BV(NRF24__EN_DYN_ACK);
+	nrf24_write_register(radio, NRF24__FEATURE, &reg_buf, 1);
+
+	nrf24_read_register(radio, NRF24__FEATURE, &reg_buf, 1);
+	// if the register is empty then the features are not enabled
+	if (!reg_buf) {
+		// enable and try again
+		nrf24_toggle_features(radio);
+		nrf24_read_register(radio, NRF24__FEATURE, &reg_buf, 1);
+		reg_buf |= _BV(NRF24__EN_DYN_ACK);
+		nrf24_write_register(radio, NRF24__FEATURE, &reg_buf, 1);
+	}
+
+	radio->dynamic_ack_enabled = 1;
+}
+
 void nrf24_set_auto_ack(nrf24_t *radio, uint8_t enable) {
 	uint8_t reg_buf;
 
@@ -672,10 +696,12 @@ void nrf24_power_up(nrf24_t *radio) {
 #endif
 }
 
-uint8_t nrf24_send(nrf24_t *radio, uint8_t *buf, uint8_t len) {
+static void nrf24_start_send_command(nrf24_t *radio, uint8_t command, uint8_t *buf, uint8_t len);
+
+static uint8_t nrf24_send_command(nrf24_t *radio, uint8_t command, uint8_t *buf, uint8_t len) {
 	uint8_t tx_ok, tx_fail, ack_payload_available;
 
-	nrf24_start_send(radio, buf, len);
+	nrf24_start_send_command(radio, command, buf, len);
 
 #ifdef NRF24_USE_IRQ
 #ifndef __AVR__
@@ -745,6 +771,17 @@ uint8_t nrf24_send(nrf24_t *radio, uint8_t *buf, uint8_t len) {
 	return tx_ok;
 }
 
+uint8_t nrf24_send(nrf24_t *radio, uint8_t *buf, uint8_t len) {
+	return nrf24_send_command(radio, NRF24__W_TX_PAYLOAD, buf, len);
+}
+
+uint8_t nrf24_send_no_ack(nrf24_t *radio, uint8_t *buf, uint8_t len) {
+	// without the dynamic ack feature the radio would silently request an ack anyway
+	if (!radio->dynamic_ack_enabled)
+		return nrf24_send(radio, buf, len);
+	return nrf24_send_command(radio, NRF24__W_TX_PAYLOAD_NOACK, buf, len);
+}
+
 uint8_t nrf24_payload_available_on_any_pipe(nrf24_t *radio, uint8_t *pipe) {
 	uint8_t status, data_available, reg_buf;
 
@@ -785,6 +822,10 @@ uint8_t nrf24_read(nrf24_t *radio, uint8_t *buf, uint8_t len) {
 }
 
 void nrf24_start_send(nrf24_t *radio, uint8_t *buf, uint8_t len) {
+	nrf24_start_send_command(radio, NRF24__W_TX_PAYLOAD, buf, len);
+}
+
+static void nrf24_start_send_command(nrf24_t *radio, uint8_t command, uint8_t *buf, uint8_t len) {
 	uint8_t reg_buf, tmp;
 
 	// power up the transmitter and put in PTX mode (~PRIM_RX)
@@ -804,7 +845,7 @@ void nrf24_start_send(nrf24_t *radio, uint8_t *buf, uint8_t len) {
 #endif
 	}
 
-	nrf24_write_payload(radio, buf, len);
+	nrf24_write_payload_command(radio, command, buf, len);
 
 	// high pulse of > 10us initiates send
 	nrf24_ce(radio, HIGH);
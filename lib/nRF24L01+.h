@@ -111,6 +111,7 @@
 #define NRF24__R_RX_PAYLOAD  0x61
 #define NRF24__W_TX_PAYLOAD  0xA0
 #define NRF24__W_ACK_PAYLOAD 0xA8
+#define NRF24__W_TX_PAYLOAD_NOACK 0xB0
 #define NRF24__FLUSH_TX      0xE1
 #define NRF24__FLUSH_RX      0xE2
 #define NRF24__REUSE_TX_PL   0xE3
@@ -150,6 +151,7 @@ typedef struct nrf24_config {
 	uint8_t ack_payload_enabled;
 	uint8_t ack_payload_length;
 	uint8_t ack_payload_available;
+	uint8_t dynamic_ack_enabled;
 	uint64_t pipe0_reading_address;
 } nrf24_t;
 
@@ -199,6 +201,8 @@ uint8_t nrf24_get_payload_size(nrf24_t *radio);
 uint8_t nrf24_get_dynamic_payload_size(nrf24_t *radio);
 void nrf24_enable_ack_payload(nrf24_t *radio);
 void nrf24_enable_dynamic_payloads(nrf24_t *radio);
+// allow individual packets to be sent without requesting an auto ack (W_TX_PAYLOAD_NOACK)
+void nrf24_enable_dynamic_ack(nrf24_t *radio);
 void nrf24_set_auto_ack(nrf24_t *radio, uint8_t enable) ;
 void nrf24_set_auto_ack_for_pipe(nrf24_t *radio, uint8_t pipe, uint8_t enable) ;
 void nrf24_set_power_level(nrf24_t *radio, nrf24_power_level_e level) ;
@@ -223,6 +227,9 @@ void nrf24_power_up(nrf24_t *radio);
 // write payload to output pipe and auto handle acks and retransmits
 // blocks on transmission and returns 0 or 1 if the send was failed or successful, respectively
 uint8_t nrf24_send(nrf24_t *radio, uint8_t *buf, uint8_t len);
+// same as nrf24_send, but the receiver(s) will not ack the packet, useful for multicast
+// returns 1 once the packet has left the radio; requires nrf24_enable_dynamic_ack
+uint8_t nrf24_send_no_ack(nrf24_t *radio, uint8_t *buf, uint8_t len);
 // returns 0 if no payload or 1 if data available
 uint8_t nrf24_payload_available(nrf24_t *radio);
 // read data from open pipe, returns 0 if success, 1 if failure
@@ -0,0 +1,28 @@
+#include <inttypes.h>
+
+#include "xtea.h"
+
+void xtea_encrypt(const uint32_t key[XTEA_KEY_WORDS], uint32_t v[2]) {
+	uint32_t v0 = v[0], v1 = v[1], sum = 0, delta = 0x9E3779B9;
+	uint8_t i;
+
+	for (i = 0; i < XTEA_ROUNDS; ++i) {
+		v0 += (((v1 << 4) ^ (v1 >> 5)) + v1) ^ (sum + key[sum & 3]);
+		sum += delta;
+		v1 += (((v0 << 4) ^ (v0 >> 5)) + v0) ^ (sum + key[(sum >> 11) & 3]);
+	}
+	v[0] = v0;
+	v[1] = v1;
+}
+
+void xtea_tag(const uint32_t key[XTEA_KEY_WORDS], const uint8_t nonce[XTEA_BLOCK_SIZE], uint8_t tag[XTEA_BLOCK_SIZE]) {
+	uint32_t v[2];
+	uint8_t i;
+
+	v[0] = v[1] = 0;
+	for (i = 0; i < XTEA_BLOCK_SIZE; ++i)
+		v[i >> 2] |= (uint32_t)nonce[i] << ((i & 3) * 8);
+	xtea_encrypt(key, v);
+	for (i = 0; i < XTEA_BLOCK_SIZE; ++i)
+		tag[i] = (uint8_t)(v[i >> 2] >> ((i & 3) * 8));
+}
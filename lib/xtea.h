@@ -0,0 +1,16 @@
+#ifndef _XTEA_H_
+#define _XTEA_H_
+
+// XTEA, a 64 bit block cipher with a 128 bit key, small enough for the AVR applications
+// used to authenticate commands: the tag of a nonce is its encryption under a shared key, so only
+// a holder of the key can answer a nonce, and a fresh nonce per command stops replays
+
+#define XTEA_BLOCK_SIZE		8
+#define XTEA_KEY_WORDS		4
+#define XTEA_ROUNDS		32
+
+void xtea_encrypt(const uint32_t key[XTEA_KEY_WORDS], uint32_t v[2]);
+// the block is taken and returned little endian so both ends agree on the bytes
+void xtea_tag(const uint32_t key[XTEA_KEY_WORDS], const uint8_t nonce[XTEA_BLOCK_SIZE], uint8_t tag[XTEA_BLOCK_SIZE]);
+
+#endif
@@ -0,0 +1 @@
+../pi/cache.c
\ No newline at end of file
@@ -0,0 +1 @@
+../pi/cache.h
\ No newline at end of file
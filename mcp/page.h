@@ -0,0 +1 @@
+../bootloader/page.h
\ No newline at end of file
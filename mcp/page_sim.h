@@ -0,0 +1 @@
+../pi/page_sim.h
\ No newline at end of file
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <string.h>
+#include <ctype.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -10,8 +11,32 @@
 
 #include "error.h"
 #include "file.h"
+#include "packet.h"
 #include "program.h"
 
+#define PROGRAM_TOKENS	" \t\r\n"
+
+static void program_compile(program_t *p, char *filename);
+
+static int program_check(file_t *f, int line_no, const char *name, char *token, int max) {
+	if (token == NULL) {
+		fatal_error("error while parsing program file '%s' on line %d: no %s token found!\n", f->filename, line_no, name);
+	} else if (atoi(token) < 0 || atoi(token) > max) {
+		fatal_error("error while parsing program file '%s' on line %d: %s > %d (was %d)\n", f->filename, line_no, name, max, atoi(token));
+	}
+
+	return atoi(token);
+}
+
+static int program_token(file_t *f, int line_no, const char *name, char **next, int max) {
+	return program_check(f, line_no, name, strtok_r(NULL, PROGRAM_TOKENS, next), max);
+}
+
+// a plain step is red, green, blue and delay, the other steps start with the name of their op:
+//	fade <red> <green> <blue> <ms>
+//	hue <first hue> <last hue> <saturation> <value> <ms>
+//	repeat <times>, up to the next loop
+//	loop
 program_t *program_load_from_file(char *filename) {
 	file_t *f;
 	program_t *p;
@@ -25,68 +50,350 @@ program_t *program_load_from_file(char *filename) {
 
 	p = malloc(sizeof(program_t));
 	memset(p, 0, sizeof(program_t));
-	p->size = sizeof(uint16_t) + sizeof(uint16_t); // preample in eeprom + # of steps in program
 
 	while (fgets(line, 1024, f->fp) != NULL) {
 		char *token, *next;
 		++line_no;
 		if (line[0] == '#')
 			continue;
+		token = strtok_r(line, PROGRAM_TOKENS, &next);
+		if (token == NULL)
+			continue;
 		s = malloc(sizeof(program_step_t));
-		//memset(s, 0, sizeof(program_step_t));
-		// red
-		token = strtok_r(line, "\t", &next);
-		if (token == NULL) {
-			fatal_error("error while parsing program file '%s' one line %d: no red token found!\n", f->filename, line_no);
-		} else if (atoi(token) > 255) {
-			fatal_error("error while parsing program file '%s' one line %d: red value > 255 (was %d)\n", f->filename, line_no, atoi(token));
+		memset(s, 0, sizeof(program_step_t));
+		if (isdigit(token[0]) || strcmp(token, "fade") == 0) {
+			if (isdigit(token[0])) {
+				s->op = PACKET_PROGRAM_OP_HOLD;
+				s->arg[0] = program_check(f, line_no, "red value", token, 255);
+			} else {
+				s->op = PACKET_PROGRAM_OP_FADE;
+				s->arg[0] = program_token(f, line_no, "red value", &next, 255);
+			}
+			s->arg[1] = program_token(f, line_no, "green value", &next, 255);
+			s->arg[2] = program_token(f, line_no, "blue value", &next, 255);
+			s->delay_in_ms = program_token(f, line_no, "delay in ms", &next, 65534);
+		} else if (strcmp(token, "hue") == 0) {
+			s->op = PACKET_PROGRAM_OP_HUE;
+			s->arg[0] = program_token(f, line_no, "first hue", &next, 255);
+			s->arg[1] = program_token(f, line_no, "last hue", &next, 255);
+			s->arg[2] = program_token(f, line_no, "saturation", &next, 255);
+			s->arg[3] = program_token(f, line_no, "value", &next, 255);
+			s->delay_in_ms = program_token(f, line_no, "delay in ms", &next, 65534);
+		} else if (strcmp(token, "repeat") == 0) {
+			s->op = PROGRAM_OP_REPEAT;
+			s->arg[0] = program_token(f, line_no, "times", &next, 255);
+			if (!s->arg[0])
+				fatal_error("error while parsing program file '%s' on line %d: a loop runs at least once\n", f->filename, line_no);
+		} else if (strcmp(token, "loop") == 0) {
+			s->op = PACKET_PROGRAM_OP_LOOP;
+		} else {
+			fatal_error("error while parsing program file '%s' on line %d: unknown step '%s'\n", f->filename, line_no, token);
 		}
-		s->rgb[0] = atoi(token);
-		// green
-		token = strtok_r(NULL, "\t", &next);
-		if (token == NULL) {
-			fatal_error("error while parsing program file '%s' one line %d: no green token found!\n", f->filename, line_no);
-		} else if (atoi(token) > 255) {
-			fatal_error("error while parsing program file '%s' one line %d: green value > 255 (was %d)\n", f->filename, line_no, atoi(token));
-		}
-		s->rgb[1] = atoi(token);
-		// blue
-		token = strtok_r(NULL, "\t", &next);
-		if (token == NULL) {
-			fatal_error("error while parsing program file '%s' one line %d: no blue token found!\n", f->filename, line_no);
-		} else if (atoi(token) > 255) {
-			fatal_error("error while parsing program file '%s' one line %d: blue value > 255 (was %d)\n", f->filename, line_no, atoi(token));
-		}
-		s->rgb[2] = atoi(token);
-		// delay
-		token = strtok_r(NULL, "]t", &next);
-		if (token == NULL) {
-			fatal_error("error while parsing program file '%s' one line %d: no delay token found!\n", f->filename, line_no);
-		} else if (atoi(token) > 65534) {
-			fatal_error("error while parsing program file '%s' one line %d: delay in ms was > 65534 (was %d)\n", f->filename, line_no, atoi(token));
-		}
-		s->delay_in_ms = atoi(token);
 		p->steps++;
 		p->step = realloc(p->step, sizeof(program_step_t *) * p->steps);
 		p->step[p->steps - 1] = s;
-		p->size += (3 * sizeof(uint8_t)) + sizeof(uint16_t);
 	}
 
+	program_compile(p, f->filename);
+
+	file_close(f);
+
+	return p;
+}
+
+// encodes the steps as a v2 program and keeps that or the plain program, whichever is smaller,
+// channels and times are only left out where the node is sure to have them, so not at the
+// start of a loop body, which is reached from before the loop as well as from its end
+static void program_compile(program_t *p, char *filename) {
+	uint8_t *v2;
+	int color[3] = { 0, 0, 0 }, time = 0, loops = 0, directives = 0, i, j;
+	uint32_t bytes = 0, plain = 0, timed = 0, plain_size;
+	struct {
+		uint16_t target;
+		uint8_t times;
+		uint32_t plain, timed;
+	} loop[PACKET_PROGRAM_V2_MAX_LOOPS];
+	program_step_t *s;
+
+	v2 = malloc(PACKET_PROGRAM_V2 + 16);
+	for (i = 0; i < p->steps; ++i) {
+		uint8_t *op = &v2[bytes++];
+
+		s = p->step[i];
+		if (s->op != PACKET_PROGRAM_OP_HOLD)
+			directives = 1;
+		*op = s->op;
+		switch (s->op) {
+			case PROGRAM_OP_REPEAT:
+				--bytes;
+				if (loops == PACKET_PROGRAM_V2_MAX_LOOPS)
+					fatal_error("program in file '%s' has loops inside each other deeper than %d\n", filename, PACKET_PROGRAM_V2_MAX_LOOPS);
+				loop[loops].target = bytes;
+				loop[loops].times = s->arg[0];
+				loop[loops].plain = plain;
+				loop[loops].timed = timed;
+				++loops;
+				plain = 0;
+				color[0] = color[1] = color[2] = time = -1;
+				continue;
+			case PACKET_PROGRAM_OP_LOOP:
+				if (!loops)
+					fatal_error("program in file '%s' has a loop without a repeat\n", filename);
+				--loops;
+				if (timed == loop[loops].timed)
+					fatal_error("program in file '%s' has a loop without steps\n", filename);
+				v2[bytes++] = loop[loops].times;
+				v2[bytes++] = (uint8_t)(loop[loops].target & 0x00FF);
+				v2[bytes++] = (uint8_t)((loop[loops].target & 0xFF00) >> 8);
+				plain = loop[loops].plain + (plain * loop[loops].times);
+				continue;
+			case PACKET_PROGRAM_OP_HOLD:
+			case PACKET_PROGRAM_OP_FADE:
+				for (j = 0; j < 3; ++j) {
+					if (color[j] == s->arg[j])
+						continue;
+					*op |= PACKET_PROGRAM_OP_RED << j;
+					v2[bytes++] = s->arg[j];
+					color[j] = s->arg[j];
+				}
+				break;
+			case PACKET_PROGRAM_OP_HUE:
+				for (j = 0; j < 4; ++j)
+					v2[bytes++] = s->arg[j];
+				break;
+		}
+		if (time == s->delay_in_ms)
+			*op |= PACKET_PROGRAM_OP_TIME_SAME;
+		else if (s->delay_in_ms < 256) {
+			*op |= PACKET_PROGRAM_OP_TIME_8;
+			v2[bytes++] = s->delay_in_ms;
+		} else {
+			*op |= PACKET_PROGRAM_OP_TIME_16;
+			v2[bytes++] = (uint8_t)(s->delay_in_ms & 0x00FF);
+			v2[bytes++] = (uint8_t)((s->delay_in_ms & 0xFF00) >> 8);
+		}
+		time = s->delay_in_ms;
+		++timed;
+		// the plain program it is compared with has a step for each of these, with the loops
+		// written out, though a plain step only jumps to its color rather than fading or sweeping
+		++plain;
+		if (bytes > PACKET_PROGRAM_V2)
+			fatal_error("program in file '%s' exceeds maximum program size of %d bytes\n", filename, PROGRAM_MAX_SIZE);
+	}
+	if (loops)
+		fatal_error("program in file '%s' has a repeat without a loop\n", filename);
+	if (!timed)
+		fatal_error("program in file '%s' has no steps\n", filename);
+
+	// preamble in eeprom + # of steps in program
+	plain_size = sizeof(uint16_t) + sizeof(uint16_t) + (plain * PACKET_PROGRAM_STEP_PACKED_SIZE);
+	if (!directives && p->steps * PACKET_PROGRAM_STEP_PACKED_SIZE <= bytes) {
+		p->length = p->steps;
+		p->units = p->steps;
+		p->image = malloc(p->units * PACKET_PROGRAM_STEP_PACKED_SIZE);
+		for (i = 0; i < p->steps; ++i) {
+			uint8_t *step = &p->image[i * PACKET_PROGRAM_STEP_PACKED_SIZE];
+
+			memcpy(step, p->step[i]->arg, 3);
+			step[3] = (uint8_t)(p->step[i]->delay_in_ms & 0x00FF);
+			step[4] = (uint8_t)((p->step[i]->delay_in_ms & 0xFF00) >> 8);
+		}
+	} else {
+		p->length = PACKET_PROGRAM_V2 | bytes;
+		p->units = (bytes + PACKET_PROGRAM_STEP_PACKED_SIZE - 1) / PACKET_PROGRAM_STEP_PACKED_SIZE;
+		p->image = malloc(p->units * PACKET_PROGRAM_STEP_PACKED_SIZE);
+		memset(p->image, 0, p->units * PACKET_PROGRAM_STEP_PACKED_SIZE);
+		memcpy(p->image, v2, bytes);
+	}
+	free(v2);
+	p->size = sizeof(uint16_t) + sizeof(uint16_t) + (p->units * PACKET_PROGRAM_STEP_PACKED_SIZE);
+
 	if (p->size > PROGRAM_MAX_SIZE)
-		fatal_error("program in file '%s' exceeds maximum program size of %d bytes\n", f->filename, PROGRAM_MAX_SIZE);
+		fatal_error("program in file '%s' exceeds maximum program size of %d bytes\n", filename, PROGRAM_MAX_SIZE);
 
-	printf("program in file '%s' has %d steps and will use %d bytes of eeprom\n", f->filename, p->steps, p->size);
+	if (p->length & PACKET_PROGRAM_V2)
+		printf("program in file '%s' has %d steps and will use %d bytes of eeprom as a v2 program, with its loops written out as %u plain steps it would use %u bytes (%u%% %s)\n", filename, p->steps, p->size, plain, plain_size,
+			(p->size < plain_size ? ((plain_size - p->size) * 100) / plain_size : ((p->size - plain_size) * 100 + plain_size - 1) / plain_size),
+			(p->size < plain_size ? "saved" : "more"));
+	else
+		printf("program in file '%s' has %d steps and will use %d bytes of eeprom\n", filename, p->steps, p->size);
+}
 
-	file_close(f);
+static uint8_t program_time_bytes(uint8_t op) {
+	switch (op & PACKET_PROGRAM_OP_TIME_MASK) {
+		case PACKET_PROGRAM_OP_TIME_16:
+			return 2;
+		case PACKET_PROGRAM_OP_TIME_8:
+			return 1;
+		case PACKET_PROGRAM_OP_TIME_SAME:
+			return 0;
+	}
+
+	return 0xFF;
+}
+
+// bytes of the op at image, 0 if it is not one
+static uint8_t program_op_bytes(uint8_t *image) {
+	uint8_t op = image[0], bytes, i;
+
+	switch (op & PACKET_PROGRAM_OP_MASK) {
+		case PACKET_PROGRAM_OP_HOLD:
+		case PACKET_PROGRAM_OP_FADE:
+			bytes = 1;
+			for (i = 0; i < 3; ++i)
+				if (op & (PACKET_PROGRAM_OP_RED << i))
+					++bytes;
+			break;
+		case PACKET_PROGRAM_OP_HUE:
+			bytes = 5;
+			break;
+		case PACKET_PROGRAM_OP_LOOP:
+			return 4;
+		default:
+			return 0;
+	}
+	if (program_time_bytes(op) == 0xFF)
+		return 0;
+
+	return bytes + program_time_bytes(op);
+}
+
+static void program_add_step(program_t *p, program_step_t *step) {
+	program_step_t *s = malloc(sizeof(program_step_t));
+
+	*s = *step;
+	p->steps++;
+	p->step = realloc(p->step, sizeof(program_step_t *) * p->steps);
+	p->step[p->steps - 1] = s;
+}
+
+// a program as read back from a node, image holds the packed steps length gives, a v2 program
+// is decoded in order, with a repeat at the start of each loop body, outer loops first
+program_t *program_load_from_image(uint16_t length, uint8_t *image) {
+	program_t *p;
+	program_step_t s;
+	uint16_t bytes, at, n, target, *loop, loops = 0;
+	uint8_t color[3] = { 0, 0, 0 }, size, i;
+	uint16_t time = 0;
+
+	p = malloc(sizeof(program_t));
+	memset(p, 0, sizeof(program_t));
+	p->length = length;
+	if (length & PACKET_PROGRAM_V2) {
+		bytes = length & ~PACKET_PROGRAM_V2;
+		p->units = (bytes + PACKET_PROGRAM_STEP_PACKED_SIZE - 1) / PACKET_PROGRAM_STEP_PACKED_SIZE;
+	} else {
+		bytes = length * PACKET_PROGRAM_STEP_PACKED_SIZE;
+		p->units = length;
+	}
+	p->image = malloc(p->units * PACKET_PROGRAM_STEP_PACKED_SIZE);
+	memcpy(p->image, image, p->units * PACKET_PROGRAM_STEP_PACKED_SIZE);
+	p->size = sizeof(uint16_t) + sizeof(uint16_t) + (p->units * PACKET_PROGRAM_STEP_PACKED_SIZE);
+
+	if (!(length & PACKET_PROGRAM_V2)) {
+		for (at = 0; at < bytes; at += PACKET_PROGRAM_STEP_PACKED_SIZE) {
+			memset(&s, 0, sizeof(program_step_t));
+			s.op = PACKET_PROGRAM_OP_HOLD;
+			memcpy(s.arg, &image[at], 3);
+			s.delay_in_ms = ((uint16_t)image[at + 4] << 8) | image[at + 3];
+			program_add_step(p, &s);
+		}
+		return p;
+	}
+
+	// where the loops are
+	loop = malloc(sizeof(uint16_t) * bytes);
+	for (at = 0; at < bytes; at += size) {
+		size = program_op_bytes(&image[at]);
+		if (!size || at + size > bytes) {
+			warning("program is broken at byte %d\n", at);
+			bytes = at;
+			break;
+		}
+		if ((image[at] & PACKET_PROGRAM_OP_MASK) == PACKET_PROGRAM_OP_LOOP)
+			loop[loops++] = at;
+	}
+
+	for (at = 0; at < bytes; at += size) {
+		size = program_op_bytes(&image[at]);
+		// the loops whose body starts here, those that end later are outside of those that end earlier
+		for (n = loops; n > 0; --n) {
+			target = ((uint16_t)image[loop[n - 1] + 3] << 8) | image[loop[n - 1] + 2];
+			if (target != at)
+				continue;
+			memset(&s, 0, sizeof(program_step_t));
+			s.op = PROGRAM_OP_REPEAT;
+			s.arg[0] = image[loop[n - 1] + 1];
+			program_add_step(p, &s);
+		}
+		memset(&s, 0, sizeof(program_step_t));
+		s.op = image[at] & PACKET_PROGRAM_OP_MASK;
+		n = at + 1;
+		switch (s.op) {
+			case PACKET_PROGRAM_OP_LOOP:
+				program_add_step(p, &s);
+				continue;
+			case PACKET_PROGRAM_OP_HOLD:
+			case PACKET_PROGRAM_OP_FADE:
+				for (i = 0; i < 3; ++i)
+					if (image[at] & (PACKET_PROGRAM_OP_RED << i))
+						color[i] = image[n++];
+				memcpy(s.arg, color, 3);
+				break;
+			case PACKET_PROGRAM_OP_HUE:
+				for (i = 0; i < 4; ++i)
+					s.arg[i] = image[n++];
+				break;
+		}
+		if (program_time_bytes(image[at]) == 2)
+			time = ((uint16_t)image[n + 1] << 8) | image[n];
+		else if (program_time_bytes(image[at]) == 1)
+			time = image[n];
+		s.delay_in_ms = time;
+		program_add_step(p, &s);
+	}
+	free(loop);
 
 	return p;
 }
 
+void program_save_to_file(program_t *p, char *filename) {
+	file_t *f;
+	program_step_t *s;
+	int i;
+
+	f = file_open(filename, "w");
+
+	for (i = 0; i < p->steps; ++i) {
+		s = p->step[i];
+		switch (s->op) {
+			case PACKET_PROGRAM_OP_HOLD:
+				fprintf(f->fp, "# step %d\n%d\t%d\t%d\t%d\n", i, s->arg[0], s->arg[1], s->arg[2], s->delay_in_ms);
+				break;
+			case PACKET_PROGRAM_OP_FADE:
+				fprintf(f->fp, "# step %d\nfade\t%d\t%d\t%d\t%d\n", i, s->arg[0], s->arg[1], s->arg[2], s->delay_in_ms);
+				break;
+			case PACKET_PROGRAM_OP_HUE:
+				fprintf(f->fp, "# step %d\nhue\t%d\t%d\t%d\t%d\t%d\n", i, s->arg[0], s->arg[1], s->arg[2], s->arg[3], s->delay_in_ms);
+				break;
+			case PROGRAM_OP_REPEAT:
+				fprintf(f->fp, "repeat\t%d\n", s->arg[0]);
+				break;
+			case PACKET_PROGRAM_OP_LOOP:
+				fprintf(f->fp, "loop\n");
+				break;
+		}
+	}
+
+	file_close(f);
+}
+
 void program_free(program_t *p) {
 	int i;
 
 	for (i = 0; i < p->steps; ++i)
 		free(p->step[i]);
 	free(p->step);
+	free(p->image);
 	free(p);
 }
@@ -25,6 +25,7 @@ const tasks_table_t tasks[] = { \
 	{ "flash", 	&task_flash }, \
 	{ "nRF24",	&task_nRF24 }, \
 	{ "gpio",	&task_gpio }, \
+	{ "bench",	&task_bench }, \
 	{ NULL,		NULL } /* end */
 };
 #else
@@ -43,9 +44,14 @@ const tasks_table_t tasks_program[] = { \
 	{ "stop",	&task_program_stop }, \
 	{ "start",	&task_program_start }, \
 	{ "rgb", 	&task_program_rgb }, \
+	{ "brightness",	&task_program_brightness }, \
+	{ "effect",	&task_program_effect }, \
+	{ "stream",	&task_program_stream }, \
 	{ "reset",	&task_program_reset }, \
 	{ "rainbow",	&task_program_rainbow }, \
 	{ "lightfreq",	&task_program_lightfreq }, \
+	{ "stats",	&task_program_stats }, \
+	{ "range",	&task_program_range }, \
 	{ NULL, 	NULL } /* end */
 };
 
@@ -53,8 +59,15 @@ const tasks_table_t tasks_flash[] = { \
 	{ "hex", 	&task_flash_hex }, \
 	{ "test",	&task_flash_test }, \
 	{ "upload", 	&task_flash_upload }, \
+	{ "resume", 	&task_flash_resume }, \
 	{ "download", 	&task_flash_download }, \
+	{ "verify",	&task_flash_verify }, \
 	{ "eeprom",	&task_flash_eeprom }, \
+	{ "broadcast",	&task_flash_broadcast }, \
+	{ "nodeid",	&task_flash_nodeid }, \
+	{ "bootwindow",	&task_flash_bootwindow }, \
+	{ "ota",	&task_flash_ota }, \
+	{ "schedule",	&task_flash_schedule }, \
 	{ NULL, 	NULL } /* end */
 };
 
@@ -66,6 +79,14 @@ const tasks_table_t tasks_nRF24[] = { \
 };
 
 #ifdef USE_GPIO
+const tasks_table_t tasks_bench[] = { \
+	{ "fec",	&task_bench_fec }, \
+	{ "hex",	&task_bench_hex }, \
+	{ "mcast",	&task_bench_mcast }, \
+	{ "pages",	&task_bench_pages }, \
+	{ NULL,		NULL } /* end */
+};
+
 const tasks_table_t tasks_gpio[] = { \
 	{ "test",	&task_gpio_test }, \
 	{ NULL,		NULL } /* end */
@@ -144,6 +165,7 @@ nrf24_t *task_radio_setup(nrf24_power_level_e power_level, nrf24_data_rate_e dat
 	nrf24_enable_dynamic_payloads(radio);
 	nrf24_set_auto_ack(radio, 1);
 	nrf24_enable_ack_payload(radio);
+	nrf24_enable_dynamic_ack(radio);
 	nrf24_power_up(radio);
 
 	return radio;
@@ -178,6 +200,19 @@ uint8_t task_send_packet(nrf24_t *radio, char *packet_type_name, uint8_t *packet
 	return ok;
 }
 
+// same as task_send_packet but no ack is requested, success only means the packet left the radio
+uint8_t task_send_packet_no_ack(nrf24_t *radio, char *packet_type_name, uint8_t *packet, uint8_t len, uint32_t delay_in_us, uint64_t verbose) {
+	uint8_t ok;
+
+	ok = nrf24_send_no_ack(radio, packet, len);
+	if (verbose)
+		printf("sent %s to 0x%llx without ack%s\n", packet_type_name, verbose, (ok ? "" : " - FAILED!"));
+
+	usleep(delay_in_us);
+
+	return ok;
+}
+
 uint8_t task_read_ack_payload(nrf24_t *radio, uint8_t *packet, uint8_t packet_type, uint8_t packet_len) {
 	// read payload
 	
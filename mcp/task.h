@@ -13,30 +13,67 @@ nrf24_t *task_radio_setup(nrf24_power_level_e power_level, nrf24_data_rate_e dat
 void task_radio_done(nrf24_t *radio);
 // in send_packet, verbose should be the uint64_t address of the recipient if anything should be printed, other this function is stdout silent
 uint8_t task_send_packet(nrf24_t *radio, char *packet_type_name, uint8_t *packet, uint8_t len, uint32_t delay_in_us, uint64_t verbose);
+uint8_t task_send_packet_no_ack(nrf24_t *radio, char *packet_type_name, uint8_t *packet, uint8_t len, uint32_t delay_in_us, uint64_t verbose);
 uint8_t task_read_ack_payload(nrf24_t *radio, uint8_t *buffer, uint8_t packet_type, uint8_t packet_len);
 
 // task_program.c
 #define PROGRAM_SEND_POST_DELAY_US 10000
+// packed steps are paced by the acks, a node busy writing a block to EEPROM stops acking
+#define PROGRAM_BLOCK_RETRY_DELAY_US 20000	// a block of EEPROM writes takes up to 100 ms
+#define PROGRAM_BLOCK_RETRIES 10
+#define PROGRAM_BLOCK_READ_DELAY_US 1000	// for the node to stage the block read
+#define PROGRAM_STREAM_DEFAULT_FPS 50
+#define PROGRAM_STREAM_MAX_FPS 1000	// a no-ack packet takes about half a millisecond on air at 1 Mbps
+#define PROGRAM_STREAM_LINE_SIZE 4096	// enough for a pipe that backed up a few hundred frames
 int task_program(int argc, char *argv[]);
 int task_program_parse(int argc, char *argv[]);
 int task_program_upload(int argc, char *argv[]);
 int task_program_stop(int argc, char *argv[]);
 int task_program_start(int argc, char *argv[]);
 int task_program_rgb(int argc, char *argv[]);
+int task_program_brightness(int argc, char *argv[]);
+int task_program_effect(int argc, char *argv[]);
+int task_program_stream(int argc, char *argv[]);
 int task_program_reset(int argc, char *argv[]);
 int task_program_rainbow(int argc, char *argv[]);
 int task_program_download(int argc, char *argv[]);
 int task_program_lightfreq(int argc, char *argv[]);
+int task_program_stats(int argc, char *argv[]);
+int task_program_range(int argc, char *argv[]);
 void task_program_print_ack_payload(nrf24_t *radio, uint8_t *packet);
 
 // task_flash.c
 #define FLASH_SEND_POST_DELAY_US 10000
+#define FLASH_PAGE_RETRIES 3	// uploads of a page before giving up on it, see the resume task
+#define FLASH_PAGE_NONE 0xFFFF	// never a page address
+#define FLASH_STATE_PROBE_PAGES 4	// page CRCs read to check a cached flash state before trusting it
+#define FLASH_OTA_HELLO_RETRIES 50	// the application resets and the bootloader comes up in the meantime
+#define FLASH_PAGE_PACKET_DELAY_US 1000	// acked page packets, the bootloader double buffers pages and writes in the background
+// no-ack multicast pacing, there are no acks to tell us when the bootloaders have caught up
+#define FLASH_MCAST_PACKET_DELAY_US 1000
+#define FLASH_MCAST_PAGE_DELAY_US 5000	// with the next page buffered only the write of the one before has to keep up
+#define FLASH_FEC_PAGE_DELAY_US 20000	// as above plus rebuilding the lost shards
+#define FLASH_MCAST_BEGIN_REPEAT 3
+#define FLASH_MCAST_REPAIR_ROUNDS 3
+#define FLASH_BLOCK_READ_DELAY_US 1000	// for the bootloader to stage the first payloads
+#define FLASH_BLOCK_RETRY_DELAY_US 20000	// a block of EEPROM writes takes up to 100 ms
+#define FLASH_BLOCK_RETRIES 10
+#define FLASH_SCHEDULE_RETRIES 10	// per packet, before a scheduled target is given up on
+#define FLASH_SCHEDULE_SPM_US 9000	// page erase and write, 4.5 ms each on the ATmega328
+#define FLASH_SCHEDULE_WINDOW 4	// page buffers of a target the schedule keeps track of
 int task_flash(int argc, char *argv[]);
 int task_flash_hex(int argc, char *argv[]);
 int task_flash_test(int argc, char *argv[]);
 int task_flash_upload(int argc, char *argv[]);
+int task_flash_resume(int argc, char *argv[]);
 int task_flash_download(int argc, char *argv[]);
+int task_flash_verify(int argc, char *argv[]);
 int task_flash_eeprom(int argc, char *argv[]);
+int task_flash_broadcast(int argc, char *argv[]);
+int task_flash_nodeid(int argc, char *argv[]);
+int task_flash_bootwindow(int argc, char *argv[]);
+int task_flash_ota(int argc, char *argv[]);
+int task_flash_schedule(int argc, char *argv[]);
 
 // task_nRF24.c
 int task_nRF24(int argc, char *argv[]);
@@ -44,6 +81,24 @@ int task_nRF24_print(int argc, char *argv[]);
 int task_nRF24_scanner(int argc, char *argv[]);
 int task_nRF24_ping(int argc, char *argv[]);
 
+// task_bench.c
+// nRF24 air time at 1 Mbps: preamble, address, control field, 32 byte payload, crc plus tx settling
+#define BENCH_AIRTIME_PACKET_US 460
+#define BENCH_AIRTIME_ACK_US 200
+#define BENCH_ARD_US 4000	// nrf24_set_retries(radio, 15, 15) in task_radio_setup
+#define BENCH_ARC 15
+// the simulated bootloader, page erase and write take 3.7 to 4.5 ms on the ATmega328
+#define BENCH_SPM_ERASE_US 4500
+#define BENCH_SPM_WRITE_US 4500
+#define BENCH_LOOP_US 10	// a turn of the bootloader main loop
+#define BENCH_RX_FIFO 3	// nRF24 receive fifo depth
+#define BENCH_WATCHDOG_US 8000000	// WDTO_8S in the bootloader
+int task_bench(int argc, char *argv[]);
+int task_bench_fec(int argc, char *argv[]);
+int task_bench_hex(int argc, char *argv[]);
+int task_bench_mcast(int argc, char *argv[]);
+int task_bench_pages(int argc, char *argv[]);
+
 // task_gpio.c
 int task_gpio(int argc, char *argv[]);
 int task_gpio_test(int argc, char *argv[]);
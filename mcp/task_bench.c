@@ -0,0 +1 @@
+../pi/task_bench.c
\ No newline at end of file
@@ -14,7 +14,11 @@
 #include "task.h"
 #include "compatability.h"
 #include "flash.h"
+#include "fec.h"
 #include "hex.h"
+#include "cache.h"
+#include "packet.h"
+#include "xtea.h"
 
 // data structure for holding the various pieces of flash related data
 typedef struct flash_data {
@@ -37,6 +41,10 @@ typedef struct flash_data {
 		uint8_t lock;
 	} fuses;
 	uint16_t eeprom_size;
+	uint8_t node_id;
+	uint8_t caps;
+	uint8_t window;
+	nrf24_data_rate_e rate;
 	hex_t *hex;
 	uint8_t packet[NRF24__MAX_PAYLOAD_SIZE];
 } flash_t;
@@ -49,9 +57,53 @@ const uint64_t flash_pipes[2] = { FLASH_SOURCE, FLASH_TARGET };
 
 // prototypes for local functions
 static uint8_t task_flash_hello_exchange(flash_t *f, uint8_t expected_sig[3]);
+static uint8_t task_flash_negotiate(flash_t *f);
 static void task_flash_print_details(flash_t *f);
-static int task_flash_upload_core(flash_t *f, hex_t *hex);
+static int task_flash_upload_session(int argc, char *argv[], uint8_t resume);
+static int task_flash_upload_core(flash_t *f, hex_t *hex, char *journal_filename, uint8_t resume, uint8_t delta);
+static int task_flash_journal_load(flash_t *f, hex_t *h, char *journal_filename, uint8_t *confirmed, uint16_t pages);
+static uint16_t task_flash_state_plan(flash_t *f, hex_t *h, cache_state_t *state, uint8_t *confirmed, uint16_t pages, FILE *journal);
+static void task_flash_state_store(flash_t *f, hex_t *h, cache_state_t *old);
+static void task_flash_state_forget(flash_t *f);
+static int task_flash_read_page_crc(flash_t *f, uint16_t address, uint16_t *crc);
+static uint8_t task_flash_complete_packet(flash_t *f);
+static uint8_t task_flash_page_packets(flash_t *f);
+static uint8_t task_flash_page_packet(flash_t *f, hex_t *h, uint16_t address, uint8_t n);
+static int task_flash_upload_page(flash_t *f, hex_t *h, uint16_t address, uint8_t no_ack);
+static int task_flash_confirm_page(flash_t *f, hex_t *h, uint16_t address, FILE *journal);
+static int task_flash_upload_page_fec(flash_t *f, hex_t *h, uint16_t address, uint8_t parity);
+static int task_flash_check_image(flash_t *f, hex_t *h);
+static void task_flash_select_target(flash_t *f, uint64_t address);
+static int task_flash_read_page_bitmap(flash_t *f, uint8_t *bitmap, uint8_t bytes);
 static int task_flash_download_core(flash_t *f, uint16_t start_address, uint16_t end_address);
+static uint8_t task_flash_send_retry(flash_t *f, char *packet_type_name, uint8_t len);
+static int task_flash_reserved_write(flash_t *f, uint8_t offset, uint8_t value);
+static int task_flash_ota_enter(uint32_t key[XTEA_KEY_WORDS], uint64_t app_address);
+static int task_flash_ota_update(flash_t *f, hex_t *h, uint8_t expected_sig[3], char *hex_filename);
+static int task_flash_block_read(flash_t *f, hex_t *h, uint16_t start, uint16_t end, uint8_t command);
+
+// a single target of a flash schedule
+typedef struct flash_job {
+	flash_t f;
+	uint8_t node_id;
+	uint8_t expected_sig[3];
+	char filename[256];
+	hex_t *h;
+	uint16_t pages, page, confirmed;
+	uint8_t packets, packet;
+	uint8_t retries;
+	uint8_t state;
+	uint8_t window;
+	struct timeval busy_until, start, end;
+	struct timeval written[FLASH_SCHEDULE_WINDOW];	// when the page in each buffer is written
+} flash_job_t;
+
+#define FLASH_JOB_SENDING	0
+#define FLASH_JOB_DONE		1
+#define FLASH_JOB_FAILED	2
+
+static int task_flash_schedule_load(char *filename, flash_job_t **jobs);
+static void task_flash_schedule_progress(flash_job_t *jobs, int count);
 
 // pointer to radio data structure
 nrf24_t *radio;
@@ -86,26 +138,28 @@ TASK_FLASH_USAGE:
 }
 
 int task_flash_hex(int argc, char *argv[]) {
-	hex_t *h;
+	hex_t *h, *m, *merged;
+	int i;
 
-	if (argc < 4 || argc > 5) {
-		warning("usage: %s %s %s <input hex filename> [<output hex filename>]\n", argv[0], argv[1], argv[2]);
+	if (argc < 4) {
+		warning("usage: %s %s %s <input hex filename> [<output hex filename> [<hex filename to merge> ...]]\n", argv[0], argv[1], argv[2]);
 		return EXIT_FAILURE;
 	}
 
 	h = hex_load_from_file(argv[3]);
 
-	if (argc == 5) {
-#if 0
-		hex_save_to_file(h, argv[4]);
-#else
-		hex_t *hout;
-		hout = hex_from_map(h->mem, h->tag, h->total_bytes, h->min_address);
-		hex_save_to_file(hout, argv[4]);
-		hex_free(hout);
-#endif
+	// later files win where they overlap
+	for (i = 5; i < argc; ++i) {
+		m = hex_load_from_file(argv[i]);
+		merged = hex_merge(h, m);
+		hex_free(h);
+		hex_free(m);
+		h = merged;
 	}
 
+	if (argc >= 5)
+		hex_save_to_file(h, argv[4], HEX_DEFAULT_BYTE_COUNT);
+
 	hex_free(h);
 	
 	return EXIT_SUCCESS;
@@ -158,17 +212,27 @@ int task_flash_test(int argc, char *argv[]) {
 }
 
 int task_flash_upload(int argc, char *argv[]) {
+	return task_flash_upload_session(argc, argv, 0);
+}
+
+// continue an interrupted upload of the same image to the same target from its journal
+int task_flash_resume(int argc, char *argv[]) {
+	return task_flash_upload_session(argc, argv, 1);
+}
+
+static int task_flash_upload_session(int argc, char *argv[], uint8_t resume) {
 	hex_t *h;
 	flash_t f;
 	uint8_t expected_sig[3];
 	uint16_t i;
+	char journal_filename[1024];
 
 	if (argc != 7) {
 		warning("usage: %s %s %s <sig byte 0> <sig byte 1> <sig byte 2> <hex filename>\n", argv[0], argv[1], argv[2]);
 		return EXIT_FAILURE;
 	}
 
-	h = hex_load_from_file(argv[6]);
+	h = cache_image_load(argv[6]);
 
 	memset(&f, 0, sizeof(flash_t));
 
@@ -179,7 +243,7 @@ int task_flash_upload(int argc, char *argv[]) {
 	f.addr.source = flash_pipes[0];
 	f.addr.target = flash_pipes[1];
 
-	printf("%s: updating flash via bootloader at address: %llx\n", argv[0], f.addr.target);
+	printf("%s: %s flash via bootloader at address: %llx\n", argv[0], (resume ? "resuming update of" : "updating"), f.addr.target);
 
 	radio = task_radio_setup(NRF24_PA_MAX, NRF24_1MBPS, FLASH_CHANNEL, f.addr.source, f.addr.target);
 #ifdef PI_DEBUG
@@ -194,37 +258,267 @@ int task_flash_upload(int argc, char *argv[]) {
 
 	task_flash_print_details(&f);
 
-	if (!task_flash_upload_core(&f, h)) {
-		warning("%s: downloading application space failed!\n", argv[0]);
+	if (!task_flash_negotiate(&f)) {
+		warning("%s: lost the bootloader while changing the data rate\n", argv[0]);
+		return EXIT_FAILURE;
 	}
 
-	if (!task_flash_download_core(&f, h->min_address, h->max_address)) {
-		warning("%s: downloading application space failed!\n", argv[0]);
+	// one journal per image and target
+	snprintf(journal_filename, sizeof(journal_filename), "%s.%02x.journal", argv[6], f.node_id);
+	if (resume && access(journal_filename, R_OK) != 0) {
+		warning("%s: no journal '%s' to resume from, use %s %s upload\n", argv[0], journal_filename, argv[0], argv[1]);
+		return EXIT_FAILURE;
 	}
 
-	// compare hex
-	for (i = 0; i < h->total_bytes; ++i) {
-		if (h->mem[i] != f.hex->mem[i]) {
-			warning("%s: verification of uploaded program failed at address %d (found %hhX, expected %hhX)", argv[0], i + h->min_address, f.hex->mem[i], h->mem[i]);
-			return EXIT_FAILURE;
-		}
+	if (!task_flash_upload_core(&f, h, journal_filename, resume, 0)) {
+		warning("%s: uploading application space failed!\n", argv[0]);
+		return EXIT_FAILURE;
 	}
 
-	hex_free(f.hex);
+	// let the bootloader start the application again
+	if (!task_send_packet(radio, "FLASH_EEPROM_PROG", f.packet, task_flash_complete_packet(&f), FLASH_SEND_POST_DELAY_US, f.addr.target))
+		return EXIT_FAILURE;
+	unlink(journal_filename);
 
 	// send application start
 	f.packet[0] = FLASH_DONE;
 	if (!task_send_packet(radio, "FLASH_DONE", f.packet, FLASH_DONE_SIZE, FLASH_SEND_POST_DELAY_US, f.addr.target))
 		return EXIT_FAILURE;
 
+	hex_free(h);
+
 	return EXIT_SUCCESS;
 }
 
-static int task_flash_upload_core(flash_t *f, hex_t *h) {
-	uint16_t i, pages, j, k;
-	uint8_t packets_per_page, packet_mod;
+// upload the image page by page, confirming each page by its CRC and noting it in the journal
+// so that an interrupted upload picks up from the first unconfirmed page with task_flash_resume
+// pages that match the node's last known state in the cache are skipped, and with delta so are the
+// pages whose CRC the node reports as already matching the image
+static int task_flash_upload_core(flash_t *f, hex_t *h, char *journal_filename, uint8_t resume, uint8_t delta) {
+	uint16_t i, pages, address = 0, crc, verify = FLASH_PAGE_NONE, confirmed_pages = 0;
+	uint8_t *confirmed;
+	FILE *journal;
+	cache_state_t state;
 	struct timeval start, end;
 
+	if (!task_flash_check_image(f, h))
+		return 0;
+	pages = h->pages;
+
+	confirmed = (uint8_t *)malloc(pages);
+	memset(confirmed, 0, pages);
+	if (resume) {
+		if (!task_flash_journal_load(f, h, journal_filename, confirmed, pages))
+			return 0;
+		journal = fopen(journal_filename, "a");
+	} else {
+		journal = fopen(journal_filename, "w");
+		if (journal)
+			fprintf(journal, "# flash session journal\nimage %016llx %d %d\ntarget %d %x %x %x %d\n", (unsigned long long)hex_hash(h), h->min_address, h->max_address, f->node_id, f->sig[0], f->sig[1], f->sig[2], f->spm_pagesize);
+	}
+	if (!journal) {
+		warning("unable to write journal '%s'\n", journal_filename);
+		return 0;
+	}
+	state.node_id = f->node_id;
+	memcpy(state.sig, f->sig, 3);
+	state.spm_pagesize = f->spm_pagesize;
+	// a resumed upload has its journal, and the state is not probed to carry over
+	if (!cache_state_load(&state) || resume || !task_flash_state_plan(f, h, &state, confirmed, pages, journal))
+		cache_state_free(&state);
+	for (i = 0; i < pages; ++i) {
+		if (delta && !confirmed[i]) {
+			address = hex_page_address(h, i);
+			if (task_flash_read_page_crc(f, address, &crc) && crc == hex_page_crc(h, address)) {
+				confirmed[i] = 1;
+				fprintf(journal, "page %d\n", address);
+			}
+		}
+		confirmed_pages += confirmed[i];
+	}
+
+	printf("uploading %d pages of %d bytes, %d already confirmed\n", pages - confirmed_pages, f->spm_pagesize, confirmed_pages);
+	if (confirmed_pages < pages)
+		task_flash_state_forget(f);
+	gettimeofday(&start, NULL);
+	// pipelined, the page before is verified once the next one is sent and is being written
+	for (i = 0; i <= pages; ++i) {
+		if (i < pages) {
+			if (confirmed[i])
+				continue;
+			address = hex_page_address(h, i);
+			printf("%5d: ", address);
+			// a failed send shows up as a bad CRC
+			task_flash_upload_page(f, h, address, 0);
+		}
+		if (verify != FLASH_PAGE_NONE && !task_flash_confirm_page(f, h, verify, journal)) {
+			warning("\npage at %d could not be confirmed, continue with the resume task\n", verify);
+			fclose(journal);
+			free(confirmed);
+			cache_state_free(&state);
+			return 0;
+		}
+		printf("\n");
+		verify = (i < pages ? address : FLASH_PAGE_NONE);
+	}
+	gettimeofday(&end, NULL);
+	printf("uploaded %d bytes in %.2f seconds (%.2f bytes / second)\n", h->total_bytes, (((end.tv_sec  - start.tv_sec) * 1000) + ((end.tv_usec - start.tv_usec)/1000.0) + 0.5) / 1000., (float)h->total_bytes / ((((end.tv_sec  - start.tv_sec) * 1000) + ((end.tv_usec - start.tv_usec)/1000.0) + 0.5)/1000.));
+
+	fclose(journal);
+	free(confirmed);
+
+	// every page is confirmed, remember that and keep the page CRCs of the image for next time
+	task_flash_state_store(f, h, &state);
+	cache_state_free(&state);
+	cache_image_store(h);
+
+	return 1;
+}
+
+// pages whose CRC in the node's last known state matches the image are confirmed without asking
+// the node for every one of them, only a few spread over them are probed to see that the state holds
+// returns the number of pages confirmed, 0 for a state that is out of date
+static uint16_t task_flash_state_plan(flash_t *f, hex_t *h, cache_state_t *state, uint8_t *confirmed, uint16_t pages, FILE *journal) {
+	uint16_t *match, matches = 0, probes, i, j, crc;
+	uint32_t address;
+
+	match = (uint16_t *)malloc(pages * sizeof(uint16_t));
+	for (i = 0, j = 0; i < pages; ++i) {
+		address = hex_page_address(h, i);
+		while (j < state->pages && state->address[j] < address)
+			++j;
+		if (j < state->pages && state->address[j] == address && state->crc[j] == hex_page_crc(h, address))
+			match[matches++] = i;
+	}
+	probes = (matches < FLASH_STATE_PROBE_PAGES ? matches : FLASH_STATE_PROBE_PAGES);
+	for (i = 0; i < probes; ++i) {
+		address = hex_page_address(h, match[(i * matches) / probes]);
+		if (!task_flash_read_page_crc(f, address, &crc) || crc != hex_page_crc(h, address)) {
+			warning("cached flash state of node 0x%02x is out of date at page %d\n", f->node_id, address);
+			free(match);
+			return 0;
+		}
+	}
+	for (i = 0; i < matches; ++i) {
+		confirmed[match[i]] = 1;
+		fprintf(journal, "page %d\n", hex_page_address(h, match[i]));
+	}
+	if (matches)
+		printf("%d pages match the cached flash state of node 0x%02x, %d probed\n", matches, f->node_id, probes);
+	free(match);
+
+	return matches;
+}
+
+// record the pages of h as the flash state of the node, on top of the pages of old that h leaves alone
+static void task_flash_state_store(flash_t *f, hex_t *h, cache_state_t *old) {
+	cache_state_t s;
+	uint32_t i, j = 0, address;
+
+	s.node_id = f->node_id;
+	memcpy(s.sig, f->sig, 3);
+	s.spm_pagesize = f->spm_pagesize;
+	s.image = hex_hash(h);
+	s.pages = 0;
+	s.address = (uint32_t *)malloc((h->pages + old->pages) * sizeof(uint32_t));
+	s.crc = (uint16_t *)malloc((h->pages + old->pages) * sizeof(uint16_t));
+	for (i = 0; i < h->pages; ++i) {
+		address = hex_page_address(h, i);
+		for (; j < old->pages && old->address[j] < address; ++j, ++s.pages) {
+			s.address[s.pages] = old->address[j];
+			s.crc[s.pages] = old->crc[j];
+		}
+		if (j < old->pages && old->address[j] == address)
+			++j;
+		s.address[s.pages] = address;
+		s.crc[s.pages++] = hex_page_crc(h, address);
+	}
+	for (; j < old->pages; ++j, ++s.pages) {
+		s.address[s.pages] = old->address[j];
+		s.crc[s.pages] = old->crc[j];
+	}
+	cache_state_store(&s);
+	cache_state_free(&s);
+}
+
+// forget the flash state of the node before anything is written to it, an update that does not get
+// to the end leaves no state behind for the next upload to skip pages by
+static void task_flash_state_forget(flash_t *f) {
+	cache_state_t s;
+
+	memset(&s, 0, sizeof(cache_state_t));
+	s.node_id = f->node_id;
+	memcpy(s.sig, f->sig, 3);
+	s.spm_pagesize = f->spm_pagesize;
+	cache_state_store(&s);
+}
+
+// mark the pages confirmed in the journal, refusing a journal for another image or target
+static int task_flash_journal_load(flash_t *f, hex_t *h, char *journal_filename, uint8_t *confirmed, uint16_t pages) {
+	file_t *journal;
+	char line[1024];
+	unsigned long long hash;
+	unsigned int min_address, max_address, node_id, sig[3], spm_pagesize, address;
+	uint32_t page;
+	uint8_t image = 0, target = 0;
+
+	journal = file_open(journal_filename, "r");
+	while (fgets(line, 1024, journal->fp) != NULL) {
+		if (sscanf(line, "image %llx %u %u", &hash, &min_address, &max_address) == 3) {
+			image = (hash == hex_hash(h) && min_address == h->min_address && max_address == h->max_address);
+		} else if (sscanf(line, "target %u %x %x %x %u", &node_id, &sig[0], &sig[1], &sig[2], &spm_pagesize) == 5) {
+			target = (node_id == f->node_id && sig[0] == f->sig[0] && sig[1] == f->sig[1] && sig[2] == f->sig[2] && spm_pagesize == f->spm_pagesize);
+		} else if (sscanf(line, "page %u", &address) == 1) {
+			if (hex_page_index(h, address, &page) && page < pages)
+				confirmed[page] = 1;
+		}
+	}
+	file_close(journal);
+
+	if (!image)
+		warning("journal '%s' is for a different image\n", journal_filename);
+	else if (!target)
+		warning("journal '%s' is for a different target\n", journal_filename);
+
+	return image && target;
+}
+
+static int task_flash_read_page_crc(flash_t *f, uint16_t address, uint16_t *crc) {
+	f->packet[0] = FLASH_PAGE_CRC;
+	f->packet[1] = (uint8_t)(address & 0x00FF);
+	f->packet[2] = (uint8_t)((address & 0xFF00) >> 8);
+	if (!task_send_packet(radio, "FLASH_PAGE_CRC", f->packet, FLASH_PAGE_CRC_SIZE, FLASH_SEND_POST_DELAY_US, 0))
+		return 0;
+	f->packet[0] = FLASH_PAGE_CRC_FLUSH;
+	if (!task_send_packet(radio, "FLASH_PAGE_CRC_FLUSH", f->packet, FLASH_PAGE_CRC_FLUSH_SIZE, FLASH_SEND_POST_DELAY_US, 0))
+		return 0;
+	if (!task_read_ack_payload(radio, f->packet, FLASH_PAGE_CRC_PAYLOAD, FLASH_PAGE_CRC_PAYLOAD_SIZE))
+		return 0;
+	if ((((uint16_t)f->packet[2] << 8) | f->packet[1]) != address) {
+		warning("page crc address mismatch, got=%d - expected=%d\n", ((uint16_t)f->packet[2] << 8) | f->packet[1], address);
+		return 0;
+	}
+	*crc = ((uint16_t)f->packet[4] << 8) | f->packet[3];
+
+	return 1;
+}
+
+// build the FLASH_EEPROM_PROG that marks the application as complete, returns the length
+static uint8_t task_flash_complete_packet(flash_t *f) {
+	uint16_t address;
+
+	address = f->eeprom_size - FLASH_EEPROM_APP_MARKER_OFFSET;
+	f->packet[0] = FLASH_EEPROM_PROG;
+	f->packet[1] = (uint8_t)(address & 0x00FF);
+	f->packet[2] = (uint8_t)((address & 0xFF00) >> 8);
+	f->packet[3] = FLASH_APP_COMPLETE;
+
+	return FLASH_EEPROM_PROG_SIZE;
+}
+
+// also pages the image the way the target does, which the page functions rely on
+static int task_flash_check_image(flash_t *f, hex_t *h) {
+	hex_set_page_size(h, f->spm_pagesize);
 	if (h->total_bytes > f->available_flash) {
 		warning("required upload size (%d) exceeds available flash (%d)\n", h->total_bytes, f->available_flash);
 		return 0;
@@ -237,70 +531,127 @@ static int task_flash_upload_core(flash_t *f, hex_t *h) {
 		warning("end address (%d) exceeds available flash (%d)\n", h->max_address, f->available_flash);
 		return 0;
 	}
-	pages = h->total_bytes / f->spm_pagesize;
-	if (h->total_bytes % f->spm_pagesize > 0)
-		pages++;
-	packets_per_page = f->spm_pagesize / (NRF24__MAX_PAYLOAD_SIZE - FLASH_PAGE_PROG_PAYLOAD_MIN_SIZE);
-	packet_mod = f->spm_pagesize % (NRF24__MAX_PAYLOAD_SIZE - FLASH_PAGE_PROG_PAYLOAD_MIN_SIZE);
-	if (packet_mod > 0)
-		packets_per_page++;
-	printf("uploading %d pages of %d bytes in %d packets for each page\n", pages, f->spm_pagesize, packets_per_page);
-	gettimeofday(&start, NULL);
-	for (i = 0; i < pages; ++i) {
-		uint16_t address = (i * f->spm_pagesize) + h->min_address;
-		uint8_t length, data_len;
-		//printf("downloading page %3d\n", i + 1);
-		printf("o");
+	return 1;
+}
+
+// number of packets to send a page, a FLASH_PAGE_PROG followed by the payload packets
+static uint8_t task_flash_page_packets(flash_t *f) {
+	uint8_t packets;
+
+	packets = f->spm_pagesize / (NRF24__MAX_PAYLOAD_SIZE - FLASH_PAGE_PROG_PAYLOAD_MIN_SIZE);
+	if (f->spm_pagesize % (NRF24__MAX_PAYLOAD_SIZE - FLASH_PAGE_PROG_PAYLOAD_MIN_SIZE) > 0)
+		packets++;
+
+	return packets + 1;
+}
+
+// build packet n of the page starting at address in f->packet, packet 0 is the FLASH_PAGE_PROG
+// and the rest are the payloads, returns the length of the packet
+static uint8_t task_flash_page_packet(flash_t *f, hex_t *h, uint16_t address, uint8_t n) {
+	uint8_t data_len;
+
+	if (n == 0) {
 		f->packet[0] = FLASH_PAGE_PROG;
 		f->packet[1] = (uint8_t)(address & 0x00FF);
 		f->packet[2] = (uint8_t)((address & 0xFF00) >> 8);
-		//if (!task_send_packet(radio, "FLASH_PAGE_PROG", f->packet, FLASH_PAGE_PROG_SIZE, FLASH_SEND_POST_DELAY_US, f->addr.target))
-		if (!task_send_packet(radio, "FLASH_PAGE_PROG", f->packet, FLASH_PAGE_PROG_SIZE, FLASH_SEND_POST_DELAY_US, 0))
+		return FLASH_PAGE_PROG_SIZE;
+	}
+
+	f->packet[0] = FLASH_PAGE_PROG_PAYLOAD;
+	f->packet[1] = n - 1;
+	data_len = NRF24__MAX_PAYLOAD_SIZE - FLASH_PAGE_PROG_PAYLOAD_MIN_SIZE;
+	if ((n - 1) * (NRF24__MAX_PAYLOAD_SIZE - FLASH_PAGE_PROG_PAYLOAD_MIN_SIZE) + data_len > f->spm_pagesize)
+		data_len = f->spm_pagesize - (n - 1) * (NRF24__MAX_PAYLOAD_SIZE - FLASH_PAGE_PROG_PAYLOAD_MIN_SIZE);
+	memcpy(&f->packet[FLASH_PAGE_PROG_PAYLOAD_MIN_SIZE], hex_page(h, address, NULL) + ((n - 1) * (NRF24__MAX_PAYLOAD_SIZE - FLASH_PAGE_PROG_PAYLOAD_MIN_SIZE)), data_len);
+
+	return FLASH_PAGE_PROG_PAYLOAD_MIN_SIZE + data_len;
+}
+
+// check an uploaded page by its CRC and note it in the journal, reprogram it on a mismatch
+static int task_flash_confirm_page(flash_t *f, hex_t *h, uint16_t address, FILE *journal) {
+	uint16_t crc;
+	uint8_t tries;
+
+	for (tries = 0; tries < FLASH_PAGE_RETRIES; ++tries) {
+		if (tries) {
+			printf(" x %d: ", address);
+			task_flash_upload_page(f, h, address, 0);
+		}
+		if (task_flash_read_page_crc(f, address, &crc) && crc == hex_page_crc(h, address)) {
+			printf(" %d ok", address);
+			fprintf(journal, "page %d\n", address);
+			fflush(journal);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// send a single page starting at address as a FLASH_PAGE_PROG followed by the payload packets
+// with no_ack the page is sent as a multicast without acks and is paced by fixed delays instead
+static int task_flash_upload_page(flash_t *f, hex_t *h, uint16_t address, uint8_t no_ack) {
+	uint8_t (*send)(nrf24_t *, char *, uint8_t *, uint8_t, uint32_t, uint64_t);
+	uint8_t j, packets, length;
+	uint32_t packet_delay_us;
+
+	send = (no_ack ? &task_send_packet_no_ack : &task_send_packet);
+	// bootloaders without a page window write each page as its last payload arrives
+	packet_delay_us = (no_ack ? FLASH_MCAST_PACKET_DELAY_US : (f->window > 1 ? FLASH_PAGE_PACKET_DELAY_US : FLASH_SEND_POST_DELAY_US));
+	packets = task_flash_page_packets(f);
+
+	//printf("uploading page at %d\n", address);
+	printf("o");
+	for (j = 0; j < packets; ++j) {
+		if (j)
+			printf(".");
+		length = task_flash_page_packet(f, h, address, j);
+		// the last payload queues the page write, give the bootloaders time to keep up
+		if (no_ack && j == packets - 1)
+			packet_delay_us = FLASH_MCAST_PAGE_DELAY_US;
+		if (!send(radio, (j ? "FLASH_PAGE_PROG_PAYLOAD" : "FLASH_PAGE_PROG"), f->packet, length, packet_delay_us, 0))
 			return 0;
-		for (j = 0; j < packets_per_page; ++j) {
-			//printf("\t%d/%d", j + 1, packets_per_page);
+		fflush(stdout);
+	}
+
+	return 1;
+}
+
+// send a page as forward error corrected shards without ack, see FLASH_FEC_SHARD_SIZE in flash.h
+// the page is written once any FLASH_FEC_DATA_SHARDS of the shards arrive, with no parity
+// shards it has to get them all, but each still carries its page number
+static int task_flash_upload_page_fec(flash_t *f, hex_t *h, uint16_t address, uint8_t parity) {
+	uint8_t data[FEC_MAX_DATA_SHARDS * FLASH_FEC_SHARD_SIZE];
+	uint8_t i, k;
+
+	k = FLASH_FEC_DATA_SHARDS(f->spm_pagesize);
+	memset(data, 0, sizeof(data));
+	memcpy(data, hex_page(h, address, NULL), f->spm_pagesize);
+
+	printf("o");
+	f->packet[0] = FLASH_PAGE_FEC_PAYLOAD;
+	f->packet[1] = (uint8_t)(address / f->spm_pagesize);
+	for (i = 0; i < k + parity; ++i) {
+		f->packet[2] = i;
+		if (i < k) {
 			printf(".");
-			f->packet[0] = FLASH_PAGE_PROG_PAYLOAD;
-			f->packet[1] = j;
-			if ((j == packets_per_page - 1) && (packet_mod > 0)) {
-				length = FLASH_PAGE_READ_PAYLOAD_MIN_SIZE + packet_mod;
-			} else {
-				length = NRF24__MAX_PAYLOAD_SIZE;
-			}
-			data_len = length - FLASH_PAGE_READ_PAYLOAD_MIN_SIZE;
-#if 0
-			if (!(address + data_len > h->max_address))
-				memcpy(&f->packet[FLASH_PAGE_PROG_PAYLOAD_MIN_SIZE], &h->mem[address - h->min_address], data_len);
-			else {
-				for (k = address; k <= h->max_address && k - address < data_len; ++k)
-					f->packet[FLASH_PAGE_PROG_PAYLOAD_MIN_SIZE + (k - address)] = h->mem[k - h->min_address];
-				for (; k - address < data_len; ++k)
-					f->packet[FLASH_PAGE_PROG_PAYLOAD_MIN_SIZE + (k - address)] = 0xFF;
-			}
-#else
-			for (k = address; k - address < data_len; ++k) {
-				if (k <= h->max_address) {	
-					f->packet[FLASH_PAGE_PROG_PAYLOAD_MIN_SIZE + (k - address)] = h->mem[k - h->min_address];
-				} else {
-					f->packet[FLASH_PAGE_PROG_PAYLOAD_MIN_SIZE + (k - address)] = 0xFF;
-				}
-			}
-#endif
-			address += data_len;
-			if (!task_send_packet(radio, "FLASH_PAGE_PROG_PAYLOAD", f->packet, length, FLASH_SEND_POST_DELAY_US, 0))
-				return 0;
-			fflush(stdout);
+			memcpy(&f->packet[FLASH_PAGE_FEC_PAYLOAD_MIN_SIZE], &data[i * FLASH_FEC_SHARD_SIZE], FLASH_FEC_SHARD_SIZE);
+		} else {
+			printf("+");
+			fec_encode(data, k, FLASH_FEC_SHARD_SIZE, i - k, &f->packet[FLASH_PAGE_FEC_PAYLOAD_MIN_SIZE]);
 		}
+		// the last shard leaves the bootloaders decoding and writing the page
+		if (!task_send_packet_no_ack(radio, "FLASH_PAGE_FEC_PAYLOAD", f->packet, NRF24__MAX_PAYLOAD_SIZE, (i == k + parity - 1 ? (parity ? FLASH_FEC_PAGE_DELAY_US : FLASH_MCAST_PAGE_DELAY_US) : FLASH_MCAST_PACKET_DELAY_US), 0))
+			return 0;
+		fflush(stdout);
 	}
-	printf("\n");
-	gettimeofday(&end, NULL);
-	printf("uploaded %d bytes in %.2f seconds (%.2f bytes / second)\n", h->total_bytes, (((end.tv_sec  - start.tv_sec) * 1000) + ((end.tv_usec - start.tv_usec)/1000.0) + 0.5) / 1000., (float)h->total_bytes / ((((end.tv_sec  - start.tv_sec) * 1000) + ((end.tv_usec - start.tv_usec)/1000.0) + 0.5)/1000.));
 
 	return 1;
 }
 
 int task_flash_download(int argc, char *argv[]) {
 	flash_t f;
+	cache_state_t state;
 	uint8_t i, expected_sig[3];
 
 	if (argc != 7) {
@@ -332,11 +683,20 @@ int task_flash_download(int argc, char *argv[]) {
 
 	task_flash_print_details(&f);
 
+	if (!task_flash_negotiate(&f)) {
+		warning("%s: lost the bootloader while changing the data rate\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
 	if (!task_flash_download_core(&f, 0, f.available_flash - 1)) {
 		warning("%s: downloading application space failed!\n", argv[0]);
+	} else {
+		// the whole flash is known now
+		memset(&state, 0, sizeof(cache_state_t));
+		task_flash_state_store(&f, f.hex, &state);
 	}
 
-	hex_save_to_file(f.hex, argv[6]);
+	hex_save_to_file(f.hex, argv[6], HEX_DEFAULT_BYTE_COUNT);
 
 	hex_free(f.hex);
 
@@ -348,10 +708,93 @@ int task_flash_download(int argc, char *argv[]) {
 	return EXIT_SUCCESS;
 }
 
+// read back the pages of the image from the bootloader and compare them with it
+// only the segments of the image are read, the rest of the flash is left alone
+int task_flash_verify(int argc, char *argv[]) {
+	hex_t *h, *d;
+	hex_segment_t *s;
+	flash_t f;
+	cache_state_t state;
+	uint8_t expected_sig[3];
+	uint32_t i, differ, *address;
+
+	if (argc != 7) {
+		warning("usage: %s %s %s <sig byte 0> <sig byte 1> <sig byte 2> <hex filename>\n", argv[0], argv[1], argv[2]);
+		return EXIT_FAILURE;
+	}
+
+	h = cache_image_load(argv[6]);
+
+	memset(&f, 0, sizeof(flash_t));
+
+	// setup the data structure from constants and arguments
+	f.hello_retries = 10;
+	for (i = 0; i < 3; ++i)
+		expected_sig[i] = (uint8_t)strtoul(argv[i + 3], NULL, 16);
+	f.addr.source = flash_pipes[0];
+	f.addr.target = flash_pipes[1];
+
+	printf("%s: verifying flash via bootloader at address: %llx\n", argv[0], f.addr.target);
+
+	radio = task_radio_setup(NRF24_PA_MAX, NRF24_1MBPS, FLASH_CHANNEL, f.addr.source, f.addr.target);
+#ifdef PI_DEBUG
+	nrf24_print_details(radio);
+#endif
+
+	if (!task_flash_hello_exchange(&f, expected_sig)) {
+		warning("%s: HELLO exchange failed!\n", argv[0]);
+		task_flash_print_details(&f);
+		return EXIT_FAILURE;
+	}
+
+	task_flash_print_details(&f);
+
+	if (!task_flash_check_image(&f, h))
+		return EXIT_FAILURE;
+
+	if (!task_flash_negotiate(&f)) {
+		warning("%s: lost the bootloader while changing the data rate\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	d = hex_new(f.spm_pagesize);
+	for (i = 0; i < h->segments; ++i) {
+		s = &h->segment[i];
+		if (!task_flash_block_read(&f, d, s->address, s->address + (s->pages * f.spm_pagesize), FLASH_PAGE_STREAM)) {
+			warning("\n%s: while streaming flash, did not receive payload packet\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	printf("\n");
+
+	// what was read is the flash state of the node now, whether it matches or not
+	state.node_id = f.node_id;
+	memcpy(state.sig, f.sig, 3);
+	state.spm_pagesize = f.spm_pagesize;
+	cache_state_load(&state);
+	task_flash_state_store(&f, d, &state);
+	cache_state_free(&state);
+
+	address = (uint32_t *)malloc(h->pages * sizeof(uint32_t));
+	differ = hex_diff(h, d, address, h->pages);
+	for (i = 0; i < differ; ++i)
+		printf("page at %d differs\n", address[i]);
+	printf("%d of %d pages differ\n", differ, h->pages);
+
+	// send application start
+	f.packet[0] = FLASH_DONE;
+	if (!task_send_packet(radio, "FLASH_DONE", f.packet, FLASH_DONE_SIZE, FLASH_SEND_POST_DELAY_US, f.addr.target))
+		return EXIT_FAILURE;
+
+	free(address);
+	hex_free(d);
+	hex_free(h);
+
+	return (differ ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
 static int task_flash_download_core(flash_t *f, uint16_t start_address, uint16_t end_address) {
-	uint8_t *mem, *tag;
-	uint16_t bytes, i, pages, j, k;
-	uint8_t packets_per_page, packet_mod;
+	uint16_t bytes;
 	struct timeval start, end;
 
 	bytes = (end_address - start_address) + 1;
@@ -367,86 +810,32 @@ static int task_flash_download_core(flash_t *f, uint16_t start_address, uint16_t
 		warning("end address (%d) exceeds available flash (%d)\n", end_address, f->available_flash);
 		return 0;
 	}
-	pages = bytes / f->spm_pagesize;
-	if (bytes % f->spm_pagesize > 0)
-		++pages;
-	mem = (uint8_t *)malloc(bytes);
-	tag = (uint8_t *)malloc(bytes);
-	memset(mem, 0xFF, bytes);
-	memset(tag, HEX_TAG_ALLOC, bytes);
-	// initiate download
-	packets_per_page = f->spm_pagesize / (NRF24__MAX_PAYLOAD_SIZE - FLASH_PAGE_READ_PAYLOAD_MIN_SIZE);
-	packet_mod = f->spm_pagesize % (NRF24__MAX_PAYLOAD_SIZE - FLASH_PAGE_READ_PAYLOAD_MIN_SIZE);
-	if (packet_mod > 0)
-		packets_per_page++;
-	printf("downloading %d pages of %d bytes in %d packets for each page\n", pages, f->spm_pagesize, packets_per_page);
+	// stream the whole range, the bootloader keeps the ack fifo full
+	printf("downloading %d bytes in %d byte blocks\n", bytes, (int)FLASH_BLOCK_SIZE);
+	f->hex = hex_new(f->spm_pagesize);
 	gettimeofday(&start, NULL);
-	for (i = 0; i < pages; ++i) {
-		uint16_t address = (i * f->spm_pagesize) + start_address;
-		uint8_t length, data_len;
-		//printf("downloading page %3d\n", i + 1);
-		printf("o");
-		f->packet[0] = FLASH_PAGE_READ;
-		f->packet[1] = (uint8_t)(address & 0x00FF);
-		f->packet[2] = (uint8_t)((address & 0xFF00) >> 8);
-		//if (!task_send_packet(radio, "FLASH_PAGE_READ", f->packet, FLASH_PAGE_READ_SIZE, FLASH_SEND_POST_DELAY_US, f->addr.target))
-		if (!task_send_packet(radio, "FLASH_PAGE_READ", f->packet, FLASH_PAGE_READ_SIZE, FLASH_SEND_POST_DELAY_US, 0))
-			return 0;
-		for (j = 0; j < packets_per_page; ++j) {
-			//printf("\t%d/%d", j + 1, packets_per_page);
-			printf(".");
-			f->packet[0] = FLASH_PAGE_READ_FLUSH;
-			//if (!task_send_packet(radio, "FLASH_PAGE_READ_FLUSH", f->packet, FLASH_PAGE_READ_FLUSH_SIZE, FLASH_SEND_POST_DELAY_US, f->addr.target))
-			if (!task_send_packet(radio, "FLASH_PAGE_READ_FLUSH", f->packet, FLASH_PAGE_READ_FLUSH_SIZE, FLASH_SEND_POST_DELAY_US, 0))
-				return 0;
-			if ((j == packets_per_page - 1) && (packet_mod > 0)) {
-				length = FLASH_PAGE_READ_PAYLOAD_MIN_SIZE + packet_mod;
-			} else {
-				length = NRF24__MAX_PAYLOAD_SIZE;
-			}
-			data_len = length - FLASH_PAGE_READ_PAYLOAD_MIN_SIZE;
-			if (!task_read_ack_payload(radio, f->packet, FLASH_PAGE_READ_PAYLOAD, length)) {
-				warning("while reading page %d, did not received payload packet %d of %d\n", i + 1, j + 1, packets_per_page);
-				return 0;
-			}
-			if (f->packet[1] != j) {
-				warning("while reading page %d, for payload packet %d of %d, the sequence number was incorrect (%d)\n", i + 1, j + 1, packets_per_page, f->packet[1]);
-				return 0;
-			}
-#if 0
-			memcpy(&mem[address], &f->packet[FLASH_PAGE_READ_PAYLOAD_MIN_SIZE], data_len);
-#else
-			for (k = address; k - address < data_len; ++k) {
-				if (k - start_address < bytes)
-					mem[k - start_address] = f->packet[FLASH_PAGE_PROG_PAYLOAD_MIN_SIZE + (k - address)];
-			}
-#endif
-			address += data_len;
-			fflush(stdout);
-		}
+	if (!task_flash_block_read(f, f->hex, start_address, end_address + 1, FLASH_PAGE_STREAM)) {
+		warning("\nwhile streaming flash, did not receive payload packet\n");
+		return 0;
 	}
 	printf("\n");
 	gettimeofday(&end, NULL);
 	printf("downloaded %d bytes in %.2f seconds (%.2f bytes / second)\n", bytes, (((end.tv_sec  - start.tv_sec) * 1000) + ((end.tv_usec - start.tv_usec)/1000.0) + 0.5) / 1000., (float)bytes / ((((end.tv_sec  - start.tv_sec) * 1000) + ((end.tv_usec - start.tv_usec)/1000.0) + 0.5)/1000.));
 
-	f->hex = hex_from_map(mem, tag, bytes, start_address);
-
-	free(mem);
-	free(tag);
-	
 	return 1;
 }
 
 int task_flash_eeprom(int argc, char *argv[]) {
 	flash_t f;
-	uint8_t mode, i, expected_sig[3];
-	uint16_t address;
+	uint8_t mode, i, length, expected_sig[3], *mem, *tag;
+	uint32_t address, page, k, limit;
 	struct timeval start, end;
 	char *hex_filename;
 
-	if (argc != 8) {
+	if (argc != 8 && (argc != 9 || strcmp(argv[8], "reserved") != 0)) {
 TASK_FLASH_EEPROM_USAGE:
-		warning("usage: %s %s %s <command: upload or download> <sig byte 0> <sig byte 1> <sig byte 2> <hex filename>\n", argv[0], argv[1], argv[2]);
+		warning("usage: %s %s %s <command: upload or download> <sig byte 0> <sig byte 1> <sig byte 2> <hex filename> [reserved]\n", argv[0], argv[1], argv[2]);
+		warning("\tan upload leaves the %d bytes at the top reserved for the bootloader alone, unless reserved is given\n", FLASH_EEPROM_RESERVED);
 		return EXIT_FAILURE;
 	}
 
@@ -486,42 +875,48 @@ TASK_FLASH_EEPROM_USAGE:
 	gettimeofday(&start, NULL);
 	if (mode == 0) {
 		f.hex = hex_load_from_file(hex_filename);
-		for (address = f.hex->min_address; address <= f.hex->max_address; ++address) {
-			if (f.hex->tag[address - f.hex->min_address] == HEX_TAG_ALLOC) {
-				f.packet[0] = FLASH_EEPROM_PROG;
+		// the bootloader leaves address checking to the host
+		if (f.hex->total_bytes && f.hex->max_address >= f.eeprom_size) {
+			warning("%s: address %d of '%s' is past the %d bytes of EEPROM\n", argv[0], f.hex->max_address, hex_filename, f.eeprom_size);
+			return EXIT_FAILURE;
+		}
+		// a download of the whole EEPROM holds the node id, application marker, boot window
+		// and nonce epoch of the time it was taken, they are not written back unless asked for
+		limit = (argc == 9 ? f.eeprom_size : f.eeprom_size - FLASH_EEPROM_RESERVED);
+		if (f.hex->total_bytes && f.hex->max_address >= limit)
+			printf("skipping the %d bytes reserved for the bootloader\n", FLASH_EEPROM_RESERVED);
+		for (page = 0; hex_page_next(f.hex, &page); page += f.hex->page_size) {
+			mem = hex_page(f.hex, page, &tag);
+			for (k = 0; k < f.hex->page_size; k += length) {
+				// runs of up to FLASH_BLOCK_SIZE bytes, skipping the holes in the image
+				for (length = 0; length < FLASH_BLOCK_SIZE && k + length < f.hex->page_size; ++length) {
+					if (tag[k + length] != HEX_TAG_ALLOC || page + k + length >= limit)
+						break;
+					f.packet[FLASH_EEPROM_BLOCK_PROG_MIN_SIZE + length] = mem[k + length];
+				}
+				if (length == 0) {
+					length = 1;
+					continue;
+				}
+				address = page + k;
+				f.packet[0] = FLASH_EEPROM_BLOCK_PROG;
 				f.packet[1] = (uint8_t)(address & 0x00FF);
 				f.packet[2] = (uint8_t)((address & 0xFF00) >> 8);
-				f.packet[3] = f.hex->mem[address - f.hex->min_address];
 				printf(".");
 				fflush(stdout);
-				if (!task_send_packet(radio, "FLASH_EEPROM_PROG", f.packet, FLASH_EEPROM_PROG_SIZE, FLASH_SEND_POST_DELAY_US, 0))
+				if (!task_flash_send_retry(&f, "FLASH_EEPROM_BLOCK_PROG", FLASH_EEPROM_BLOCK_PROG_MIN_SIZE + length))
 					return EXIT_FAILURE;
 			}
 		}
 		printf("\n");
 	} else {
-		uint8_t *map, *tag;
-		map = (uint8_t *)malloc(f.eeprom_size);
-		tag = (uint8_t *)malloc(f.eeprom_size);
-		memset(map, 0xFF, f.eeprom_size);
-		memset(tag, HEX_TAG_ALLOC, f.eeprom_size);
-		for (address = 0; address < f.eeprom_size; ++address) {
-			f.packet[0] = FLASH_EEPROM_READ;
-			f.packet[1] = (uint8_t)(address & 0x00FF);
-			f.packet[2] = (uint8_t)((address & 0xFF00) >> 8);
-			printf(".");
-			fflush(stdout);
-			if (!task_send_packet(radio, "FLASH_EEPROM_READ", f.packet, FLASH_EEPROM_READ_SIZE, FLASH_SEND_POST_DELAY_US, 0))
-				return EXIT_FAILURE;
-			if (!task_read_ack_payload(radio, f.packet, FLASH_EEPROM_READ_PAYLOAD, FLASH_EEPROM_READ_PAYLOAD_SIZE)) {
-				warning("%s: while reading EEPROM address %d, did not received payload packet\n", argv[0], address);
-				return 0;
-			}
-			map[address] = f.packet[1];
+		f.hex = hex_new(HEX_PAGE_SIZE);
+		if (!task_flash_block_read(&f, f.hex, 0, f.eeprom_size, FLASH_EEPROM_BLOCK_READ)) {
+			warning("%s: while reading EEPROM, did not receive payload packet\n", argv[0]);
+			return EXIT_FAILURE;
 		}
 		printf("\n");
-		f.hex = hex_from_map(map, tag, f.eeprom_size, 0);
-		hex_save_to_file(f.hex, hex_filename);
+		hex_save_to_file(f.hex, hex_filename, HEX_DEFAULT_BYTE_COUNT);
 	}
 	gettimeofday(&end, NULL);
 	printf("%sloaded %d bytes in %.2f seconds (%.2f bytes / second)\n", (mode == 0 ? "up" : "down"), f.hex->total_bytes, (((end.tv_sec  - start.tv_sec) * 1000) + ((end.tv_usec - start.tv_usec)/1000.0) + 0.5) / 1000., (float)f.hex->total_bytes / ((((end.tv_sec  - start.tv_sec) * 1000) + ((end.tv_usec - start.tv_usec)/1000.0) + 0.5)/1000.));
@@ -531,21 +926,869 @@ TASK_FLASH_EEPROM_USAGE:
 	return EXIT_SUCCESS;
 }
 
-static void task_flash_print_details(flash_t *f) {
-	printf("flash/bootloader details:\n");
-	printf("\t%-20s: 0x%llx\n", "source address", f->addr.source);
-	printf("\t%-20s: 0x%llx\n", "target address", f->addr.target);
-	printf("\t%-20s: %d\n", "hello retries", f->hello_retries);
-	printf("\t%-20s: 0x%x 0x%x 0x%x\n", "signature", f->sig[0], f->sig[1], f->sig[2]);
-	printf("\t%-20s: %d.%d\n", "bootloader version", f->version.major, f->version.minor);
-	printf("\t%-20s: %d bytes\n", "SPM_PAGESIZE", f->spm_pagesize);
-	printf("\t%-20s: %d bytes\n",  "available flash", f->available_flash);
-	printf("\t%-20s:\n", "fuses");
-	printf("\t\t%-12s: 0x%x\n", "low", f->fuses.low);
-	printf("\t\t%-12s: 0x%x\n", "high", f->fuses.high);
-	printf("\t\t%-12s: 0x%x\n", "extended", f->fuses.extended);
-	printf("\t\t%-12s: 0x%x\n", "lock", f->fuses.lock);
-	printf("\t%-20s: %d bytes\n", "EEPROM size", f->eeprom_size);
+// send a packet that is safe to repeat, a bootloader busy writing EEPROM lets its rx fifo fill
+// up, so rather than sleeping after every packet, back off only when one is not acked
+static uint8_t task_flash_send_retry(flash_t *f, char *packet_type_name, uint8_t len) {
+	uint8_t i;
+
+	for (i = 0; i < FLASH_BLOCK_RETRIES; ++i) {
+		if (task_send_packet(radio, packet_type_name, f->packet, len, 0, 0))
+			return 1;
+		usleep(FLASH_BLOCK_RETRY_DELAY_US);
+	}
+	warning("maximum number of retries (%d) reached for %s packet\n", FLASH_BLOCK_RETRIES, packet_type_name);
+
+	return 0;
+}
+
+// read addresses start up to end into the image h, with the command being
+// FLASH_EEPROM_BLOCK_READ or FLASH_PAGE_STREAM; each flush returns a payload the bootloader
+// staged earlier, a lost or out of order payload restarts the read where it left off
+static int task_flash_block_read(flash_t *f, hex_t *h, uint16_t start, uint16_t end, uint8_t command) {
+	uint16_t address = start, resume, retries = 0;
+	uint8_t length, flush, payload;
+	char *command_name, *flush_name;
+
+	if (command == FLASH_PAGE_STREAM) {
+		command_name = "FLASH_PAGE_STREAM";
+		flush = FLASH_PAGE_STREAM_FLUSH;
+		flush_name = "FLASH_PAGE_STREAM_FLUSH";
+		payload = FLASH_PAGE_STREAM_PAYLOAD;
+	} else {
+		command_name = "FLASH_EEPROM_BLOCK_READ";
+		flush = FLASH_EEPROM_BLOCK_READ_FLUSH;
+		flush_name = "FLASH_EEPROM_BLOCK_READ_FLUSH";
+		payload = FLASH_EEPROM_BLOCK_READ_PAYLOAD;
+	}
+
+	while (address < end) {
+		resume = address;
+		f->packet[0] = command;
+		f->packet[1] = (uint8_t)(address & 0x00FF);
+		f->packet[2] = (uint8_t)((address & 0xFF00) >> 8);
+		f->packet[3] = (uint8_t)((end - address) & 0x00FF);
+		f->packet[4] = (uint8_t)(((end - address) & 0xFF00) >> 8);
+		if (task_send_packet(radio, command_name, f->packet, FLASH_EEPROM_BLOCK_READ_SIZE, FLASH_BLOCK_READ_DELAY_US, 0)) {
+			while (address < end) {
+				length = (end - address > FLASH_BLOCK_SIZE ? FLASH_BLOCK_SIZE : end - address);
+				f->packet[0] = flush;
+				if (!task_send_packet(radio, flush_name, f->packet, FLASH_EEPROM_BLOCK_READ_FLUSH_SIZE, 0, 0))
+					break;
+				if (!task_read_ack_payload(radio, f->packet, payload, FLASH_EEPROM_BLOCK_READ_PAYLOAD_MIN_SIZE + length))
+					break;
+				if ((((uint16_t)f->packet[2] << 8) | f->packet[1]) != address) {
+					warning("block address mismatch, got=%d - expected=%d\n", ((uint16_t)f->packet[2] << 8) | f->packet[1], address);
+					break;
+				}
+				hex_write(h, address, &f->packet[FLASH_EEPROM_BLOCK_READ_PAYLOAD_MIN_SIZE], length);
+				address += length;
+				printf(".");
+				fflush(stdout);
+			}
+		}
+		// only reads that make no progress at all count against the retries
+		if (address != resume)
+			retries = 0;
+		if (address < end) {
+			if (++retries > FLASH_BLOCK_RETRIES)
+				return 0;
+			usleep(FLASH_BLOCK_RETRY_DELAY_US);
+		}
+	}
+
+	return 1;
+}
+
+// update a fleet of bootloaders sharing a device signature at once
+// every page is multicast once without acks, then each node is asked which pages it missed
+// and only those are sent again to the node's own address
+// note: every bootloader of this signature that is listening takes the multicast pages, named or not
+int task_flash_broadcast(int argc, char *argv[]) {
+	hex_t *h;
+	flash_t f;
+	uint8_t expected_sig[3], *node_id, *bitmap, nodes, n, round, bitmap_bytes, parity, shards;
+	uint16_t i, pages, page, missing, *repairs;
+	struct timeval start, mid, end;
+
+	if (argc < 9) {
+		warning("usage: %s %s %s <sig byte 0> <sig byte 1> <sig byte 2> <hex filename> <fec parity shards> <node id> [<node id> ...]\n", argv[0], argv[1], argv[2]);
+		warning("\tfec parity shards: 0 sends the pages alone, 1 to %d sends that many parity shards per page\n", FLASH_FEC_MAX_PARITY);
+		return EXIT_FAILURE;
+	}
+
+	parity = (uint8_t)strtoul(argv[7], NULL, 0);
+	if (parity > FLASH_FEC_MAX_PARITY) {
+		warning("%s: at most %d parity shards per page\n", argv[0], FLASH_FEC_MAX_PARITY);
+		return EXIT_FAILURE;
+	}
+
+	nodes = argc - 8;
+	node_id = (uint8_t *)malloc(nodes * sizeof(uint8_t));
+	repairs = (uint16_t *)malloc(nodes * sizeof(uint16_t));
+	memset(repairs, 0, nodes * sizeof(uint16_t));
+	for (n = 0; n < nodes; ++n) {
+		node_id[n] = (uint8_t)strtoul(argv[n + 8], NULL, 0);
+		if (!FLASH_NODE_ID_VALID(node_id[n])) {
+			warning("%s: node id '%s' is not valid, use 0x%x to 0x%x\n", argv[0], argv[n + 8], (uint8_t)FLASH_SOURCE + 1, FLASH_NODE_ID_NONE - 1);
+			return EXIT_FAILURE;
+		}
+	}
+
+	h = cache_image_load(argv[6]);
+
+	memset(&f, 0, sizeof(flash_t));
+
+	// setup the data structure from constants and arguments
+	f.hello_retries = 10;
+	for (i = 0; i < 3; ++i)
+		expected_sig[i] = (uint8_t)strtoul(argv[i + 3], NULL, 16);
+	f.addr.source = FLASH_NODE_ADDRESS(node_id[0]);
+	f.addr.target = flash_pipes[1];
+
+	printf("%s: updating flash of %d nodes via multicast at address: %llx\n", argv[0], nodes, FLASH_MULTICAST);
+
+	radio = task_radio_setup(NRF24_PA_MAX, NRF24_1MBPS, FLASH_CHANNEL, f.addr.source, f.addr.target);
+#ifdef PI_DEBUG
+	nrf24_print_details(radio);
+#endif
+
+	gettimeofday(&start, NULL);
+
+	// every node has to be sitting in its bootloader before the multicast
+	for (n = 0; n < nodes; ++n) {
+		task_flash_select_target(&f, FLASH_NODE_ADDRESS(node_id[n]));
+		if (!task_flash_hello_exchange(&f, expected_sig)) {
+			warning("%s: HELLO exchange with node 0x%x failed!\n", argv[0], node_id[n]);
+			task_flash_print_details(&f);
+			return EXIT_FAILURE;
+		}
+		// the pages are not confirmed by their CRC, the next upload has to ask the node again
+		task_flash_state_forget(&f);
+	}
+
+	task_flash_print_details(&f);
+
+	if (!task_flash_check_image(&f, h))
+		return EXIT_FAILURE;
+
+	// pages go out as shards, parity or not, where they fit, as a shard names its page while a
+	// FLASH_PAGE_PROG_PAYLOAD only has its place in the page, so that losing a FLASH_PAGE_PROG
+	// could hand the payloads of a page to the one before
+	shards = (FLASH_FEC_DATA_SHARDS(f.spm_pagesize) + parity <= FEC_MAX_DATA_SHARDS && f.available_flash / f.spm_pagesize <= 255);
+	if (parity && !shards) {
+		warning("%s: a %d byte page does not fit forward error correction with %d parity shards\n", argv[0], f.spm_pagesize, parity);
+		return EXIT_FAILURE;
+	}
+
+	pages = h->pages;
+	bitmap_bytes = ((f.available_flash / f.spm_pagesize) + 7) / 8;
+	bitmap = (uint8_t *)malloc(bitmap_bytes);
+
+	// multicast pass
+	task_flash_select_target(&f, FLASH_MULTICAST);
+	f.packet[0] = FLASH_MCAST_BEGIN;
+	f.packet[1] = expected_sig[0];
+	f.packet[2] = expected_sig[1];
+	f.packet[3] = expected_sig[2];
+	for (i = 0; i < FLASH_MCAST_BEGIN_REPEAT; ++i)
+		task_send_packet_no_ack(radio, "FLASH_MCAST_BEGIN", f.packet, FLASH_MCAST_BEGIN_SIZE, FLASH_MCAST_PACKET_DELAY_US, f.addr.source);
+	printf("multicasting %d pages of %d bytes with %d parity shards\n", pages, f.spm_pagesize, parity);
+	for (i = 0; i < pages; ++i) {
+		if (shards) {
+			if (!task_flash_upload_page_fec(&f, h, hex_page_address(h, i), parity)) {
+				warning("%s: multicast of page %d failed to leave the radio\n", argv[0], i);
+				return EXIT_FAILURE;
+			}
+		} else if (!task_flash_upload_page(&f, h, hex_page_address(h, i), 1)) {
+			warning("%s: multicast of page %d failed to leave the radio\n", argv[0], i);
+			return EXIT_FAILURE;
+		}
+	}
+	printf("\n");
+	gettimeofday(&mid, NULL);
+
+	// repair pass, node by node
+	for (n = 0; n < nodes; ++n) {
+		task_flash_select_target(&f, FLASH_NODE_ADDRESS(node_id[n]));
+		for (round = 0; round <= FLASH_MCAST_REPAIR_ROUNDS; ++round) {
+			if (!task_flash_read_page_bitmap(&f, bitmap, bitmap_bytes)) {
+				warning("%s: unable to read the page map of node 0x%x\n", argv[0], node_id[n]);
+				return EXIT_FAILURE;
+			}
+			missing = 0;
+			for (i = 0; i < pages; ++i) {
+				page = hex_page_address(h, i) / f.spm_pagesize;
+				if (bitmap[page >> 3] & (1 << (page & 0x07)))
+					continue;
+				if (round == FLASH_MCAST_REPAIR_ROUNDS) {
+					++missing;
+					continue;
+				}
+				if (!task_flash_upload_page(&f, h, hex_page_address(h, i), 0)) {
+					warning("%s: repair of page %d on node 0x%x failed\n", argv[0], i, node_id[n]);
+					return EXIT_FAILURE;
+				}
+				++missing;
+				++repairs[n];
+			}
+			if (!missing)
+				break;
+			printf("\n");
+		}
+		if (missing) {
+			warning("%s: node 0x%x is still missing %d pages after %d repair rounds\n", argv[0], node_id[n], missing, FLASH_MCAST_REPAIR_ROUNDS);
+			return EXIT_FAILURE;
+		}
+		// let the bootloader start the application again
+		if (!task_send_packet(radio, "FLASH_EEPROM_PROG", f.packet, task_flash_complete_packet(&f), FLASH_SEND_POST_DELAY_US, f.addr.source))
+			return EXIT_FAILURE;
+		// send application start
+		f.packet[0] = FLASH_DONE;
+		if (!task_send_packet(radio, "FLASH_DONE", f.packet, FLASH_DONE_SIZE, FLASH_SEND_POST_DELAY_US, f.addr.source))
+			return EXIT_FAILURE;
+	}
+	gettimeofday(&end, NULL);
+
+	printf("multicast of %d pages took %.2f seconds\n", pages, (((mid.tv_sec  - start.tv_sec) * 1000) + ((mid.tv_usec - start.tv_usec)/1000.0) + 0.5) / 1000.);
+	for (n = 0; n < nodes; ++n)
+		printf("\tnode 0x%02x: %d pages repaired\n", node_id[n], repairs[n]);
+	printf("updated %d nodes in %.2f seconds\n", nodes, (((end.tv_sec  - start.tv_sec) * 1000) + ((end.tv_usec - start.tv_usec)/1000.0) + 0.5) / 1000.);
+
+	free(bitmap);
+	free(repairs);
+	free(node_id);
+	hex_free(h);
+
+	return EXIT_SUCCESS;
+}
+
+// store the node id in the reserved EEPROM of the only bootloader listening on FLASH_SOURCE
+// without one the bootloader uses the id hashed from its serial number, as reported by HELLO
+int task_flash_nodeid(int argc, char *argv[]) {
+	flash_t f;
+	uint8_t i, expected_sig[3], node_id;
+
+	if (argc != 7) {
+		warning("usage: %s %s %s <sig byte 0> <sig byte 1> <sig byte 2> <node id>\n", argv[0], argv[1], argv[2]);
+		return EXIT_FAILURE;
+	}
+
+	node_id = (uint8_t)strtoul(argv[6], NULL, 0);
+	if (!FLASH_NODE_ID_VALID(node_id)) {
+		warning("%s: node id '%s' is not valid, use 0x%x to 0x%x\n", argv[0], argv[6], (uint8_t)FLASH_SOURCE + 1, FLASH_NODE_ID_NONE - 1);
+		return EXIT_FAILURE;
+	}
+
+	memset(&f, 0, sizeof(flash_t));
+
+	// setup the data structure from constants and arguments
+	f.hello_retries = 10;
+	for (i = 0; i < 3; ++i)
+		expected_sig[i] = (uint8_t)strtoul(argv[i + 3], NULL, 16);
+	f.addr.source = flash_pipes[0];
+	f.addr.target = flash_pipes[1];
+
+	printf("%s: setting node id 0x%x via bootloader at address: %llx\n", argv[0], node_id, f.addr.source);
+
+	radio = task_radio_setup(NRF24_PA_MAX, NRF24_1MBPS, FLASH_CHANNEL, f.addr.source, f.addr.target);
+#ifdef PI_DEBUG
+	nrf24_print_details(radio);
+#endif
+
+	if (!task_flash_hello_exchange(&f, expected_sig)) {
+		warning("%s: HELLO exchange failed!\n", argv[0]);
+		task_flash_print_details(&f);
+		return EXIT_FAILURE;
+	}
+
+	if (!task_flash_reserved_write(&f, FLASH_EEPROM_NODE_ID_OFFSET, node_id)) {
+		warning("%s: node id read back does not match\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	printf("node id 0x%x stored, the bootloader will listen on 0x%llx after its next reset\n", node_id, FLASH_NODE_ADDRESS(node_id));
+
+	return EXIT_SUCCESS;
+}
+
+// set how long the bootloader listens for a host after a reset before it starts the application
+int task_flash_bootwindow(int argc, char *argv[]) {
+	flash_t f;
+	uint8_t i, expected_sig[3], window;
+	unsigned long ms;
+
+	if (argc != 7) {
+		warning("usage: %s %s %s <sig byte 0> <sig byte 1> <sig byte 2> <window ms, 0 waits for the watchdog>\n", argv[0], argv[1], argv[2]);
+		return EXIT_FAILURE;
+	}
+
+	ms = strtoul(argv[6], NULL, 0);
+	window = (uint8_t)((ms + FLASH_BOOT_WINDOW_UNIT_MS - 1) / FLASH_BOOT_WINDOW_UNIT_MS);
+	if (window >= FLASH_BOOT_WINDOW_ERASED || (ms && !window)) {
+		warning("%s: window '%s' is not valid, use 0 to %d ms\n", argv[0], argv[6], (FLASH_BOOT_WINDOW_ERASED - 1) * FLASH_BOOT_WINDOW_UNIT_MS);
+		return EXIT_FAILURE;
+	}
+
+	memset(&f, 0, sizeof(flash_t));
+
+	// setup the data structure from constants and arguments
+	f.hello_retries = 10;
+	for (i = 0; i < 3; ++i)
+		expected_sig[i] = (uint8_t)strtoul(argv[i + 3], NULL, 16);
+	f.addr.source = flash_pipes[0];
+	f.addr.target = flash_pipes[1];
+
+	printf("%s: setting the boot window to %d ms via bootloader at address: %llx\n", argv[0], window * FLASH_BOOT_WINDOW_UNIT_MS, f.addr.source);
+
+	radio = task_radio_setup(NRF24_PA_MAX, NRF24_1MBPS, FLASH_CHANNEL, f.addr.source, f.addr.target);
+#ifdef PI_DEBUG
+	nrf24_print_details(radio);
+#endif
+
+	if (!task_flash_hello_exchange(&f, expected_sig)) {
+		warning("%s: HELLO exchange failed!\n", argv[0]);
+		task_flash_print_details(&f);
+		return EXIT_FAILURE;
+	}
+
+	if (!task_flash_reserved_write(&f, FLASH_EEPROM_BOOT_WINDOW_OFFSET, window)) {
+		warning("%s: boot window read back does not match\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (window == FLASH_BOOT_WINDOW_NONE)
+		printf("the bootloader will wait for its watchdog before starting the application\n");
+	else
+		printf("the bootloader will start the application %d ms after a reset unless a host shows up\n", window * FLASH_BOOT_WINDOW_UNIT_MS);
+
+	return EXIT_SUCCESS;
+}
+
+// update running applications over the air, one after the other
+// each application is asked to enter its bootloader with the XTEA tag of a nonce it hands out,
+// the bootloader is then found on the flash channel, the pages that differ are uploaded and
+// verified and the application is started again
+// the downtime runs from the application taking the command to the bootloader taking FLASH_DONE
+int task_flash_ota(int argc, char *argv[]) {
+	hex_t *h;
+	flash_t f;
+	uint32_t key[XTEA_KEY_WORDS];
+	uint8_t i, ok, expected_sig[3];
+	uint64_t app_address;
+	char digits[9];
+	int n, nodes, updated = 0;
+	struct timeval down, up;
+	double seconds, total = 0.;
+
+	if (argc < 8) {
+		warning("usage: %s %s %s <key, %d hex digits> <sig byte 0> <sig byte 1> <sig byte 2> <hex filename> [<application address>...]\n", argv[0], argv[1], argv[2], XTEA_KEY_WORDS * 8);
+		return EXIT_FAILURE;
+	}
+
+	if (strlen(argv[3]) != XTEA_KEY_WORDS * 8 || strspn(argv[3], "0123456789abcdefABCDEF") != XTEA_KEY_WORDS * 8) {
+		warning("%s: key '%s' is not %d hex digits\n", argv[0], argv[3], XTEA_KEY_WORDS * 8);
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < XTEA_KEY_WORDS; ++i) {
+		memcpy(digits, &argv[3][i * 8], 8);
+		digits[8] = '\0';
+		key[i] = (uint32_t)strtoul(digits, NULL, 16);
+	}
+	for (i = 0; i < 3; ++i)
+		expected_sig[i] = (uint8_t)strtoul(argv[i + 4], NULL, 16);
+
+	h = cache_image_load(argv[7]);
+
+	// without addresses, the application address of the led strips
+	nodes = (argc > 8 ? argc - 8 : 1);
+	for (n = 0; n < nodes; ++n) {
+		app_address = (argc > 8 ? strtoull(argv[8 + n], NULL, 16) : PIPE_0_ADDR);
+		printf("%s: updating the application at address: %llx\n", argv[0], app_address);
+
+		if (!task_flash_ota_enter(key, app_address)) {
+			warning("%s: application at %llx did not enter its bootloader\n", argv[0], app_address);
+			continue;
+		}
+		gettimeofday(&down, NULL);
+
+		memset(&f, 0, sizeof(flash_t));
+		f.hello_retries = FLASH_OTA_HELLO_RETRIES;
+		f.addr.source = flash_pipes[0];
+		f.addr.target = flash_pipes[1];
+		radio = task_radio_setup(NRF24_PA_MAX, NRF24_1MBPS, FLASH_CHANNEL, f.addr.source, f.addr.target);
+		ok = task_flash_ota_update(&f, h, expected_sig, argv[7]);
+		gettimeofday(&up, NULL);
+		task_radio_done(radio);
+		radio = NULL;
+
+		seconds = (((up.tv_sec - down.tv_sec) * 1000) + ((up.tv_usec - down.tv_usec)/1000.0) + 0.5) / 1000.;
+		if (!ok) {
+			warning("%s: update of %llx failed after %.2f seconds, its bootloader waits for the resume task\n", argv[0], app_address, seconds);
+			continue;
+		}
+		printf("%llx was down for %.2f seconds\n", app_address, seconds);
+		total += seconds;
+		++updated;
+	}
+	printf("updated %d of %d nodes with %.2f seconds of downtime\n", updated, nodes, total);
+
+	hex_free(h);
+
+	return (updated == nodes ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+// ask the application for a nonce and answer it to send the application into its bootloader
+static int task_flash_ota_enter(uint32_t key[XTEA_KEY_WORDS], uint64_t app_address) {
+	uint8_t packet[NRF24__MAX_PAYLOAD_SIZE], ok = 0;
+
+	radio = task_radio_setup(NRF24_PA_MAX, NRF24_1MBPS, CHANNEL, app_address, PIPE_1_ADDR);
+
+	packet[0] = PACKET_READ_BOOT_NONCE;
+	if (!task_send_packet(radio, "READ_BOOT_NONCE", packet, PACKET_READ_BOOT_NONCE_SIZE, FLASH_SEND_POST_DELAY_US, 0))
+		goto TASK_FLASH_OTA_ENTER_DONE;
+	packet[0] = PACKET_READ_BOOT_NONCE_FLUSH;
+	if (!task_send_packet(radio, "READ_BOOT_NONCE_FLUSH", packet, PACKET_READ_BOOT_NONCE_FLUSH_SIZE, FLASH_SEND_POST_DELAY_US, 0))
+		goto TASK_FLASH_OTA_ENTER_DONE;
+	if (!task_read_ack_payload(radio, packet, PACKET_BOOT_NONCE, PACKET_BOOT_NONCE_SIZE))
+		goto TASK_FLASH_OTA_ENTER_DONE;
+
+	// the tag goes in place of the nonce
+	xtea_tag(key, &packet[1], &packet[1]);
+	packet[0] = PACKET_ENTER_BOOTLOADER;
+	ok = task_send_packet(radio, "ENTER_BOOTLOADER", packet, PACKET_ENTER_BOOTLOADER_SIZE, 0, app_address);
+
+TASK_FLASH_OTA_ENTER_DONE:
+	task_radio_done(radio);
+	radio = NULL;
+
+	return ok;
+}
+
+// bring the bootloader the image, only the pages that differ are written
+static int task_flash_ota_update(flash_t *f, hex_t *h, uint8_t expected_sig[3], char *hex_filename) {
+	char journal_filename[1024];
+
+	if (!task_flash_hello_exchange(f, expected_sig)) {
+		warning("HELLO exchange failed!\n");
+		task_flash_print_details(f);
+		return 0;
+	}
+	if (!task_flash_negotiate(f))
+		return 0;
+
+	// the same journal as an upload, so that the resume task can finish the job
+	snprintf(journal_filename, sizeof(journal_filename), "%s.%02x.journal", hex_filename, f->node_id);
+	if (!task_flash_upload_core(f, h, journal_filename, 0, 1))
+		return 0;
+
+	// let the bootloader start the application again
+	if (!task_send_packet(radio, "FLASH_EEPROM_PROG", f->packet, task_flash_complete_packet(f), FLASH_SEND_POST_DELAY_US, f->addr.target))
+		return 0;
+	unlink(journal_filename);
+
+	f->packet[0] = FLASH_DONE;
+	if (!task_send_packet(radio, "FLASH_DONE", f->packet, FLASH_DONE_SIZE, FLASH_SEND_POST_DELAY_US, f->addr.target))
+		return 0;
+
+	return 1;
+}
+
+// write a byte of the bootloader's reserved EEPROM and read it back
+static int task_flash_reserved_write(flash_t *f, uint8_t offset, uint8_t value) {
+	uint16_t address;
+
+	address = f->eeprom_size - offset;
+	f->packet[0] = FLASH_EEPROM_PROG;
+	f->packet[1] = (uint8_t)(address & 0x00FF);
+	f->packet[2] = (uint8_t)((address & 0xFF00) >> 8);
+	f->packet[3] = value;
+	if (!task_send_packet(radio, "FLASH_EEPROM_PROG", f->packet, FLASH_EEPROM_PROG_SIZE, FLASH_SEND_POST_DELAY_US, f->addr.source))
+		return 0;
+
+	// read it back
+	f->packet[0] = FLASH_EEPROM_READ;
+	if (!task_send_packet(radio, "FLASH_EEPROM_READ", f->packet, FLASH_EEPROM_READ_SIZE, FLASH_SEND_POST_DELAY_US, 0))
+		return 0;
+	f->packet[0] = FLASH_EEPROM_READ_FLUSH;
+	if (!task_send_packet(radio, "FLASH_EEPROM_READ_FLUSH", f->packet, FLASH_EEPROM_READ_FLUSH_SIZE, FLASH_SEND_POST_DELAY_US, 0))
+		return 0;
+	if (!task_read_ack_payload(radio, f->packet, FLASH_EEPROM_READ_PAYLOAD, FLASH_EEPROM_READ_PAYLOAD_SIZE) || f->packet[1] != value)
+		return 0;
+
+	return 1;
+}
+
+// flash several bootloaders in one run, taking the jobs from a manifest of
+// <node id> <sig byte 0> <sig byte 1> <sig byte 2> <hex filename>
+// lines, with # starting a comment
+// packets are interleaved across the targets so that one bootloader erasing or writing a page
+// does not hold up the others; page packets are paced as a single upload paces them and a target
+// is only busy once the page the next one is to go into is still being written, which with a
+// page window of two is the page before the one just sent
+int task_flash_schedule(int argc, char *argv[]) {
+	flash_job_t *jobs, *job;
+	int count, i, n, last, sending;
+	uint8_t length;
+	uint16_t page, crc;
+	uint64_t address, current = 0;
+	uint32_t delay_us;
+	cache_state_t state;
+	struct timeval now, start, end, wait, written;
+	long usecs;
+	float seconds;
+
+	if (argc != 4) {
+		warning("usage: %s %s %s <manifest filename>\n", argv[0], argv[1], argv[2]);
+		warning("\teach line of the manifest is: <node id> <sig byte 0> <sig byte 1> <sig byte 2> <hex filename>\n");
+		return EXIT_FAILURE;
+	}
+
+	count = task_flash_schedule_load(argv[3], &jobs);
+	if (count <= 0)
+		return EXIT_FAILURE;
+
+	printf("%s: scheduling %d flash jobs from %s\n", argv[0], count, argv[3]);
+
+	radio = task_radio_setup(NRF24_PA_MAX, NRF24_1MBPS, FLASH_CHANNEL, FLASH_NODE_ADDRESS(jobs[0].node_id), flash_pipes[1]);
+#ifdef PI_DEBUG
+	nrf24_print_details(radio);
+#endif
+
+	gettimeofday(&start, NULL);
+
+	// greet every target up front, a target that does not answer is left out of the schedule
+	for (i = 0; i < count; ++i) {
+		job = &jobs[i];
+		job->f.hello_retries = 10;
+		job->f.addr.target = flash_pipes[1];
+		task_flash_select_target(&job->f, FLASH_NODE_ADDRESS(job->node_id));
+		current = job->f.addr.source;
+		job->state = FLASH_JOB_FAILED;
+		if (!task_flash_hello_exchange(&job->f, job->expected_sig)) {
+			warning("%s: HELLO exchange with node 0x%x failed, skipping %s\n", argv[0], job->node_id, job->filename);
+			continue;
+		}
+		if (!task_flash_check_image(&job->f, job->h))
+			continue;
+		task_flash_state_forget(&job->f);
+		job->pages = job->h->pages;
+		job->packets = task_flash_page_packets(&job->f);
+		job->state = FLASH_JOB_SENDING;
+		gettimeofday(&job->start, NULL);
+		job->busy_until = job->start;
+		job->window = (job->f.window < 1 ? 1 : (job->f.window > FLASH_SCHEDULE_WINDOW ? FLASH_SCHEDULE_WINDOW : job->f.window));
+		for (n = 0; n < job->window; ++n)
+			job->written[n] = job->start;
+		printf("node 0x%02x: %d pages of %s\n", job->node_id, job->pages, job->filename);
+	}
+
+	last = count - 1;
+	for (;;) {
+		// round robin over the targets that are ready for their next packet
+		gettimeofday(&now, NULL);
+		job = NULL;
+		sending = 0;
+		for (n = 1; n <= count; ++n) {
+			i = (last + n) % count;
+			if (jobs[i].state != FLASH_JOB_SENDING)
+				continue;
+			if (!sending || timercmp(&jobs[i].busy_until, &wait, <))
+				wait = jobs[i].busy_until;
+			++sending;
+			if (!job && !timercmp(&jobs[i].busy_until, &now, >)) {
+				job = &jobs[i];
+				last = i;
+			}
+		}
+		if (!sending)
+			break;
+		// every target is still busy, sleep until the first is free
+		if (!job) {
+			usecs = ((wait.tv_sec - now.tv_sec) * 1000000L) + (wait.tv_usec - now.tv_usec);
+			if (usecs > 0)
+				usleep(usecs);
+			continue;
+		}
+
+		address = FLASH_NODE_ADDRESS(job->node_id);
+		if (address != current) {
+			task_flash_select_target(&job->f, address);
+			current = address;
+		}
+
+		// bootloaders without a page window write each page as its last payload arrives
+		delay_us = FLASH_SEND_POST_DELAY_US;
+		if (job->page < job->pages) {
+			if (job->window > 1)
+				delay_us = FLASH_PAGE_PACKET_DELAY_US;
+			length = task_flash_page_packet(&job->f, job->h, hex_page_address(job->h, job->page), job->packet);
+			if (!task_send_packet(radio, (job->packet ? "FLASH_PAGE_PROG_PAYLOAD" : "FLASH_PAGE_PROG"), job->f.packet, length, 0, 0)) {
+				// out of sequence repeats are dropped by the bootloader, so simply try again
+				delay_us = FLASH_SEND_POST_DELAY_US;
+				if (++job->retries > FLASH_SCHEDULE_RETRIES) {
+					warning("\n%s: node 0x%x stopped answering at page %d\n", argv[0], job->node_id, job->page);
+					job->state = FLASH_JOB_FAILED;
+					gettimeofday(&job->end, NULL);
+				}
+			} else {
+				job->retries = 0;
+				if (++job->packet == job->packets) {
+					// the bootloader writes its pages in turn, the page just sent once its data is
+					// in and the page before it is written
+					gettimeofday(&now, NULL);
+					written = job->written[(job->page + job->window - 1) % job->window];
+					if (timercmp(&written, &now, <))
+						written = now;
+					wait.tv_sec = 0;
+					wait.tv_usec = FLASH_SCHEDULE_SPM_US;
+					timeradd(&written, &wait, &job->written[job->page % job->window]);
+					job->packet = 0;
+					++job->page;
+					task_flash_schedule_progress(jobs, count);
+				}
+			}
+		} else if (job->confirmed < job->pages) {
+			// every page is confirmed by its CRC before the application is marked complete, a
+			// page at a time so the other targets keep going, as upload does it
+			page = hex_page_address(job->h, job->confirmed);
+			if (task_flash_read_page_crc(&job->f, page, &crc) && crc == hex_page_crc(job->h, page)) {
+				job->retries = 0;
+				// the image is all that is known of the node now
+				if (++job->confirmed == job->pages) {
+					memset(&state, 0, sizeof(cache_state_t));
+					task_flash_state_store(&job->f, job->h, &state);
+				}
+			} else if (++job->retries < FLASH_PAGE_RETRIES) {
+				task_flash_upload_page(&job->f, job->h, page, 0);
+			} else {
+				warning("\n%s: page at %d of node 0x%x could not be confirmed\n", argv[0], page, job->node_id);
+				job->state = FLASH_JOB_FAILED;
+				gettimeofday(&job->end, NULL);
+			}
+		} else if (job->packet == 0) {
+			// let the bootloader start the application again
+			if (task_send_packet(radio, "FLASH_EEPROM_PROG", job->f.packet, task_flash_complete_packet(&job->f), 0, 0)) {
+				job->retries = 0;
+				++job->packet;
+			} else if (++job->retries > FLASH_SCHEDULE_RETRIES) {
+				job->state = FLASH_JOB_FAILED;
+				gettimeofday(&job->end, NULL);
+			}
+		} else {
+			// send application start
+			job->f.packet[0] = FLASH_DONE;
+			if (task_send_packet(radio, "FLASH_DONE", job->f.packet, FLASH_DONE_SIZE, 0, 0)) {
+				job->state = FLASH_JOB_DONE;
+				gettimeofday(&job->end, NULL);
+			} else if (++job->retries > FLASH_SCHEDULE_RETRIES) {
+				job->state = FLASH_JOB_FAILED;
+				gettimeofday(&job->end, NULL);
+			}
+		}
+
+		gettimeofday(&now, NULL);
+		wait.tv_sec = 0;
+		wait.tv_usec = delay_us;
+		timeradd(&now, &wait, &job->busy_until);
+		// the next page goes into the buffer of the page a window before it
+		if (job->packet == 0 && job->page < job->pages && timercmp(&job->busy_until, &job->written[job->page % job->window], <))
+			job->busy_until = job->written[job->page % job->window];
+	}
+	gettimeofday(&end, NULL);
+
+	printf("\n");
+	n = 0;
+	for (i = 0; i < count; ++i) {
+		job = &jobs[i];
+		if (job->state == FLASH_JOB_DONE) {
+			seconds = (((job->end.tv_sec - job->start.tv_sec) * 1000) + ((job->end.tv_usec - job->start.tv_usec)/1000.0) + 0.5) / 1000.;
+			printf("node 0x%02x: uploaded %d bytes in %.2f seconds (%.2f bytes / second) from %s\n", job->node_id, job->h->total_bytes, seconds, (float)job->h->total_bytes / seconds, job->filename);
+			n += job->h->total_bytes;
+		} else {
+			printf("node 0x%02x: FAILED at page %d of %d from %s\n", job->node_id, job->page, job->pages, job->filename);
+		}
+	}
+	seconds = (((end.tv_sec - start.tv_sec) * 1000) + ((end.tv_usec - start.tv_usec)/1000.0) + 0.5) / 1000.;
+	printf("uploaded %d bytes to %d nodes in %.2f seconds (%.2f bytes / second)\n", n, count, seconds, (float)n / seconds);
+
+	sending = 0;
+	for (i = 0; i < count; ++i) {
+		if (jobs[i].state != FLASH_JOB_DONE)
+			sending = 1;
+		hex_free(jobs[i].h);
+	}
+	free(jobs);
+
+	return (sending ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+static int task_flash_schedule_load(char *filename, flash_job_t **jobs) {
+	file_t *f;
+	char line[1024], *comment;
+	int count = 0, lineno = 0, fields;
+	unsigned int node_id;
+	flash_job_t *job;
+
+	*jobs = NULL;
+	f = file_open(filename, "r");
+	while (fgets(line, 1024, f->fp) != NULL) {
+		++lineno;
+		if ((comment = strchr(line, '#')) != NULL)
+			*comment = '\0';
+		if (strspn(line, " \t\r\n") == strlen(line))
+			continue;
+		*jobs = (flash_job_t *)realloc(*jobs, (count + 1) * sizeof(flash_job_t));
+		job = &(*jobs)[count];
+		memset(job, 0, sizeof(flash_job_t));
+		fields = sscanf(line, "%i %hhx %hhx %hhx %255s", &node_id, &job->expected_sig[0], &job->expected_sig[1], &job->expected_sig[2], job->filename);
+		if (fields != 5) {
+			warning("%s:%d: expected <node id> <sig byte 0> <sig byte 1> <sig byte 2> <hex filename>\n", filename, lineno);
+			count = -1;
+			break;
+		}
+		job->node_id = (uint8_t)node_id;
+		if (node_id > 0xFF || !FLASH_NODE_ID_VALID(job->node_id)) {
+			warning("%s:%d: node id 0x%x is not valid\n", filename, lineno, node_id);
+			count = -1;
+			break;
+		}
+		job->h = cache_image_load(job->filename);
+		++count;
+	}
+	file_close(f);
+
+	if (count == 0)
+		warning("%s: no jobs found\n", filename);
+
+	return count;
+}
+
+static void task_flash_schedule_progress(flash_job_t *jobs, int count) {
+	int i;
+
+	printf("\r");
+	for (i = 0; i < count; ++i) {
+		if (jobs[i].state == FLASH_JOB_FAILED && jobs[i].pages == 0)
+			continue;
+		printf("0x%02x %3d/%-3d ", jobs[i].node_id, jobs[i].page, jobs[i].pages);
+	}
+	fflush(stdout);
+}
+
+static void task_flash_select_target(flash_t *f, uint64_t address) {
+	f->addr.source = address;
+	nrf24_open_write_pipe(radio, address);
+}
+
+// fetch the map of written pages from the bootloader, bit n of the map is page n
+static int task_flash_read_page_bitmap(flash_t *f, uint8_t *bitmap, uint8_t bytes) {
+	uint8_t offset, length;
+
+	for (offset = 0; offset < bytes; offset += length) {
+		length = bytes - offset;
+		if (length > NRF24__MAX_PAYLOAD_SIZE - FLASH_MCAST_STATUS_PAYLOAD_MIN_SIZE)
+			length = NRF24__MAX_PAYLOAD_SIZE - FLASH_MCAST_STATUS_PAYLOAD_MIN_SIZE;
+		f->packet[0] = FLASH_MCAST_STATUS;
+		f->packet[1] = offset;
+		if (!task_send_packet(radio, "FLASH_MCAST_STATUS", f->packet, FLASH_MCAST_STATUS_SIZE, FLASH_SEND_POST_DELAY_US, 0))
+			return 0;
+		f->packet[0] = FLASH_MCAST_STATUS_FLUSH;
+		if (!task_send_packet(radio, "FLASH_MCAST_STATUS_FLUSH", f->packet, FLASH_MCAST_STATUS_FLUSH_SIZE, FLASH_SEND_POST_DELAY_US, 0))
+			return 0;
+		if (!task_read_ack_payload(radio, f->packet, FLASH_MCAST_STATUS_PAYLOAD, FLASH_MCAST_STATUS_PAYLOAD_MIN_SIZE + length))
+			return 0;
+		if (f->packet[1] != offset) {
+			warning("page map offset mismatch, got=%d - expected=%d\n", f->packet[1], offset);
+			return 0;
+		}
+		memcpy(&bitmap[offset], &f->packet[FLASH_MCAST_STATUS_PAYLOAD_MIN_SIZE], length);
+	}
+
+	return 1;
+}
+
+static void task_flash_print_details(flash_t *f) {
+	printf("flash/bootloader details:\n");
+	printf("\t%-20s: 0x%llx\n", "source address", f->addr.source);
+	printf("\t%-20s: 0x%llx\n", "target address", f->addr.target);
+	printf("\t%-20s: %d\n", "hello retries", f->hello_retries);
+	printf("\t%-20s: 0x%x 0x%x 0x%x\n", "signature", f->sig[0], f->sig[1], f->sig[2]);
+	printf("\t%-20s: %d.%d\n", "bootloader version", f->version.major, f->version.minor);
+	printf("\t%-20s: %d bytes\n", "SPM_PAGESIZE", f->spm_pagesize);
+	printf("\t%-20s: %d bytes\n",  "available flash", f->available_flash);
+	printf("\t%-20s:\n", "fuses");
+	printf("\t\t%-12s: 0x%x\n", "low", f->fuses.low);
+	printf("\t\t%-12s: 0x%x\n", "high", f->fuses.high);
+	printf("\t\t%-12s: 0x%x\n", "extended", f->fuses.extended);
+	printf("\t\t%-12s: 0x%x\n", "lock", f->fuses.lock);
+	printf("\t%-20s: %d bytes\n", "EEPROM size", f->eeprom_size);
+	printf("\t%-20s: 0x%x (address 0x%llx)\n", "node id", f->node_id, FLASH_NODE_ADDRESS(f->node_id));
+	printf("\t%-20s: 0x%x%s%s%s%s%s%s\n", "capabilities", f->caps,
+		(f->caps & FLASH_CAP_RATE_250KBPS ? " 250kbps" : ""), (f->caps & FLASH_CAP_RATE_1MBPS ? " 1mbps" : ""), (f->caps & FLASH_CAP_RATE_2MBPS ? " 2mbps" : ""),
+		(f->caps & FLASH_CAP_PAGE_CRC ? " crc" : ""), (f->caps & FLASH_CAP_PAGE_STREAM ? " stream" : ""), (f->caps & FLASH_CAP_FEC ? " fec" : ""));
+	printf("\t%-20s: %d pages\n", "page window", f->window);
+}
+
+// stream the first page back to back, flushes and payloads without a pause or a retry, so that a
+// link that only just carries a HELLO at the new rate does not pass
+static uint8_t task_flash_rate_burst(flash_t *f) {
+	uint16_t address = 0;
+	uint8_t length;
+
+	f->packet[0] = FLASH_PAGE_STREAM;
+	f->packet[1] = 0;
+	f->packet[2] = 0;
+	f->packet[3] = f->spm_pagesize;
+	f->packet[4] = 0;
+	if (!task_send_packet(radio, "FLASH_PAGE_STREAM", f->packet, FLASH_EEPROM_BLOCK_READ_SIZE, FLASH_BLOCK_READ_DELAY_US, 0))
+		return 0;
+	while (address < f->spm_pagesize) {
+		length = (f->spm_pagesize - address > FLASH_BLOCK_SIZE ? FLASH_BLOCK_SIZE : f->spm_pagesize - address);
+		f->packet[0] = FLASH_PAGE_STREAM_FLUSH;
+		if (!task_send_packet(radio, "FLASH_PAGE_STREAM_FLUSH", f->packet, FLASH_EEPROM_BLOCK_READ_FLUSH_SIZE, 0, 0))
+			return 0;
+		if (!task_read_ack_payload(radio, f->packet, FLASH_PAGE_STREAM_PAYLOAD, FLASH_EEPROM_BLOCK_READ_PAYLOAD_MIN_SIZE + length))
+			return 0;
+		if ((((uint16_t)f->packet[2] << 8) | f->packet[1]) != address)
+			return 0;
+		address += length;
+	}
+
+	return 1;
+}
+
+// move the link to the fastest data rate both ends support
+// a HELLO and a page burst have to get through at the new rate before the host confirms it with
+// a second FLASH_SET_RATE, if either fails the host goes back to 1 Mbps and waits out the
+// probation after which the bootloader does the same
+// returns 0 only when the bootloader cannot be reached at either rate
+static uint8_t task_flash_negotiate(flash_t *f) {
+	uint8_t sig[3];
+
+	if (!(f->caps & FLASH_CAP_RATE_2MBPS) || !(f->caps & FLASH_CAP_PAGE_STREAM) || f->rate == NRF24_2MBPS)
+		return 1;
+
+	memcpy(sig, f->sig, sizeof(sig));
+	f->packet[0] = FLASH_SET_RATE;
+	f->packet[1] = FLASH_RATE_2MBPS;
+	if (task_send_packet(radio, "FLASH_SET_RATE", f->packet, FLASH_SET_RATE_SIZE, FLASH_SEND_POST_DELAY_US, f->addr.target)) {
+		nrf24_set_data_rate(radio, NRF24_2MBPS);
+		if (task_flash_hello_exchange(f, sig) && task_flash_rate_burst(f)) {
+			f->packet[0] = FLASH_SET_RATE;
+			f->packet[1] = FLASH_RATE_2MBPS;
+			if (task_send_packet(radio, "FLASH_SET_RATE", f->packet, FLASH_SET_RATE_SIZE, FLASH_SEND_POST_DELAY_US, f->addr.target)) {
+				f->rate = NRF24_2MBPS;
+				printf("link moved to 2 Mbps\n");
+				return 1;
+			}
+		}
+		nrf24_set_data_rate(radio, NRF24_1MBPS);
+	}
+	// the bootloader may have switched without the ack reaching us
+	warning("2 Mbps failed, falling back to 1 Mbps\n");
+	usleep(FLASH_RATE_PROBATION_MS * 1000);
+
+	return task_flash_hello_exchange(f, sig);
 }
 
 static uint8_t task_flash_hello_exchange(flash_t *f, uint8_t expected_sig[3]) {
@@ -560,6 +1803,7 @@ static uint8_t task_flash_hello_exchange(flash_t *f, uint8_t expected_sig[3]) {
 	f->packet[5] = expected_sig[2];
 	for (i = 6; i < FLASH_HELLO_SIZE; ++i)
 		f->packet[i] = 0;
+	f->packet[16] = FLASH_CAP_RATE_250KBPS | FLASH_CAP_RATE_1MBPS | FLASH_CAP_RATE_2MBPS | FLASH_CAP_PAGE_CRC | FLASH_CAP_PAGE_STREAM | FLASH_CAP_FEC;
 	// try to send the hello packet until it succeeds or retries exceeded
 	for (i = 0; i < f->hello_retries; ++i)
 		if (task_send_packet(radio, "FLASH_HELLO", f->packet, FLASH_HELLO_SIZE, FLASH_SEND_POST_DELAY_US, f->addr.target))
@@ -611,6 +1855,9 @@ static uint8_t task_flash_hello_exchange(flash_t *f, uint8_t expected_sig[3]) {
 	f->fuses.extended = f->packet[11];
 	f->fuses.lock = f->packet[12];
 	f->eeprom_size = ((uint16_t)f->packet[14] << 8) | f->packet[13];
+	f->node_id = f->packet[15];
+	f->caps = f->packet[16];
+	f->window = f->packet[17];
 
 	return result;
 }
@@ -3,6 +3,10 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <math.h>
 
@@ -23,6 +27,24 @@ nrf24_t *radio;
 
 extern const tasks_table_t tasks_program[];
 
+// input of the stream task, a regular file is read a frame a slot, anything else is drained
+// without blocking and only the newest color counts
+typedef struct program_stream_input {
+	int fd;
+	FILE *fp;
+	uint8_t live, eof;
+	size_t used;
+	char buf[PROGRAM_STREAM_LINE_SIZE];
+} program_stream_input_t;
+
+static uint8_t task_program_send_retry(uint8_t *packet, char *packet_type_name, uint8_t len);
+static int task_program_block_read(uint8_t *packet, uint16_t step, uint8_t steps);
+static uint16_t task_program_stream_read(uint8_t *image, uint8_t *packet, uint16_t start, uint16_t end);
+static int task_program_stream_next(program_stream_input_t *in, uint8_t *color, uint32_t *superseded);
+static uint8_t task_program_stream_color(char *line, uint8_t *color);
+static uint64_t task_program_stream_us(void);
+static int task_program_stream_compare(const void *a, const void *b);
+
 int task_program(int argc, char *argv[]) {
 	int (*function)(int argc, char *argv[]);
 
@@ -91,7 +113,8 @@ int task_program_rainbow(int argc, char *argv[]) {
    		rgb[0] = (uint8_t)(sin(frequency*(float)i + 0.) * 127.) + 128;
    		rgb[1] = (uint8_t)(sin(frequency*(float)i + 2.) * 127.) + 128;
    		rgb[2] = (uint8_t)(sin(frequency*(float)i + 4.) * 127.) + 128;
-		fprintf(f->fp, "%d\t%d\t%d\t%d\n", rgb[0], rgb[1], rgb[2], delay_in_ms);
+		// each color is faded to rather than jumped to, see program_load_from_file
+		fprintf(f->fp, "fade\t%d\t%d\t%d\t%d\n", rgb[0], rgb[1], rgb[2], delay_in_ms);
 	}
 
 	file_close(f);
@@ -101,7 +124,7 @@ int task_program_rainbow(int argc, char *argv[]) {
 
 int task_program_upload(int argc, char *argv[]) {
 	program_t *p;
-	uint8_t packet[NRF24__MAX_PAYLOAD_SIZE];
+	uint8_t packet[NRF24__MAX_PAYLOAD_SIZE], steps;
 	uint16_t i;
 
 	if (argc != 4) {
@@ -138,28 +161,29 @@ int task_program_upload(int argc, char *argv[]) {
 	
 	// send program length
 	packet[0] = PACKET_PROGRAM_LENGTH;
-	packet[1] = (uint8_t)(p->steps & 0x00FF);
-	packet[2] = (uint8_t)((p->steps & 0xFF00) >> 8);
+	packet[1] = (uint8_t)(p->length & 0x00FF);
+	packet[2] = (uint8_t)((p->length & 0xFF00) >> 8);
 	if (!task_send_packet(radio, "PROGRAM_LENGTH", packet, PACKET_PROGRAM_LENGTH_SIZE, PROGRAM_SEND_POST_DELAY_US, program_pipes[1]))
 		return EXIT_FAILURE;
 
-	// send program steps
-	for (i = 0; i < p->steps; ++i) {
-		packet[0] = PACKET_PROGRAM_STEP;
+	// send the program image, packed as many steps to a block as fit
+	for (i = 0; i < p->units; i += steps) {
+		steps = (p->units - i > PACKET_PROGRAM_STEPS_BLOCK_MAX_STEPS ? PACKET_PROGRAM_STEPS_BLOCK_MAX_STEPS : p->units - i);
+		packet[0] = PACKET_PROGRAM_STEPS_BLOCK;
 		packet[1] = (uint8_t)(i & 0x00FF);
 		packet[2] = (uint8_t)((i & 0xFF00) >> 8);
-		packet[3] = p->step[i]->rgb[0];
-		packet[4] = p->step[i]->rgb[1];
-		packet[5] = p->step[i]->rgb[2];
-		packet[6] = (uint8_t)(p->step[i]->delay_in_ms & 0x00FF);
-		packet[7] = (uint8_t)((p->step[i]->delay_in_ms & 0xFF00) >> 8);
-		if (!task_send_packet(radio, "PROGRAM_STEP", packet, PACKET_PROGRAM_STEP_SIZE, PROGRAM_SEND_POST_DELAY_US, program_pipes[1]))
+		packet[3] = steps;
+		memcpy(&packet[PACKET_PROGRAM_STEPS_BLOCK_MIN_SIZE], &p->image[i * PACKET_PROGRAM_STEP_PACKED_SIZE], steps * PACKET_PROGRAM_STEP_PACKED_SIZE);
+		if (!task_program_send_retry(packet, "PROGRAM_STEPS_BLOCK", PACKET_PROGRAM_STEPS_BLOCK_MIN_SIZE + (steps * PACKET_PROGRAM_STEP_PACKED_SIZE)))
 			return EXIT_FAILURE;
+		printf(".");
+		fflush(stdout);
 	}
+	printf("\n");
 
-	// send programming done packet
+	// send programming done packet, queued behind the blocks still being written
 	packet[0] = PACKET_END_PROGRAMMING;
-	if (!task_send_packet(radio, "END_PROGRAMMING", packet, PACKET_END_PROGRAMMING_SIZE, PROGRAM_SEND_POST_DELAY_US, program_pipes[1]))
+	if (!task_program_send_retry(packet, "END_PROGRAMMING", PACKET_END_PROGRAMMING_SIZE))
 		return EXIT_FAILURE;
 
 	// send start program
@@ -173,9 +197,11 @@ int task_program_upload(int argc, char *argv[]) {
 }
 
 int task_program_download(int argc, char *argv[]) {
-	file_t *f;
-	uint8_t packet[NRF24__MAX_PAYLOAD_SIZE], rgb[3];
-	uint16_t steps, step, i, delay_in_ms;
+	program_t *p;
+	uint8_t packet[NRF24__MAX_PAYLOAD_SIZE], image[PROGRAM_MAX_SIZE], count;
+	uint16_t length, steps, i;
+	struct timeval start, end;
+	int ms;
 
 	if (argc != 4) {
 		warning("usage: %s %s %s <filename>\n", argv[0], argv[1], argv[2]);
@@ -184,8 +210,6 @@ int task_program_download(int argc, char *argv[]) {
 
 	printf("%s: downloading program from %llx to '%s'\n", argv[0], program_pipes[1], argv[3]);
 
-	f = file_open(argv[3], "w");
-	
 	radio = task_radio_setup(NRF24_PA_MAX, NRF24_1MBPS, CHANNEL, program_pipes[0], program_pipes[1]);
 #ifdef PI_DEBUG
 	nrf24_print_details(radio);
@@ -209,44 +233,92 @@ int task_program_download(int argc, char *argv[]) {
 		task_program_print_ack_payload(radio, packet);
 		return EXIT_FAILURE;
 	}
-	steps = ((uint16_t)packet[2] << 8) | packet[1];
+	// a v2 program is read back in the packed steps it was sent in
+	length = ((uint16_t)packet[2] << 8) | packet[1];
+	if (length & PACKET_PROGRAM_V2)
+		steps = ((length & ~PACKET_PROGRAM_V2) + PACKET_PROGRAM_STEP_PACKED_SIZE - 1) / PACKET_PROGRAM_STEP_PACKED_SIZE;
+	else
+		steps = length;
+	if (steps * PACKET_PROGRAM_STEP_PACKED_SIZE > sizeof(image)) {
+		warning("%s: program length %d is out of range\n", argv[0], steps);
+		return EXIT_FAILURE;
+	}
 
 	printf("reading %d steps...\n", steps);
 
-	// get program steps
-	for (i = 0; i < steps; ++i) {
-		packet[0] = PACKET_READ_PROGRAM_STEP;
-		packet[1] = (uint8_t)(i & 0x00FF);
-		packet[2] = (uint8_t)((i & 0xFF00) >> 8);
-		printf("fetching data for step %d (packet type = %d)\n", i, PACKET_READ_PROGRAM_STEP);
-		if (!task_send_packet(radio, "READ_PROGRAM_STEP", packet, PACKET_READ_PROGRAM_STEP_SIZE, PROGRAM_SEND_POST_DELAY_US, program_pipes[1]))
-			return EXIT_FAILURE;
-		packet[0] = PACKET_READ_PROGRAM_STEP_FLUSH;
-		if (!task_send_packet(radio, "READ_PROGRAM_STEP_FLUSH", packet, PACKET_READ_PROGRAM_STEP_FLUSH_SIZE, PROGRAM_SEND_POST_DELAY_US, program_pipes[1]))
+	// stream the program steps, whatever the stream did not get is read a block at a time
+	gettimeofday(&start, NULL);
+	for (i = task_program_stream_read(image, packet, 0, steps); i < steps; i += count) {
+		count = (steps - i > PACKET_PROGRAM_STEPS_BLOCK_MAX_STEPS ? PACKET_PROGRAM_STEPS_BLOCK_MAX_STEPS : steps - i);
+		if (!task_program_block_read(packet, i, count)) {
+			warning("%s: while reading steps %d to %d, did not receive payload packet\n", argv[0], i, i + count - 1);
 			return EXIT_FAILURE;
-		// read payload
-		if (!task_read_ack_payload(radio, packet, PACKET_PROGRAM_STEP, PACKET_PROGRAM_STEP_SIZE)) {
-			task_program_print_ack_payload(radio, packet);
-			return EXIT_FAILURE;
-		}
-		step = ((uint16_t)packet[2] << 8) | packet[1];
-		rgb[0] = packet[3];
-		rgb[1] = packet[4];
-		rgb[2] = packet[5];
-		delay_in_ms = ((uint16_t)packet[7] << 8) | packet[6];
-
-		if (step != i) {
-			warning("%s: program read back is out of order, expected step=%d, got=%d\n", argv[0], i, step);
 		}
-		fprintf(f->fp, "# step %d\n%d\t%d\t%d\t%d\n", step, rgb[0], rgb[1], rgb[2], delay_in_ms);
+		memcpy(&image[i * PACKET_PROGRAM_STEP_PACKED_SIZE], &packet[PACKET_PROGRAM_STEPS_BLOCK_MIN_SIZE], count * PACKET_PROGRAM_STEP_PACKED_SIZE);
+		printf(".");
+		fflush(stdout);
 	}
+	gettimeofday(&end, NULL);
+	ms = ((end.tv_sec  - start.tv_sec) * 1000) + ((end.tv_usec - start.tv_usec)/1000.0) + 0.5;
+	printf("\nread %d steps in %d ms\n", steps, ms);
 
 	// send start program
 	packet[0] = PACKET_RUN_PROGRAM;
 	if (!task_send_packet(radio, "RUN_PROGRAM", packet, PACKET_RUN_PROGRAM_SIZE, PROGRAM_SEND_POST_DELAY_US, program_pipes[1]))
 		return EXIT_FAILURE;
 
-	file_close(f);
+	p = program_load_from_image(length, image);
+	program_save_to_file(p, argv[3]);
+	program_free(p);
+
+	return EXIT_SUCCESS;
+}
+
+// the node refuses block reads that run into the EEPROM reserved for the bootloader, the same
+// check guards its block writes, a block that ends right below the reserved bytes is read and
+// one that runs a step further is not
+int task_program_range(int argc, char *argv[]) {
+	uint8_t packet[NRF24__MAX_PAYLOAD_SIZE];
+	uint16_t end = (PROGRAM_MAX_SIZE - PROGRAM_STEPS_OFFSET) / PACKET_PROGRAM_STEP_PACKED_SIZE;
+
+	if (argc != 3) {
+		warning("usage: %s %s %s\n", argv[0], argv[1], argv[2]);
+		return EXIT_FAILURE;
+	}
+
+	radio = task_radio_setup(NRF24_PA_MAX, NRF24_1MBPS, CHANNEL, program_pipes[0], program_pipes[1]);
+#ifdef PI_DEBUG
+	nrf24_print_details(radio);
+#endif
+
+	packet[0] = PACKET_STOP_PROGRAM;
+	if (!task_send_packet(radio, "STOP_PROGRAM", packet, PACKET_STOP_PROGRAM_SIZE, PROGRAM_SEND_POST_DELAY_US, program_pipes[1]))
+		return EXIT_FAILURE;
+
+	if (!task_program_block_read(packet, end - 2, 2)) {
+		warning("%s: steps %d to %d are in range but were not read\n", argv[0], end - 2, end - 1);
+		return EXIT_FAILURE;
+	}
+	// a refused read leaves nothing for the flush to return, once is enough
+	packet[0] = PACKET_READ_PROGRAM_STEPS_BLOCK;
+	packet[1] = (uint8_t)((end - 1) & 0x00FF);
+	packet[2] = (uint8_t)(((end - 1) & 0xFF00) >> 8);
+	packet[3] = 2;
+	if (!task_send_packet(radio, "READ_PROGRAM_STEPS_BLOCK", packet, PACKET_READ_PROGRAM_STEPS_BLOCK_SIZE, PROGRAM_BLOCK_READ_DELAY_US, 0))
+		return EXIT_FAILURE;
+	packet[0] = PACKET_READ_PROGRAM_STEPS_BLOCK_FLUSH;
+	if (!task_send_packet(radio, "READ_PROGRAM_STEPS_BLOCK_FLUSH", packet, PACKET_READ_PROGRAM_STEPS_BLOCK_FLUSH_SIZE, 0, 0))
+		return EXIT_FAILURE;
+	if (nrf24_is_ack_payload_available(radio)) {
+		nrf24_read_payload(radio, packet, radio->ack_payload_length);
+		warning("%s: steps %d to %d run into the reserved EEPROM but were read\n", argv[0], end - 1, end);
+		return EXIT_FAILURE;
+	}
+	printf("steps from %d on are refused\n", end);
+
+	packet[0] = PACKET_RUN_PROGRAM;
+	if (!task_send_packet(radio, "RUN_PROGRAM", packet, PACKET_RUN_PROGRAM_SIZE, PROGRAM_SEND_POST_DELAY_US, program_pipes[1]))
+		return EXIT_FAILURE;
 
 	return EXIT_SUCCESS;
 }
@@ -314,6 +386,169 @@ int task_program_rgb(int argc, char *argv[]) {
 	return EXIT_SUCCESS;
 }
 
+int task_program_brightness(int argc, char *argv[]) {
+	uint8_t packet[PACKET_SET_BRIGHTNESS_SIZE];
+
+	if (argc != 4) {
+		warning("usage: %s %s %s <brightness (0 to 255)>\n", argv[0], argv[1], argv[2]);
+		return EXIT_FAILURE;
+	}
+
+	radio = task_radio_setup(NRF24_PA_MAX, NRF24_1MBPS, CHANNEL, program_pipes[0], program_pipes[1]);
+#ifdef PI_DEBUG
+	nrf24_print_details(radio);
+#endif
+
+	packet[0] = PACKET_SET_BRIGHTNESS;
+	packet[1] = atoi(argv[3]);
+	if (!task_send_packet(radio, "SET_BRIGHTNESS", packet, PACKET_SET_BRIGHTNESS_SIZE, PROGRAM_SEND_POST_DELAY_US, program_pipes[1]))
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
+
+int task_program_effect(int argc, char *argv[]) {
+	// in the order of PACKET_EFFECT_NONE to PACKET_EFFECT_CYCLE
+	const char *effects[] = { "none", "rainbow", "breathe", "strobe", "chase", "cycle", NULL };
+	uint8_t packet[PACKET_RUN_EFFECT_SIZE];
+	int effect, period;
+
+	for (effect = 0; argc >= 4 && effects[effect] != NULL; ++effect)
+		if (strcmp(argv[3], effects[effect]) == 0)
+			break;
+	if (argc < 4 || argc > 10 || effects[effect] == NULL || (argc > 5 && argc < 8)) {
+		warning("usage: %s %s %s <none|rainbow|breathe|strobe|chase|cycle> [<period in ms> [<red> <green> <blue> [<shape (0 to 255)> [<phase per node id (0 to 255)>]]]]\n", argv[0], argv[1], argv[2]);
+		return EXIT_FAILURE;
+	}
+	period = (argc > 4 ? atoi(argv[4]) : 5000);
+
+	radio = task_radio_setup(NRF24_PA_MAX, NRF24_1MBPS, CHANNEL, program_pipes[0], program_pipes[1]);
+#ifdef PI_DEBUG
+	nrf24_print_details(radio);
+#endif
+
+	// white, half way shapes, a saturated rainbow and the nodes in phase, unless given
+	packet[0] = PACKET_RUN_EFFECT;
+	packet[1] = effect;
+	packet[2] = (uint8_t)(period & 0x00FF);
+	packet[3] = (uint8_t)((period & 0xFF00) >> 8);
+	packet[4] = (argc > 7 ? atoi(argv[5]) : 255);
+	packet[5] = (argc > 7 ? atoi(argv[6]) : 255);
+	packet[6] = (argc > 7 ? atoi(argv[7]) : 255);
+	packet[7] = (argc > 8 ? atoi(argv[8]) : (effect == PACKET_EFFECT_RAINBOW ? 255 : 128));
+	packet[8] = (argc > 9 ? atoi(argv[9]) : 0);
+	if (!task_send_packet(radio, "RUN_EFFECT", packet, PACKET_RUN_EFFECT_SIZE, PROGRAM_SEND_POST_DELAY_US, program_pipes[1]))
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
+
+// colors in real time, slot i of the schedule is due i periods after the start by the monotonic
+// clock, so that the time it takes to read and send a frame does not add up
+int task_program_stream(int argc, char *argv[]) {
+	program_stream_input_t in;
+	uint8_t packet[PACKET_STREAM_COLOR_SIZE], sequence = 0;
+	uint32_t *jitter = NULL, jitters = 0, jitters_size = 0;
+	uint32_t sent = 0, failed = 0, late = 0, dropped = 0, superseded = 0;
+	uint64_t start, due, now, slot, period_us, elapsed_us;
+	struct stat st;
+	int fps, flags = 0, next;
+
+	fps = (argc > 3 ? atoi(argv[3]) : PROGRAM_STREAM_DEFAULT_FPS);
+	if (argc > 5 || fps < 1 || fps > PROGRAM_STREAM_MAX_FPS) {
+		warning("usage: %s %s %s [<frames per second (1 to %d)> [<file, fifo or - for stdin>]]\n", argv[0], argv[1], argv[2], PROGRAM_STREAM_MAX_FPS);
+		warning("\ta frame is a line of <red> <green> <blue>, # starts a comment\n");
+		return EXIT_FAILURE;
+	}
+	period_us = 1000000 / fps;
+
+	memset(&in, 0, sizeof(in));
+	if (argc < 5 || strcmp(argv[4], "-") == 0)
+		in.fd = STDIN_FILENO;
+	else if ((in.fd = open(argv[4], O_RDONLY)) < 0)	// a fifo blocks here until it has a writer
+		fatal_error("unable to open stream input '%s'\n", argv[4]);
+	if (fstat(in.fd, &st) < 0)
+		fatal_error("unable to stat stream input\n");
+	in.live = !S_ISREG(st.st_mode);
+	if (in.live) {
+		flags = fcntl(in.fd, F_GETFL);
+		if (flags < 0 || fcntl(in.fd, F_SETFL, flags | O_NONBLOCK) < 0)
+			fatal_error("unable to make stream input non blocking\n");
+	} else if (!(in.fp = fdopen(dup(in.fd), "r")))
+		fatal_error("unable to read stream input\n");
+
+	radio = task_radio_setup(NRF24_PA_MAX, NRF24_1MBPS, CHANNEL, program_pipes[0], program_pipes[1]);
+#ifdef PI_DEBUG
+	nrf24_print_details(radio);
+#endif
+
+	printf("%s: streaming %s at %d fps to %llx\n", argv[0], (in.live ? "live colors" : "frames"), fps, program_pipes[1]);
+	packet[0] = PACKET_STREAM_COLOR;
+	start = task_program_stream_us();
+	for (slot = 0; ; ++slot) {
+		due = start + (slot * period_us);
+		while ((now = task_program_stream_us()) < due) {
+			struct timespec ts;
+
+			ts.tv_sec = (due - now) / 1000000;
+			ts.tv_nsec = ((due - now) % 1000000) * 1000;
+			nanosleep(&ts, NULL);
+		}
+		// a whole period or more behind, the frames of the slots gone by are dropped and the
+		// schedule goes on with the slot that is due now
+		if (now - due >= period_us) {
+			uint64_t missed = (now - due) / period_us;
+
+			late += missed;
+			slot += missed;
+			due += missed * period_us;
+			for (; !in.live && missed; --missed) {
+				if (task_program_stream_next(&in, &packet[2], &superseded) < 0)
+					break;
+				++dropped;
+			}
+		}
+
+		next = task_program_stream_next(&in, &packet[2], &superseded);
+		if (next < 0)
+			break;
+		if (next == 0)
+			continue;	// nothing new from a live input, the node holds the color
+		packet[1] = sequence++;
+		now = task_program_stream_us();
+		if (task_send_packet_no_ack(radio, "STREAM_COLOR", packet, PACKET_STREAM_COLOR_SIZE, 0, 0))
+			++sent;
+		else
+			++failed;
+
+		if (jitters == jitters_size) {
+			jitters_size = (jitters_size ? jitters_size * 2 : 1024);
+			if (!(jitter = realloc(jitter, jitters_size * sizeof(uint32_t))))
+				fatal_error("unable to allocate memory for %d jitter samples\n", jitters_size);
+		}
+		jitter[jitters++] = (uint32_t)(now - due);
+	}
+	elapsed_us = task_program_stream_us() - start;
+
+	if (in.live)
+		fcntl(in.fd, F_SETFL, flags);
+	else
+		fclose(in.fp);
+	if (in.fd != STDIN_FILENO)
+		close(in.fd);
+
+	// the node counts the frames the radio lost, see the stats task
+	printf("sent %u frames in %.2f s, %.1f fps\n", sent, elapsed_us / 1000000., (elapsed_us ? (sent * 1000000.) / elapsed_us : 0.));
+	if (jitters) {
+		qsort(jitter, jitters, sizeof(uint32_t), task_program_stream_compare);
+		printf("send jitter: p50 %u us, p90 %u us, p99 %u us, max %u us\n", jitter[(jitters - 1) / 2], jitter[((jitters - 1) * 90) / 100], jitter[((jitters - 1) * 99) / 100], jitter[jitters - 1]);
+	}
+	printf("late slots: %u, frames dropped late: %u, colors superseded before their slot: %u, failed sends: %u\n", late, dropped, superseded, failed);
+	free(jitter);
+
+	return EXIT_SUCCESS;
+}
+
 int task_program_reset(int argc, char *argv[]) {
 	uint8_t packet[1];
 
@@ -369,6 +604,222 @@ int task_program_lightfreq(int argc, char *argv[]) {
 	return EXIT_SUCCESS;
 }
 
+int task_program_stats(int argc, char *argv[]) {
+	uint8_t packet[NRF24__MAX_PAYLOAD_SIZE];
+
+	if (argc != 3) {
+		warning("usage: %s %s %s\n", argv[0], argv[1], argv[2]);
+		return EXIT_FAILURE;
+	}
+
+	radio = task_radio_setup(NRF24_PA_MAX, NRF24_1MBPS, CHANNEL, program_pipes[0], program_pipes[1]);
+#ifdef PI_DEBUG
+	nrf24_print_details(radio);
+#endif
+
+	// the node resets its maxima with every read, so this covers the time since the last one
+	packet[0] = PACKET_READ_STATS;
+	if (!task_send_packet(radio, "READ_STATS", packet, PACKET_READ_STATS_SIZE, PROGRAM_SEND_POST_DELAY_US, program_pipes[1]))
+		return EXIT_FAILURE;
+	packet[0] = PACKET_READ_STATS_FLUSH;
+	if (!task_send_packet(radio, "READ_STATS_FLUSH", packet, PACKET_READ_STATS_FLUSH_SIZE, PROGRAM_SEND_POST_DELAY_US, program_pipes[1]))
+		return EXIT_FAILURE;
+	if (!task_read_ack_payload(radio, packet, PACKET_STATS, PACKET_STATS_SIZE)) {
+		task_program_print_ack_payload(radio, packet);
+		return EXIT_FAILURE;
+	}
+	printf("longest radio ISR:          %d us\n", ((uint16_t)packet[2] << 8) | packet[1]);
+	printf("worst PWM period overrun:   %d us\n", ((uint16_t)packet[4] << 8) | packet[3]);
+	printf("radio queue overflows:      %d\n", ((uint16_t)packet[6] << 8) | packet[5]);
+	printf("radio queue high water:     %d\n", packet[7]);
+	printf("latest program step:        %d ms\n", ((uint16_t)packet[9] << 8) | packet[8]);
+	printf("late program steps:         %d\n", ((uint16_t)packet[11] << 8) | packet[10]);
+	printf("PWM:                        %d Hz, %d.%d%% CPU\n", ((uint16_t)packet[15] << 8) | packet[14], (((uint16_t)packet[13] << 8) | packet[12]) / 10, (((uint16_t)packet[13] << 8) | packet[12]) % 10);
+	printf("stream frames lost:         %d\n", ((uint16_t)packet[17] << 8) | packet[16]);
+	printf("colors replaced unshown:    %d\n", ((uint16_t)packet[19] << 8) | packet[18]);
+
+	return EXIT_SUCCESS;
+}
+
+// send a packet the node may not have room for yet, it has stopped acking while it
+// writes earlier blocks to EEPROM, a block that is acked twice is written twice with the same data
+static uint8_t task_program_send_retry(uint8_t *packet, char *packet_type_name, uint8_t len) {
+	uint8_t i;
+
+	for (i = 0; i < PROGRAM_BLOCK_RETRIES; ++i) {
+		if (task_send_packet(radio, packet_type_name, packet, len, 0, 0))
+			return 1;
+		usleep(PROGRAM_BLOCK_RETRY_DELAY_US);
+	}
+	warning("maximum number of retries (%d) reached for %s packet\n", PROGRAM_BLOCK_RETRIES, packet_type_name);
+
+	return 0;
+}
+
+// read steps step up to step + steps into packet, the read primes the ack payload that the
+// flush after it returns
+static int task_program_block_read(uint8_t *packet, uint16_t step, uint8_t steps) {
+	uint8_t retries;
+
+	for (retries = 0; retries < PROGRAM_BLOCK_RETRIES; ++retries) {
+		if (retries)
+			usleep(PROGRAM_BLOCK_RETRY_DELAY_US);
+		packet[0] = PACKET_READ_PROGRAM_STEPS_BLOCK;
+		packet[1] = (uint8_t)(step & 0x00FF);
+		packet[2] = (uint8_t)((step & 0xFF00) >> 8);
+		packet[3] = steps;
+		if (!task_send_packet(radio, "READ_PROGRAM_STEPS_BLOCK", packet, PACKET_READ_PROGRAM_STEPS_BLOCK_SIZE, PROGRAM_BLOCK_READ_DELAY_US, 0))
+			continue;
+		packet[0] = PACKET_READ_PROGRAM_STEPS_BLOCK_FLUSH;
+		if (!task_send_packet(radio, "READ_PROGRAM_STEPS_BLOCK_FLUSH", packet, PACKET_READ_PROGRAM_STEPS_BLOCK_FLUSH_SIZE, 0, 0))
+			continue;
+		if (!task_read_ack_payload(radio, packet, PACKET_PROGRAM_STEPS_BLOCK, PACKET_PROGRAM_STEPS_BLOCK_MIN_SIZE + (steps * PACKET_PROGRAM_STEP_PACKED_SIZE))) {
+			task_program_print_ack_payload(radio, packet);
+			continue;
+		}
+		if ((((uint16_t)packet[2] << 8) | packet[1]) != step || packet[3] != steps) {
+			warning("program read back is out of order, expected step=%d, got=%d\n", step, ((uint16_t)packet[2] << 8) | packet[1]);
+			continue;
+		}
+		return 1;
+	}
+
+	return 0;
+}
+
+// stream steps start up to end into image, each flush returns a payload the node staged earlier,
+// a lost payload shows as a gap in the sequence and restarts the stream where it left off
+// returns the step the stream got up to
+static uint16_t task_program_stream_read(uint8_t *image, uint8_t *packet, uint16_t start, uint16_t end) {
+	uint16_t step = start, resume, retries = 0;
+	uint8_t sequence, steps;
+
+	while (step < end) {
+		resume = step;
+		packet[0] = PACKET_READ_PROGRAM_STREAM;
+		packet[1] = (uint8_t)(step & 0x00FF);
+		packet[2] = (uint8_t)((step & 0xFF00) >> 8);
+		packet[3] = (uint8_t)((end - step) & 0x00FF);
+		packet[4] = (uint8_t)(((end - step) & 0xFF00) >> 8);
+		if (task_send_packet(radio, "READ_PROGRAM_STREAM", packet, PACKET_READ_PROGRAM_STREAM_SIZE, PROGRAM_BLOCK_READ_DELAY_US, 0)) {
+			for (sequence = 0; step < end; ++sequence) {
+				steps = (end - step > PACKET_PROGRAM_STREAM_STEPS ? PACKET_PROGRAM_STREAM_STEPS : end - step);
+				packet[0] = PACKET_READ_PROGRAM_STREAM_FLUSH;
+				if (!task_send_packet(radio, "READ_PROGRAM_STREAM_FLUSH", packet, PACKET_READ_PROGRAM_STREAM_FLUSH_SIZE, 0, 0))
+					break;
+				if (!task_read_ack_payload(radio, packet, PACKET_PROGRAM_STREAM_PAYLOAD, PACKET_PROGRAM_STREAM_PAYLOAD_MIN_SIZE + (steps * PACKET_PROGRAM_STEP_PACKED_SIZE)))
+					break;
+				if (packet[1] != sequence) {
+					warning("stream sequence gap, got=%d - expected=%d\n", packet[1], sequence);
+					break;
+				}
+				memcpy(&image[step * PACKET_PROGRAM_STEP_PACKED_SIZE], &packet[PACKET_PROGRAM_STREAM_PAYLOAD_MIN_SIZE], steps * PACKET_PROGRAM_STEP_PACKED_SIZE);
+				step += steps;
+				printf(".");
+				fflush(stdout);
+			}
+		}
+		// only streams that make no progress at all count against the retries
+		if (step != resume)
+			retries = 0;
+		if (step < end) {
+			if (++retries > PROGRAM_BLOCK_RETRIES)
+				break;
+			usleep(PROGRAM_BLOCK_RETRY_DELAY_US);
+		}
+	}
+
+	return step;
+}
+
+// the color of the next frame, 1 with a color, 0 when a live input has nothing new and -1 at the end
+static int task_program_stream_next(program_stream_input_t *in, uint8_t *color, uint32_t *superseded) {
+	uint8_t next[3], got = 0;
+	char *line, *end;
+	ssize_t n;
+
+	if (!in->live) {
+		while (fgets(in->buf, sizeof(in->buf), in->fp))
+			if (task_program_stream_color(in->buf, color))
+				return 1;
+		return -1;
+	}
+
+	while (!in->eof) {
+		n = read(in->fd, in->buf + in->used, sizeof(in->buf) - 1 - in->used);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				warning("unable to read stream input: %s\n", strerror(errno));
+			else
+				break;
+		}
+		if (n <= 0) {
+			// a last line without a newline
+			in->eof = 1;
+			in->buf[in->used] = '\n';
+			n = 1;
+		}
+		in->used += n;
+		in->buf[in->used] = '\0';
+
+		for (line = in->buf; (end = strchr(line, '\n')) != NULL; line = end + 1) {
+			*end = '\0';
+			if (task_program_stream_color(line, next)) {
+				if (got)
+					++*superseded;
+				memcpy(color, next, sizeof(next));
+				got = 1;
+			}
+		}
+		in->used -= line - in->buf;
+		memmove(in->buf, line, in->used);
+		if (in->used == sizeof(in->buf) - 1) {
+			warning("stream input line longer than %d characters dropped\n", (int)sizeof(in->buf) - 2);
+			in->used = 0;
+		}
+	}
+
+	return (got ? 1 : (in->eof ? -1 : 0));
+}
+
+// a frame is a line of <red> <green> <blue>, # starts a comment
+static uint8_t task_program_stream_color(char *line, uint8_t *color) {
+	char *comment = strchr(line, '#');
+	int red, green, blue, n;
+
+	if (comment)
+		*comment = '\0';
+	line[strcspn(line, "\r\n")] = '\0';
+	n = sscanf(line, "%d %d %d", &red, &green, &blue);
+	if (n == EOF)
+		return 0;
+	if (n != 3 || red < 0 || red > 255 || green < 0 || green > 255 || blue < 0 || blue > 255) {
+		warning("skipping stream frame that is not <red> <green> <blue> (0 to 255): %s\n", line);
+		return 0;
+	}
+	color[0] = red;
+	color[1] = green;
+	color[2] = blue;
+
+	return 1;
+}
+
+static uint64_t task_program_stream_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+static int task_program_stream_compare(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
 void task_program_print_ack_payload(nrf24_t *radio, uint8_t *packet) {
         int i;
 
@@ -394,6 +845,22 @@ void task_program_print_ack_payload(nrf24_t *radio, uint8_t *packet) {
                                 printf("\tdecoded content: step = %d, rgb = %d  %d  %d, delay_in_ms = %d\n", step, rgb[0], rgb[1], rgb[2], delay_in_ms);
                                 break;
                         }
+                case PACKET_PROGRAM_STEPS_BLOCK: {
+                                uint16_t step = ((uint16_t)packet[2] << 8) | packet[1];
+                                printf("PACKET_PROGRAM_STEPS_BLOCK (expected length = %d + %d per step, got = %d)\n", (int)PACKET_PROGRAM_STEPS_BLOCK_MIN_SIZE, (int)PACKET_PROGRAM_STEP_PACKED_SIZE, radio->ack_payload_length);
+                                for (i = 0; i < radio->ack_payload_length; ++i) {
+                                        printf("\t\tpacket[%d] = %d\n", i, packet[i]);
+                                }
+                                printf("\tdecoded content: step = %d, steps = %d\n", step, packet[3]);
+                                break;
+                        }
+                case PACKET_STATS: {
+                                printf("PACKET_STATS (expected length = %d, got = %d)\n", (int)PACKET_STATS_SIZE, radio->ack_payload_length);
+                                for (i = 0; i < radio->ack_payload_length; ++i) {
+                                        printf("\t\tpacket[%d] = %d\n", i, packet[i]);
+                                }
+                                break;
+                        }
                 case PACKET_LIGHT_FREQ: {
                                 uint16_t hz = ((uint16_t)packet[2] << 8) | packet[1];
                                 printf("PACKET_LIGHT_FREQ (expected length = %d, got = %d)\n", PACKET_LIGHT_FREQ_SIZE, radio->ack_payload_length);
@@ -0,0 +1 @@
+../lib/xtea.c
\ No newline at end of file
@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "error.h"
+#include "hex.h"
+#include "cache.h"
+
+// path of name in the cache directory, 0 when there is no cache
+static int cache_path(char *path, size_t len, const char *name) {
+	char *dir, *home;
+
+	dir = getenv(CACHE_DIR_ENV);
+	if (dir) {
+		if (!*dir)
+			return 0;
+		snprintf(path, len, "%s", dir);
+	} else {
+		if (!(home = getenv("HOME")))
+			return 0;
+		snprintf(path, len, "%s/%s", home, CACHE_DIR);
+	}
+	if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+		warning("unable to create cache directory '%s'\n", path);
+		return 0;
+	}
+	snprintf(path + strlen(path), len - strlen(path), "/%s", name);
+
+	return 1;
+}
+
+// 64 bit FNV-1a of the contents of the file, 0 when it can not be read
+static uint64_t cache_file_hash(char *filename) {
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	uint8_t buf[65536];
+	size_t n, i;
+	FILE *fp;
+
+	if (!(fp = fopen(filename, "rb")))
+		return 0;
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+		for (i = 0; i < n; ++i)
+			hash = (hash ^ buf[i]) * 0x100000001B3ULL;
+	fclose(fp);
+
+	return hash;
+}
+
+static int cache_image_read(FILE *fp, hex_t *h) {
+	hex_segment_t *s;
+	uint32_t magic, version, i, bytes;
+
+	if (fread(&magic, sizeof(magic), 1, fp) != 1 || magic != CACHE_IMAGE_MAGIC)
+		return 0;
+	if (fread(&version, sizeof(version), 1, fp) != 1 || version != CACHE_IMAGE_VERSION)
+		return 0;
+	if (fread(&h->page_size, sizeof(uint32_t), 1, fp) != 1 || fread(&h->pages, sizeof(uint32_t), 1, fp) != 1
+		|| fread(&h->segments, sizeof(uint32_t), 1, fp) != 1 || fread(&h->min_address, sizeof(uint32_t), 1, fp) != 1
+		|| fread(&h->max_address, sizeof(uint32_t), 1, fp) != 1 || fread(&h->total_bytes, sizeof(uint32_t), 1, fp) != 1)
+		return 0;
+	if (h->page_size == 0 || (h->page_size & (h->page_size - 1)) || h->segments > h->pages)
+		return 0;
+	h->address_range = (h->max_address - h->min_address) + 1;
+	h->segment = (hex_segment_t *)calloc(h->segments, sizeof(hex_segment_t));
+	for (i = 0; i < h->segments; ++i) {
+		s = &h->segment[i];
+		if (fread(&s->address, sizeof(uint32_t), 1, fp) != 1 || fread(&s->pages, sizeof(uint32_t), 1, fp) != 1 || s->pages > h->pages) {
+			h->segments = i;
+			return 0;
+		}
+		s->size = s->pages;
+		bytes = s->pages * h->page_size;
+		s->mem = (uint8_t *)malloc(bytes);
+		s->tag = (uint8_t *)malloc(bytes);
+		s->flags = (uint8_t *)malloc(s->pages);
+		s->crc = (uint16_t *)malloc(s->pages * sizeof(uint16_t));
+		if (fread(s->mem, 1, bytes, fp) != bytes || fread(s->tag, 1, bytes, fp) != bytes
+			|| fread(s->flags, 1, s->pages, fp) != s->pages || fread(s->crc, sizeof(uint16_t), s->pages, fp) != s->pages) {
+			h->segments = i + 1;
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+// the image of a hex file, parsed only the first time the cache sees its contents
+hex_t *cache_image_load(char *filename) {
+	char name[64], path[1024];
+	uint64_t source;
+	hex_t *h;
+	FILE *fp;
+
+	source = cache_file_hash(filename);
+	snprintf(name, sizeof(name), "%016llx.img", (unsigned long long)source);
+	if (source && cache_path(path, sizeof(path), name) && (fp = fopen(path, "rb")) != NULL) {
+		h = hex_new(HEX_PAGE_SIZE);
+		if (cache_image_read(fp, h)) {
+			fclose(fp);
+			h->source = source;
+			printf("hex: %s from cache %s\n", filename, path);
+			printf("\t%-20s: %d\n", "total bytes", h->total_bytes);
+			printf("\t%-20s: %04X (%u)\n", "min address", h->min_address, h->min_address);
+			printf("\t%-20s: %04X (%u)\n", "max address", h->max_address, h->max_address);
+			printf("\t%-20s: %d of %d bytes in %d segments\n", "pages", h->pages, h->page_size, h->segments);
+			return h;
+		}
+		fclose(fp);
+		hex_free(h);
+		warning("ignoring damaged cache entry '%s'\n", path);
+	}
+
+	h = hex_load_from_file(filename);
+	h->source = source;
+	cache_image_store(h);
+
+	return h;
+}
+
+// write the image to the cache under the hash of its file, with whatever page CRCs it has by now
+// the entry is written aside and renamed so a reader never sees half of it
+void cache_image_store(hex_t *h) {
+	char name[64], path[1024], tmp[1040];
+	uint32_t magic = CACHE_IMAGE_MAGIC, version = CACHE_IMAGE_VERSION, i, bytes;
+	hex_segment_t *s;
+	FILE *fp;
+	int ok;
+
+	snprintf(name, sizeof(name), "%016llx.img", (unsigned long long)h->source);
+	if (!h->source || !cache_path(path, sizeof(path), name))
+		return;
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+	if (!(fp = fopen(tmp, "wb")))
+		return;
+	ok = (fwrite(&magic, sizeof(magic), 1, fp) == 1 && fwrite(&version, sizeof(version), 1, fp) == 1
+		&& fwrite(&h->page_size, sizeof(uint32_t), 1, fp) == 1 && fwrite(&h->pages, sizeof(uint32_t), 1, fp) == 1
+		&& fwrite(&h->segments, sizeof(uint32_t), 1, fp) == 1 && fwrite(&h->min_address, sizeof(uint32_t), 1, fp) == 1
+		&& fwrite(&h->max_address, sizeof(uint32_t), 1, fp) == 1 && fwrite(&h->total_bytes, sizeof(uint32_t), 1, fp) == 1);
+	for (i = 0; ok && i < h->segments; ++i) {
+		s = &h->segment[i];
+		bytes = s->pages * h->page_size;
+		ok = (fwrite(&s->address, sizeof(uint32_t), 1, fp) == 1 && fwrite(&s->pages, sizeof(uint32_t), 1, fp) == 1
+			&& fwrite(s->mem, 1, bytes, fp) == bytes && fwrite(s->tag, 1, bytes, fp) == bytes
+			&& fwrite(s->flags, 1, s->pages, fp) == s->pages && fwrite(s->crc, sizeof(uint16_t), s->pages, fp) == s->pages);
+	}
+	if (fclose(fp) != 0)
+		ok = 0;
+	if (!ok || rename(tmp, path) != 0) {
+		warning("unable to write cache entry '%s'\n", path);
+		unlink(tmp);
+	}
+}
+
+static void cache_state_name(cache_state_t *s, char *name, size_t len) {
+	snprintf(name, len, "node-%02x%02x%02x-%02x.state", s->sig[0], s->sig[1], s->sig[2], s->node_id);
+}
+
+// the last known state of the node named by node_id and sig, 0 when there is none for its page size
+int cache_state_load(cache_state_t *s) {
+	char name[64], path[1024], line[1024];
+	unsigned int node_id, sig[3], spm_pagesize, address, crc;
+	unsigned long long image;
+	int target = 0;
+	FILE *fp;
+
+	s->pages = 0;
+	s->address = NULL;
+	s->crc = NULL;
+	s->image = 0;
+	cache_state_name(s, name, sizeof(name));
+	if (!cache_path(path, sizeof(path), name) || !(fp = fopen(path, "r")))
+		return 0;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "target %u %x %x %x %u", &node_id, &sig[0], &sig[1], &sig[2], &spm_pagesize) == 5) {
+			target = (node_id == s->node_id && sig[0] == s->sig[0] && sig[1] == s->sig[1] && sig[2] == s->sig[2] && spm_pagesize == s->spm_pagesize);
+		} else if (sscanf(line, "image %llx", &image) == 1) {
+			s->image = image;
+		} else if (sscanf(line, "page %u %x", &address, &crc) == 2) {
+			s->address = (uint32_t *)realloc(s->address, (s->pages + 1) * sizeof(uint32_t));
+			s->crc = (uint16_t *)realloc(s->crc, (s->pages + 1) * sizeof(uint16_t));
+			s->address[s->pages] = address;
+			s->crc[s->pages++] = crc;
+		}
+	}
+	fclose(fp);
+
+	if (!target)
+		cache_state_free(s);
+
+	return target && s->pages;
+}
+
+void cache_state_store(cache_state_t *s) {
+	char name[64], path[1024];
+	uint32_t i;
+	FILE *fp;
+
+	cache_state_name(s, name, sizeof(name));
+	if (!cache_path(path, sizeof(path), name))
+		return;
+	if (!(fp = fopen(path, "w"))) {
+		warning("unable to write cache entry '%s'\n", path);
+		return;
+	}
+	fprintf(fp, "# last known flash state\ntarget %d %x %x %x %d\nimage %016llx\n", s->node_id, s->sig[0], s->sig[1], s->sig[2], s->spm_pagesize, (unsigned long long)s->image);
+	for (i = 0; i < s->pages; ++i)
+		fprintf(fp, "page %d %04x\n", s->address[i], s->crc[i]);
+	fclose(fp);
+}
+
+void cache_state_free(cache_state_t *s) {
+	free(s->address);
+	free(s->crc);
+	s->address = NULL;
+	s->crc = NULL;
+	s->pages = 0;
+}
@@ -0,0 +1,30 @@
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+// the cache lives in $NRF24_CACHE, or in CACHE_DIR under $HOME when that is not set,
+// setting NRF24_CACHE to an empty string turns it off
+#define CACHE_DIR_ENV	"NRF24_CACHE"
+#define CACHE_DIR	".nrf24-cache"
+
+// parsed images, "<content hash>.img"
+#define CACHE_IMAGE_MAGIC	0x474D4946	// "FIMG"
+#define CACHE_IMAGE_VERSION	1
+
+// what is known to be in the flash of a node, by the page CRCs confirmed on it
+typedef struct cache_state {
+	uint8_t node_id;
+	uint8_t sig[3];
+	uint8_t spm_pagesize;
+	uint64_t image;
+	uint32_t pages;
+	uint32_t *address;
+	uint16_t *crc;
+} cache_state_t;
+
+hex_t *cache_image_load(char *filename);
+void cache_image_store(hex_t *h);
+int cache_state_load(cache_state_t *s);
+void cache_state_store(cache_state_t *s);
+void cache_state_free(cache_state_t *s);
+
+#endif /* _CACHE_H_ */
@@ -0,0 +1 @@
+../lib/fec.c
\ No newline at end of file
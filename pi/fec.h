@@ -0,0 +1 @@
+../lib/fec.h
\ No newline at end of file
@@ -7,230 +7,672 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <sys/mman.h>
 
 #include "error.h"
 #include "file.h"
 #include "hex.h"
 
-hex_t *hex_load_from_file(char *filename) {
-	file_t *f;
-	hex_t *h;
-	char line[1024];
-	int line_no = 0, fields, i, j;
-	uint8_t checksum, eof = 0;
-	hex_record_t *r;
+// hex digit values, HEX_DIGIT marks the characters that are digits at all
+#define HEX_DIGIT	0x10
+static const uint8_t hex_digit[256] = {
+	['0'] = HEX_DIGIT | 0x0, ['1'] = HEX_DIGIT | 0x1, ['2'] = HEX_DIGIT | 0x2, ['3'] = HEX_DIGIT | 0x3,
+	['4'] = HEX_DIGIT | 0x4, ['5'] = HEX_DIGIT | 0x5, ['6'] = HEX_DIGIT | 0x6, ['7'] = HEX_DIGIT | 0x7,
+	['8'] = HEX_DIGIT | 0x8, ['9'] = HEX_DIGIT | 0x9,
+	['A'] = HEX_DIGIT | 0xA, ['B'] = HEX_DIGIT | 0xB, ['C'] = HEX_DIGIT | 0xC,
+	['D'] = HEX_DIGIT | 0xD, ['E'] = HEX_DIGIT | 0xE, ['F'] = HEX_DIGIT | 0xF,
+	['a'] = HEX_DIGIT | 0xA, ['b'] = HEX_DIGIT | 0xB, ['c'] = HEX_DIGIT | 0xC,
+	['d'] = HEX_DIGIT | 0xD, ['e'] = HEX_DIGIT | 0xE, ['f'] = HEX_DIGIT | 0xF,
+};
+
+// the two digits at p as a byte, returns 0 when they are not hex digits
+static inline int hex_byte(const char *p, uint8_t *byte) {
+	uint8_t hi = hex_digit[(uint8_t)p[0]], lo = hex_digit[(uint8_t)p[1]];
+
+	*byte = ((hi & 0x0F) << 4) | (lo & 0x0F);
+
+	return hi & lo & HEX_DIGIT;
+}
+
+// first segment starting above address, the one before it is the only one that can hold address
+static uint32_t hex_segment_after(hex_t *h, uint32_t address) {
+	uint32_t lo = 0, hi = h->segments, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (h->segment[mid].address <= address)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
 
-	f = file_open(filename, "r");
+// the segment and page holding address, 0 when the page is not in the image
+static int hex_segment_find(hex_t *h, uint32_t address, hex_segment_t **s, uint32_t *page) {
+	uint32_t n;
 
-	printf("reading hex from file '%s'\n", f->filename);
+	n = hex_segment_after(h, address);
+	if (n == 0)
+		return 0;
+	*s = &h->segment[n - 1];
+	if (address >= (*s)->address + ((*s)->pages * h->page_size))
+		return 0;
+	*page = (address - (*s)->address) / h->page_size;
+
+	return 1;
+}
+
+// make room for pages more pages at the end of s
+static void hex_segment_reserve(hex_t *h, hex_segment_t *s, uint32_t pages) {
+	if (s->pages + pages <= s->size)
+		return;
+	s->size = (s->size * 2 > s->pages + pages ? s->size * 2 : s->pages + pages);
+	s->mem = (uint8_t *)realloc(s->mem, s->size * h->page_size);
+	s->tag = (uint8_t *)realloc(s->tag, s->size * h->page_size);
+	s->flags = (uint8_t *)realloc(s->flags, s->size);
+	s->crc = (uint16_t *)realloc(s->crc, s->size * sizeof(uint16_t));
+	if (!s->mem || !s->tag || !s->flags || !s->crc)
+		fatal_error("unable to allocate memory for hex segment\n");
+}
+
+static void hex_segment_blank(hex_t *h, hex_segment_t *s, uint32_t page) {
+	memset(&s->mem[page * h->page_size], 0xFF, h->page_size);
+	memset(&s->tag[page * h->page_size], HEX_TAG_UNALLOC, h->page_size);
+	s->flags[page] = HEX_PAGE_BLANK;
+}
+
+// page of the image holding address, added when it is not there yet
+// hex files are nearly always in address order so a new page almost always extends the last segment
+static void hex_page_get(hex_t *h, uint32_t address, hex_segment_t **seg, uint32_t *page) {
+	hex_segment_t *s, *t;
+	uint32_t n, ps = h->page_size;
+
+	address &= ~(ps - 1);
+	if (hex_segment_find(h, address, seg, page))
+		return;
+
+	n = hex_segment_after(h, address);
+	h->pages++;
+	h->cursor = h->cursor_page = 0;
+	if (n > 0 && h->segment[n - 1].address + (h->segment[n - 1].pages * ps) == address) {
+		// extends the segment before, which may now run into the one after
+		s = &h->segment[n - 1];
+		hex_segment_reserve(h, s, 1);
+		hex_segment_blank(h, s, s->pages);
+		*page = s->pages++;
+		if (n < h->segments && h->segment[n].address == address + ps) {
+			t = &h->segment[n];
+			hex_segment_reserve(h, s, t->pages);
+			memcpy(&s->mem[s->pages * ps], t->mem, t->pages * ps);
+			memcpy(&s->tag[s->pages * ps], t->tag, t->pages * ps);
+			memcpy(&s->flags[s->pages], t->flags, t->pages);
+			memcpy(&s->crc[s->pages], t->crc, t->pages * sizeof(uint16_t));
+			s->pages += t->pages;
+			free(t->mem);
+			free(t->tag);
+			free(t->flags);
+			free(t->crc);
+			memmove(t, t + 1, (h->segments - n - 1) * sizeof(hex_segment_t));
+			h->segments--;
+			s = &h->segment[n - 1];
+		}
+	} else if (n < h->segments && h->segment[n].address == address + ps) {
+		// runs into the segment after, its pages move up by one
+		s = &h->segment[n];
+		hex_segment_reserve(h, s, 1);
+		memmove(&s->mem[ps], s->mem, s->pages * ps);
+		memmove(&s->tag[ps], s->tag, s->pages * ps);
+		memmove(&s->flags[1], s->flags, s->pages);
+		memmove(&s->crc[1], s->crc, s->pages * sizeof(uint16_t));
+		s->address = address;
+		s->pages++;
+		hex_segment_blank(h, s, 0);
+		*page = 0;
+	} else {
+		h->segment = (hex_segment_t *)realloc(h->segment, (h->segments + 1) * sizeof(hex_segment_t));
+		if (!h->segment)
+			fatal_error("unable to allocate memory for hex segments\n");
+		memmove(&h->segment[n + 1], &h->segment[n], (h->segments - n) * sizeof(hex_segment_t));
+		h->segments++;
+		s = &h->segment[n];
+		memset(s, 0, sizeof(hex_segment_t));
+		s->address = address;
+		hex_segment_reserve(h, s, 1);
+		hex_segment_blank(h, s, 0);
+		s->pages = 1;
+		*page = 0;
+	}
+	*seg = s;
+}
+
+hex_t *hex_new(uint32_t page_size) {
+	hex_t *h;
+
+	if (page_size == 0 || (page_size & (page_size - 1)))
+		fatal_error("hex page size %d is not a power of two\n", page_size);
 
 	h = malloc(sizeof(hex_t));
 	memset(h, 0, sizeof(hex_t));
-	h->min_address = UINT16_MAX;
+	h->page_size = page_size;
+	h->min_address = UINT32_MAX;
 
-	while (fgets(line, 1024, f->fp) != NULL) {
+	return h;
+}
+
+// add bytes of data at address to the image, replacing what is there
+void hex_write(hex_t *h, uint32_t address, uint8_t *data, uint32_t bytes) {
+	hex_segment_t *s = NULL;
+	uint32_t page = 0, i, k, ps = h->page_size;
+	uint8_t *mem, *tag;
+
+	if (bytes == 0)
+		return;
+	if (address < h->min_address)
+		h->min_address = address;
+	if (address + (bytes - 1) > h->max_address || h->total_bytes == 0)
+		h->max_address = address + (bytes - 1);
+
+	for (i = 0; i < bytes; ++i, ++address) {
+		if (!s || (address & (ps - 1)) == 0) {
+			hex_page_get(h, address, &s, &page);
+			s->flags[page] = (s->flags[page] & ~HEX_PAGE_CRC) | HEX_PAGE_ALLOC;
+		}
+		k = (page * ps) + (address & (ps - 1));
+		mem = &s->mem[k];
+		tag = &s->tag[k];
+		if (*tag == HEX_TAG_UNALLOC) {
+			*tag = HEX_TAG_ALLOC;
+			h->total_bytes++;
+		}
+		if (data[i] != 0xFF) {
+			s->flags[page] &= ~HEX_PAGE_BLANK;
+		} else if (*mem != 0xFF) {
+			// the page may have just gone blank
+			*mem = 0xFF;
+			for (k = 0; k < ps && s->mem[(page * ps) + k] == 0xFF; ++k)
+				;
+			if (k == ps)
+				s->flags[page] |= HEX_PAGE_BLANK;
+		}
+		*mem = data[i];
+	}
+	h->address_range = (h->max_address - h->min_address) + 1;
+}
+
+// the allocated bytes of src written over dst, run by run
+static void hex_write_image(hex_t *dst, hex_t *src) {
+	hex_segment_t *s;
+	uint32_t i, start, end, bytes;
+
+	for (i = 0; i < src->segments; ++i) {
+		s = &src->segment[i];
+		bytes = s->pages * src->page_size;
+		for (start = 0; start < bytes; start = end) {
+			while (start < bytes && s->tag[start] != HEX_TAG_ALLOC)
+				++start;
+			for (end = start; end < bytes && s->tag[end] == HEX_TAG_ALLOC; ++end)
+				;
+			hex_write(dst, s->address + start, &s->mem[start], end - start);
+		}
+	}
+}
+
+// single pass over the mapped file, the data goes straight into the pages of the image
+// extended segment (02) and extended linear (04) address records give 32 bit addresses, the start
+// address records (03, 05) are checked and ignored
+hex_t *hex_load_from_file(char *filename) {
+	hex_t *h;
+	struct stat st;
+	const char *map, *p, *end, *line;
+	uint8_t byte_count, record_type, checksum, byte, data[255];
+	uint16_t offset;
+	uint32_t base = 0, records = 0, i, n;
+	int fd, line_no = 0, eof = 0;
+
+	if ((fd = open(filename, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+		perror(NULL);
+		fatal_error("unable to open file '%s'\n", filename);
+	}
+	map = (st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL);
+	if (map == MAP_FAILED) {
+		perror(NULL);
+		fatal_error("unable to map file '%s'\n", filename);
+	}
+
+	printf("reading hex from file '%s'\n", filename);
+
+	h = hex_new(HEX_PAGE_SIZE);
+
+	end = map + st.st_size;
+	for (p = map; p < end; ) {
+		// one line, without its end of line characters
+		line = p;
+		while (p < end && *p != '\n')
+			++p;
+		n = p - line;
+		if (p < end)
+			++p;
 		++line_no;
-		if (line[0] == '#')
+		while (n && (line[n - 1] == '\r' || line[n - 1] == ' ' || line[n - 1] == '\t'))
+			--n;
+		if (n == 0 || line[0] == '#')
 			continue;
 		if (eof) {
-			warning("in file '%s' on line %d: additional lines found in file after EOF record on line %d\n", f->filename, line_no, eof);
+			warning("in file '%s' on line %d: additional lines found in file after EOF record on line %d\n", filename, line_no, eof);
 			exit(EXIT_FAILURE);
 		}
-		r = malloc(sizeof(hex_record_t));
-		r->line = strdup(line);
-		// parse the line
-		if (strlen(r->line) < (1 + 2 + 4 + 2 + 2)) {	// : + byte_count + address + record_type + checksum
-			warning("in file '%s' on line %d: line too short for minimum content\n", f->filename, line_no);
+		if (n < (1 + 2 + 4 + 2 + 2)) {	// : + byte_count + address + record_type + checksum
+			warning("in file '%s' on line %d: line too short for minimum content\n", filename, line_no);
 			exit(EXIT_FAILURE);
 		}
-		fields = sscanf(line, ":%02hhX%04hx%02hhX", &r->byte_count, &r->address, &r->record_type);
-		if (fields != 3) {
-			warning("in file '%s' on line %d: unable to read first three fields on line: byte_count, address, and record_type\n", f->filename, line_no);
+		if (line[0] != ':' || !hex_byte(&line[1], &byte_count) || !hex_byte(&line[3], &byte) || !hex_byte(&line[5], &checksum) || !hex_byte(&line[7], &record_type)) {
+			warning("in file '%s' on line %d: unable to read first three fields on line: byte_count, address, and record_type\n", filename, line_no);
 			exit(EXIT_FAILURE);
 		}
-		if (r->record_type == 0x0) {
-			// normal
-			if (r->address < h->min_address) {
-				h->min_address = r->address;
-			}
-			if (r->address + (r->byte_count - 1) > h->max_address) {
-				h->max_address = r->address + (r->byte_count - 1);
-			}
-		} else if (r->record_type == 0x1) {
-			if (r->byte_count != 0) {
-				warning("in file '%s' on line %d: for record type %04hX (EOF), byte count must = 0 (found %d)\n", f->filename, line_no, r->record_type, r->byte_count);
-				exit(EXIT_FAILURE);
-			} else if (r->address != 0) {
-				warning("in file '%s' on line %d: for record type %04hX (EOF), address must = 0x0000 (found %0xhX)\n", f->filename, line_no, r->record_type, r->address);
-				exit(EXIT_FAILURE);
-			}
-			eof = line_no;
-		} else {
-			warning("in file '%s' on line %d: unhandled record type %04hX (%d)\n", f->filename, line_no, r->record_type, r->record_type);
-			exit(EXIT_FAILURE);
-		}
-//		printf("parsed %d fields: 0x%x 0x%x 0x%x\n", fields, r->byte_count, r->address, r->record_type);
-		if (strlen(r->line) < (1 + 2 + 4 + 2 + 2 + (2 * r->byte_count))) {
-			warning("in file '%s' on line %d: line too short for minimum content and specified byte count (%d)\n", f->filename, line_no, r->byte_count);
+		offset = ((uint16_t)byte << 8) | checksum;
+		if (n < (1 + 2 + 4 + 2 + 2 + (2 * byte_count))) {
+			warning("in file '%s' on line %d: line too short for minimum content and specified byte count (%d)\n", filename, line_no, byte_count);
 			exit(EXIT_FAILURE);
 		}
-		if (r->byte_count > 0) {
-			r->data = (uint8_t *)malloc(r->byte_count * sizeof(uint8_t));
-			for (i = 0; i < r->byte_count; ++i) {
-				sscanf(&line[9 + (i * 2)], "%02hhX", &r->data[i]);
+		checksum = byte_count + (offset >> 8) + (offset & 0x00FF) + record_type;
+		for (i = 0; i <= byte_count; ++i) {
+			if (!hex_byte(&line[9 + (i * 2)], &byte)) {
+				warning("in file '%s' on line %d: invalid hex digits at column %d\n", filename, line_no, 10 + (i * 2));
+				exit(EXIT_FAILURE);
 			}
-		} else {
-			i = 0;
-		}
-		// checksum
-		sscanf(&line[9 + (i * 2)], "%02hhX", &r->checksum);
-		checksum = r->byte_count + ((r->address & 0xFF00) >> 8) + (r->address & 0x00FF) + r->record_type;
-		for (i = 0; i < r->byte_count; ++i) {
-			checksum += r->data[i];
-		}
-//		checksum = ~checksum + 1;
-//		if (checksum != r->checksum) ...
-//		alternately
-		if (((checksum + r->checksum) & 0xFF) != 0) {
-			warning("in file '%s' on line %d: checksum failed!\n", f->filename, line_no);
+			checksum += byte;
+			if (i < byte_count)
+				data[i] = byte;
+		}
+		if (checksum != 0) {
+			warning("in file '%s' on line %d: checksum failed!\n", filename, line_no);
 			exit(EXIT_FAILURE);
 		}
+		++records;
 
-		h->records++;
-		h->record = realloc(h->record, sizeof(hex_record_t *) * h->records);
-		h->record[h->records - 1] = r;
-		h->total_bytes += r->byte_count;
+		switch (record_type) {
+			case 0x00:
+				// data
+				hex_write(h, base + offset, data, byte_count);
+				break;
+			case 0x01:
+				// end of file
+				if (byte_count != 0) {
+					warning("in file '%s' on line %d: for record type %04hX (EOF), byte count must = 0 (found %d)\n", filename, line_no, record_type, byte_count);
+					exit(EXIT_FAILURE);
+				} else if (offset != 0) {
+					warning("in file '%s' on line %d: for record type %04hX (EOF), address must = 0x0000 (found %0xhX)\n", filename, line_no, record_type, offset);
+					exit(EXIT_FAILURE);
+				}
+				eof = line_no;
+				break;
+			case 0x02:
+			case 0x04:
+				// extended segment address (bits 4 - 19) or extended linear address (bits 16 - 31)
+				if (byte_count != 2) {
+					warning("in file '%s' on line %d: for record type %04hX (extended address), byte count must = 2 (found %d)\n", filename, line_no, record_type, byte_count);
+					exit(EXIT_FAILURE);
+				}
+				base = ((uint32_t)data[0] << 8) | data[1];
+				base <<= (record_type == 0x02 ? 4 : 16);
+				break;
+			case 0x03:
+			case 0x05:
+				// start segment address (CS:IP) or start linear address (EIP), nothing for us to run
+				if (byte_count != 4) {
+					warning("in file '%s' on line %d: for record type %04hX (start address), byte count must = 4 (found %d)\n", filename, line_no, record_type, byte_count);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			default:
+				warning("in file '%s' on line %d: unhandled record type %04hX (%d)\n", filename, line_no, record_type, record_type);
+				exit(EXIT_FAILURE);
+		}
 	}
-	h->address_range = (h->max_address - h->min_address) + 1;
-	h->mem = (uint8_t *)malloc((h->max_address + 1) * sizeof(uint8_t));
-	h->tag = (uint8_t *)malloc((h->max_address + 1) * sizeof(uint8_t));
-	memset(h->mem, 0xFF, (h->max_address + 1) * sizeof(uint8_t));
-	memset(h->tag, HEX_TAG_UNALLOC, (h->max_address + 1) * sizeof(uint8_t));
-	for (i = 0; i < h->records; ++i) {
-		uint16_t addr;
-		r = h->record[i];
-		addr = r->address;
-		for (j = 0; j < r->byte_count; ++j) {
-			h->mem[addr] = r->data[j];
-			h->tag[addr++] = HEX_TAG_ALLOC;
-		}
-	}
-
-	printf("hex: %s\n", f->filename);
-	printf("\t%-20s: %d\n", "records", h->records);
+	if (h->total_bytes == 0) {
+		warning("in file '%s': no data records\n", filename);
+		exit(EXIT_FAILURE);
+	}
+
+	printf("hex: %s\n", filename);
+	printf("\t%-20s: %d\n", "records", records);
 	printf("\t%-20s: %d\n", "total bytes", h->total_bytes);
-	printf("\t%-20s: %04hX (%d)\n", "min address", h->min_address, h->min_address);
-	printf("\t%-20s: %04hX (%d)\n", "max address", h->max_address, h->max_address);
-	printf("\t%-20s: %04hX (%d)\n", "address range", h->address_range, h->address_range);
+	printf("\t%-20s: %04X (%u)\n", "min address", h->min_address, h->min_address);
+	printf("\t%-20s: %04X (%u)\n", "max address", h->max_address, h->max_address);
+	printf("\t%-20s: %04X (%u)\n", "address range", h->address_range, h->address_range);
+	printf("\t%-20s: %d of %d bytes in %d segments\n", "pages", h->pages, h->page_size, h->segments);
 
-	file_close(f);
+	if (map)
+		munmap((void *)map, st.st_size);
+	close(fd);
 
 	return h;
 }
 
+
 void hex_free(hex_t *h) {
-	int i;
+	uint32_t i;
 
-	free(h->mem);
-	free(h->tag);
-	for (i = 0; i < h->records; ++i) {
-		free(h->record[i]->line);
-		if (h->record[i]->byte_count)
-			free(h->record[i]->data);
-		free(h->record[i]);
+	for (i = 0; i < h->segments; ++i) {
+		free(h->segment[i].mem);
+		free(h->segment[i].tag);
+		free(h->segment[i].flags);
+		free(h->segment[i].crc);
 	}
-	free(h->record);	
+	free(h->segment);
 	free(h);
 }
 
-void hex_from_map_add_record(hex_t *h, uint16_t start, uint16_t end) {
-	hex_record_t *r;
-	uint16_t i;
-	uint8_t line_len;
+// page the image the way the target does, the cached CRCs go with the old pages
+void hex_set_page_size(hex_t *h, uint32_t page_size) {
+	hex_t *n;
+	uint32_t i;
 
-	r = (hex_record_t *)malloc(sizeof(hex_record_t));
-	h->record = (hex_record_t **)realloc(h->record, (h->records + 1) * sizeof(hex_record_t *));
-	h->record[h->records++] = r;
-	r->address = start + h->min_address;
-	r->byte_count = (end - start) + 1;
-	r->record_type = 0;
-	r->data = (uint8_t *)malloc(sizeof(uint8_t) * r->byte_count);
-	for (i = start; i <= end; ++i) {
-		r->data[i - start] = h->mem[i];
+	if (h->page_size == page_size)
+		return;
+	n = hex_new(page_size);
+	hex_write_image(n, h);
+	for (i = 0; i < h->segments; ++i) {
+		free(h->segment[i].mem);
+		free(h->segment[i].tag);
+		free(h->segment[i].flags);
+		free(h->segment[i].crc);
 	}
-	r->checksum = r->byte_count + ((r->address & 0xFF00) >> 8) + (r->address & 0x00FF) + r->record_type;
-	for (i = 0; i < r->byte_count; ++i) {
-		r->checksum += r->data[i];
-	}
-	r->checksum = ~r->checksum + 1;
-
-	line_len = (1 + 2 + 4 + 2 + 2 + (2 * r->byte_count) + 1);
-	r->line = (char *)malloc(sizeof(char) * line_len);
-	sprintf(r->line, ":%02hhX%04hx%02hhX", r->byte_count, r->address, r->record_type);
-	for (i = 0; i < r->byte_count; ++i)
-		sprintf(&r->line[(i * 2) + 9], "%02hhX", r->data[i]);
-	sprintf(&r->line[(i * 2) + 9], "%02hhX", r->checksum);
+	free(h->segment);
+	n->source = h->source;
+	*h = *n;
+	free(n);
 }
 
-hex_t *hex_from_map(uint8_t *mem, uint8_t *tag, uint16_t bytes, uint16_t min_address) {
+// a new image of the bytes of a with those of b over them, in the pages of a
+hex_t *hex_merge(hex_t *a, hex_t *b) {
 	hex_t *h;
-	uint16_t i, start = 0;
-	uint8_t last_tag = HEX_TAG_UNALLOC, consecutive_allocs = 0;
-	
-	h = malloc(sizeof(hex_t));
-	memset(h, 0, sizeof(hex_t));
-	h->min_address = min_address;
-	h->max_address = min_address + (bytes - 1);
-	h->address_range = (h->max_address - h->min_address) + 1;
 
-	h->mem = (uint8_t *)malloc(sizeof(uint8_t) * bytes);
-	memcpy(h->mem, mem, sizeof(uint8_t) * bytes);
-	h->tag = (uint8_t *)malloc(sizeof(uint8_t) * bytes);
-	memcpy(h->tag, tag, sizeof(uint8_t) * bytes);
-
-	printf("hex_from_map: %d byte mem map\n", bytes);
-
-	for (i = 0; i < bytes; ++i) {
-		if (h->tag[i] == HEX_TAG_UNALLOC && last_tag == HEX_TAG_ALLOC) {
-			// create a new record up through from start to i - 1
-			hex_from_map_add_record(h, start, i - 1);
-			consecutive_allocs = 0;
-		} else if (consecutive_allocs >= HEX_DEFAULT_BYTE_COUNT) {
-			hex_from_map_add_record(h, start, i - 1);
-			start = i;
-			consecutive_allocs = 0;
-		} else if (h->tag[i] == HEX_TAG_ALLOC && last_tag == HEX_TAG_UNALLOC) {
-			start = i;
-		}
-		last_tag = h->tag[i];
-		if (h->tag[i] == HEX_TAG_ALLOC) {
-			consecutive_allocs++;
-			h->total_bytes++;
+	h = hex_new(a->page_size);
+	hex_write_image(h, a);
+	hex_write_image(h, b);
+
+	return h;
+}
+
+// addresses of the pages that differ between a and b, bytes outside an image read as 0xFF
+// up to max addresses are stored, the number of differing pages is returned
+uint32_t hex_diff(hex_t *a, hex_t *b, uint32_t *address, uint32_t max) {
+	uint32_t pa = 0, pb = 0, page, n = 0;
+	int more_a, more_b;
+	uint8_t *ma, *mb;
+
+	if (a->page_size != b->page_size)
+		fatal_error("hex_diff: page sizes differ (%d and %d)\n", a->page_size, b->page_size);
+
+	more_a = hex_page_next(a, &pa);
+	more_b = hex_page_next(b, &pb);
+	while (more_a || more_b) {
+		page = (!more_b || (more_a && pa < pb) ? pa : pb);
+		ma = (more_a && pa == page ? hex_page(a, page, NULL) : NULL);
+		mb = (more_b && pb == page ? hex_page(b, page, NULL) : NULL);
+		if (ma && mb ? memcmp(ma, mb, a->page_size) != 0 : !(hex_page_flags(ma ? a : b, page) & HEX_PAGE_BLANK)) {
+			if (n < max)
+				address[n] = page;
+			++n;
 		}
-	}
-	if (h->tag[i - 1] == HEX_TAG_ALLOC) {
-		if (last_tag == HEX_TAG_ALLOC) {
-			hex_from_map_add_record(h, start, i - 1);
-		} else {
-			hex_from_map_add_record(h, i - 1, i - 1);
+		if (ma) {
+			pa += a->page_size;
+			more_a = hex_page_next(a, &pa);
+		}
+		if (mb) {
+			pb += b->page_size;
+			more_b = hex_page_next(b, &pb);
 		}
 	}
 
-	printf("created %d records\n", h->records);
+	return n;
+}
 
-	return h;
+// moves address on to the first page of the image at or above it, 0 when there is none
+int hex_page_next(hex_t *h, uint32_t *address) {
+	hex_segment_t *s;
+	uint32_t n, page;
+
+	if (hex_segment_find(h, *address & ~(h->page_size - 1), &s, &page)) {
+		*address = s->address + (page * h->page_size);
+		return 1;
+	}
+	n = hex_segment_after(h, *address);
+	if (n == h->segments)
+		return 0;
+	*address = h->segment[n].address;
+
+	return 1;
 }
 
-void hex_save_to_file(hex_t *h, char *filename) {
-	int i;
+// address of page n of the image, counting from the lowest, walking on from the last lookup
+uint32_t hex_page_address(hex_t *h, uint32_t n) {
+	if (n < h->cursor_page)
+		h->cursor = h->cursor_page = 0;
+	while (h->cursor < h->segments && n >= h->cursor_page + h->segment[h->cursor].pages)
+		h->cursor_page += h->segment[h->cursor++].pages;
+	if (h->cursor == h->segments)
+		fatal_error("hex_page_address: page %d is past the %d pages of the image\n", n, h->pages);
+
+	return h->segment[h->cursor].address + ((n - h->cursor_page) * h->page_size);
+}
+
+// index of the page holding address as counted by hex_page_address, 0 when it is not in the image
+int hex_page_index(hex_t *h, uint32_t address, uint32_t *n) {
+	hex_segment_t *s;
+	uint32_t i, page;
+
+	if (!hex_segment_find(h, address, &s, &page))
+		return 0;
+	*n = page;
+	for (i = 0; &h->segment[i] != s; ++i)
+		*n += h->segment[i].pages;
+
+	return 1;
+}
+
+// bytes of the page holding address, NULL when it is not in the image
+uint8_t *hex_page(hex_t *h, uint32_t address, uint8_t **tag) {
+	hex_segment_t *s;
+	uint32_t page;
+
+	if (!hex_segment_find(h, address, &s, &page))
+		return NULL;
+	if (tag)
+		*tag = &s->tag[page * h->page_size];
+
+	return &s->mem[page * h->page_size];
+}
+
+uint8_t hex_page_flags(hex_t *h, uint32_t address) {
+	hex_segment_t *s;
+	uint32_t page;
+
+	if (!hex_segment_find(h, address, &s, &page))
+		return HEX_PAGE_BLANK;
+
+	return s->flags[page];
+}
+
+// avr-libc _crc16_update, as used by the bootloader
+static uint16_t hex_crc16_update(uint16_t crc, uint8_t a) {
+	uint8_t i;
+
+	crc ^= a;
+	for (i = 0; i < 8; ++i) {
+		if (crc & 1)
+			crc = (crc >> 1) ^ 0xA001;
+		else
+			crc = (crc >> 1);
+	}
+
+	return crc;
+}
+
+// CRC of the page holding address as it is written, unused bytes are 0xFF
+// computed once per page and kept until the page is written to again
+uint16_t hex_page_crc(hex_t *h, uint32_t address) {
+	hex_segment_t *s;
+	uint32_t page, k;
+	uint16_t crc = 0xFFFF;
+	uint8_t *mem;
+
+	if (!hex_segment_find(h, address, &s, &page)) {
+		for (k = 0; k < h->page_size; ++k)
+			crc = hex_crc16_update(crc, 0xFF);
+		return crc;
+	}
+	if (s->flags[page] & HEX_PAGE_CRC)
+		return s->crc[page];
+	mem = &s->mem[page * h->page_size];
+	for (k = 0; k < h->page_size; ++k)
+		crc = hex_crc16_update(crc, mem[k]);
+	s->crc[page] = crc;
+	s->flags[page] |= HEX_PAGE_CRC;
+
+	return crc;
+}
+
+// 64 bit FNV-1a of the address range and contents of the image, gaps hash as 0xFF
+uint64_t hex_hash(hex_t *h) {
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	uint32_t i, address, end;
+	hex_segment_t *s;
+
+	for (i = 0; i < 4; ++i)
+		hash = (hash ^ ((h->min_address >> (i * 8)) & 0xFF)) * 0x100000001B3ULL;
+	address = h->min_address;
+	for (i = 0; i < h->segments; ++i) {
+		s = &h->segment[i];
+		for (; address < s->address; ++address)
+			hash = (hash ^ 0xFF) * 0x100000001B3ULL;
+		end = s->address + ((s->pages - 1) * h->page_size) + (h->page_size - 1);
+		if (end > h->max_address)
+			end = h->max_address;
+		for (; address <= end; ++address)
+			hash = (hash ^ s->mem[address - s->address]) * 0x100000001B3ULL;
+	}
+
+	return hash;
+}
+
+// two upper case hex digits per byte value, filled in on first use
+static char hex_lut[256][2];
+
+static void hex_lut_init(void) {
+	static const char digits[] = "0123456789ABCDEF";
+	uint32_t i;
+
+	if (hex_lut[0][0])
+		return;
+	for (i = 0; i < 256; ++i) {
+		hex_lut[i][0] = digits[i >> 4];
+		hex_lut[i][1] = digits[i & 0x0F];
+	}
+}
+
+// format one record at p, returns the end of its line
+static char *hex_save_record(char *p, uint8_t record_type, uint16_t address, uint8_t *data, uint8_t bytes) {
+	uint8_t i, checksum;
+
+	checksum = bytes + (address >> 8) + (address & 0x00FF) + record_type;
+	*p++ = ':';
+	memcpy(p, hex_lut[bytes], 2);
+	memcpy(p + 2, hex_lut[address >> 8], 2);
+	memcpy(p + 4, hex_lut[address & 0x00FF], 2);
+	memcpy(p + 6, hex_lut[record_type], 2);
+	p += 8;
+	for (i = 0; i < bytes; ++i, p += 2) {
+		memcpy(p, hex_lut[data[i]], 2);
+		checksum += data[i];
+	}
+	memcpy(p, hex_lut[(uint8_t)(~checksum + 1)], 2);
+	p[2] = '\n';
+
+	return p + 3;
+}
+
+// records are formatted straight from the segments into buf, which goes out in a single fwrite
+// whenever it might not hold the next line
+typedef struct hex_save {
+	char buf[HEX_SAVE_BUFFER_SIZE];
+	char *p;
+	uint16_t upper;
+	uint32_t records;
+	FILE *fp;
+} hex_save_t;
+
+static void hex_save_data(hex_save_t *o, uint32_t address, uint8_t *data, uint8_t bytes) {
+	uint8_t upper[2];
+
+	// room for an extended linear address record and the longest data record
+	if (o->p - o->buf > HEX_SAVE_BUFFER_SIZE - 2 * (1 + 2 + 4 + 2 + (2 * 255) + 2 + 1)) {
+		if (fwrite(o->buf, 1, o->p - o->buf, o->fp) != (size_t)(o->p - o->buf))
+			fatal_error("unable to write hex file\n");
+		o->p = o->buf;
+	}
+	// an extended linear address record ahead of records above 64K
+	if ((address >> 16) != o->upper) {
+		o->upper = address >> 16;
+		upper[0] = o->upper >> 8;
+		upper[1] = o->upper & 0x00FF;
+		o->p = hex_save_record(o->p, 0x04, 0, upper, 2);
+	}
+	o->p = hex_save_record(o->p, 0x00, address & 0xFFFF, data, bytes);
+	o->records++;
+}
+
+// runs of allocated bytes as records of up to record_bytes bytes, split where a record would cross
+// into the next 64K as the address of its line is only 16 bits
+void hex_save_to_file(hex_t *h, char *filename, uint8_t record_bytes) {
+	uint32_t i, start, end, bytes, record, split, boundary;
+	hex_segment_t *s;
+	hex_save_t *o;
 	file_t *f;
 
+	if (record_bytes == 0)
+		record_bytes = HEX_DEFAULT_BYTE_COUNT;
+	hex_lut_init();
+	o = (hex_save_t *)malloc(sizeof(hex_save_t));
+	if (!o)
+		fatal_error("unable to allocate memory for hex output\n");
+	o->p = o->buf;
+	o->upper = 0;
+	o->records = 0;
+
 	f = file_open(filename, "w");
+	o->fp = f->fp;
 
-	for (i = 0; i < h->records; ++i) {
-		fprintf(f->fp, "%s\n",  h->record[i]->line);
+	for (i = 0; i < h->segments; ++i) {
+		s = &h->segment[i];
+		bytes = s->pages * h->page_size;
+		for (start = 0; start < bytes; start = end) {
+			while (start < bytes && s->tag[start] != HEX_TAG_ALLOC)
+				++start;
+			for (end = start; end < bytes && s->tag[end] == HEX_TAG_ALLOC; ++end)
+				;
+			for (record = start; record < end; record = split) {
+				split = (end - record < record_bytes ? end : record + record_bytes);
+				boundary = (s->address + split - 1) & 0xFFFF0000;
+				if (boundary > s->address + record) {
+					boundary -= s->address;
+					hex_save_data(o, s->address + record, &s->mem[record], boundary - record);
+					hex_save_data(o, s->address + boundary, &s->mem[boundary], split - boundary);
+				} else {
+					hex_save_data(o, s->address + record, &s->mem[record], split - record);
+				}
+			}
+		}
 	}
-	fprintf(f->fp, ":00000001FF\n");
+	o->p = hex_save_record(o->p, 0x01, 0, NULL, 0);
+	if (fwrite(o->buf, 1, o->p - o->buf, o->fp) != (size_t)(o->p - o->buf))
+		fatal_error("unable to write hex file '%s'\n", filename);
 
 	file_close(f);
+
+	printf("wrote %d records to '%s'\n", o->records, filename);
+	free(o);
 }
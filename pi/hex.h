@@ -1,35 +1,66 @@
 #ifndef _HEX_H_
 #define _HEX_H_
 
-typedef struct hex_record {
-	uint8_t byte_count;
-	uint16_t address;
-	uint8_t record_type;
-	uint8_t *data;
-	uint8_t checksum;
-	char *line;
-} hex_record_t;
-
 #define HEX_TAG_UNALLOC	0
 #define HEX_TAG_ALLOC	1
 
 //#define HEX_DEFAULT_BYTE_COUNT	32
 #define HEX_DEFAULT_BYTE_COUNT	16
 
-typedef struct hex {
-	uint16_t records;
-	hex_record_t **record;
-	uint16_t min_address;
-	uint16_t max_address;
-	uint16_t address_range;
-	uint16_t total_bytes;
+// hex_save_to_file formats into a buffer of this size and writes it out whole
+#define HEX_SAVE_BUFFER_SIZE	65536
+
+// page size of an image loaded from a file, hex_set_page_size changes it to the target's
+#define HEX_PAGE_SIZE	256
+
+// per page flags
+#define HEX_PAGE_ALLOC	0x01	// at least one byte of the page is in the image
+#define HEX_PAGE_BLANK	0x02	// every byte of the page is 0xFF
+#define HEX_PAGE_CRC	0x04	// crc holds the page CRC
+
+// a run of consecutive pages, bytes that are not in the image are 0xFF
+typedef struct hex_segment {
+	uint32_t address;
+	uint32_t pages;
+	uint32_t size;
 	uint8_t *mem;
-	uint8_t	*tag;
+	uint8_t *tag;
+	uint8_t *flags;
+	uint16_t *crc;
+} hex_segment_t;
+
+// an image is a list of segments sorted by address, no two of them adjacent, so that
+// memory follows the data present rather than the address range
+typedef struct hex {
+	uint32_t page_size;
+	uint32_t pages;
+	uint32_t segments;
+	hex_segment_t *segment;
+	uint32_t min_address;
+	uint32_t max_address;
+	uint32_t address_range;
+	uint32_t total_bytes;
+	// content hash of the file the image came from, 0 when it was not read from a file
+	uint64_t source;
+	// last segment found by hex_page_address and the index of its first page
+	uint32_t cursor;
+	uint32_t cursor_page;
 } hex_t;
 
+hex_t *hex_new(uint32_t page_size);
 hex_t *hex_load_from_file(char *filename);
 void hex_free(hex_t *p);
-hex_t *hex_from_map(uint8_t *mem, uint8_t *tag, uint16_t bytes, uint16_t min_address);
-void hex_save_to_file(hex_t *h, char *filename);
+void hex_write(hex_t *h, uint32_t address, uint8_t *data, uint32_t bytes);
+void hex_set_page_size(hex_t *h, uint32_t page_size);
+hex_t *hex_merge(hex_t *a, hex_t *b);
+uint32_t hex_diff(hex_t *a, hex_t *b, uint32_t *address, uint32_t max);
+int hex_page_next(hex_t *h, uint32_t *address);
+uint32_t hex_page_address(hex_t *h, uint32_t n);
+int hex_page_index(hex_t *h, uint32_t address, uint32_t *n);
+uint8_t *hex_page(hex_t *h, uint32_t address, uint8_t **tag);
+uint8_t hex_page_flags(hex_t *h, uint32_t address);
+uint16_t hex_page_crc(hex_t *h, uint32_t address);
+void hex_save_to_file(hex_t *h, char *filename, uint8_t record_bytes);
+uint64_t hex_hash(hex_t *h);
 
 #endif /* _HEX_H_ */
@@ -0,0 +1 @@
+../bootloader/page.c
\ No newline at end of file
@@ -0,0 +1,18 @@
+#ifndef _PAGE_SIM_H_
+#define _PAGE_SIM_H_
+
+// what page.c takes from avr/boot.h and the part, for building the bootloader's page buffers
+// into the host benchmarks, which run them on a simulated SPM engine, see task_bench.c
+// the sizes are those of the ATmega328 with the 4 kB boot section of bootloader/Makefile
+#define SPM_PAGESIZE	128
+#define AVAILABLE_FLASH	28672U
+#define E2END		1023
+
+uint8_t boot_spm_busy(void);
+void boot_spm_busy_wait(void);
+void boot_page_erase(uint16_t address);
+void boot_page_fill(uint16_t address, uint16_t word);
+void boot_page_write(uint16_t address);
+void boot_rww_enable(void);
+
+#endif /* _PAGE_SIM_H_ */
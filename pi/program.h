@@ -1,20 +1,35 @@
 #ifndef _PROGRAM_H_
 #define _PROGRAM_H_
 
-#define PROGRAM_MAX_SIZE 1024
+// the top of the EEPROM is reserved for the bootloader, see FLASH_EEPROM_RESERVED in flash.h
+#define PROGRAM_MAX_SIZE (1024 - 8)
+// the steps follow the preamble and the length
+#define PROGRAM_STEPS_OFFSET 4
+
+// a program file holds a step a line, the ops are those of packet.h and repeat, which starts
+// the body of the loop that ends with the next loop op
+#define PROGRAM_OP_REPEAT	0x10
 
 typedef struct program_step {
-	uint8_t rgb[3];
+	uint8_t op;
+	uint8_t arg[4];		// hold, fade: red, green, blue, hue: first, last, saturation, value, repeat: times
 	uint16_t delay_in_ms;
 } program_step_t;
 
+// a program is sent as an image of packed steps, that of a plain program is its steps and that
+// of a v2 program the encoded ops, length is what goes in the PROGRAM_LENGTH packet
 typedef struct program {
 	uint16_t steps;
 	program_step_t **step;
 	uint16_t size;
+	uint16_t length;
+	uint16_t units;
+	uint8_t *image;
 } program_t;
 
 program_t *program_load_from_file(char *filename);
+program_t *program_load_from_image(uint16_t length, uint8_t *image);
+void program_save_to_file(program_t *p, char *filename);
 void program_free(program_t *p);
 
 #endif /* _PROGRAM_H_ */
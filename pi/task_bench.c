@@ -0,0 +1,741 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <sys/time.h>
+#include <math.h>
+
+#include "error.h"
+#include "nRF24L01+.h"
+#include "task.h"
+#include "flash.h"
+#include "fec.h"
+#include "hex.h"
+#include "page_sim.h"
+#include "page.h"
+
+extern const tasks_table_t tasks_bench[];
+
+// loss rates, in percent, swept by the benchmarks
+static const uint8_t bench_loss_percent[] = { 0, 1, 2, 5, 10, 15, 20, 30, 40 };
+
+// a packet from the simulated host, delay_us is the pause after it as in task_send_packet
+typedef struct bench_packet {
+	uint8_t data[NRF24__MAX_PAYLOAD_SIZE];
+	uint8_t length;
+	uint8_t ack;
+	uint32_t delay_us;
+} bench_packet_t;
+
+// a simulated node, the page buffers of the bootloader (page.c) on a simulated SPM engine and
+// radio, time only goes by as the bootloader polls the SPM engine, as its main loop does
+typedef struct bench_node {
+	uint64_t now_us, spm_busy_us, watchdog_us;
+	uint8_t flash[AVAILABLE_FLASH];
+	uint8_t spm_buffer[SPM_PAGESIZE];
+	int32_t last_page;
+	uint32_t out_of_order, spm_errors;
+	// the host, sending tx[tx_next] at tx_us
+	bench_packet_t *tx;
+	uint32_t tx_count, tx_size, tx_next;
+	uint64_t tx_us;
+	uint8_t tx_tries, tx_delivered;
+	// the radio
+	bench_packet_t fifo[BENCH_RX_FIFO];
+	uint8_t fifo_head, fifo_count;
+	unsigned int seed;
+	double loss;
+	uint32_t retries, overflows, give_ups;
+	// the page map last returned to FLASH_MCAST_STATUS
+	uint8_t bitmap[FLASH_PAGE_BITMAP_SIZE];
+	jmp_buf watchdog;
+} bench_node_t;
+
+static bench_node_t *bench_node;
+
+int task_bench(int argc, char *argv[]) {
+	int (*function)(int argc, char *argv[]);
+
+	if (argc < 3) {
+		int i;
+TASK_BENCH_USAGE:
+		warning("usage: %s %s <task> [<task parameters>]\n", argv[0], argv[1]);
+		warning("supported tasks are:\n", argv[0]);
+		for (i = 0; tasks_bench[i].name != NULL; ++i)
+			warning("\t%s\n", tasks_bench[i].name);
+		return EXIT_FAILURE;
+	}
+
+	function = task_lookup(tasks_bench, 2, argc, argv);
+
+	if (function)
+		return function(argc, argv);
+
+	goto TASK_BENCH_USAGE;
+
+	return EXIT_SUCCESS;
+}
+
+static uint8_t task_bench_lost(unsigned int *seed, double loss) {
+	return ((double)rand_r(seed) / ((double)RAND_MAX + 1.)) < loss;
+}
+
+// auto-ack: a packet costs its airtime plus the ack when both make it, otherwise a full ARD
+// wait before the retransmit; a packet out of retries counts against the task and goes again
+static double task_bench_arq_us(unsigned int *seed, double loss, uint32_t packets, uint32_t *failures) {
+	double us = 0.;
+	uint32_t i;
+	uint8_t tries;
+
+	for (i = 0; i < packets; ++i) {
+		for (;;) {
+			for (tries = 0; tries <= BENCH_ARC; ++tries) {
+				if (!task_bench_lost(seed, loss) && !task_bench_lost(seed, loss)) {
+					us += BENCH_AIRTIME_PACKET_US + BENCH_AIRTIME_ACK_US;
+					break;
+				}
+				us += BENCH_ARD_US;
+			}
+			if (tries <= BENCH_ARC)
+				break;
+			++(*failures);
+		}
+	}
+
+	return us;
+}
+
+// no-ack blocks of k data and m parity shards, run through the real codec, a block that cannot
+// be rebuilt is sent again as a whole
+static double task_bench_fec_us(unsigned int *seed, double loss, uint8_t k, uint8_t m, uint32_t blocks, uint32_t *failures, uint32_t *errors) {
+	uint8_t data[FEC_MAX_DATA_SHARDS * FLASH_FEC_SHARD_SIZE], received[FEC_MAX_DATA_SHARDS * FLASH_FEC_SHARD_SIZE];
+	uint8_t parity[FEC_MAX_PARITY_SHARDS * FLASH_FEC_SHARD_SIZE], rows[FEC_MAX_PARITY_SHARDS];
+	uint8_t i, present, parity_count;
+	uint16_t j;
+	uint32_t b;
+	double us = 0.;
+
+	for (b = 0; b < blocks; ++b) {
+		for (j = 0; j < k * FLASH_FEC_SHARD_SIZE; ++j)
+			data[j] = (uint8_t)rand_r(seed);
+		for (;;) {
+			us += (k + m) * BENCH_AIRTIME_PACKET_US;
+			present = 0;
+			parity_count = 0;
+			memset(received, 0, sizeof(received));
+			for (i = 0; i < k; ++i) {
+				if (task_bench_lost(seed, loss))
+					continue;
+				present |= 1 << i;
+				memcpy(&received[i * FLASH_FEC_SHARD_SIZE], &data[i * FLASH_FEC_SHARD_SIZE], FLASH_FEC_SHARD_SIZE);
+			}
+			for (i = 0; i < m; ++i) {
+				if (task_bench_lost(seed, loss))
+					continue;
+				fec_encode(data, k, FLASH_FEC_SHARD_SIZE, i, &parity[parity_count * FLASH_FEC_SHARD_SIZE]);
+				rows[parity_count++] = i;
+			}
+			if (fec_decode(received, k, FLASH_FEC_SHARD_SIZE, present, parity, rows, parity_count)) {
+				if (memcmp(received, data, k * FLASH_FEC_SHARD_SIZE) != 0)
+					++(*errors);
+				break;
+			}
+			++(*failures);
+		}
+	}
+
+	return us;
+}
+
+// goodput of plain ARQ against FEC over a sweep of independent packet loss rates
+// the times are nRF24 air times at 1 Mbps with the retry settings of task_radio_setup,
+// host pacing delays are left out as they are the same for either scheme
+int task_bench_fec(int argc, char *argv[]) {
+	uint8_t k, m, l;
+	uint32_t blocks, arq_failures, fec_failures, fec_errors;
+	unsigned int seed;
+	double loss, arq_us, fec_us, bytes;
+
+	if (argc < 5 || argc > 7) {
+		warning("usage: %s %s %s <data shards> <parity shards> [<blocks>] [<seed>]\n", argv[0], argv[1], argv[2]);
+		return EXIT_FAILURE;
+	}
+
+	k = (uint8_t)strtoul(argv[3], NULL, 0);
+	m = (uint8_t)strtoul(argv[4], NULL, 0);
+	blocks = (argc > 5 ? strtoul(argv[5], NULL, 0) : 1000);
+	seed = (argc > 6 ? strtoul(argv[6], NULL, 0) : 1);
+	if (k < 1 || k > FEC_MAX_DATA_SHARDS || m > FEC_MAX_PARITY_SHARDS || k + m > FEC_MAX_DATA_SHARDS) {
+		warning("%s: need 1 to %d data shards, at most %d parity shards and at most %d shards in all\n", argv[0], FEC_MAX_DATA_SHARDS, FEC_MAX_PARITY_SHARDS, FEC_MAX_DATA_SHARDS);
+		return EXIT_FAILURE;
+	}
+
+	bytes = (double)blocks * k * FLASH_FEC_SHARD_SIZE;
+	printf("%d blocks of %d + %d shards, %d bytes per shard, %.0f bytes\n", blocks, k, m, (int)FLASH_FEC_SHARD_SIZE, bytes);
+	printf("loss %%\tARQ kB/s\tretry outs\tFEC kB/s\tresent blocks\tFEC / ARQ\n");
+	for (l = 0; l < sizeof(bench_loss_percent) / sizeof(bench_loss_percent[0]); ++l) {
+		loss = bench_loss_percent[l] / 100.;
+		arq_failures = fec_failures = fec_errors = 0;
+		arq_us = task_bench_arq_us(&seed, loss, (uint32_t)ceil(bytes / FLASH_FEC_SHARD_SIZE), &arq_failures);
+		fec_us = task_bench_fec_us(&seed, loss, k, m, blocks, &fec_failures, &fec_errors);
+		printf("%d\t%.2f\t\t%d\t\t%.2f\t\t%d\t\t%.2f\n", bench_loss_percent[l], bytes / arq_us * 1000., arq_failures, bytes / fec_us * 1000., fec_failures, arq_us / fec_us);
+		if (fec_errors) {
+			warning("%s: %d blocks decoded to the wrong data\n", argv[0], fec_errors);
+			return EXIT_FAILURE;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+// writes a synthetic image of 16 byte data records with extended linear address records
+static int task_bench_hex_write(FILE *fp, uint8_t *data, uint32_t bytes) {
+	uint32_t address, i;
+	uint8_t count, checksum;
+
+	for (address = 0; address < bytes; address += count) {
+		if ((address & 0xFFFF) == 0) {
+			checksum = 0x02 + 0x04 + (address >> 24) + ((address >> 16) & 0xFF);
+			fprintf(fp, ":02000004%04X%02X\n", address >> 16, (uint8_t)(0 - checksum));
+		}
+		count = (bytes - address < HEX_DEFAULT_BYTE_COUNT ? bytes - address : HEX_DEFAULT_BYTE_COUNT);
+		checksum = count + ((address >> 8) & 0xFF) + (address & 0xFF);
+		fprintf(fp, ":%02X%04X00", count, address & 0xFFFF);
+		for (i = 0; i < count; ++i) {
+			fprintf(fp, "%02X", data[address + i]);
+			checksum += data[address + i];
+		}
+		fprintf(fp, "%02X\n", (uint8_t)(0 - checksum));
+	}
+	fprintf(fp, ":00000001FF\n");
+
+	return (ferror(fp) ? 0 : 1);
+}
+
+// parse and write times of a synthetic hex file, checked against the data it was made from
+// and, for the writer, by parsing what it wrote back in
+int task_bench_hex(int argc, char *argv[]) {
+	char filename[] = "/tmp/bench_hexXXXXXX";
+	uint32_t bytes, runs, i;
+	uint8_t *data, record_bytes;
+	struct timeval start, end;
+	double us, best_us = 0, best_save_us = 0;
+	hex_t *h, *expected;
+	FILE *fp;
+	int fd, ok = 1;
+
+	if (argc > 6) {
+		warning("usage: %s %s %s [<bytes>] [<runs>] [<bytes per written record>]\n", argv[0], argv[1], argv[2]);
+		return EXIT_FAILURE;
+	}
+
+	bytes = (argc > 3 ? strtoul(argv[3], NULL, 0) : 256 * 1024);
+	runs = (argc > 4 ? strtoul(argv[4], NULL, 0) : 10);
+	i = (argc > 5 ? strtoul(argv[5], NULL, 0) : HEX_DEFAULT_BYTE_COUNT);
+	if (bytes < 1 || runs < 1 || i < 1 || i > 255) {
+		warning("%s: need at least one byte and one run, and 1 to 255 bytes per record\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	record_bytes = i;
+
+	data = (uint8_t *)malloc(bytes);
+	if (!data)
+		fatal_error("unable to allocate memory for hex benchmark data\n");
+	srand(1);
+	for (i = 0; i < bytes; ++i)
+		data[i] = rand();
+
+	expected = hex_new(HEX_PAGE_SIZE);
+	hex_write(expected, 0, data, bytes);
+
+	fd = mkstemp(filename);
+	if (fd < 0 || !(fp = fdopen(fd, "w")))
+		fatal_error("unable to create temporary file '%s'\n", filename);
+	if (!task_bench_hex_write(fp, data, bytes))
+		fatal_error("unable to write temporary file '%s'\n", filename);
+	fclose(fp);
+
+	for (i = 0; i < runs && ok; ++i) {
+		gettimeofday(&start, NULL);
+		h = hex_load_from_file(filename);
+		gettimeofday(&end, NULL);
+		us = (end.tv_sec - start.tv_sec) * 1000000. + (end.tv_usec - start.tv_usec);
+		if (i == 0 || us < best_us)
+			best_us = us;
+		if (h->min_address != 0 || h->address_range != bytes || h->total_bytes != bytes || hex_diff(h, expected, NULL, 0) != 0) {
+			warning("%s: parsed image does not match the data written\n", argv[0]);
+			ok = 0;
+		}
+		hex_free(h);
+	}
+	for (i = 0; i < runs && ok; ++i) {
+		gettimeofday(&start, NULL);
+		hex_save_to_file(expected, filename, record_bytes);
+		gettimeofday(&end, NULL);
+		us = (end.tv_sec - start.tv_sec) * 1000000. + (end.tv_usec - start.tv_usec);
+		if (i == 0 || us < best_save_us)
+			best_save_us = us;
+	}
+	if (ok) {
+		h = hex_load_from_file(filename);
+		if (h->total_bytes != bytes || hex_diff(h, expected, NULL, 0) != 0) {
+			warning("%s: written image does not parse back to the data\n", argv[0]);
+			ok = 0;
+		}
+		hex_free(h);
+	}
+	unlink(filename);
+	hex_free(expected);
+	free(data);
+
+	if (!ok)
+		return EXIT_FAILURE;
+
+	printf("%d bytes, best of %d runs\n", bytes, runs);
+	printf("\tparse: %.3f ms, %.2f MB/s of image\n", best_us / 1000., bytes / best_us);
+	printf("\twrite: %.3f ms, %.2f MB/s of image in %d byte records\n", best_save_us / 1000., bytes / best_save_us, record_bytes);
+
+	return EXIT_SUCCESS;
+}
+
+// append a packet for the simulated host to send
+static bench_packet_t *task_bench_packet(bench_node_t *n, uint8_t ack, uint32_t delay_us) {
+	bench_packet_t *p;
+
+	if (n->tx_count == n->tx_size) {
+		n->tx_size = (n->tx_size ? n->tx_size * 2 : 256);
+		if (!(n->tx = (bench_packet_t *)realloc(n->tx, n->tx_size * sizeof(bench_packet_t))))
+			fatal_error("unable to allocate memory for %d simulated packets\n", n->tx_size);
+	}
+	p = &n->tx[n->tx_count++];
+	p->ack = ack;
+	p->delay_us = delay_us;
+
+	return p;
+}
+
+// the FLASH_PAGE_PROG and payloads of a page, as task_flash_upload_page sends them
+static void task_bench_page_packets(bench_node_t *n, uint8_t *image, uint16_t address, uint8_t ack, uint32_t packet_delay_us, uint32_t page_delay_us) {
+	bench_packet_t *p;
+	uint8_t seq_no, length, offset;
+
+	p = task_bench_packet(n, ack, packet_delay_us);
+	p->data[0] = FLASH_PAGE_PROG;
+	p->data[1] = (uint8_t)(address & 0x00FF);
+	p->data[2] = (uint8_t)((address & 0xFF00) >> 8);
+	p->length = FLASH_PAGE_PROG_SIZE;
+	for (seq_no = 0, offset = 0; offset < SPM_PAGESIZE; ++seq_no, offset += length) {
+		length = NRF24__MAX_PAYLOAD_SIZE - FLASH_PAGE_PROG_PAYLOAD_MIN_SIZE;
+		if (offset + length >= SPM_PAGESIZE) {
+			length = SPM_PAGESIZE - offset;
+			packet_delay_us = page_delay_us;
+		}
+		p = task_bench_packet(n, ack, packet_delay_us);
+		p->data[0] = FLASH_PAGE_PROG_PAYLOAD;
+		p->data[1] = seq_no;
+		memcpy(&p->data[FLASH_PAGE_PROG_PAYLOAD_MIN_SIZE], &image[address + offset], length);
+		p->length = FLASH_PAGE_PROG_PAYLOAD_MIN_SIZE + length;
+	}
+}
+
+// the FLASH_PAGE_FEC_PAYLOAD shards of a page, as task_flash_upload_page_fec sends them
+static void task_bench_fec_packets(bench_node_t *n, uint8_t *image, uint16_t address, uint8_t parity) {
+	uint8_t data[FEC_MAX_DATA_SHARDS * FLASH_FEC_SHARD_SIZE];
+	bench_packet_t *p;
+	uint8_t i, k;
+
+	k = FLASH_FEC_DATA_SHARDS(SPM_PAGESIZE);
+	memset(data, 0, sizeof(data));
+	memcpy(data, &image[address], SPM_PAGESIZE);
+	for (i = 0; i < k + parity; ++i) {
+		p = task_bench_packet(n, 0, (i == k + parity - 1 ? (parity ? FLASH_FEC_PAGE_DELAY_US : FLASH_MCAST_PAGE_DELAY_US) : FLASH_MCAST_PACKET_DELAY_US));
+		p->data[0] = FLASH_PAGE_FEC_PAYLOAD;
+		p->data[1] = (uint8_t)(address / SPM_PAGESIZE);
+		p->data[2] = i;
+		if (i < k)
+			memcpy(&p->data[FLASH_PAGE_FEC_PAYLOAD_MIN_SIZE], &data[i * FLASH_FEC_SHARD_SIZE], FLASH_FEC_SHARD_SIZE);
+		else
+			fec_encode(data, k, FLASH_FEC_SHARD_SIZE, i - k, &p->data[FLASH_PAGE_FEC_PAYLOAD_MIN_SIZE]);
+		p->length = NRF24__MAX_PAYLOAD_SIZE;
+	}
+}
+
+// FLASH_MCAST_BEGIN and the pages of a multicast pass, as task_flash_broadcast sends them, the
+// pages of the simulated part always fit in shards
+static void task_bench_mcast_packets(bench_node_t *n, uint8_t *image, uint16_t pages, uint8_t parity) {
+	bench_packet_t *p;
+	uint16_t i;
+
+	for (i = 0; i < FLASH_MCAST_BEGIN_REPEAT; ++i) {
+		p = task_bench_packet(n, 0, FLASH_MCAST_PACKET_DELAY_US);
+		p->data[0] = FLASH_MCAST_BEGIN;
+		p->length = FLASH_MCAST_BEGIN_SIZE;
+	}
+	for (i = 0; i < pages; ++i)
+		task_bench_fec_packets(n, image, i * SPM_PAGESIZE, parity);
+}
+
+// let time go by on the node, the host packets due in the meantime land in the receive fifo
+// an acked packet is sent again after ARD until it gets through, as the radio does, while a
+// no-ack packet that finds the fifo full is lost
+static void task_bench_tick(bench_node_t *n, uint32_t us) {
+	bench_packet_t *p;
+	unsigned int seed = n->seed;	// the struct is packed
+
+	n->now_us += us;
+	if (n->now_us > n->watchdog_us)
+		longjmp(n->watchdog, 1);
+	while (n->tx_next < n->tx_count && n->tx_us <= n->now_us) {
+		p = &n->tx[n->tx_next];
+		// a retransmit of a packet already taken is dropped by the receiver, but still acked
+		if (!n->tx_delivered && !task_bench_lost(&seed, n->loss)) {
+			if (n->fifo_count < BENCH_RX_FIFO) {
+				n->fifo[(n->fifo_head + n->fifo_count++) % BENCH_RX_FIFO] = *p;
+				n->tx_delivered = 1;
+			} else if (!p->ack)
+				++n->overflows;
+		}
+		if (p->ack && !(n->tx_delivered && !task_bench_lost(&seed, n->loss))) {
+			if (++n->tx_tries <= BENCH_ARC) {
+				++n->retries;
+				n->tx_us += BENCH_ARD_US;
+				continue;
+			}
+			++n->give_ups;
+		}
+		n->tx_us += BENCH_AIRTIME_PACKET_US + (p->ack ? BENCH_AIRTIME_ACK_US : 0) + p->delay_us;
+		n->tx_next++;
+		n->tx_tries = 0;
+		n->tx_delivered = 0;
+	}
+	n->seed = seed;
+}
+
+// the packet handlers of bootloader/main.c that the simulation covers
+static void task_bench_dispatch(bench_node_t *n, bench_packet_t *p) {
+	// the bootloader pets the watchdog for every packet
+	n->watchdog_us = n->now_us + BENCH_WATCHDOG_US;
+	switch (p->data[0]) {
+		case FLASH_PAGE_PROG:
+			page_prog(((uint16_t)p->data[2] << 8) | p->data[1]);
+			break;
+		case FLASH_PAGE_PROG_PAYLOAD:
+			page_prog_payload(p->data[1], &p->data[FLASH_PAGE_PROG_PAYLOAD_MIN_SIZE], p->length - FLASH_PAGE_PROG_PAYLOAD_MIN_SIZE);
+			break;
+		case FLASH_PAGE_FEC_PAYLOAD:
+			page_fec_payload(p->data[1], p->data[2], &p->data[FLASH_PAGE_FEC_PAYLOAD_MIN_SIZE]);
+			break;
+		case FLASH_HELLO:
+			page_session();
+			break;
+		case FLASH_MCAST_BEGIN:
+			page_session();
+			memset(page_bitmap, 0, sizeof(page_bitmap));
+			break;
+		case FLASH_MCAST_STATUS:
+			memcpy(n->bitmap, page_bitmap, sizeof(n->bitmap));
+			break;
+		case FLASH_EEPROM_PROG:
+		case FLASH_DONE:
+			spm_drain();
+			break;
+	}
+}
+
+// run the bootloader until the host has sent every packet and it has taken them all
+// returns 0 when the watchdog went off, with the page buffers stuck where they were
+static int task_bench_run(bench_node_t *n) {
+	bench_packet_t p;
+
+	bench_node = n;
+	n->tx_us = n->now_us;
+	n->watchdog_us = n->now_us + BENCH_WATCHDOG_US;
+	if (setjmp(n->watchdog))
+		return 0;
+	while (n->tx_next < n->tx_count || n->fifo_count) {
+		// the main loop keeps the page writes going and takes every packet in the fifo
+		spm_poll();
+		while (n->fifo_count) {
+			p = n->fifo[n->fifo_head];
+			n->fifo_head = (n->fifo_head + 1) % BENCH_RX_FIFO;
+			--n->fifo_count;
+			task_bench_dispatch(n, &p);
+		}
+	}
+	n->tx_count = n->tx_next = 0;
+
+	return 1;
+}
+
+// the SPM engine and EEPROM queue that page.c runs on, a poll of the engine is a turn of the
+// main loop, erase and write take the worst case times of the datasheet
+uint8_t boot_spm_busy(void) {
+	task_bench_tick(bench_node, BENCH_LOOP_US);
+
+	return bench_node->now_us < bench_node->spm_busy_us;
+}
+
+void boot_spm_busy_wait(void) {
+	while (boot_spm_busy());
+}
+
+void boot_page_erase(uint16_t address) {
+	if (bench_node->now_us < bench_node->spm_busy_us)
+		++bench_node->spm_errors;
+	memset(&bench_node->flash[address], 0xFF, SPM_PAGESIZE);
+	bench_node->spm_busy_us = bench_node->now_us + BENCH_SPM_ERASE_US;
+}
+
+void boot_page_fill(uint16_t address, uint16_t word) {
+	bench_node->spm_buffer[address % SPM_PAGESIZE] = (uint8_t)(word & 0x00FF);
+	bench_node->spm_buffer[(address % SPM_PAGESIZE) + 1] = (uint8_t)((word & 0xFF00) >> 8);
+}
+
+// a write can only clear bits, the temporary page buffer is erased by it
+void boot_page_write(uint16_t address) {
+	uint16_t i;
+
+	if (bench_node->now_us < bench_node->spm_busy_us)
+		++bench_node->spm_errors;
+	for (i = 0; i < SPM_PAGESIZE; ++i)
+		bench_node->flash[address + i] &= bench_node->spm_buffer[i];
+	memset(bench_node->spm_buffer, 0xFF, SPM_PAGESIZE);
+	if ((int32_t)(address / SPM_PAGESIZE) <= bench_node->last_page)
+		++bench_node->out_of_order;
+	bench_node->last_page = address / SPM_PAGESIZE;
+	bench_node->spm_busy_us = bench_node->now_us + BENCH_SPM_WRITE_US;
+}
+
+void boot_rww_enable(void) {
+}
+
+uint8_t eeprom_poll(void) {
+	return 0;
+}
+
+void eeprom_update(uint16_t address, uint8_t value) {
+}
+
+static bench_node_t *task_bench_node_new(unsigned int seed, double loss) {
+	bench_node_t *n;
+
+	if (!(n = (bench_node_t *)calloc(1, sizeof(bench_node_t))))
+		fatal_error("unable to allocate memory for a simulated node\n");
+	memset(n->flash, 0xFF, sizeof(n->flash));
+	memset(n->spm_buffer, 0xFF, sizeof(n->spm_buffer));
+	n->last_page = -1;
+	n->seed = seed;
+	n->loss = loss;
+
+	return n;
+}
+
+static void task_bench_node_free(bench_node_t *n) {
+	free(n->tx);
+	free(n);
+}
+
+// an acked upload to the simulated bootloader, as flash upload sends it, over a sweep of packet
+// delays down to back to back, which fills pages faster than they are erased and written
+// every page has to be written whole and in order, and FLASH_DONE has to get through the
+// writes still buffered before the watchdog goes off
+int task_bench_pages(int argc, char *argv[]) {
+	const uint32_t delays_us[] = { 0, 250, 500, FLASH_PAGE_PACKET_DELAY_US, 2000, FLASH_SEND_POST_DELAY_US };
+	bench_node_t *n;
+	bench_packet_t *p;
+	uint8_t *image, ok = 1, run_ok;
+	uint16_t pages, i;
+	uint32_t d;
+	unsigned int seed;
+	uint64_t start_us;
+
+	if (argc > 5) {
+		warning("usage: %s %s %s [<pages (1 to %d)>] [<seed>]\n", argv[0], argv[1], argv[2], FLASH_PAGES);
+		return EXIT_FAILURE;
+	}
+	pages = (argc > 3 ? strtoul(argv[3], NULL, 0) : 64);
+	seed = (argc > 4 ? strtoul(argv[4], NULL, 0) : 1);
+	if (pages < 1 || pages > FLASH_PAGES) {
+		warning("%s: the simulated part has %d pages of %d bytes\n", argv[0], FLASH_PAGES, SPM_PAGESIZE);
+		return EXIT_FAILURE;
+	}
+
+	if (!(image = (uint8_t *)malloc(pages * SPM_PAGESIZE)))
+		fatal_error("unable to allocate memory for the simulated image\n");
+	for (i = 0; i < pages * SPM_PAGESIZE; ++i)
+		image[i] = (uint8_t)rand_r(&seed);
+
+	printf("%d pages of %d bytes, %d page buffers, erase %d us and write %d us a page\n", pages, SPM_PAGESIZE, PAGE_BUFFERS, BENCH_SPM_ERASE_US, BENCH_SPM_WRITE_US);
+	printf("delay us\tseconds\tkB/s\tretries\tout of order\tresult\n");
+	for (d = 0; d < sizeof(delays_us) / sizeof(delays_us[0]); ++d) {
+		n = task_bench_node_new(seed, 0.);
+		for (i = 0; i < pages; ++i)
+			task_bench_page_packets(n, image, i * SPM_PAGESIZE, 1, delays_us[d], delays_us[d]);
+		// the application marker and the start both wait for the buffered pages
+		p = task_bench_packet(n, 1, delays_us[d]);
+		p->data[0] = FLASH_EEPROM_PROG;
+		p->length = FLASH_EEPROM_PROG_SIZE;
+		p = task_bench_packet(n, 1, 0);
+		p->data[0] = FLASH_DONE;
+		p->length = FLASH_DONE_SIZE;
+
+		start_us = n->now_us;
+		run_ok = task_bench_run(n);
+		printf("%d\t\t%.3f\t%.2f\t%d\t%d\t\t", delays_us[d], (n->now_us - start_us) / 1000000., (pages * SPM_PAGESIZE) / ((n->now_us - start_us) / 1000.), n->retries, n->out_of_order);
+		if (!run_ok)
+			printf("watchdog reset, the buffered pages were never written\n");
+		else if (n->spm_errors)
+			printf("%d SPM operations started while busy\n", n->spm_errors);
+		else if (n->give_ups || memcmp(n->flash, image, pages * SPM_PAGESIZE) != 0 || n->out_of_order)
+			printf("flash does not match the image\n");
+		else
+			printf("ok\n");
+		ok = ok && run_ok && !n->spm_errors && !n->give_ups && !n->out_of_order && memcmp(n->flash, image, pages * SPM_PAGESIZE) == 0;
+		task_bench_node_free(n);
+		// the page buffers are stuck after a watchdog reset, there is no going on from there
+		if (!run_ok)
+			break;
+	}
+	free(image);
+
+	return (ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+// a multicast update of one simulated node, as task_flash_broadcast runs it, after an earlier
+// multicast that was broken off after its first page
+// returns 0 when the watchdog went off, the pages still missing after the repair rounds are
+// left in *missing and the host gives up on the node without starting the application
+static int task_bench_mcast_node(bench_node_t *n, uint8_t *image, uint16_t pages, uint8_t parity, uint64_t *mcast_us, uint32_t *repairs, uint16_t *missing) {
+	bench_packet_t *p;
+	uint64_t start_us;
+	uint16_t i;
+	uint8_t round;
+
+	// a bootloader fresh from reset
+	memset(page_bitmap, 0, sizeof(page_bitmap));
+	task_bench_mcast_packets(n, image, 1, parity);
+	p = task_bench_packet(n, 1, FLASH_SEND_POST_DELAY_US);
+	p->data[0] = FLASH_HELLO;
+	p->length = FLASH_HELLO_SIZE;
+	if (!task_bench_run(n))
+		return 0;
+
+	start_us = n->now_us;
+	task_bench_mcast_packets(n, image, pages, parity);
+	if (!task_bench_run(n))
+		return 0;
+	*mcast_us = n->now_us - start_us;
+
+	for (round = 0; round <= FLASH_MCAST_REPAIR_ROUNDS; ++round) {
+		p = task_bench_packet(n, 1, FLASH_SEND_POST_DELAY_US);
+		p->data[0] = FLASH_MCAST_STATUS;
+		p->data[1] = 0;
+		p->length = FLASH_MCAST_STATUS_SIZE;
+		p = task_bench_packet(n, 1, FLASH_SEND_POST_DELAY_US);
+		p->data[0] = FLASH_MCAST_STATUS_FLUSH;
+		p->length = FLASH_MCAST_STATUS_FLUSH_SIZE;
+		if (!task_bench_run(n))
+			return 0;
+		for (*missing = 0, i = 0; i < pages; ++i) {
+			if (n->bitmap[i >> 3] & (1 << (i & 0x07)))
+				continue;
+			++*missing;
+			if (round < FLASH_MCAST_REPAIR_ROUNDS) {
+				task_bench_page_packets(n, image, i * SPM_PAGESIZE, 1, FLASH_PAGE_PACKET_DELAY_US, FLASH_PAGE_PACKET_DELAY_US);
+				++*repairs;
+			}
+		}
+		if (!*missing)
+			break;
+		if (!task_bench_run(n))
+			return 0;
+	}
+	if (*missing || n->give_ups)
+		return 1;
+
+	p = task_bench_packet(n, 1, FLASH_SEND_POST_DELAY_US);
+	p->data[0] = FLASH_EEPROM_PROG;
+	p->length = FLASH_EEPROM_PROG_SIZE;
+	p = task_bench_packet(n, 1, FLASH_SEND_POST_DELAY_US);
+	p->data[0] = FLASH_DONE;
+	p->length = FLASH_DONE_SIZE;
+
+	return task_bench_run(n);
+}
+
+// a multicast update of several simulated nodes, plain or forward error corrected, with the
+// pacing of task_flash_broadcast over the sweep of loss rates
+// every node that gets all its pages has to hold the image, and on a clean link the
+// multicast pass alone has to write every page, with nothing lost to a full receive fifo
+int task_bench_mcast(int argc, char *argv[]) {
+	bench_node_t *n;
+	uint8_t *image, ok = 1, run_ok, parity, nodes, node, incomplete, failed;
+	uint16_t pages, missing, i;
+	uint32_t repairs, overflows, l;
+	uint64_t mcast_us, mcast_total_us;
+	unsigned int seed;
+
+	if (argc > 7) {
+		warning("usage: %s %s %s [<nodes>] [<fec parity shards (0 to %d)>] [<pages (1 to %d)>] [<seed>]\n", argv[0], argv[1], argv[2], FLASH_FEC_MAX_PARITY, FLASH_PAGES);
+		return EXIT_FAILURE;
+	}
+	nodes = (argc > 3 ? strtoul(argv[3], NULL, 0) : 4);
+	parity = (argc > 4 ? strtoul(argv[4], NULL, 0) : 0);
+	pages = (argc > 5 ? strtoul(argv[5], NULL, 0) : 64);
+	seed = (argc > 6 ? strtoul(argv[6], NULL, 0) : 1);
+	if (nodes < 1 || parity > FLASH_FEC_MAX_PARITY || FLASH_FEC_DATA_SHARDS(SPM_PAGESIZE) + parity > FEC_MAX_DATA_SHARDS) {
+		warning("%s: at least one node and at most %d parity shards per page\n", argv[0], FLASH_FEC_MAX_PARITY);
+		return EXIT_FAILURE;
+	}
+	if (pages < 1 || pages > FLASH_PAGES) {
+		warning("%s: the simulated part has %d pages of %d bytes\n", argv[0], FLASH_PAGES, SPM_PAGESIZE);
+		return EXIT_FAILURE;
+	}
+
+	if (!(image = (uint8_t *)malloc(pages * SPM_PAGESIZE)))
+		fatal_error("unable to allocate memory for the simulated image\n");
+	for (i = 0; i < pages * SPM_PAGESIZE; ++i)
+		image[i] = (uint8_t)rand_r(&seed);
+
+	printf("%d nodes, %d pages of %d bytes, %d parity shards, erase %d us and write %d us a page\n", nodes, pages, SPM_PAGESIZE, parity, BENCH_SPM_ERASE_US, BENCH_SPM_WRITE_US);
+	printf("multicast packet delay %d us, page delay %d us, %d repair rounds\n", FLASH_MCAST_PACKET_DELAY_US, (parity ? FLASH_FEC_PAGE_DELAY_US : FLASH_MCAST_PAGE_DELAY_US), FLASH_MCAST_REPAIR_ROUNDS);
+	printf("loss %%\tmulticast s\trepaired\toverflows\tincomplete\tresult\n");
+	for (l = 0; l < sizeof(bench_loss_percent) / sizeof(bench_loss_percent[0]); ++l) {
+		repairs = overflows = 0;
+		mcast_total_us = 0;
+		incomplete = failed = 0;
+		run_ok = 1;
+		for (node = 0; node < nodes && run_ok; ++node) {
+			n = task_bench_node_new(seed + node, bench_loss_percent[l] / 100.);
+			mcast_us = 0;
+			run_ok = task_bench_mcast_node(n, image, pages, parity, &mcast_us, &repairs, &missing);
+			mcast_total_us += mcast_us;
+			overflows += n->overflows;
+			if (!run_ok || n->spm_errors)
+				++failed;
+			else if (missing || n->give_ups)
+				++incomplete;
+			else if (memcmp(n->flash, image, pages * SPM_PAGESIZE) != 0)
+				++failed;
+			task_bench_node_free(n);
+		}
+		printf("%d\t%.3f\t\t%d\t\t%d\t\t%d\t\t", bench_loss_percent[l], mcast_total_us / (double)node / 1000000., repairs, overflows, incomplete);
+		if (!run_ok)
+			printf("watchdog reset, the buffered pages were never written\n");
+		else if (failed)
+			printf("%d nodes do not hold the image\n", failed);
+		else if (!bench_loss_percent[l] && (repairs || overflows))
+			printf("pages lost on a clean link, the pacing does not keep up\n");
+		else
+			printf("ok\n");
+		ok = ok && run_ok && !failed && (bench_loss_percent[l] || (!repairs && !overflows));
+		// the page buffers are stuck after a watchdog reset, there is no going on from there
+		if (!run_ok)
+			break;
+	}
+	free(image);
+
+	return (ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
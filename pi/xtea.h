@@ -0,0 +1 @@
+../lib/xtea.h
\ No newline at end of file